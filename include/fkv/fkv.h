@@ -29,6 +29,39 @@ typedef struct {
     size_t count;
 } fkv_iter_t;
 
+/* Entries fkv_view_prefix() can borrow without allocating. */
+#define FKV_VIEW_INLINE 16
+
+/*
+ * Borrowed result of fkv_view_prefix(): entries point into the store and
+ * stay valid, unchanged by later puts, until fkv_view_release().
+ */
+typedef struct {
+    const fkv_entry_t *entries;
+    size_t count;
+    /* Private. */
+    void *guard;
+    fkv_entry_t *heap;
+    fkv_entry_t inline_entries[FKV_VIEW_INLINE];
+} fkv_view_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum; /* values read as decimal digits, mod 2^64 */
+} fkv_aggregate_t;
+
+/* Memory held by the trie, see fkv_memory_usage(). */
+typedef struct {
+    size_t entries;         /* keys stored */
+    size_t nodes;           /* trie nodes */
+    size_t slabs;           /* 64 KiB slabs holding nodes, records and top-K summaries */
+    size_t large_objects;   /* records or summaries too big for a slab, malloc'd one by one */
+    size_t reserved_bytes;  /* slabs plus large objects: everything taken from malloc */
+    size_t used_bytes;      /* handed out, including replaced objects readers may still hold */
+    size_t free_bytes;      /* reclaimed, reused by later puts */
+    size_t retired_objects; /* replaced, waiting for readers to move on */
+} fkv_memory_t;
+
 typedef struct {
     uint8_t *key;
     size_t key_len;
@@ -57,18 +90,69 @@ int fkv_put_scored(const uint8_t *key,
                    size_t vn,
                    fkv_entry_type_t type,
                    uint64_t priority);
+/*
+ * Applies the puts in order as one write; concurrent readers that overlap it
+ * retry, so they see none or all of them. Entries with priority 0 take the
+ * next sequence number, like fkv_put(). Every entry is validated before the
+ * first put; only an allocation failure can leave a prefix of the batch
+ * applied.
+ */
+int fkv_put_batch(const fkv_entry_t *entries, size_t count);
 int fkv_get_prefix(const uint8_t *key, size_t kn, fkv_iter_t *it, size_t k);
+/*
+ * The entries fkv_get_prefix() would copy, borrowed in place: up to k
+ * (0: the top-K limit) of them, the entry at exactly key first. Only more
+ * than FKV_VIEW_INLINE entries allocate. The view pins what it points to
+ * until fkv_view_release(); writes may go on meanwhile, but fkv_shutdown()
+ * and fkv_load() wait for every view, so the holding thread must release
+ * before calling them. Returns 0, or -1 on bad input or allocation failure
+ * (nothing to release then, though releasing is harmless).
+ */
+int fkv_view_prefix(const uint8_t *key, size_t kn, fkv_view_t *view, size_t k);
+void fkv_view_release(fkv_view_t *view);
+/*
+ * The entry fkv_get_prefix(key, kn, it, 1) would return, without heap
+ * copies: its value goes to value (*value_len: capacity in, bytes out;
+ * longer values keep their last digits) and its key length to *key_len.
+ * Returns 1 when there is such an entry, 0 when not, -1 on bad input.
+ */
+int fkv_get_first(const uint8_t *key, size_t kn, uint8_t *value, size_t *value_len, size_t *key_len);
+/*
+ * Count and sum of the FKV_ENTRY_TYPE_VALUE entries whose key starts with
+ * key. Every trie node keeps these for its subtree and puts update them
+ * along their path, so this costs O(kn) however many entries match. exact
+ * (either may be NULL) gets the same for the entry at exactly key alone.
+ * Returns 0, or -1 on bad input.
+ */
+int fkv_aggregate_prefix(const uint8_t *key, size_t kn, fkv_aggregate_t *prefix, fkv_aggregate_t *exact);
 void fkv_iter_free(fkv_iter_t *it);
 void fkv_set_topk_limit(size_t limit);
 size_t fkv_get_topk_limit(void);
 int fkv_save(const char *path);
 int fkv_load(const char *path);
 uint64_t fkv_current_sequence(void);
+/*
+ * Changes whenever anything a reader could observe changes (puts, including
+ * ones with an explicit priority, init, shutdown, load, top-K pruning).
+ * Unlike the sequence number it is never reset.
+ */
+uint64_t fkv_generation(void);
 int fkv_export_delta(uint64_t since_sequence, fkv_delta_t *delta);
 int fkv_apply_delta(const fkv_delta_t *delta);
 void fkv_delta_free(fkv_delta_t *delta);
+void fkv_memory_usage(fkv_memory_t *out);
 uint16_t fkv_delta_compute_checksum(const fkv_delta_t *delta);
 
+/*
+ * Packed digits: two per byte, the first in the high nibble, so packed
+ * strings of equal length compare like the digits. An odd count leaves the
+ * last low nibble 0. Snapshots use this form; the API takes one digit per
+ * byte. Both run 32 digits at a time with SSE2.
+ */
+#define FKV_PACKED_SIZE(n) (((n) + 1) / 2)
+void fkv_pack_digits(const uint8_t *digits, size_t n, uint8_t *packed);
+void fkv_unpack_digits(const uint8_t *packed, size_t n, uint8_t *digits);
+
 #ifdef __cplusplus
 }
 #endif
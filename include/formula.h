@@ -165,6 +165,13 @@ int evaluate_formula_with_vm(const Formula* formula,
                              double* out_poe,
                              double* out_mdl,
                              size_t* out_program_len);
+/* Same as evaluate_formula_with_vm, reusing ctx buffers when ctx is not NULL. */
+int evaluate_formula_with_vm_context(vm_context_t* ctx,
+                                     const Formula* formula,
+                                     vm_result_t* out_result,
+                                     double* out_poe,
+                                     double* out_mdl,
+                                     size_t* out_program_len);
 
 
 #endif // FORMULA_H
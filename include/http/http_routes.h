@@ -28,6 +28,8 @@ void http_response_free(http_response_t *resp);
 void http_routes_set_start_time(uint64_t ms_since_epoch);
 void http_routes_set_blockchain(Blockchain *chain);
 void http_routes_set_ai(struct KolibriAI *ai);
+/* Frees per-thread route state; worker threads call it before exiting. */
+void http_routes_release_thread_state(void);
 
 
 #endif
@@ -25,6 +25,26 @@ int evaluate_formula_with_vm(const Formula *formula,
                              double *out_poe,
                              double *out_mdl,
                              size_t *out_program_len);
+typedef struct {
+    int rc; /* what evaluate_formula_with_vm would have returned */
+    vm_result_t result;
+    double poe;
+    double mdl;
+    size_t program_len;
+} formula_vm_evaluation_t;
+
+/* Evaluates count formulas with vm_run_batch on up to `threads` workers. */
+int evaluate_formulas_with_vm_batch(const Formula *const *formulas,
+                                    size_t count,
+                                    size_t threads,
+                                    formula_vm_evaluation_t *out);
+/* Same as evaluate_formula_with_vm, reusing ctx buffers when ctx is not NULL. */
+int evaluate_formula_with_vm_context(vm_context_t *ctx,
+                                     const Formula *formula,
+                                     vm_result_t *out_result,
+                                     double *out_poe,
+                                     double *out_mdl,
+                                     size_t *out_program_len);
 
 #ifdef __cplusplus
 }
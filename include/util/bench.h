@@ -2,6 +2,7 @@
 #define KOLIBRI_UTIL_BENCH_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #include "util/config.h"
 
@@ -36,6 +37,8 @@ int bench_options_add_threshold_override(bench_options_t *opts,
                                          int has_p99,
                                          double p99_ms);
 int bench_run_all(const kolibri_config_t *cfg, const bench_options_t *opts);
+/* Prints a Δ-VM trace stream (vm_trace_sink_t output) as one JSON object per line. */
+int bench_decode_trace(const char *path, FILE *out);
 
 #ifdef __cplusplus
 }
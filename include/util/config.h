@@ -22,6 +22,10 @@ typedef struct {
     uint32_t max_steps;
     uint32_t max_stack;
     uint32_t trace_depth;
+    uint32_t result_cache_entries;
+    int profile;
+    /* "gas": per-opcode cost by mnemonic, indexed by opcode byte; 0 = default (1) */
+    uint32_t gas_costs[256];
 } vm_config_t;
 
 typedef struct {
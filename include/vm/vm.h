@@ -15,9 +15,25 @@ typedef struct {
     size_t len;
 } prog_t;
 
+typedef enum {
+    VM_ENGINE_DEFAULT = 0,  /* whatever vm_set_default_engine() selected */
+    VM_ENGINE_SWITCH = 1,   /* reference switch interpreter */
+    VM_ENGINE_THREADED = 2, /* pre-decoded, computed-goto dispatch */
+    VM_ENGINE_JIT = 3,      /* x86-64 code for hot verified programs, else threaded */
+    VM_ENGINE_REGISTER = 4, /* register code translated from the stack code, else threaded */
+} vm_engine_t;
+
 typedef struct {
+    /* Gas budget; a step costs its opcode's vm_gas_cost(), 1 by default. */
     uint32_t max_steps;
     uint32_t max_stack;
+    vm_engine_t engine;
+    /*
+     * Together with the vm_set_seed() seed and the bytecode, selects the
+     * RANDOM10 sequence of a run: equal triples draw equal values on any
+     * thread and engine.
+     */
+    uint64_t request_id;
 } vm_limits_t;
 
 typedef struct {
@@ -28,20 +44,86 @@ typedef struct {
     uint32_t gas_left;
 } vm_trace_entry_t;
 
+typedef enum {
+    VM_TRACE_HEAD = 0, /* keep the first `capacity` steps */
+    VM_TRACE_RING = 1, /* keep the last `capacity` steps */
+} vm_trace_mode_t;
+
+/*
+ * Streaming trace sink: steps are appended as compact binary records to a
+ * buffer that is written to `fd` whenever it fills up and on
+ * vm_trace_sink_flush(). A sink belongs to one thread at a time.
+ */
+#define VM_TRACE_SINK_BUFFER 4096
+
+typedef struct {
+    int fd;
+    int error;          /* errno of the first failed write; nothing is written after it */
+    uint32_t last_step; /* records store the step as a delta */
+    size_t len;
+    uint64_t records;
+    uint8_t buffer[VM_TRACE_SINK_BUFFER];
+} vm_trace_sink_t;
+
+/*
+ * Steps whose number is a multiple of `sample_every` (0 or 1: all steps)
+ * are kept according to `mode` and, when `sink` is set, streamed to it.
+ * In ring mode, once `count == capacity` the oldest entry is at `cursor`;
+ * vm_trace_at() hides the difference. `total` counts the steps that passed
+ * sampling, so `total - count` of them were dropped.
+ */
 typedef struct {
     vm_trace_entry_t *entries;
     size_t capacity;
     size_t count;
     size_t cursor;
+    vm_trace_mode_t mode;
+    uint32_t sample_every;
+    vm_trace_sink_t *sink;
+    uint64_t total;
 } vm_trace_t;
 
+/* The i-th oldest kept step, or NULL when i >= count. */
+const vm_trace_entry_t *vm_trace_at(const vm_trace_t *trace, size_t i);
+
+/* Writes the stream header to the buffer; nothing reaches fd before a flush. */
+void vm_trace_sink_init(vm_trace_sink_t *sink, int fd);
+int vm_trace_sink_flush(vm_trace_sink_t *sink);
+
+/*
+ * Offline decoder for sink output. Every run starts with a
+ * VM_TRACE_RECORD_RUN record followed by its steps.
+ */
+typedef enum {
+    VM_TRACE_RECORD_RUN = 1,
+    VM_TRACE_RECORD_STEP = 2,
+} vm_trace_record_kind_t;
+
+typedef struct {
+    vm_trace_record_kind_t kind;
+    vm_trace_entry_t entry; /* VM_TRACE_RECORD_STEP only */
+} vm_trace_record_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t offset;
+    uint32_t step;
+} vm_trace_reader_t;
+
+/* -1 when data does not start with a trace stream header. */
+int vm_trace_reader_init(vm_trace_reader_t *reader, const uint8_t *data, size_t len);
+/* 1 with *record filled, 0 at the end of the data, -1 on a malformed record. */
+int vm_trace_reader_next(vm_trace_reader_t *reader, vm_trace_record_t *record);
+
 typedef enum {
     VM_OK = 0,
     VM_ERR_INVALID_OPCODE = -1,
     VM_ERR_STACK_OVERFLOW = -2,
     VM_ERR_STACK_UNDERFLOW = -3,
     VM_ERR_DIV_BY_ZERO = -4,
-    VM_ERR_GAS_EXHAUSTED = -5
+    VM_ERR_GAS_EXHAUSTED = -5,
+    VM_YIELD = 1 /* slice used up; vm_context_resume() continues the run */
 } vm_status_t;
 
 typedef struct {
@@ -49,12 +131,210 @@ typedef struct {
     uint64_t result;
     uint32_t steps;
     uint8_t halted;
+    uint32_t gas_used; /* equals steps under the default gas schedule */
 } vm_result_t;
 
+/* Seed for RANDOM10 sequences of later runs (see vm_limits_t.request_id). */
 void vm_set_seed(uint32_t seed);
 
+/*
+ * Gas schedule of later runs: costs[opcode] is charged for each step with
+ * that opcode byte, 0 meaning the default of 1; NULL restores the default.
+ * A step runs only when its whole cost fits into what is left of
+ * max_steps. The JIT and register engines meter steps only, so under a
+ * non-default schedule their runs go to the threaded interpreter.
+ */
+#define VM_GAS_OPCODES 256
+void vm_set_gas_schedule(const uint32_t *costs);
+uint32_t vm_gas_cost(uint8_t opcode);
+
+void vm_set_default_engine(vm_engine_t engine);
+vm_engine_t vm_get_default_engine(void);
+const char *vm_engine_name(vm_engine_t engine);
+
 int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out);
 
+/*
+ * Result cache for untraced runs. Programs that cannot reach RANDOM10,
+ * TIME10 or WRITE_FKV are deterministic in their bytecode and limits;
+ * those that can reach READ_FKV are cached per fkv_generation(). Keys are
+ * 128-bit hashes of the bytecode and the effective limits; entries live in
+ * lock-striped shards with LRU eviction inside small buckets. vm_run,
+ * vm_run_verified and the vm_context_* runs consult it.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bypassed; /* runs of programs that cannot be cached */
+    size_t entries;
+    size_t capacity;
+} vm_result_cache_stats_t;
+
+/* Sets the capacity in entries and drops every cached result; 0 disables. */
+int vm_result_cache_configure(size_t capacity);
+void vm_result_cache_clear(void);
+void vm_result_cache_stats(vm_result_cache_stats_t *out);
+
+/*
+ * Opt-in execution profiler. While enabled, vm_run, vm_run_verified, the
+ * vm_context_* runs and vm_run_batch go through the reference interpreter,
+ * bypass the result cache and count executions and elapsed clock per
+ * opcode byte and per instruction pointer (vm_run_lanes is not profiled).
+ * Counters are kept per thread and merged by vm_profile_snapshot(); those
+ * of exited threads are kept. Clock units are TSC cycles on x86-64,
+ * nanoseconds elsewhere.
+ */
+#define VM_PROFILE_OPCODES 256
+/* Instruction pointers from VM_PROFILE_IPS - 1 up share the last slot. */
+#define VM_PROFILE_IPS 1024
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} vm_profile_counter_t;
+
+typedef struct {
+    int enabled;
+    uint64_t runs;
+    uint64_t steps;
+    uint64_t cycles;
+    vm_profile_counter_t opcodes[VM_PROFILE_OPCODES];
+    vm_profile_counter_t ips[VM_PROFILE_IPS];
+} vm_profile_t;
+
+void vm_profile_enable(int enabled);
+int vm_profile_enabled(void);
+void vm_profile_reset(void);
+void vm_profile_snapshot(vm_profile_t *out);
+/* JSON report with every executed opcode and the `hot_ips` hottest ips; caller frees. */
+char *vm_profile_serialize(const vm_profile_t *profile, size_t hot_ips);
+
+/* Runs with VM_ENGINE_JIT before a program is compiled (default 8). */
+void vm_jit_set_threshold(uint32_t hits);
+/* Drops compiled programs that are not currently running. */
+void vm_jit_flush(void);
+/* 1 when native code generation is supported on this platform. */
+int vm_jit_available(void);
+/* Drops VM_ENGINE_REGISTER translations that are not currently running. */
+void vm_register_flush(void);
+
+/*
+ * A program proven safe by vm_verify(): every reachable instruction is
+ * well formed, jumps land on instruction boundaries, the operand stack
+ * never underflows and never grows past max_depth, and calls nest at most
+ * max_call_depth deep. The code buffer is borrowed, not copied.
+ */
+typedef struct {
+    prog_t prog;
+    uint32_t max_depth;
+    uint32_t max_call_depth;
+    /*
+     * Bounds for pre-admission, set when bounded: every run that ends
+     * normally (HALT, top-level RET or falling off the end) takes at least
+     * min_steps steps and min_gas gas, and no run takes more than max_steps
+     * or max_gas. Gas is priced by the schedule in effect at vm_verify()
+     * and is what vm_limits_t.max_steps budgets. A program is unbounded,
+     * with all four left 0, when a reachable loop can repeat with the same
+     * stack depth and call chain.
+     */
+    uint32_t min_steps;
+    uint32_t max_steps;
+    uint32_t min_gas;
+    uint32_t max_gas;
+    uint8_t bounded;
+    vm_status_t reject_status; /* why vm_verify() rejected the program */
+    uint32_t reject_ip;
+    void *impl;
+    void *fused; /* superinstruction table from vm_optimize(), or NULL */
+} vm_verified_prog_t;
+
+/* Returns 0 if verified, 1 if rejected (see reject_*), -1 on error. */
+int vm_verify(const prog_t *p, const vm_limits_t *lim, vm_verified_prog_t *out);
+int vm_run_verified(const vm_verified_prog_t *vp,
+                    const vm_limits_t *lim,
+                    vm_trace_t *trace,
+                    vm_result_t *out);
+void vm_verified_free(vm_verified_prog_t *vp);
+
+/*
+ * Peephole pass over a verified program: folds constant subexpressions,
+ * collapses NOP runs and fuses PUSHd/PUSHN+ADD10/SUB10/MUL10 and CMP+JZ/JNZ
+ * into superinstructions. Untraced vm_run_verified() and
+ * vm_context_run_verified() calls then use the fused table; steps and gas
+ * still count the original instructions, and traced runs use the original
+ * table. Returns 0 on success (also when nothing could be fused).
+ */
+int vm_optimize(vm_verified_prog_t *vp);
+
+/*
+ * A reusable execution context: owns the operand stack, the decoded
+ * instruction table and an optional trace buffer, so repeated runs on one
+ * thread do not allocate once the buffers have grown to the largest program
+ * and stack seen. A context must not be shared between threads.
+ */
+typedef struct vm_context vm_context_t;
+
+/* trace_capacity == 0 disables tracing for runs in this context. */
+vm_context_t *vm_context_create(const vm_limits_t *lim, size_t trace_capacity);
+void vm_context_reset(vm_context_t *ctx);
+int vm_context_run(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim, vm_result_t *out);
+int vm_context_run_verified(vm_context_t *ctx,
+                            const vm_verified_prog_t *vp,
+                            const vm_limits_t *lim,
+                            vm_result_t *out);
+/*
+ * Trace mode, sampling and sink for later runs; a sink also traces a
+ * context created without a trace buffer. The sink must outlive its use.
+ */
+void vm_context_set_trace(vm_context_t *ctx, vm_trace_mode_t mode, uint32_t sample_every, vm_trace_sink_t *sink);
+/*
+ * Resumable runs for cooperative scheduling. vm_context_start() loads a
+ * program into the context; each vm_context_resume() then spends at most
+ * `slice` further gas (0: no slice limit) on the reference interpreter, or
+ * one step when that step alone costs more, and reports VM_YIELD when the
+ * slice ran out first, with steps, gas and result counting the whole run so
+ * far. Any other status ends the run. ip, stack, call stack, counters and
+ * the run's buffered F-KV writes live in the context, so slices may run on
+ * different threads as long as they do not overlap. The whole run is one
+ * F-KV transaction: its writes are committed when it ends with VM_OK and
+ * dropped otherwise, and the result cache is not used. The bytecode must
+ * stay valid until the run ends; vm_context_start(), vm_context_run*() and
+ * vm_context_reset() abandon it, dropping its writes.
+ */
+int vm_context_start(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim);
+int vm_context_resume(vm_context_t *ctx, uint32_t slice, vm_result_t *out);
+/* 1 while a started run has yielded and can be resumed. */
+int vm_context_suspended(const vm_context_t *ctx);
+/* Trace of the last run, or NULL when the context does not trace. */
+const vm_trace_t *vm_context_trace(const vm_context_t *ctx);
+void vm_context_destroy(vm_context_t *ctx);
+
+/*
+ * Runs n independent programs under the same limits on up to `threads`
+ * workers (0: one per online CPU) and stores one result per program in
+ * out. Program i runs under lim->request_id + i, so results do not depend
+ * on the thread count. A program that cannot be run at all gets
+ * VM_ERR_INVALID_OPCODE and makes the call return -1 once the whole batch
+ * has finished.
+ */
+int vm_run_batch(const prog_t *progs, size_t n, const vm_limits_t *lim, vm_result_t *out, size_t threads);
+
+/*
+ * Runs one program once per lane. When inputs is not NULL, lane i starts
+ * with inputs[i] already on its stack. Lanes that agree on ip and stack
+ * depth execute together as vector operations; out[i] is what vm_run
+ * would report for lane i under lim->request_id + i. A program that can
+ * reach an F-KV opcode runs lane by lane instead, each lane one F-KV
+ * transaction committed in lane order, so lanes behave like consecutive
+ * vm_run calls.
+ */
+int vm_run_lanes(const prog_t *p,
+                 const vm_limits_t *lim,
+                 const int64_t *inputs,
+                 size_t lanes,
+                 vm_result_t *out);
+
 void vm_force_fkv_errors(int get_enabled, int get_rc, int put_enabled, int put_rc);
 void vm_reset_fkv_errors(void);
 
@@ -4,70 +4,639 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Concurrency: writers serialize on fkv_lock, readers take no lock.
+ * Everything a reader dereferences is published by an atomic pointer swap:
+ * entry records are immutable and replaced whole by every put, a node's
+ * aggregates and top-K list live in an immutable fkv_summary_t that is
+ * rebuilt and swapped the same way, and a node that has to grow or split
+ * is copied and swapped into its parent. The one in-place change is
+ * appending a child to a node with room, which publishes the child before
+ * the count that makes it visible. Replaced objects go to a limbo list
+ * tagged with the global epoch and are freed once no reader is still in
+ * that epoch (epoch-based reclamation). Whole tries (shutdown, load) are
+ * dropped after waiting for every reader to leave.
+ *
+ * Memory: nodes, records and summaries all come from fkv_pool (see
+ * fkv_pool_alloc()), so dropping a trie frees its slabs instead of walking it.
+ */
+
+/* Header of every node, record and summary: its pool size, then the limbo link once retired. */
+typedef struct fkv_retired {
+    struct fkv_retired *next;
+    uint64_t epoch;
+    uint32_t size;
+} fkv_retired_t;
+
+/* Key digits then value digits follow inline, see record_key() and record_value(). */
 typedef struct fkv_entry_record {
-    uint8_t *key;
-    size_t key_len;
-    uint8_t *value;
-    size_t value_len;
-    fkv_entry_type_t type;
+    fkv_retired_t retired;
     uint64_t priority;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint8_t type;
+    uint8_t bytes[];
 } fkv_entry_record_t;
 
-typedef struct fkv_node {
-    struct fkv_node *children[10];
-    fkv_entry_record_t *self_entry;
-    fkv_entry_record_t **top_entries;
+/* What a node knows about its subtree; replaced, never modified, once published. */
+typedef struct fkv_summary {
+    fkv_retired_t retired;
+    /* Value entries at or below the node, see fkv_aggregate_prefix(). */
+    uint64_t agg_count;
+    uint64_t agg_sum;
     size_t top_count;
-    size_t top_capacity;
+    fkv_entry_record_t *top[]; /* highest priority first */
+} fkv_summary_t;
+
+/*
+ * Adaptive radix node. The edge from the parent is the child's digit plus
+ * path[], the digits of a single-child run folded into the node, packed two
+ * per byte (longer runs chain nodes). kind is how many children fit: 0
+ * (leaf), 1 or 4, found through keys[] in insertion order, or 10, indexed
+ * by digit. Every
+ * prefix that ends inside path[] has the node's subtree, so it shares the
+ * node's summary.
+ */
+#define FKV_PATH_MAX 16
+
+typedef struct fkv_node {
+    fkv_retired_t retired;
+    _Atomic(fkv_entry_record_t *) self_entry;
+    _Atomic(fkv_summary_t *) summary; /* NULL until the first put below the node */
+    uint8_t kind;
+    _Atomic uint8_t child_count; /* kinds 1 and 4 */
+    uint8_t keys[4];
+    uint8_t path_len;
+    uint8_t path[FKV_PACKED_SIZE(FKV_PATH_MAX)];
+    _Atomic(struct fkv_node *) children[];
 } fkv_node_t;
 
+#define FKV_LOAD(ptr) atomic_load_explicit(&(ptr), memory_order_acquire)
+/* Writers own what they load under fkv_lock. */
+#define FKV_LOAD_LOCKED(ptr) atomic_load_explicit(&(ptr), memory_order_relaxed)
+#define FKV_PUBLISH(ptr, value) atomic_store_explicit(&(ptr), (value), memory_order_release)
+
+void fkv_pack_digits(const uint8_t *digits, size_t n, uint8_t *packed) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    /* 32 digits per round: in each 16-bit lane (even | odd << 8), (lane << 4 | lane >> 8) & 0xFF is the byte. */
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    for (; i + 32 <= n; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(digits + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(digits + i + 16));
+        a = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(a, 4), _mm_srli_epi16(a, 8)), low_byte);
+        b = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(b, 4), _mm_srli_epi16(b, 8)), low_byte);
+        _mm_storeu_si128((__m128i *)(packed + i / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i + 1 < n; i += 2) {
+        packed[i / 2] = (uint8_t)(digits[i] << 4 | digits[i + 1]);
+    }
+    if (i < n) {
+        packed[i / 2] = (uint8_t)(digits[i] << 4);
+    }
+}
+
+void fkv_unpack_digits(const uint8_t *packed, size_t n, uint8_t *digits) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    for (; i + 32 <= n; i += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(packed + i / 2));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i low = _mm_and_si128(v, nibble);
+        _mm_storeu_si128((__m128i *)(digits + i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(digits + i + 16), _mm_unpackhi_epi8(high, low));
+    }
+#endif
+    for (; i + 1 < n; i += 2) {
+        digits[i] = packed[i / 2] >> 4;
+        digits[i + 1] = packed[i / 2] & 0x0F;
+    }
+    if (i < n) {
+        digits[i] = packed[i / 2] >> 4;
+    }
+}
+
+static inline const uint8_t *record_key(const fkv_entry_record_t *rec) {
+    return rec->bytes;
+}
+
+static inline const uint8_t *record_value(const fkv_entry_record_t *rec) {
+    return rec->bytes + rec->key_len;
+}
+
+/*
+ * Slab pool. A bump pointer carves objects out of FKV_SLAB_BYTES slabs,
+ * rounded up to FKV_POOL_ALIGN; reclaimed objects go to a free list per
+ * size class and are handed out again before the bump pointer moves. Objects
+ * above FKV_POOL_MAX_OBJECT (long keys or values, big top-K lists) are
+ * malloc'd and chained instead. fkv_pool_reset() thus frees a whole trie in
+ * O(slabs + large objects). Only touched under fkv_lock.
+ */
+#define FKV_SLAB_BYTES (64u * 1024u)
+#define FKV_POOL_ALIGN 16u
+#define FKV_POOL_MAX_OBJECT 512u
+#define FKV_POOL_CLASSES (FKV_POOL_MAX_OBJECT / FKV_POOL_ALIGN)
+
+typedef struct fkv_slab {
+    struct fkv_slab *next;
+} fkv_slab_t;
+
+typedef struct fkv_free_object {
+    struct fkv_free_object *next;
+} fkv_free_object_t;
+
+typedef struct fkv_large {
+    _Alignas(16) struct fkv_large *prev;
+    struct fkv_large *next;
+} fkv_large_t;
+
+typedef struct {
+    fkv_slab_t *slabs;
+    uint8_t *bump;
+    size_t bump_left;
+    fkv_free_object_t *free_lists[FKV_POOL_CLASSES];
+    fkv_large_t *large;
+    size_t slab_count;
+    size_t large_count;
+    size_t large_bytes;
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t nodes;
+    size_t entries;
+    size_t retired;
+} fkv_pool_t;
+
+static fkv_pool_t fkv_pool;
+
+#define FKV_SLAB_HEADER ((sizeof(fkv_slab_t) + FKV_POOL_ALIGN - 1) & ~(size_t)(FKV_POOL_ALIGN - 1))
+
+static size_t fkv_pool_round(size_t size) {
+    return (size + FKV_POOL_ALIGN - 1) & ~(size_t)(FKV_POOL_ALIGN - 1);
+}
+
+/* size bytes, 16-byte aligned, uninitialized; size must be what fkv_pool_free() gets back. */
+static void *fkv_pool_alloc(size_t size) {
+    size = fkv_pool_round(size);
+    if (size > FKV_POOL_MAX_OBJECT) {
+        fkv_large_t *large = malloc(sizeof(*large) + size);
+        if (!large) {
+            return NULL;
+        }
+        large->prev = NULL;
+        large->next = fkv_pool.large;
+        if (fkv_pool.large) {
+            fkv_pool.large->prev = large;
+        }
+        fkv_pool.large = large;
+        fkv_pool.large_count++;
+        fkv_pool.large_bytes += size;
+        fkv_pool.used_bytes += size;
+        return large + 1;
+    }
+    size_t cls = size / FKV_POOL_ALIGN - 1;
+    fkv_free_object_t *object = fkv_pool.free_lists[cls];
+    if (object) {
+        fkv_pool.free_lists[cls] = object->next;
+        fkv_pool.free_bytes -= size;
+        fkv_pool.used_bytes += size;
+        return object;
+    }
+    if (fkv_pool.bump_left < size) {
+        /* The tail of the old slab is lost; at most FKV_POOL_MAX_OBJECT per slab. */
+        fkv_slab_t *slab = malloc(FKV_SLAB_BYTES);
+        if (!slab) {
+            return NULL;
+        }
+        slab->next = fkv_pool.slabs;
+        fkv_pool.slabs = slab;
+        fkv_pool.slab_count++;
+        fkv_pool.bump = (uint8_t *)slab + FKV_SLAB_HEADER;
+        fkv_pool.bump_left = FKV_SLAB_BYTES - FKV_SLAB_HEADER;
+    }
+    void *out = fkv_pool.bump;
+    fkv_pool.bump += size;
+    fkv_pool.bump_left -= size;
+    fkv_pool.used_bytes += size;
+    return out;
+}
+
+static void fkv_pool_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    size = fkv_pool_round(size);
+    fkv_pool.used_bytes -= size;
+    if (size > FKV_POOL_MAX_OBJECT) {
+        fkv_large_t *large = (fkv_large_t *)ptr - 1;
+        if (large->prev) {
+            large->prev->next = large->next;
+        } else {
+            fkv_pool.large = large->next;
+        }
+        if (large->next) {
+            large->next->prev = large->prev;
+        }
+        fkv_pool.large_count--;
+        fkv_pool.large_bytes -= size;
+        free(large);
+        return;
+    }
+    size_t cls = size / FKV_POOL_ALIGN - 1;
+    fkv_free_object_t *object = ptr;
+    object->next = fkv_pool.free_lists[cls];
+    fkv_pool.free_lists[cls] = object;
+    fkv_pool.free_bytes += size;
+}
+
+/* Frees every object at once; nothing allocated before may be used again. */
+static void fkv_pool_reset(void) {
+    while (fkv_pool.slabs) {
+        fkv_slab_t *next = fkv_pool.slabs->next;
+        free(fkv_pool.slabs);
+        fkv_pool.slabs = next;
+    }
+    while (fkv_pool.large) {
+        fkv_large_t *next = fkv_pool.large->next;
+        free(fkv_pool.large);
+        fkv_pool.large = next;
+    }
+    memset(&fkv_pool, 0, sizeof(fkv_pool));
+}
+
+/* A record or summary: pool memory whose header remembers its size. */
+static void *fkv_object_alloc(size_t size) {
+    fkv_retired_t *object = fkv_pool_alloc(size);
+    if (object) {
+        object->size = (uint32_t)size;
+    }
+    return object;
+}
+
+static void fkv_object_free(void *ptr) {
+    if (ptr) {
+        fkv_pool_free(ptr, ((fkv_retired_t *)ptr)->size);
+    }
+}
+
+/* Per-thread reader slot, linked into fkv_readers while the thread lives. */
+typedef struct fkv_reader {
+    atomic_uint_fast64_t epoch; /* 0 outside read sections */
+    unsigned depth;
+    struct fkv_reader *next;
+} fkv_reader_t;
+
 static pthread_mutex_t fkv_lock = PTHREAD_MUTEX_INITIALIZER;
-static fkv_node_t *fkv_root = NULL;
-static size_t fkv_topk_limit = 4;
-static uint64_t fkv_sequence = 1;
+static _Atomic(fkv_node_t *) fkv_root = NULL;
+static atomic_size_t fkv_topk_limit = 4;
+static atomic_uint_fast64_t fkv_sequence = 1;
+/* Bumped after every change to the visible contents, see fkv_generation(). */
+static atomic_uint_fast64_t fkv_generation_counter = 0;
+/* Odd while fkv_put_batch() applies several puts; readers retry across it. */
+static atomic_uint_fast64_t fkv_batch_seq = 0;
+
+static atomic_uint_fast64_t fkv_epoch = 1;
+static fkv_retired_t *fkv_limbo = NULL; /* newest first, under fkv_lock */
+static pthread_mutex_t fkv_reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static fkv_reader_t *fkv_readers = NULL;
+static pthread_key_t fkv_reader_key;
+static pthread_once_t fkv_reader_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local fkv_reader_t *fkv_reader_self = NULL;
+
+static void fkv_reader_exit(void *arg) {
+    fkv_reader_t *reader = arg;
+    pthread_mutex_lock(&fkv_reader_lock);
+    for (fkv_reader_t **link = &fkv_readers; *link; link = &(*link)->next) {
+        if (*link == reader) {
+            *link = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fkv_reader_lock);
+    free(reader);
+}
 
-static fkv_node_t *node_create(void) {
-    return calloc(1, sizeof(fkv_node_t));
+static void fkv_reader_make_key(void) {
+    pthread_key_create(&fkv_reader_key, fkv_reader_exit);
 }
 
-static void node_free(fkv_node_t *node) {
+static fkv_reader_t *fkv_reader_register(void) {
+    pthread_once(&fkv_reader_key_once, fkv_reader_make_key);
+    fkv_reader_t *reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        return NULL;
+    }
+    pthread_mutex_lock(&fkv_reader_lock);
+    reader->next = fkv_readers;
+    fkv_readers = reader;
+    pthread_mutex_unlock(&fkv_reader_lock);
+    pthread_setspecific(fkv_reader_key, reader);
+    fkv_reader_self = reader;
+    return reader;
+}
+
+/*
+ * Enters a read section: until fkv_read_end(), nothing reachable from
+ * fkv_root is freed. Sections nest, and a thread may write inside one.
+ * NULL means the thread could not be registered (out of memory).
+ */
+static fkv_reader_t *fkv_read_begin(void) {
+    fkv_reader_t *reader = fkv_reader_self ? fkv_reader_self : fkv_reader_register();
+    if (!reader) {
+        return NULL;
+    }
+    if (reader->depth++ == 0) {
+        atomic_store_explicit(&reader->epoch, atomic_load(&fkv_epoch), memory_order_relaxed);
+        /* Pairs with the fence in fkv_advance_epoch_locked(): either the writer sees us, or we see its unlink. */
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    return reader;
+}
+
+static void fkv_read_end(fkv_reader_t *reader) {
+    if (--reader->depth == 0) {
+        atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    }
+}
+
+/* Oldest epoch a reader may still be in, UINT64_MAX when nobody reads. */
+static uint64_t fkv_reader_min_epoch(void) {
+    uint64_t min = UINT64_MAX;
+    pthread_mutex_lock(&fkv_reader_lock);
+    for (fkv_reader_t *reader = fkv_readers; reader; reader = reader->next) {
+        uint64_t epoch = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+        if (epoch != 0 && epoch < min) {
+            min = epoch;
+        }
+    }
+    pthread_mutex_unlock(&fkv_reader_lock);
+    return min;
+}
+
+/* Starts a new epoch and returns the one everything unlinked so far belongs to. */
+static uint64_t fkv_advance_epoch_locked(void) {
+    uint64_t epoch = atomic_fetch_add(&fkv_epoch, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return epoch;
+}
+
+static void fkv_retire_locked(void *object) {
+    fkv_retired_t *retired = object;
+    retired->epoch = atomic_load_explicit(&fkv_epoch, memory_order_relaxed);
+    retired->next = fkv_limbo;
+    fkv_limbo = retired;
+    fkv_pool.retired++;
+}
+
+static void fkv_free_retired(fkv_retired_t *retired) {
+    while (retired) {
+        fkv_retired_t *next = retired->next;
+        fkv_pool.retired--;
+        fkv_object_free(retired);
+        retired = next;
+    }
+}
+
+/* Frees the retired objects no reader can reach any more. */
+static void fkv_reclaim_locked(void) {
+    if (!fkv_limbo) {
+        return;
+    }
+    fkv_advance_epoch_locked();
+    uint64_t min = fkv_reader_min_epoch();
+    fkv_retired_t **link = &fkv_limbo;
+    while (*link && (*link)->epoch >= min) {
+        link = &(*link)->next;
+    }
+    fkv_free_retired(*link);
+    *link = NULL;
+}
+
+/* Unpublishes the trie, waits until no reader can still see it, then frees all of it. */
+static void fkv_discard_trie_locked(void) {
+    FKV_PUBLISH(fkv_root, NULL);
+    uint64_t epoch = fkv_advance_epoch_locked();
+    while (fkv_reader_min_epoch() <= epoch) {
+        sched_yield();
+    }
+    fkv_limbo = NULL;
+    fkv_pool_reset();
+}
+
+static void fkv_write_unlock(void) {
+    fkv_reclaim_locked();
+    pthread_mutex_unlock(&fkv_lock);
+}
+
+static void fkv_bump_generation_locked(void) {
+    atomic_store_explicit(&fkv_generation_counter,
+                          atomic_load_explicit(&fkv_generation_counter, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/* Batch sequence a read may start at: waits out a batch in progress. */
+static uint64_t fkv_batch_enter(void) {
+    for (;;) {
+        uint64_t seq = atomic_load_explicit(&fkv_batch_seq, memory_order_acquire);
+        if ((seq & 1) == 0) {
+            return seq;
+        }
+        sched_yield();
+    }
+}
+
+static int fkv_batch_overlapped(uint64_t seq) {
+    return atomic_load_explicit(&fkv_batch_seq, memory_order_acquire) != seq;
+}
+
+static uint8_t node_path_digit(const fkv_node_t *node, size_t i) {
+    uint8_t byte = node->path[i >> 1];
+    return (i & 1) ? (byte & 0x0F) : (byte >> 4);
+}
+
+static fkv_node_t *node_create(uint8_t kind, const uint8_t *path, size_t path_len) {
+    size_t size = sizeof(fkv_node_t) + kind * sizeof(_Atomic(fkv_node_t *));
+    fkv_node_t *node = fkv_object_alloc(size);
     if (!node) {
+        return NULL;
+    }
+    memset((uint8_t *)node + sizeof(fkv_retired_t), 0, size - sizeof(fkv_retired_t));
+    node->kind = kind;
+    node->path_len = (uint8_t)path_len;
+    fkv_pack_digits(path, path_len, node->path);
+    fkv_pool.nodes++;
+    return node;
+}
+
+static void node_retire_locked(fkv_node_t *node) {
+    fkv_pool.nodes--;
+    fkv_retire_locked(node);
+}
+
+/* The child under digit d; for readers and writers alike. */
+static fkv_node_t *node_child(const fkv_node_t *node, uint8_t d) {
+    if (node->kind == 10) {
+        return FKV_LOAD(((fkv_node_t *)node)->children[d]);
+    }
+    size_t count = atomic_load_explicit(&((fkv_node_t *)node)->child_count, memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+        if (node->keys[i] == d) {
+            return FKV_LOAD(((fkv_node_t *)node)->children[i]);
+        }
+    }
+    return NULL;
+}
+
+static _Atomic(fkv_node_t *) *node_child_slot(fkv_node_t *node, uint8_t d) {
+    if (node->kind == 10) {
+        return FKV_LOAD_LOCKED(node->children[d]) ? &node->children[d] : NULL;
+    }
+    size_t count = atomic_load_explicit(&node->child_count, memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (node->keys[i] == d) {
+            return &node->children[i];
+        }
+    }
+    return NULL;
+}
+
+/* Adds child under digit d, in place when node has room; publishes before counting. */
+static void node_link_child(fkv_node_t *node, uint8_t d, fkv_node_t *child) {
+    if (node->kind == 10) {
+        FKV_PUBLISH(node->children[d], child);
         return;
     }
-    for (size_t i = 0; i < 10; ++i) {
-        node_free(node->children[i]);
+    size_t count = atomic_load_explicit(&node->child_count, memory_order_relaxed);
+    FKV_PUBLISH(node->children[count], child);
+    node->keys[count] = d;
+    atomic_store_explicit(&node->child_count, (uint8_t)(count + 1), memory_order_release);
+}
+
+static int node_full(const fkv_node_t *node) {
+    return node->kind != 10 &&
+           atomic_load_explicit(&((fkv_node_t *)node)->child_count, memory_order_relaxed) == node->kind;
+}
+
+/* A copy of node with another kind or path; the copy takes over the entry and summary. */
+static fkv_node_t *node_clone(const fkv_node_t *node, uint8_t kind, const uint8_t *path, size_t path_len) {
+    fkv_node_t *copy = node_create(kind, path, path_len);
+    if (!copy) {
+        return NULL;
     }
-    if (node->self_entry) {
-        free(node->self_entry->key);
-        free(node->self_entry->value);
-        free(node->self_entry);
+    atomic_init(&copy->self_entry, FKV_LOAD_LOCKED(((fkv_node_t *)node)->self_entry));
+    atomic_init(&copy->summary, FKV_LOAD_LOCKED(((fkv_node_t *)node)->summary));
+    for (uint8_t d = 0; d < 10; ++d) {
+        fkv_node_t *child = node_child(node, d);
+        if (child) {
+            node_link_child(copy, d, child);
+        }
     }
-    free(node->top_entries);
-    free(node);
+    return copy;
 }
 
-static void node_prune_entries(fkv_node_t *node) {
+static fkv_summary_t *summary_create(size_t top_capacity) {
+    return fkv_object_alloc(sizeof(fkv_summary_t) + top_capacity * sizeof(fkv_entry_record_t *));
+}
+
+static void node_prune_entries(fkv_node_t *node, size_t limit) {
     if (!node) {
         return;
     }
-    if (node->top_count > fkv_topk_limit) {
-        node->top_count = fkv_topk_limit;
+    fkv_summary_t *old = FKV_LOAD_LOCKED(node->summary);
+    if (old && old->top_count > limit) {
+        /* On allocation failure the longer list stays; readers cap by limit anyway. */
+        fkv_summary_t *pruned = summary_create(limit);
+        if (pruned) {
+            pruned->agg_count = old->agg_count;
+            pruned->agg_sum = old->agg_sum;
+            pruned->top_count = limit;
+            memcpy(pruned->top, old->top, limit * sizeof(old->top[0]));
+            FKV_PUBLISH(node->summary, pruned);
+            fkv_retire_locked(old);
+        }
     }
-    for (size_t i = 0; i < 10; ++i) {
-        node_prune_entries(node->children[i]);
+    for (uint8_t d = 0; d < 10; ++d) {
+        node_prune_entries(node_child(node, d), limit);
     }
 }
 
-static int ensure_root_locked(void) {
-    if (!fkv_root) {
-        fkv_root = node_create();
+/* Frees a node no reader has seen. */
+static void node_discard(fkv_node_t *node) {
+    if (node) {
+        fkv_pool.nodes--;
+        fkv_object_free(node);
     }
-    return fkv_root ? 0 : -1;
+}
+
+/* Replaces node, which *slot points to, by a copy with room for one more child. */
+static fkv_node_t *node_grow_locked(_Atomic(fkv_node_t *) *slot, fkv_node_t *node) {
+    uint8_t kind = node->kind == 0 ? 1 : node->kind == 1 ? 4 : 10;
+    uint8_t path[FKV_PATH_MAX];
+    fkv_unpack_digits(node->path, node->path_len, path);
+    fkv_node_t *grown = node_clone(node, kind, path, node->path_len);
+    if (!grown) {
+        return NULL;
+    }
+    FKV_PUBLISH(*slot, grown);
+    node_retire_locked(node);
+    return grown;
+}
+
+/*
+ * Cuts the edge into node, which *slot points to, after its first m path
+ * digits: a new node of the given kind takes the first m digits, and a copy
+ * of node with the rest of the path hangs below it. Both cover the same
+ * subtree, so the new node starts with a copy of node's summary.
+ */
+static fkv_node_t *node_split_locked(_Atomic(fkv_node_t *) *slot, fkv_node_t *node, size_t m, uint8_t kind) {
+    const fkv_summary_t *summary = FKV_LOAD_LOCKED(node->summary);
+    fkv_summary_t *copy = NULL;
+    if (summary) {
+        copy = summary_create(summary->top_count);
+        if (!copy) {
+            return NULL;
+        }
+        copy->agg_count = summary->agg_count;
+        copy->agg_sum = summary->agg_sum;
+        copy->top_count = summary->top_count;
+        memcpy(copy->top, summary->top, summary->top_count * sizeof(summary->top[0]));
+    }
+    uint8_t path[FKV_PATH_MAX];
+    fkv_unpack_digits(node->path, node->path_len, path);
+    fkv_node_t *upper = node_create(kind, path, m);
+    fkv_node_t *lower = node_clone(node, node->kind, path + m + 1, node->path_len - m - 1);
+    if (!upper || !lower) {
+        node_discard(upper);
+        node_discard(lower);
+        fkv_object_free(copy);
+        return NULL;
+    }
+    atomic_init(&upper->summary, copy);
+    node_link_child(upper, path[m], lower);
+    FKV_PUBLISH(*slot, upper);
+    node_retire_locked(node);
+    return upper;
+}
+
+static fkv_node_t *ensure_root_locked(void) {
+    fkv_node_t *root = FKV_LOAD_LOCKED(fkv_root);
+    if (!root) {
+        root = node_create(0, NULL, 0);
+        FKV_PUBLISH(fkv_root, root);
+    }
+    return root;
 }
 
 static fkv_entry_record_t *entry_create(const uint8_t *key,
@@ -76,102 +645,81 @@ static fkv_entry_record_t *entry_create(const uint8_t *key,
                                        size_t vn,
                                        fkv_entry_type_t type,
                                        uint64_t priority) {
-    fkv_entry_record_t *entry = calloc(1, sizeof(*entry));
+    fkv_entry_record_t *entry = fkv_object_alloc(sizeof(*entry) + kn + vn);
     if (!entry) {
         return NULL;
     }
-    entry->key = malloc(kn);
-    entry->value = malloc(vn);
-    if ((!entry->key && kn > 0) || (!entry->value && vn > 0)) {
-        free(entry->key);
-        free(entry->value);
-        free(entry);
-        return NULL;
-    }
     if (kn > 0) {
-        memcpy(entry->key, key, kn);
+        memcpy(entry->bytes, key, kn);
     }
     if (vn > 0) {
-        memcpy(entry->value, val, vn);
+        memcpy(entry->bytes + kn, val, vn);
     }
-    entry->key_len = kn;
-    entry->value_len = vn;
-    entry->type = type;
+    entry->key_len = (uint32_t)kn;
+    entry->value_len = (uint32_t)vn;
+    entry->type = (uint8_t)type;
     entry->priority = priority;
     return entry;
 }
 
-static void node_remove_top_entry(fkv_node_t *node, const fkv_entry_record_t *entry) {
-    if (!node || !entry || node->top_count == 0) {
+/* An entry's share of the aggregates: value entries count, their digits add up mod 2^64. */
+static void entry_aggregate(const fkv_entry_record_t *entry, fkv_aggregate_t *agg) {
+    agg->count = 0;
+    agg->sum = 0;
+    if (!entry || entry->type != FKV_ENTRY_TYPE_VALUE) {
         return;
     }
-    for (size_t i = 0; i < node->top_count; ++i) {
-        if (node->top_entries[i] == entry) {
-            if (i + 1 < node->top_count) {
-                memmove(node->top_entries + i,
-                        node->top_entries + i + 1,
-                        (node->top_count - i - 1) * sizeof(node->top_entries[0]));
-            }
-            node->top_count--;
-            break;
-        }
+    agg->count = 1;
+    for (size_t i = 0; i < entry->value_len; ++i) {
+        agg->sum = agg->sum * 10 + record_value(entry)[i];
     }
 }
 
-static int node_ensure_capacity(fkv_node_t *node, size_t needed) {
-    if (!node) {
-        return -1;
-    }
-    if (node->top_capacity >= needed) {
-        return 0;
-    }
-    size_t new_capacity = node->top_capacity ? node->top_capacity : fkv_topk_limit;
-    if (new_capacity == 0) {
-        new_capacity = 1;
-    }
-    while (new_capacity < needed) {
-        new_capacity *= 2;
-    }
-    fkv_entry_record_t **tmp =
-        realloc(node->top_entries, new_capacity * sizeof(*tmp));
-    if (!tmp) {
-        return -1;
-    }
-    node->top_entries = tmp;
-    node->top_capacity = new_capacity;
-    return 0;
-}
-
-static int node_insert_top_entry(fkv_node_t *node, fkv_entry_record_t *entry) {
-    if (!node || !entry) {
-        return -1;
-    }
-    node_remove_top_entry(node, entry);
-    if (fkv_topk_limit == 0) {
-        return 0;
-    }
-    size_t needed = node->top_count + 1;
-    if (needed < fkv_topk_limit) {
-        needed = fkv_topk_limit;
-    }
-    if (node_ensure_capacity(node, needed) != 0) {
-        return -1;
+/*
+ * The summary of a node once `entry` replaces `old_entry` (NULL for a new
+ * key) in its subtree: aggregates move by delta, and entry takes its place
+ * in the top-K list after the entries of equal or higher priority. Returns
+ * old itself when nothing changes, NULL when out of memory.
+ */
+static fkv_summary_t *summary_replace(fkv_summary_t *old,
+                                      const fkv_entry_record_t *old_entry,
+                                      fkv_entry_record_t *entry,
+                                      const fkv_aggregate_t *delta,
+                                      size_t limit) {
+    size_t old_count = old ? old->top_count : 0;
+    size_t capacity = old_count + 1 < limit ? old_count + 1 : limit;
+    fkv_summary_t *next = summary_create(capacity);
+    if (!next) {
+        return NULL;
     }
-    size_t insert_pos = node->top_count;
-    while (insert_pos > 0 && node->top_entries[insert_pos - 1]->priority < entry->priority) {
-        insert_pos--;
+    next->agg_count = (old ? old->agg_count : 0) + delta->count;
+    next->agg_sum = (old ? old->agg_sum : 0) + delta->sum;
+    size_t count = 0;
+    int placed = 0;
+    for (size_t i = 0; i < old_count && count < capacity; ++i) {
+        fkv_entry_record_t *rec = old->top[i];
+        if (rec == old_entry) {
+            continue;
+        }
+        if (!placed && rec->priority < entry->priority) {
+            next->top[count++] = entry;
+            placed = 1;
+            if (count == capacity) {
+                break;
+            }
+        }
+        next->top[count++] = rec;
     }
-    if (insert_pos < node->top_count) {
-        memmove(node->top_entries + insert_pos + 1,
-                node->top_entries + insert_pos,
-                (node->top_count - insert_pos) * sizeof(node->top_entries[0]));
+    if (!placed && count < capacity) {
+        next->top[count++] = entry;
     }
-    node->top_entries[insert_pos] = entry;
-    node->top_count++;
-    if (node->top_count > fkv_topk_limit) {
-        node->top_count = fkv_topk_limit;
+    next->top_count = count;
+    if (old && delta->count == 0 && delta->sum == 0 && count == old_count &&
+        memcmp(next->top, old->top, count * sizeof(next->top[0])) == 0) {
+        fkv_object_free(next);
+        return old;
     }
-    return 0;
+    return next;
 }
 
 static void fkv_delta_entry_cleanup(fkv_delta_entry_t *entry) {
@@ -226,7 +774,7 @@ static int fkv_delta_append_entry(fkv_delta_t *delta, const fkv_entry_record_t *
         if (!entry->key) {
             return -1;
         }
-        memcpy(entry->key, rec->key, rec->key_len);
+        memcpy(entry->key, record_key(rec), rec->key_len);
         entry->key_len = rec->key_len;
     }
     if (rec->value_len > 0) {
@@ -237,10 +785,10 @@ static int fkv_delta_append_entry(fkv_delta_t *delta, const fkv_entry_record_t *
             entry->key_len = 0;
             return -1;
         }
-        memcpy(entry->value, rec->value, rec->value_len);
+        memcpy(entry->value, record_value(rec), rec->value_len);
         entry->value_len = rec->value_len;
     }
-    entry->type = rec->type;
+    entry->type = (fkv_entry_type_t)rec->type;
     entry->priority = rec->priority;
 
     if (delta->count == 0 || rec->priority < delta->min_sequence) {
@@ -260,130 +808,188 @@ static int fkv_collect_delta_entries(const fkv_node_t *node,
     if (!node) {
         return 0;
     }
-    if (node->self_entry && node->self_entry->priority > since_sequence) {
-        if (fkv_delta_append_entry(delta, node->self_entry) != 0) {
+    const fkv_entry_record_t *self = FKV_LOAD_LOCKED(node->self_entry);
+    if (self && self->priority > since_sequence) {
+        if (fkv_delta_append_entry(delta, self) != 0) {
             return -1;
         }
     }
-    for (size_t i = 0; i < 10; ++i) {
-        if (node->children[i]) {
-            if (fkv_collect_delta_entries(node->children[i], since_sequence, delta) != 0) {
-                return -1;
-            }
+    for (uint8_t d = 0; d < 10; ++d) {
+        const fkv_node_t *child = node_child(node, d);
+        if (child && fkv_collect_delta_entries(child, since_sequence, delta) != 0) {
+            return -1;
         }
     }
     return 0;
 }
 
+#define FKV_INLINE_PATH 32
+
 static int fkv_put_locked_internal(const uint8_t *key,
                                    size_t kn,
                                    const uint8_t *val,
                                    size_t vn,
                                    fkv_entry_type_t type,
                                    uint64_t priority) {
-    if (ensure_root_locked() != 0) {
+    fkv_node_t *node = ensure_root_locked();
+    if (!node) {
         return -1;
     }
-
-    size_t depth_capacity = kn + 1;
-    if (depth_capacity == 0) {
-        depth_capacity = 1;
-    }
-    fkv_node_t **path = calloc(depth_capacity, sizeof(*path));
-    if (!path) {
+    /* Record sizes and lengths are 32-bit. */
+    if (kn > UINT32_MAX / 4 || vn > UINT32_MAX / 4) {
         return -1;
     }
-
-    int rc = 0;
-    fkv_node_t *node = fkv_root;
-    size_t depth = 0;
-    path[depth++] = node;
     for (size_t i = 0; i < kn; ++i) {
-        uint8_t idx = key[i];
-        if (idx > 9) {
-            rc = -1;
-            goto cleanup;
-        }
-        if (!node->children[idx]) {
-            node->children[idx] = node_create();
-            if (!node->children[idx]) {
-                rc = -1;
-                goto cleanup;
-            }
-        }
-        node = node->children[idx];
-        if (depth < depth_capacity) {
-            path[depth++] = node;
+        if (key[i] > 9) {
+            return -1;
         }
     }
 
-    uint64_t effective_priority = priority ? priority : fkv_sequence++;
+    /* path[i] is the i-th node from the root; summaries[i] its replacement summary. */
+    fkv_node_t *inline_path[FKV_INLINE_PATH];
+    fkv_summary_t *inline_summaries[FKV_INLINE_PATH];
+    fkv_node_t **path = inline_path;
+    fkv_summary_t **summaries = inline_summaries;
+    if (kn + 1 > FKV_INLINE_PATH) {
+        path = malloc((kn + 1) * (sizeof(*path) + sizeof(*summaries)));
+        if (!path) {
+            return -1;
+        }
+        summaries = (fkv_summary_t **)(path + kn + 1);
+    }
 
-    if (node->self_entry) {
-        if (node->self_entry->value_len != vn) {
-            uint8_t *tmp = realloc(node->self_entry->value, vn);
-            if (!tmp && vn > 0) {
+    /*
+     * Walk down, reshaping as needed: missing edges get a new leaf carrying
+     * up to FKV_PATH_MAX more digits, full nodes grow, and an edge the key
+     * leaves or ends inside is split. Reshaping does not change what readers
+     * see, so it is published at once even if the put fails later.
+     */
+    int rc = 0;
+    size_t built = 0;
+    size_t depth = 0;
+    fkv_entry_record_t *entry = NULL;
+    _Atomic(fkv_node_t *) *slot = &fkv_root;
+    path[depth++] = node;
+    size_t pos = 0;
+    while (pos < kn) {
+        uint8_t d = key[pos++];
+        _Atomic(fkv_node_t *) *child_slot = node_child_slot(node, d);
+        if (!child_slot) {
+            size_t run = kn - pos < FKV_PATH_MAX ? kn - pos : FKV_PATH_MAX;
+            fkv_node_t *leaf = node_create(0, key + pos, run);
+            if (!leaf) {
                 rc = -1;
                 goto cleanup;
             }
-            node->self_entry->value = tmp;
+            if (node_full(node)) {
+                fkv_node_t *grown = node_grow_locked(slot, node);
+                if (!grown) {
+                    node_discard(leaf);
+                    rc = -1;
+                    goto cleanup;
+                }
+                node = grown;
+                path[depth - 1] = node;
+            }
+            node_link_child(node, d, leaf);
+            child_slot = node_child_slot(node, d);
         }
-        if (node->self_entry->key_len != kn) {
-            uint8_t *tmp = realloc(node->self_entry->key, kn);
-            if (!tmp && kn > 0) {
+        fkv_node_t *child = FKV_LOAD_LOCKED(*child_slot);
+        size_t m = 0;
+        while (m < child->path_len && pos + m < kn && key[pos + m] == node_path_digit(child, m)) {
+            ++m;
+        }
+        if (m < child->path_len) {
+            /* Ends inside the edge: the new node holds the entry; otherwise it branches. */
+            child = node_split_locked(child_slot, child, m, pos + m == kn ? 1 : 4);
+            if (!child) {
                 rc = -1;
                 goto cleanup;
             }
-            node->self_entry->key = tmp;
-            node->self_entry->key_len = kn;
-        }
-        if (vn > 0) {
-            memcpy(node->self_entry->value, val, vn);
-        }
-        if (kn > 0) {
-            memcpy(node->self_entry->key, key, kn);
         }
-        node->self_entry->value_len = vn;
-        node->self_entry->type = type;
-        node->self_entry->priority = effective_priority;
-    } else {
-        node->self_entry = entry_create(key, kn, val, vn, type, effective_priority);
-        if (!node->self_entry) {
+        pos += m;
+        slot = child_slot;
+        node = child;
+        path[depth++] = node;
+    }
+
+    uint64_t sequence = atomic_load_explicit(&fkv_sequence, memory_order_relaxed);
+    uint64_t effective_priority = priority ? priority : sequence++;
+    entry = entry_create(key, kn, val, vn, type, effective_priority);
+    if (!entry) {
+        rc = -1;
+        goto cleanup;
+    }
+    fkv_entry_record_t *old_entry = FKV_LOAD_LOCKED(node->self_entry);
+    fkv_aggregate_t before;
+    fkv_aggregate_t after;
+    entry_aggregate(old_entry, &before);
+    entry_aggregate(entry, &after);
+    fkv_aggregate_t delta = {after.count - before.count, after.sum - before.sum};
+
+    /* Build every replacement first, so a failed allocation changes nothing. */
+    size_t limit = atomic_load_explicit(&fkv_topk_limit, memory_order_relaxed);
+    for (; built < depth; ++built) {
+        summaries[built] = summary_replace(FKV_LOAD_LOCKED(path[built]->summary), old_entry, entry, &delta, limit);
+        if (!summaries[built]) {
             rc = -1;
             goto cleanup;
         }
     }
 
+    /* Publish the record before any summary that lists it. */
+    FKV_PUBLISH(node->self_entry, entry);
+    if (old_entry) {
+        fkv_retire_locked(old_entry);
+    } else {
+        fkv_pool.entries++;
+    }
     for (size_t i = 0; i < depth; ++i) {
-        if (node_insert_top_entry(path[i], node->self_entry) != 0) {
-            rc = -1;
-            goto cleanup;
+        fkv_summary_t *old = FKV_LOAD_LOCKED(path[i]->summary);
+        if (summaries[i] != old) {
+            FKV_PUBLISH(path[i]->summary, summaries[i]);
+            if (old) {
+                fkv_retire_locked(old);
+            }
         }
     }
+    entry = NULL;
+    built = 0;
 
-    if (effective_priority >= fkv_sequence) {
-        fkv_sequence = effective_priority + 1;
+    if (effective_priority >= sequence) {
+        sequence = effective_priority + 1;
     }
+    atomic_store_explicit(&fkv_sequence, sequence, memory_order_relaxed);
+    fkv_bump_generation_locked();
 
 cleanup:
-    free(path);
+    for (size_t i = 0; i < built; ++i) {
+        if (summaries[i] != FKV_LOAD_LOCKED(path[i]->summary)) {
+            fkv_object_free(summaries[i]);
+        }
+    }
+    fkv_object_free(entry);
+    if (path != inline_path) {
+        free(path);
+    }
     return rc;
 }
 
 int fkv_init(void) {
     pthread_mutex_lock(&fkv_lock);
-    int rc = ensure_root_locked();
+    int rc = ensure_root_locked() ? 0 : -1;
     if (rc == 0) {
-        fkv_sequence = 1;
+        atomic_store_explicit(&fkv_sequence, 1, memory_order_relaxed);
     }
-    pthread_mutex_unlock(&fkv_lock);
+    fkv_bump_generation_locked();
+    fkv_write_unlock();
     return rc;
 }
 
 void fkv_shutdown(void) {
     pthread_mutex_lock(&fkv_lock);
-    node_free(fkv_root);
-    fkv_root = NULL;
+    fkv_discard_trie_locked();
+    fkv_bump_generation_locked();
     pthread_mutex_unlock(&fkv_lock);
 }
 
@@ -407,142 +1013,272 @@ int fkv_put_scored(const uint8_t *key,
 
     pthread_mutex_lock(&fkv_lock);
     int rc = fkv_put_locked_internal(key, kn, val, vn, type, priority);
-    pthread_mutex_unlock(&fkv_lock);
+    fkv_write_unlock();
     return rc;
 }
 
-int fkv_get_prefix(const uint8_t *key, size_t kn, fkv_iter_t *it, size_t k) {
-    if (!it) {
+int fkv_put_batch(const fkv_entry_t *entries, size_t count) {
+    if (!entries && count > 0) {
         return -1;
     }
-    it->entries = NULL;
-    it->count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const fkv_entry_t *e = &entries[i];
+        if (!e->key || !e->value || e->key_len == 0 || e->value_len == 0) {
+            return -1;
+        }
+        for (size_t j = 0; j < e->key_len; ++j) {
+            if (e->key[j] > 9) {
+                return -1;
+            }
+        }
+    }
 
     pthread_mutex_lock(&fkv_lock);
-    if (!fkv_root) {
-        pthread_mutex_unlock(&fkv_lock);
+    /* Readers that overlap a multi-entry batch retry, so they see none or all of it. */
+    uint64_t seq = atomic_load_explicit(&fkv_batch_seq, memory_order_relaxed);
+    if (count > 1) {
+        atomic_store_explicit(&fkv_batch_seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0; ++i) {
+        const fkv_entry_t *e = &entries[i];
+        rc = fkv_put_locked_internal(e->key, e->key_len, e->value, e->value_len, e->type, e->priority);
+    }
+    if (count > 1) {
+        atomic_store_explicit(&fkv_batch_seq, seq + 2, memory_order_release);
+    }
+    fkv_write_unlock();
+    return rc;
+}
+
+/*
+ * The node whose subtree holds the keys starting with key, or NULL. *inside
+ * is set when key ends within that node's path, so its own entry is not at
+ * key; *bad when key holds a non-digit before the walk ends.
+ */
+static const fkv_node_t *fkv_find(const uint8_t *key, size_t kn, int *bad, int *inside) {
+    const fkv_node_t *node = FKV_LOAD(fkv_root);
+    *bad = 0;
+    *inside = 0;
+    size_t pos = 0;
+    while (node && pos < kn) {
+        if (key[pos] > 9) {
+            *bad = 1;
+            return NULL;
+        }
+        node = node_child(node, key[pos++]);
+        for (size_t m = 0; node && m < node->path_len; ++m, ++pos) {
+            if (pos == kn) {
+                *inside = 1;
+                return node;
+            }
+            if (key[pos] != node_path_digit(node, m)) {
+                *bad = key[pos] > 9;
+                return NULL;
+            }
+        }
+    }
+    return node;
+}
+
+int fkv_get_first(const uint8_t *key, size_t kn, uint8_t *value, size_t *value_len, size_t *key_len) {
+    if ((!key && kn > 0) || !value || !value_len || !key_len) {
+        return -1;
+    }
+    fkv_view_t view;
+    if (fkv_view_prefix(key, kn, &view, 1) != 0) {
+        return -1;
+    }
+    if (view.count == 0) {
+        fkv_view_release(&view);
+        *value_len = 0;
         return 0;
     }
+    const fkv_entry_t *rec = &view.entries[0];
+    size_t n = rec->value_len < *value_len ? rec->value_len : *value_len;
+    memcpy(value, rec->value + (rec->value_len - n), n);
+    *value_len = n;
+    *key_len = rec->key_len;
+    fkv_view_release(&view);
+    return 1;
+}
 
-    const fkv_node_t *node = fkv_root;
+int fkv_aggregate_prefix(const uint8_t *key, size_t kn, fkv_aggregate_t *prefix, fkv_aggregate_t *exact) {
+    if (!key && kn > 0) {
+        return -1;
+    }
     for (size_t i = 0; i < kn; ++i) {
-        uint8_t idx = key[i];
-        if (idx > 9) {
-            pthread_mutex_unlock(&fkv_lock);
+        if (key[i] > 9) {
             return -1;
         }
-        node = node->children[idx];
-        if (!node) {
-            pthread_mutex_unlock(&fkv_lock);
-            return 0;
+    }
+    fkv_reader_t *reader = fkv_read_begin();
+    if (!reader) {
+        return -1;
+    }
+    int bad = 0;
+    int inside = 0;
+    const fkv_summary_t *summary;
+    const fkv_entry_record_t *self;
+    uint64_t seq;
+    do {
+        seq = fkv_batch_enter();
+        const fkv_node_t *node = fkv_find(key, kn, &bad, &inside);
+        summary = node ? FKV_LOAD(node->summary) : NULL;
+        self = node && !inside ? FKV_LOAD(node->self_entry) : NULL;
+    } while (fkv_batch_overlapped(seq));
+    if (prefix) {
+        prefix->count = summary ? summary->agg_count : 0;
+        prefix->sum = summary ? summary->agg_sum : 0;
+    }
+    if (exact) {
+        entry_aggregate(self, exact);
+    }
+    fkv_read_end(reader);
+    return 0;
+}
+
+static void fkv_entry_borrow(fkv_entry_t *out, const fkv_entry_record_t *rec) {
+    out->key = record_key(rec);
+    out->key_len = rec->key_len;
+    out->value = record_value(rec);
+    out->value_len = rec->value_len;
+    out->type = (fkv_entry_type_t)rec->type;
+    out->priority = rec->priority;
+}
+
+/* Up to limit entries under node: the entry at key first, then its top-K list. */
+static size_t fkv_select(const fkv_node_t *node, size_t kn, int inside, fkv_entry_t *selected, size_t limit) {
+    size_t count = 0;
+    const fkv_entry_record_t *self = inside ? NULL : FKV_LOAD(node->self_entry);
+    const fkv_summary_t *summary = FKV_LOAD(node->summary);
+    if (self && limit > 0) {
+        fkv_entry_borrow(&selected[count++], self);
+    }
+    for (size_t i = 0; summary && i < summary->top_count && count < limit; ++i) {
+        const fkv_entry_record_t *rec = summary->top[i];
+        /* A put may have swapped the own entry in between; keys of length kn are that entry. */
+        if (self && rec->key_len == kn) {
+            continue;
         }
+        fkv_entry_borrow(&selected[count++], rec);
     }
+    return count;
+}
 
-    size_t limit = k ? k : fkv_topk_limit;
-    if (limit == 0) {
-        limit = fkv_topk_limit ? fkv_topk_limit : 1;
+int fkv_view_prefix(const uint8_t *key, size_t kn, fkv_view_t *view, size_t k) {
+    if (!view) {
+        return -1;
+    }
+    view->entries = NULL;
+    view->count = 0;
+    view->guard = NULL;
+    view->heap = NULL;
+    if (!key && kn > 0) {
+        return -1;
     }
 
-    fkv_entry_record_t **selected = NULL;
-    size_t capacity = limit;
-    if (capacity == 0) {
-        capacity = 1;
+    size_t topk = atomic_load_explicit(&fkv_topk_limit, memory_order_relaxed);
+    size_t limit = k ? k : topk;
+    if (limit == 0) {
+        limit = topk ? topk : 1;
     }
-    if (capacity <= 64) {
-        static fkv_entry_record_t *stack_entries[64];
-        selected = stack_entries;
-        capacity = 64;
-    } else {
-        selected = calloc(capacity, sizeof(*selected));
+    /* The own entry plus a top-K list; a huge k must not size the buffer. */
+    if (limit > topk + 1) {
+        limit = topk + 1;
+    }
+    fkv_entry_t *selected = view->inline_entries;
+    if (limit > FKV_VIEW_INLINE) {
+        selected = view->heap = malloc(limit * sizeof(*selected));
         if (!selected) {
-            pthread_mutex_unlock(&fkv_lock);
             return -1;
         }
     }
 
-    size_t selected_count = 0;
-    if (node->self_entry && limit > 0) {
-        selected[selected_count++] = node->self_entry;
+    fkv_reader_t *reader = fkv_read_begin();
+    if (!reader) {
+        free(view->heap);
+        view->heap = NULL;
+        return -1;
     }
-    for (size_t i = 0; i < node->top_count && selected_count < limit; ++i) {
-        int seen = 0;
-        for (size_t j = 0; j < selected_count; ++j) {
-            if (selected[j] == node->top_entries[i]) {
-                seen = 1;
-                break;
-            }
-        }
-        if (!seen) {
-            selected[selected_count++] = node->top_entries[i];
-        }
+    int bad = 0;
+    int inside = 0;
+    size_t count = 0;
+    uint64_t seq;
+    do {
+        seq = fkv_batch_enter();
+        const fkv_node_t *node = fkv_find(key, kn, &bad, &inside);
+        count = node ? fkv_select(node, kn, inside, selected, limit) : 0;
+    } while (fkv_batch_overlapped(seq));
+    if (bad) {
+        fkv_read_end(reader);
+        free(view->heap);
+        view->heap = NULL;
+        return -1;
     }
+    view->guard = reader;
+    view->entries = selected;
+    view->count = count;
+    return 0;
+}
 
-    if (selected_count == 0) {
-        pthread_mutex_unlock(&fkv_lock);
-        if (capacity > 64) {
-            free(selected);
-        }
-        return 0;
+void fkv_view_release(fkv_view_t *view) {
+    if (!view || !view->guard) {
+        return;
     }
+    fkv_read_end(view->guard);
+    free(view->heap);
+    view->entries = NULL;
+    view->count = 0;
+    view->guard = NULL;
+    view->heap = NULL;
+}
 
-    fkv_entry_t *entries = calloc(selected_count, sizeof(fkv_entry_t));
-    if (!entries) {
-        pthread_mutex_unlock(&fkv_lock);
-        if (capacity > 64) {
-            free(selected);
-        }
+int fkv_get_prefix(const uint8_t *key, size_t kn, fkv_iter_t *it, size_t k) {
+    if (!it) {
         return -1;
     }
+    it->entries = NULL;
+    it->count = 0;
 
-    for (size_t i = 0; i < selected_count; ++i) {
-        fkv_entry_record_t *rec = selected[i];
-        if (rec->key_len > 0) {
-            uint8_t *key_copy = malloc(rec->key_len);
-            if (!key_copy) {
-                pthread_mutex_unlock(&fkv_lock);
-                for (size_t j = 0; j < i; ++j) {
-                    free((void *)entries[j].key);
-                    free((void *)entries[j].value);
-                }
-                free(entries);
-                if (capacity > 64) {
-                    free(selected);
-                }
-                return -1;
-            }
+    fkv_view_t view;
+    if (fkv_view_prefix(key, kn, &view, k) != 0) {
+        return -1;
+    }
+    if (view.count == 0) {
+        fkv_view_release(&view);
+        return 0;
+    }
+    fkv_entry_t *entries = calloc(view.count, sizeof(fkv_entry_t));
+    if (!entries) {
+        fkv_view_release(&view);
+        return -1;
+    }
+    for (size_t i = 0; i < view.count; ++i) {
+        const fkv_entry_t *rec = &view.entries[i];
+        uint8_t *key_copy = rec->key_len ? malloc(rec->key_len) : NULL;
+        uint8_t *val_copy = rec->value_len ? malloc(rec->value_len) : NULL;
+        entries[i] = *rec;
+        entries[i].key = key_copy;
+        entries[i].value = val_copy;
+        if ((rec->key_len && !key_copy) || (rec->value_len && !val_copy)) {
+            fkv_view_release(&view);
+            it->entries = entries;
+            it->count = i + 1;
+            fkv_iter_free(it);
+            return -1;
+        }
+        if (rec->key_len) {
             memcpy(key_copy, rec->key, rec->key_len);
-            entries[i].key = key_copy;
-        }
-        entries[i].key_len = rec->key_len;
-        if (rec->value_len > 0) {
-            uint8_t *val_copy = malloc(rec->value_len);
-            if (!val_copy) {
-                pthread_mutex_unlock(&fkv_lock);
-                for (size_t j = 0; j <= i; ++j) {
-                    free((void *)entries[j].key);
-                    free((void *)entries[j].value);
-                }
-                free(entries);
-                if (capacity > 64) {
-                    free(selected);
-                }
-                return -1;
-            }
+        }
+        if (rec->value_len) {
             memcpy(val_copy, rec->value, rec->value_len);
-            entries[i].value = val_copy;
         }
-        entries[i].value_len = rec->value_len;
-        entries[i].type = rec->type;
-        entries[i].priority = rec->priority;
-    }
-    pthread_mutex_unlock(&fkv_lock);
-
-    if (capacity > 64) {
-        free(selected);
     }
-
     it->entries = entries;
-    it->count = selected_count;
+    it->count = view.count;
+    fkv_view_release(&view);
     return 0;
 }
 
@@ -563,45 +1299,68 @@ static void count_entries(const fkv_node_t *node, size_t *count) {
     if (!node) {
         return;
     }
-    if (node->self_entry) {
+    if (FKV_LOAD_LOCKED(node->self_entry)) {
         (*count)++;
     }
-    for (size_t i = 0; i < 10; ++i) {
-        count_entries(node->children[i], count);
+    for (uint8_t d = 0; d < 10; ++d) {
+        count_entries(node_child(node, d), count);
     }
 }
 
+/*
+ * Snapshot: the magic, an entry count, then per entry u32 key_len, u32
+ * value_len, u8 type, u64 priority and the packed key and value. A value
+ * with a byte above 15 is written as is, flagged in type. Files without the
+ * magic are the older unpacked format, which starts with the count.
+ */
+#define FKV_SNAPSHOT_MAGIC UINT64_C(0x314b4341504b5646) /* "FKVPACK1" */
+#define FKV_SNAPSHOT_RAW_VALUE 0x80u
+
+static int write_packed(FILE *fp, const uint8_t *digits, size_t n) {
+    uint8_t packed[256];
+    while (n > 0) {
+        size_t chunk = n < 2 * sizeof(packed) ? n : 2 * sizeof(packed);
+        fkv_pack_digits(digits, chunk, packed);
+        if (fwrite(packed, 1, FKV_PACKED_SIZE(chunk), fp) != FKV_PACKED_SIZE(chunk)) {
+            return -1;
+        }
+        digits += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
 static int serialize_node(FILE *fp, const fkv_node_t *node) {
     if (!node) {
         return 0;
     }
-    if (node->self_entry) {
-        const fkv_entry_record_t *entry = node->self_entry;
-        uint64_t key_len = entry->key_len;
-        uint64_t value_len = entry->value_len;
+    const fkv_entry_record_t *entry = FKV_LOAD_LOCKED(node->self_entry);
+    if (entry) {
+        const uint8_t *value = record_value(entry);
+        uint32_t lens[2] = {entry->key_len, entry->value_len};
         uint8_t type = (uint8_t)entry->type;
         uint64_t priority = entry->priority;
-        if (fwrite(&key_len, sizeof(key_len), 1, fp) != 1) {
-            return -1;
-        }
-        if (key_len && fwrite(entry->key, 1, key_len, fp) != key_len) {
-            return -1;
-        }
-        if (fwrite(&value_len, sizeof(value_len), 1, fp) != 1) {
-            return -1;
+        for (uint32_t i = 0; i < entry->value_len; ++i) {
+            if (value[i] > 0x0F) {
+                type |= FKV_SNAPSHOT_RAW_VALUE;
+                break;
+            }
         }
-        if (value_len && fwrite(entry->value, 1, value_len, fp) != value_len) {
+        if (fwrite(lens, sizeof(lens), 1, fp) != 1 || fwrite(&type, sizeof(type), 1, fp) != 1 ||
+            fwrite(&priority, sizeof(priority), 1, fp) != 1) {
             return -1;
         }
-        if (fwrite(&type, sizeof(type), 1, fp) != 1) {
+        if (write_packed(fp, record_key(entry), entry->key_len) != 0) {
             return -1;
         }
-        if (fwrite(&priority, sizeof(priority), 1, fp) != 1) {
+        if ((type & FKV_SNAPSHOT_RAW_VALUE)
+                ? (entry->value_len && fwrite(value, 1, entry->value_len, fp) != entry->value_len)
+                : write_packed(fp, value, entry->value_len) != 0) {
             return -1;
         }
     }
-    for (size_t i = 0; i < 10; ++i) {
-        if (serialize_node(fp, node->children[i]) != 0) {
+    for (uint8_t d = 0; d < 10; ++d) {
+        if (serialize_node(fp, node_child(node, d)) != 0) {
             return -1;
         }
     }
@@ -619,14 +1378,16 @@ int fkv_save(const char *path) {
         return -1;
     }
 
+    /* Writers wait, so the count and the entries describe one snapshot; readers do not. */
     pthread_mutex_lock(&fkv_lock);
+    const fkv_node_t *root = FKV_LOAD_LOCKED(fkv_root);
     size_t count = 0;
-    count_entries(fkv_root, &count);
-    uint64_t stored = (uint64_t)count;
+    count_entries(root, &count);
+    uint64_t header[2] = {FKV_SNAPSHOT_MAGIC, (uint64_t)count};
     int rc = 0;
-    if (fwrite(&stored, sizeof(stored), 1, fp) != 1) {
+    if (fwrite(header, sizeof(header), 1, fp) != 1) {
         rc = -1;
-    } else if (fkv_root && serialize_node(fp, fkv_root) != 0) {
+    } else if (root && serialize_node(fp, root) != 0) {
         rc = -1;
     }
     pthread_mutex_unlock(&fkv_lock);
@@ -641,6 +1402,46 @@ static int read_exact(FILE *fp, void *buffer, size_t len) {
     return len == 0 || fread(buffer, 1, len, fp) == len ? 0 : -1;
 }
 
+/* Reads n digits, packed or not, into *buffer, growing it as needed. */
+static int read_digits(FILE *fp, int packed, size_t n, uint8_t **buffer, size_t *capacity) {
+    if (n > *capacity) {
+        uint8_t *grown = realloc(*buffer, n);
+        if (!grown) {
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = n;
+    }
+    if (!packed) {
+        return read_exact(fp, *buffer, n);
+    }
+    uint8_t chunk[256];
+    for (size_t done = 0; done < n;) {
+        size_t count = n - done < 2 * sizeof(chunk) ? n - done : 2 * sizeof(chunk);
+        if (read_exact(fp, chunk, FKV_PACKED_SIZE(count)) != 0) {
+            return -1;
+        }
+        fkv_unpack_digits(chunk, count, *buffer + done);
+        done += count;
+    }
+    return 0;
+}
+
+static int read_entry_header(FILE *fp, int packed, uint64_t *key_len, uint64_t *value_len, uint8_t *type, uint64_t *priority) {
+    if (packed) {
+        uint32_t lens[2];
+        if (fread(lens, sizeof(lens), 1, fp) != 1 || fread(type, sizeof(*type), 1, fp) != 1 ||
+            fread(priority, sizeof(*priority), 1, fp) != 1) {
+            return -1;
+        }
+        *key_len = lens[0];
+        *value_len = lens[1];
+        return 0;
+    }
+    /* Legacy entries interleave lengths and bytes; only the key length comes first. */
+    return fread(key_len, sizeof(*key_len), 1, fp) == 1 ? 0 : -1;
+}
+
 int fkv_load(const char *path) {
     if (!path) {
         errno = EINVAL;
@@ -657,17 +1458,26 @@ int fkv_load(const char *path) {
         fclose(fp);
         return -1;
     }
+    int packed = count == FKV_SNAPSHOT_MAGIC;
+    if (packed && fread(&count, sizeof(count), 1, fp) != 1) {
+        fclose(fp);
+        return -1;
+    }
 
     pthread_mutex_lock(&fkv_lock);
-    node_free(fkv_root);
-    fkv_root = node_create();
-    if (!fkv_root && count > 0) {
-        pthread_mutex_unlock(&fkv_lock);
+    fkv_discard_trie_locked();
+    fkv_node_t *root = ensure_root_locked();
+    fkv_bump_generation_locked();
+    pthread_mutex_unlock(&fkv_lock);
+    if (!root && count > 0) {
         fclose(fp);
         return -1;
     }
-    pthread_mutex_unlock(&fkv_lock);
 
+    uint8_t *key_buf = NULL;
+    uint8_t *value_buf = NULL;
+    size_t key_capacity = 0;
+    size_t value_capacity = 0;
     int rc = 0;
     for (uint64_t i = 0; i < count; ++i) {
         uint64_t key_len = 0;
@@ -675,45 +1485,25 @@ int fkv_load(const char *path) {
         uint8_t type = 0;
         uint64_t priority = 0;
 
-        if (fread(&key_len, sizeof(key_len), 1, fp) != 1) {
+        if (read_entry_header(fp, packed, &key_len, &value_len, &type, &priority) != 0 || key_len > SIZE_MAX) {
             rc = -1;
             break;
         }
-        uint8_t *key_buf = NULL;
-        if (key_len > 0) {
-            key_buf = malloc((size_t)key_len);
-            if (!key_buf || read_exact(fp, key_buf, (size_t)key_len) != 0) {
-                free(key_buf);
-                rc = -1;
-                break;
-            }
-        }
-
-        if (fread(&value_len, sizeof(value_len), 1, fp) != 1) {
-            free(key_buf);
+        if (read_digits(fp, packed, (size_t)key_len, &key_buf, &key_capacity) != 0) {
             rc = -1;
             break;
         }
-        uint8_t *value_buf = NULL;
-        if (value_len > 0) {
-            value_buf = malloc((size_t)value_len);
-            if (!value_buf || read_exact(fp, value_buf, (size_t)value_len) != 0) {
-                free(key_buf);
-                free(value_buf);
-                rc = -1;
-                break;
-            }
+        if (!packed && fread(&value_len, sizeof(value_len), 1, fp) != 1) {
+            rc = -1;
+            break;
         }
-
-        if (fread(&type, sizeof(type), 1, fp) != 1) {
-            free(key_buf);
-            free(value_buf);
+        int packed_value = packed && !(type & FKV_SNAPSHOT_RAW_VALUE);
+        type &= (uint8_t)~FKV_SNAPSHOT_RAW_VALUE;
+        if (value_len > SIZE_MAX || read_digits(fp, packed_value, (size_t)value_len, &value_buf, &value_capacity) != 0) {
             rc = -1;
             break;
         }
-        if (fread(&priority, sizeof(priority), 1, fp) != 1) {
-            free(key_buf);
-            free(value_buf);
+        if (!packed && (fread(&type, sizeof(type), 1, fp) != 1 || fread(&priority, sizeof(priority), 1, fp) != 1)) {
             rc = -1;
             break;
         }
@@ -725,18 +1515,15 @@ int fkv_load(const char *path) {
                                      (size_t)value_len,
                                      (fkv_entry_type_t)type,
                                      priority);
-        pthread_mutex_unlock(&fkv_lock);
+        fkv_write_unlock();
         if (rc != 0) {
-            free(key_buf);
-            free(value_buf);
             rc = -1;
             break;
         }
-
-        free(key_buf);
-        free(value_buf);
     }
 
+    free(key_buf);
+    free(value_buf);
     fclose(fp);
     return rc;
 }
@@ -746,30 +1533,47 @@ void fkv_set_topk_limit(size_t limit) {
         limit = 1;
     }
     pthread_mutex_lock(&fkv_lock);
-    fkv_topk_limit = limit;
-    if (fkv_root) {
-        node_prune_entries(fkv_root);
+    atomic_store_explicit(&fkv_topk_limit, limit, memory_order_relaxed);
+    fkv_node_t *root = FKV_LOAD_LOCKED(fkv_root);
+    if (root) {
+        node_prune_entries(root, limit);
     }
-    pthread_mutex_unlock(&fkv_lock);
+    fkv_bump_generation_locked();
+    fkv_write_unlock();
 }
 
 size_t fkv_get_topk_limit(void) {
-    pthread_mutex_lock(&fkv_lock);
-    size_t limit = fkv_topk_limit;
-    pthread_mutex_unlock(&fkv_lock);
-    return limit;
+    return atomic_load_explicit(&fkv_topk_limit, memory_order_relaxed);
+}
+
+uint64_t fkv_generation(void) {
+    return atomic_load_explicit(&fkv_generation_counter, memory_order_acquire);
 }
 
 uint64_t fkv_current_sequence(void) {
-    pthread_mutex_lock(&fkv_lock);
-    uint64_t seq = fkv_sequence;
-    pthread_mutex_unlock(&fkv_lock);
+    uint64_t seq = atomic_load_explicit(&fkv_sequence, memory_order_relaxed);
     if (seq == 0) {
         return 0;
     }
     return seq - 1;
 }
 
+void fkv_memory_usage(fkv_memory_t *out) {
+    if (!out) {
+        return;
+    }
+    pthread_mutex_lock(&fkv_lock);
+    out->entries = fkv_pool.entries;
+    out->nodes = fkv_pool.nodes;
+    out->slabs = fkv_pool.slab_count;
+    out->large_objects = fkv_pool.large_count;
+    out->reserved_bytes = fkv_pool.slab_count * FKV_SLAB_BYTES + fkv_pool.large_bytes;
+    out->used_bytes = fkv_pool.used_bytes;
+    out->free_bytes = fkv_pool.free_bytes;
+    out->retired_objects = fkv_pool.retired;
+    pthread_mutex_unlock(&fkv_lock);
+}
+
 uint16_t fkv_delta_compute_checksum(const fkv_delta_t *delta) {
     if (!delta || delta->count == 0) {
         return 0;
@@ -800,13 +1604,14 @@ int fkv_export_delta(uint64_t since_sequence, fkv_delta_t *delta) {
     delta->max_sequence = since_sequence;
 
     pthread_mutex_lock(&fkv_lock);
-    if (!fkv_root) {
+    const fkv_node_t *root = FKV_LOAD_LOCKED(fkv_root);
+    if (!root) {
         pthread_mutex_unlock(&fkv_lock);
         delta->min_sequence = 0;
         delta->checksum = 0;
         return 0;
     }
-    int rc = fkv_collect_delta_entries(fkv_root, since_sequence, delta);
+    int rc = fkv_collect_delta_entries(root, since_sequence, delta);
     pthread_mutex_unlock(&fkv_lock);
 
     if (rc != 0) {
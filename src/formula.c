@@ -3,6 +3,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "formula.h"
+#include "synthesis/formula_vm_eval.h"
 
 #include <ctype.h>
 #include <math.h>
@@ -981,17 +982,44 @@ int formula_training_pipeline_evaluate(FormulaTrainingPipeline* pipeline,
     double total_imitation = 0.0;
     double total_success = 0.0;
 
+    /* Run every candidate program up front across all cores. If the batch
+     * cannot be set up, fall back to one context on this thread. */
+    size_t candidate_count = pipeline->candidates.count;
+    const Formula** batch_formulas = calloc(candidate_count, sizeof(*batch_formulas));
+    formula_vm_evaluation_t* batch = calloc(candidate_count, sizeof(*batch));
+    int batched = 0;
+    if (batch_formulas && batch) {
+        for (size_t i = 0; i < candidate_count; ++i) {
+            batch_formulas[i] = &pipeline->candidates.hypotheses[i].formula;
+        }
+        batched = evaluate_formulas_with_vm_batch(batch_formulas, candidate_count, 0, batch) == 0;
+    }
+    free(batch_formulas);
+    vm_context_t* vm_ctx = batched ? NULL : vm_context_create(NULL, 0);
+
     for (size_t i = 0; i < pipeline->candidates.count; ++i) {
         FormulaHypothesis* hypothesis = &pipeline->candidates.hypotheses[i];
         vm_result_t vm_out = {0};
         double poe = 0.0;
         double mdl = 1.0;
         size_t program_len = 0;
-        int eval_rc = evaluate_formula_with_vm(&hypothesis->formula,
-                                               &vm_out,
-                                               &poe,
-                                               &mdl,
-                                               &program_len);
+        int eval_rc = 0;
+        if (batched) {
+            eval_rc = batch[i].rc;
+            if (eval_rc == 0) {
+                vm_out = batch[i].result;
+                poe = batch[i].poe;
+                mdl = batch[i].mdl;
+            }
+            program_len = batch[i].program_len;
+        } else {
+            eval_rc = evaluate_formula_with_vm_context(vm_ctx,
+                                                       &hypothesis->formula,
+                                                       &vm_out,
+                                                       &poe,
+                                                       &mdl,
+                                                       &program_len);
+        }
 
         double dataset_score = 0.0;
         double best_dataset_score = 0.0;
@@ -1060,6 +1088,8 @@ int formula_training_pipeline_evaluate(FormulaTrainingPipeline* pipeline,
         total_imitation += imitation;
         total_success += success;
     }
+    vm_context_destroy(vm_ctx);
+    free(batch);
 
     pipeline->metrics.total_evaluated = pipeline->candidates.count;
     pipeline->metrics.average_reward = total_reward / (double)pipeline->candidates.count;
@@ -41,6 +41,122 @@ static size_t submitted_program_capacity = 0;
 static uint64_t submitted_program_counter = 0;
 static pthread_mutex_t dialog_lock = PTHREAD_MUTEX_INITIALIZER;
 static uint64_t dialog_exchange_counter = 0;
+/* Δ-VM context of the current worker thread, created on first use. */
+static _Thread_local vm_context_t *routes_vm_context = NULL;
+
+/*
+ * Programs seen by the current worker thread, verified and run through
+ * vm_optimize() once and keyed by bytecode and stack limit. Programs that
+ * fail verification are remembered as such and interpreted.
+ */
+#define ROUTES_PROGRAM_CACHE_SLOTS 64
+
+typedef struct {
+    uint64_t hash;
+    uint8_t *code;
+    size_t len;
+    uint32_t max_stack;
+    int verified; /* program holds the step and stack bounds */
+    int optimized;
+    vm_verified_prog_t program;
+} routes_cached_program_t;
+
+static _Thread_local routes_cached_program_t routes_program_cache[ROUTES_PROGRAM_CACHE_SLOTS];
+
+static int routes_vm_run(const prog_t *prog, const vm_limits_t *limits, vm_result_t *result) {
+    if (!routes_vm_context) {
+        routes_vm_context = vm_context_create(limits, 0);
+        if (!routes_vm_context) {
+            return vm_run(prog, limits, NULL, result);
+        }
+    }
+    return vm_context_run(routes_vm_context, prog, limits, result);
+}
+
+static void routes_program_evict(routes_cached_program_t *slot) {
+    if (slot->optimized) {
+        vm_verified_free(&slot->program);
+    }
+    free(slot->code);
+    memset(slot, 0, sizeof(*slot));
+}
+
+static routes_cached_program_t *routes_program_lookup(const prog_t *prog, const vm_limits_t *limits) {
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < prog->len; ++i) {
+        hash ^= prog->code[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= limits->max_stack;
+
+    routes_cached_program_t *slot = &routes_program_cache[hash % ROUTES_PROGRAM_CACHE_SLOTS];
+    if (slot->code && slot->hash == hash && slot->len == prog->len && slot->max_stack == limits->max_stack &&
+        memcmp(slot->code, prog->code, prog->len) == 0) {
+        return slot;
+    }
+    routes_program_evict(slot);
+    slot->code = malloc(prog->len);
+    if (!slot->code) {
+        return NULL;
+    }
+    memcpy(slot->code, prog->code, prog->len);
+    slot->len = prog->len;
+    slot->hash = hash;
+    slot->max_stack = limits->max_stack;
+
+    prog_t owned = {.code = slot->code, .len = slot->len};
+    if (vm_verify(&owned, limits, &slot->program) == 0) {
+        slot->verified = 1;
+        if (vm_optimize(&slot->program) == 0) {
+            slot->optimized = 1;
+        } else {
+            vm_verified_free(&slot->program);
+        }
+    }
+    return slot;
+}
+
+/*
+ * Pre-admission: 1 when the verifier proved that every run of the program
+ * needs more gas than limits->max_steps, so it cannot finish.
+ * Writes the estimate as a JSON object (or null when unknown) to json.
+ */
+static int routes_vm_estimate(const prog_t *prog, const vm_limits_t *limits, char *json, size_t json_size) {
+    routes_cached_program_t *slot = routes_program_lookup(prog, limits);
+    if (!slot || !slot->verified) {
+        snprintf(json, json_size, "null");
+        return 0;
+    }
+    const vm_verified_prog_t *vp = &slot->program;
+    if (!vp->bounded) {
+        snprintf(json, json_size, "{\"bounded\":false,\"max_stack\":%u}", vp->max_depth);
+        return 0;
+    }
+    snprintf(json,
+             json_size,
+             "{\"bounded\":true,\"min_steps\":%u,\"max_steps\":%u,\"min_gas\":%u,\"max_gas\":%u,\"max_stack\":%u}",
+             vp->min_steps,
+             vp->max_steps,
+             vp->min_gas,
+             vp->max_gas,
+             vp->max_depth);
+    return vp->min_gas > limits->max_steps;
+}
+
+/* Like routes_vm_run, but through the optimized program cache. */
+static int routes_vm_run_cached(const prog_t *prog, const vm_limits_t *limits, vm_result_t *result) {
+    routes_cached_program_t *slot = routes_program_lookup(prog, limits);
+    if (!slot || !slot->optimized) {
+        return routes_vm_run(prog, limits, result);
+    }
+    if (!routes_vm_context) {
+        routes_vm_context = vm_context_create(limits, 0);
+        if (!routes_vm_context) {
+            return vm_run_verified(&slot->program, limits, NULL, result);
+        }
+    }
+    return vm_context_run_verified(routes_vm_context, &slot->program, limits, result);
+}
 
 static char *duplicate_string(const char *src) {
     if (!src) {
@@ -873,7 +989,7 @@ static int handle_dialog(const kolibri_config_t *cfg,
         if (limits.max_stack == 0) {
             limits.max_stack = 64;
         }
-        if (vm_run(&prog, &limits, NULL, &result) == 0 && result.status == VM_OK) {
+        if (routes_vm_run(&prog, &limits, &result) == 0 && result.status == VM_OK) {
             evaluated = 1;
         }
         free(bytecode);
@@ -1003,6 +1119,10 @@ static int handle_vm_run(const kolibri_config_t *cfg,
     if (json_extract_uint32(body, "gas_limit", &gas_limit) == 0 && gas_limit > 0) {
         limits.max_steps = gas_limit;
     }
+    /* Clients that replay a request send the same id to get the same RANDOM10 draws. */
+    if (parse_json_uint_field(body, "request_id", &override) == 0) {
+        limits.request_id = override;
+    }
     if (limits.max_steps == 0) {
         limits.max_steps = 256;
     }
@@ -1011,20 +1131,28 @@ static int handle_vm_run(const kolibri_config_t *cfg,
     }
 
     prog_t prog = {.code = program, .len = program_len};
+    char estimate[192];
+    if (routes_vm_estimate(&prog, &limits, estimate, sizeof(estimate))) {
+        free(program);
+        return respond_error(resp, 400, "gas_limit_exceeded", "program needs more gas than gas_limit");
+    }
     vm_result_t result = {0};
-    int rc = vm_run(&prog, &limits, NULL, &result);
+    int rc = routes_vm_run_cached(&prog, &limits, &result);
     free(program);
     if (rc != 0 || result.status != VM_OK) {
         return respond_error(resp, 400, "vm_error", "virtual machine rejected program");
     }
 
-    char buffer[256];
+    char buffer[384];
     snprintf(buffer,
              sizeof(buffer),
-             "{\"result\":\"%llu\",\"stack\":[\"%llu\"],\"trace\":{\"steps\":[]},\"gas_used\":%u}",
+             "{\"result\":\"%llu\",\"stack\":[\"%llu\"],\"trace\":{\"steps\":[]},\"steps\":%u,"
+             "\"gas_used\":%u,\"estimate\":%s}",
              (unsigned long long)result.result,
              (unsigned long long)result.result,
-             result.steps);
+             result.steps,
+             result.gas_used,
+             estimate);
     return respond_json(resp, buffer, 200);
 }
 
@@ -1093,8 +1221,9 @@ static int handle_fkv_get(const char *path, http_response_t *resp) {
         }
     }
 
-    fkv_iter_t iter = {0};
-    if (fkv_get_prefix(digits, digits_len, &iter, limit) != 0) {
+    /* Borrowed entries: the response is built straight from the store. */
+    fkv_view_t iter;
+    if (fkv_view_prefix(digits, digits_len, &iter, limit) != 0) {
         return respond_error(resp, 500, "internal_error", "fkv lookup failed");
     }
 
@@ -1108,7 +1237,7 @@ static int handle_fkv_get(const char *path, http_response_t *resp) {
     int first_value = 1;
     int first_program = 1;
     for (size_t i = 0; i < iter.count; ++i) {
-        fkv_entry_t *entry = &iter.entries[i];
+        const fkv_entry_t *entry = &iter.entries[i];
         char key_str[128];
         char value_str[256];
         if (digits_to_string(entry->key, entry->key_len, key_str, sizeof(key_str)) != 0) {
@@ -1141,7 +1270,7 @@ static int handle_fkv_get(const char *path, http_response_t *resp) {
     }
 
     for (size_t i = 0; i < iter.count; ++i) {
-        fkv_entry_t *entry = &iter.entries[i];
+        const fkv_entry_t *entry = &iter.entries[i];
         if (entry->type != FKV_ENTRY_TYPE_PROGRAM) {
             continue;
         }
@@ -1177,7 +1306,7 @@ static int handle_fkv_get(const char *path, http_response_t *resp) {
 
 cleanup:
     free(buf.data);
-    fkv_iter_free(&iter);
+    fkv_view_release(&iter);
     return status;
 }
 
@@ -1204,8 +1333,13 @@ static int handle_program_submit(const kolibri_config_t *cfg,
         .max_stack = cfg->vm.max_stack ? cfg->vm.max_stack : 128,
     };
     prog_t prog = {.code = bytecode, .len = bytecode_len};
+    char estimate[192];
+    if (routes_vm_estimate(&prog, &limits, estimate, sizeof(estimate))) {
+        free(bytecode);
+        return respond_error(resp, 400, "gas_limit_exceeded", "program needs more gas than vm.max_steps");
+    }
     vm_result_t result = {0};
-    int vm_rc = vm_run(&prog, &limits, NULL, &result);
+    int vm_rc = routes_vm_run_cached(&prog, &limits, &result);
     free(bytecode);
     if (vm_rc != 0 || result.status != VM_OK) {
         return respond_error(resp, 400, "vm_error", "virtual machine rejected program");
@@ -1242,14 +1376,16 @@ static int handle_program_submit(const kolibri_config_t *cfg,
         kolibri_ai_add_formula(routes_ai, &slot->formula);
     }
 
-    char buffer[256];
+    char buffer[384];
     snprintf(buffer,
              sizeof(buffer),
-             "{\"program_id\":\"%s\",\"poe\":%.6f,\"mdl\":%.6f,\"score\":%.6f,\"accepted\":true}",
+             "{\"program_id\":\"%s\",\"poe\":%.6f,\"mdl\":%.6f,\"score\":%.6f,\"accepted\":true,"
+             "\"estimate\":%s}",
              slot->formula.id,
              slot->poe,
              slot->mdl,
-             slot->score);
+             slot->score,
+             estimate);
     return respond_json(resp, buffer, 200);
 }
 
@@ -1309,19 +1445,69 @@ static int handle_metrics(http_response_t *resp) {
     if (!ai_state) {
         return respond_json(resp, "{\"requests\":0,\"errors\":0}", 200);
     }
-    size_t len = strlen(ai_state) + 64;
+    vm_result_cache_stats_t cache;
+    vm_result_cache_stats(&cache);
+    fkv_memory_t fkv_mem;
+    fkv_memory_usage(&fkv_mem);
+    size_t len = strlen(ai_state) + 512;
     char *buffer = malloc(len);
     if (!buffer) {
         free(ai_state);
         return respond_json(resp, "{\"requests\":0,\"errors\":0}", 200);
     }
-    snprintf(buffer, len, "{\"requests\":0,\"errors\":0,\"ai\":%s}", ai_state);
+    snprintf(buffer,
+             len,
+             "{\"requests\":0,\"errors\":0,"
+             "\"vm_result_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,"
+             "\"bypassed\":%llu,\"entries\":%zu,\"capacity\":%zu},"
+             "\"fkv_memory\":{\"entries\":%zu,\"nodes\":%zu,\"slabs\":%zu,\"large_objects\":%zu,"
+             "\"reserved_bytes\":%zu,\"used_bytes\":%zu,\"free_bytes\":%zu,\"retired_objects\":%zu},"
+             "\"ai\":%s}",
+             (unsigned long long)cache.hits,
+             (unsigned long long)cache.misses,
+             (unsigned long long)cache.evictions,
+             (unsigned long long)cache.bypassed,
+             cache.entries,
+             cache.capacity,
+             fkv_mem.entries,
+             fkv_mem.nodes,
+             fkv_mem.slabs,
+             fkv_mem.large_objects,
+             fkv_mem.reserved_bytes,
+             fkv_mem.used_bytes,
+             fkv_mem.free_bytes,
+             fkv_mem.retired_objects,
+             ai_state);
     free(ai_state);
     int rc = respond_json(resp, buffer, 200);
     free(buffer);
     return rc;
 }
 
+static int handle_vm_profile(const char *path, http_response_t *resp) {
+    size_t top = 16;
+    char raw[32];
+    if (path && parse_query_param(path, "top", raw, sizeof(raw)) == 0) {
+        top = strtoul(raw, NULL, 10);
+    }
+    vm_profile_t *profile = malloc(sizeof(*profile));
+    if (!profile) {
+        return respond_error(resp, 500, "internal_error", "allocation failure");
+    }
+    vm_profile_snapshot(profile);
+    if (path && parse_query_param(path, "reset", raw, sizeof(raw)) == 0 && strcmp(raw, "1") == 0) {
+        vm_profile_reset();
+    }
+    char *json = vm_profile_serialize(profile, top);
+    free(profile);
+    if (!json) {
+        return respond_error(resp, 500, "internal_error", "allocation failure");
+    }
+    int rc = respond_json(resp, json, 200);
+    free(json);
+    return rc;
+}
+
 typedef int (*route_handler_fn)(const kolibri_config_t *cfg,
                                 const char *path,
                                 const char *body,
@@ -1352,6 +1538,17 @@ static int route_handle_metrics(const kolibri_config_t *cfg,
     return handle_metrics(resp);
 }
 
+static int route_handle_vm_profile(const kolibri_config_t *cfg,
+                                   const char *path,
+                                   const char *body,
+                                   size_t body_len,
+                                   http_response_t *resp) {
+    (void)cfg;
+    (void)body;
+    (void)body_len;
+    return handle_vm_profile(path, resp);
+}
+
 static int route_handle_fkv_get(const kolibri_config_t *cfg,
                                 const char *path,
                                 const char *body,
@@ -1413,6 +1610,7 @@ static const http_route_entry_t HTTP_ROUTES[] = {
     {"GET", "/api/v1/health", 0, route_handle_health},
     {"GET", "/api/v1/metrics", 0, route_handle_metrics},
     {"GET", "/api/v1/fkv/get", 1, route_handle_fkv_get},
+    {"GET", "/api/v1/vm/profile", 1, route_handle_vm_profile},
     {"POST", "/api/v1/dialog", 0, route_handle_dialog},
     {"POST", "/api/v1/vm/run", 0, route_handle_vm_run},
     {"POST", "/api/v1/program/submit", 0, route_handle_program_submit},
@@ -1487,3 +1685,11 @@ void http_routes_set_blockchain(Blockchain *chain) {
 void http_routes_set_ai(KolibriAI *ai) {
     routes_ai = ai;
 }
+
+void http_routes_release_thread_state(void) {
+    vm_context_destroy(routes_vm_context);
+    routes_vm_context = NULL;
+    for (size_t i = 0; i < ROUTES_PROGRAM_CACHE_SLOTS; ++i) {
+        routes_program_evict(&routes_program_cache[i]);
+    }
+}
@@ -370,6 +370,7 @@ static void *worker_loop(void *arg) {
         handle_client(client);
         close(client);
     }
+    http_routes_release_thread_state();
     return NULL;
 }
 
@@ -1235,6 +1235,12 @@ static int run_bench(const kolibri_config_t *cfg, int argc, char **argv) {
             opts.include_profile = 1;
         } else if (strcmp(arg, "--no-profile") == 0) {
             opts.include_profile = 0;
+        } else if (strcmp(arg, "--decode-trace") == 0) {
+            if (i + 1 >= argc) {
+                log_error("--decode-trace requires a path");
+                return 1;
+            }
+            return bench_decode_trace(argv[i + 1], stdout) == 0 ? 0 : 1;
         } else if (strcmp(arg, "--threshold") == 0) {
             if (i + 1 >= argc) {
                 log_error("--threshold requires a spec like name:p95=...,p99=...");
@@ -1272,6 +1278,7 @@ int main(int argc, char **argv) {
     }
 
     fkv_set_topk_limit(cfg.fkv.top_k ? cfg.fkv.top_k : 1);
+    vm_set_gas_schedule(cfg.vm.gas_costs);
 
     if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
         log_set_file(NULL);
@@ -1282,6 +1289,11 @@ int main(int argc, char **argv) {
         return run_bench(&cfg, argc - 2, argv + 2);
     }
 
+    if (vm_result_cache_configure(cfg.vm.result_cache_entries) != 0) {
+        log_warn("could not allocate the VM result cache, running without it");
+    }
+    vm_profile_enable(cfg.vm.profile);
+
     if (argc > 1 && strcmp(argv[1], "--chat") == 0) {
         if (fkv_init() != 0) {
             log_error("failed to initialize F-KV");
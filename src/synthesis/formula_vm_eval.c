@@ -46,36 +46,33 @@ static int bb_push(byte_buffer_t *bb, uint8_t value) {
     return 0;
 }
 
+/*
+ * Literals up to 255 fit a single PUSHd; wider ones use PUSHN with a LEB128
+ * operand (see vm_read_pushn), one instruction either way.
+ */
 static int emit_push_number(byte_buffer_t *bb, uint64_t value) {
     if (!bb) {
         return -1;
     }
-    if (bb_push(bb, 0x01) != 0 || bb_push(bb, 0x00) != 0) {
-        return -1;
-    }
-    char digits[32];
-    snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
-    for (size_t i = 0; digits[i]; ++i) {
-        if (bb_push(bb, 0x01) != 0 || bb_push(bb, 0x02) != 0) {
-            return -1;
-        }
-        if (bb_push(bb, 0x01) != 0 || bb_push(bb, 0x05) != 0) {
-            return -1;
-        }
-        if (bb_push(bb, 0x04) != 0) {
-            return -1;
-        }
-        if (bb_push(bb, 0x04) != 0) {
+    if (value <= UINT8_MAX) {
+        if (bb_push(bb, 0x01) != 0 || bb_push(bb, (uint8_t)value) != 0) {
             return -1;
         }
-        uint8_t digit = (uint8_t)(digits[i] - '0');
-        if (bb_push(bb, 0x01) != 0 || bb_push(bb, digit) != 0) {
-            return -1;
+        return 0;
+    }
+    if (bb_push(bb, 0x13) != 0) {
+        return -1;
+    }
+    do {
+        uint8_t group = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            group |= 0x80;
         }
-        if (bb_push(bb, 0x02) != 0) {
+        if (bb_push(bb, group) != 0) {
             return -1;
         }
-    }
+    } while (value != 0);
     return 0;
 }
 
@@ -229,11 +226,7 @@ static double compute_mdl(size_t program_len) {
     return mdl;
 }
 
-int evaluate_formula_with_vm(const Formula *formula,
-                             vm_result_t *out_result,
-                             double *out_poe,
-                             double *out_mdl,
-                             size_t *out_program_len) {
+static int compile_formula(const Formula *formula, uint8_t **out_code, size_t *out_len) {
     if (!formula) {
         return -1;
     }
@@ -246,17 +239,34 @@ int evaluate_formula_with_vm(const Formula *formula,
     if (!expression || strlen(expression) == 0) {
         return -1;
     }
+    return formula_vm_compile_from_text(expression, out_code, out_len);
+}
+
+int evaluate_formula_with_vm(const Formula *formula,
+                             vm_result_t *out_result,
+                             double *out_poe,
+                             double *out_mdl,
+                             size_t *out_program_len) {
+    return evaluate_formula_with_vm_context(NULL, formula, out_result, out_poe, out_mdl, out_program_len);
+}
 
+int evaluate_formula_with_vm_context(vm_context_t *ctx,
+                                     const Formula *formula,
+                                     vm_result_t *out_result,
+                                     double *out_poe,
+                                     double *out_mdl,
+                                     size_t *out_program_len) {
     uint8_t *bytecode = NULL;
     size_t bytecode_len = 0;
-    if (formula_vm_compile_from_text(expression, &bytecode, &bytecode_len) != 0) {
+    if (compile_formula(formula, &bytecode, &bytecode_len) != 0) {
         return -1;
     }
 
     prog_t prog = {bytecode, bytecode_len};
-    vm_limits_t limits = {256, 64};
+    vm_limits_t limits = {.max_steps = 256, .max_stack = 64};
     vm_result_t local_result = {0};
-    int rc = vm_run(&prog, &limits, NULL, &local_result);
+    int rc = ctx ? vm_context_run(ctx, &prog, &limits, &local_result)
+                 : vm_run(&prog, &limits, NULL, &local_result);
     if (out_result) {
         *out_result = local_result;
     }
@@ -274,3 +284,64 @@ int evaluate_formula_with_vm(const Formula *formula,
     free(bytecode);
     return rc;
 }
+
+int evaluate_formulas_with_vm_batch(const Formula *const *formulas,
+                                    size_t count,
+                                    size_t threads,
+                                    formula_vm_evaluation_t *out) {
+    if ((!formulas || !out) && count > 0) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint8_t **bytecode = calloc(count, sizeof(*bytecode));
+    prog_t *progs = calloc(count, sizeof(*progs));
+    vm_result_t *results = calloc(count, sizeof(*results));
+    size_t *owner = calloc(count, sizeof(*owner));
+    if (!bytecode || !progs || !results || !owner) {
+        free(bytecode);
+        free(progs);
+        free(results);
+        free(owner);
+        return -1;
+    }
+
+    size_t compiled = 0;
+    for (size_t i = 0; i < count; ++i) {
+        memset(&out[i], 0, sizeof(out[i]));
+        out[i].rc = -1;
+        out[i].mdl = 1.0;
+        size_t len = 0;
+        if (compile_formula(formulas[i], &bytecode[i], &len) != 0) {
+            continue;
+        }
+        out[i].program_len = len;
+        progs[compiled].code = bytecode[i];
+        progs[compiled].len = len;
+        owner[compiled] = i;
+        compiled++;
+    }
+
+    vm_limits_t limits = {.max_steps = 256, .max_stack = 64};
+    /* A program the batch could not start reports VM_ERR_INVALID_OPCODE,
+     * which callers already treat as a failed evaluation. */
+    (void)vm_run_batch(progs, compiled, &limits, results, threads);
+    for (size_t k = 0; k < compiled; ++k) {
+        formula_vm_evaluation_t *eval = &out[owner[k]];
+        eval->rc = 0;
+        eval->result = results[k];
+        eval->poe = compute_poe(&results[k], eval->program_len);
+        eval->mdl = compute_mdl(eval->program_len);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        free(bytecode[i]);
+    }
+    free(bytecode);
+    free(progs);
+    free(results);
+    free(owner);
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include "vm/vm.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,8 +63,14 @@ static void apply_threshold_override(const bench_options_t *opts, bench_result_t
 typedef struct {
     vm_limits_t limits;
     prog_t program;
+    vm_context_t *context; /* NULL: allocate per run through vm_run */
 } bench_vm_ctx_t;
 
+typedef struct {
+    vm_limits_t limits;
+    vm_verified_prog_t verified;
+} bench_vm_verified_ctx_t;
+
 typedef struct {
     size_t value_len;
     size_t key_len;
@@ -73,6 +80,15 @@ typedef struct {
     size_t limit;
 } bench_fkv_ctx_t;
 
+/* Prefix lookups per reader thread in one iteration of the multithreaded case. */
+#define BENCH_FKV_THREAD_LOOKUPS 256
+
+typedef struct {
+    const bench_fkv_ctx_t *fkv;
+    size_t threads;
+    size_t lookups; /* per thread */
+} bench_fkv_mt_ctx_t;
+
 typedef struct {
     kolibri_config_t cfg;
     const char *method;
@@ -149,7 +165,18 @@ static int cmp_double(const void *a, const void *b) {
 static int bench_vm_iteration(void *user_data) {
     bench_vm_ctx_t *ctx = (bench_vm_ctx_t *)user_data;
     vm_result_t result = {0};
-    if (vm_run(&ctx->program, &ctx->limits, NULL, &result) != 0) {
+    int rc = ctx->context ? vm_context_run(ctx->context, &ctx->program, &ctx->limits, &result)
+                          : vm_run(&ctx->program, &ctx->limits, NULL, &result);
+    if (rc != 0) {
+        return -1;
+    }
+    return result.status == VM_OK ? 0 : -1;
+}
+
+static int bench_vm_verified_iteration(void *user_data) {
+    bench_vm_verified_ctx_t *ctx = (bench_vm_verified_ctx_t *)user_data;
+    vm_result_t result = {0};
+    if (vm_run_verified(&ctx->verified, &ctx->limits, NULL, &result) != 0) {
         return -1;
     }
     return result.status == VM_OK ? 0 : -1;
@@ -159,6 +186,100 @@ static uint8_t digit_from_int(unsigned value) {
     return (uint8_t)(value % 10u);
 }
 
+static uint32_t bench_lcg_next(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/* Random program over the deterministic opcodes (no TIME10, no F-KV). */
+static size_t bench_random_program(uint32_t *state, uint8_t *code, size_t cap) {
+    size_t starts[64];
+    size_t patches[64];
+    size_t count = 0;
+    size_t patch_count = 0;
+    size_t len = 0;
+    uint32_t depth = 0;
+    size_t n = 4 + bench_lcg_next(state) % 40;
+    for (size_t i = 0; i < n && count < ARRAY_SIZE(starts) && len + 11 <= cap; ++i) {
+        starts[count++] = len;
+        uint32_t pick = bench_lcg_next(state) % 16;
+        if ((depth < 2 || pick < 5) && pick % 4 == 0 && len + 11 <= cap) {
+            uint64_t value = (uint64_t)bench_lcg_next(state) * bench_lcg_next(state);
+            code[len++] = 0x13; /* PUSHN, LEB128 literal */
+            do {
+                code[len++] = (uint8_t)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+                value >>= 7;
+            } while (value != 0);
+            depth++;
+        } else if (depth < 2 || pick < 5) {
+            code[len++] = 0x01;
+            code[len++] = digit_from_int(bench_lcg_next(state));
+            depth++;
+        } else if (pick < 11) {
+            code[len++] = (uint8_t)(0x02 + pick - 5);
+            depth--;
+        } else if (pick < 13) {
+            code[len++] = (pick == 11) ? (uint8_t)(0x08 + bench_lcg_next(state) % 2) : 0x0A;
+            patches[patch_count++] = len - 1;
+            code[len++] = 0;
+            code[len++] = 0;
+            depth -= (pick == 11);
+        } else {
+            static const uint8_t other[] = {0x0E, 0x0F, 0x0B, 0x11, 0x12};
+            uint8_t op = other[bench_lcg_next(state) % ARRAY_SIZE(other)];
+            code[len++] = op;
+            depth += (op == 0x0F);
+        }
+    }
+    for (size_t i = 0; i < patch_count; ++i) {
+        size_t at = patches[i];
+        size_t target = starts[bench_lcg_next(state) % count];
+        uint16_t operand = (code[at] == 0x0A) ? (uint16_t)target
+                                              : (uint16_t)(int16_t)((int)target - (int)(at + 3));
+        code[at + 1] = (uint8_t)operand;
+        code[at + 2] = (uint8_t)(operand >> 8);
+    }
+    return len;
+}
+
+/*
+ * Runs random programs on the JIT and on the switch interpreter and compares
+ * the outcomes. The JIT threshold is dropped to zero for the duration so
+ * every verifiable program is compiled. Returns the number of mismatches.
+ */
+static size_t bench_jit_differential(size_t programs) {
+    uint32_t state = 20240601u;
+    uint8_t code[160];
+    size_t mismatches = 0;
+    vm_jit_set_threshold(0);
+    for (size_t i = 0; i < programs; ++i) {
+        prog_t prog = {code, bench_random_program(&state, code, sizeof(code))};
+        vm_limits_t lim = {.max_steps = 256, .max_stack = 16, .engine = VM_ENGINE_SWITCH};
+        vm_result_t ref = {0};
+        vm_result_t jit = {0};
+        vm_set_seed(7);
+        int ref_rc = vm_run(&prog, &lim, NULL, &ref);
+        lim.engine = VM_ENGINE_JIT;
+        vm_set_seed(7);
+        int jit_rc = vm_run(&prog, &lim, NULL, &jit);
+        if (ref_rc != jit_rc || ref.status != jit.status || ref.result != jit.result || ref.steps != jit.steps ||
+            ref.halted != jit.halted) {
+            log_error("Δ-VM JIT mismatch on random program %zu: status %d/%d result %llu/%llu steps %u/%u",
+                      i,
+                      (int)ref.status,
+                      (int)jit.status,
+                      (unsigned long long)ref.result,
+                      (unsigned long long)jit.result,
+                      ref.steps,
+                      jit.steps);
+            mismatches++;
+        }
+    }
+    vm_jit_flush();
+    vm_jit_set_threshold(8);
+    return mismatches;
+}
+
 static int bench_fkv_iteration(void *user_data) {
     bench_fkv_ctx_t *ctx = (bench_fkv_ctx_t *)user_data;
     fkv_iter_t it = {0};
@@ -169,6 +290,71 @@ static int bench_fkv_iteration(void *user_data) {
     return rc;
 }
 
+static int bench_fkv_view_iteration(void *user_data) {
+    bench_fkv_ctx_t *ctx = (bench_fkv_ctx_t *)user_data;
+    fkv_view_t view;
+    int rc = fkv_view_prefix(ctx->prefix, ctx->prefix_len, &view, ctx->limit);
+    fkv_view_release(&view);
+    return rc;
+}
+
+static void *bench_fkv_reader(void *user_data) {
+    const bench_fkv_mt_ctx_t *ctx = user_data;
+    for (size_t i = 0; i < ctx->lookups; ++i) {
+        if (bench_fkv_iteration((void *)ctx->fkv) != 0) {
+            return (void *)ctx;
+        }
+    }
+    return NULL;
+}
+
+/* Readers do not serialize on the writer lock, so this should scale with cores. */
+static int bench_fkv_mt_iteration(void *user_data) {
+    bench_fkv_mt_ctx_t *ctx = (bench_fkv_mt_ctx_t *)user_data;
+    pthread_t threads[16];
+    size_t started = 0;
+    int rc = 0;
+    for (; started < ctx->threads && started < ARRAY_SIZE(threads); ++started) {
+        if (pthread_create(&threads[started], NULL, bench_fkv_reader, ctx) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; ++i) {
+        void *failed = NULL;
+        pthread_join(threads[i], &failed);
+        if (failed) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+/* Logs prefix lookup throughput at 1, 2, 4 and 8 reader threads. */
+static void bench_fkv_scaling(const bench_fkv_ctx_t *fkv) {
+    static const size_t thread_counts[] = {1, 2, 4, 8};
+    double base = 0.0;
+    for (size_t i = 0; i < ARRAY_SIZE(thread_counts); ++i) {
+        bench_fkv_mt_ctx_t ctx = {fkv, thread_counts[i], 20000};
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (bench_fkv_mt_iteration(&ctx) != 0) {
+            log_warn("F-KV scaling run with %zu threads failed", ctx.threads);
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = timespec_to_ms_diff(&start, &end);
+        double per_sec = ms > 0.0 ? (double)(ctx.threads * ctx.lookups) * 1000.0 / ms : 0.0;
+        if (i == 0) {
+            base = per_sec;
+        }
+        log_info("bench fkv_prefix_get threads=%zu lookups/s=%.0f speedup=%.2fx",
+                 ctx.threads,
+                 per_sec,
+                 base > 0.0 ? per_sec / base : 0.0);
+    }
+}
+
 static int bench_http_iteration(void *user_data) {
     bench_http_ctx_t *ctx = (bench_http_ctx_t *)user_data;
     http_response_t resp = {0};
@@ -256,7 +442,8 @@ static void write_json_report(FILE *fp,
                               const bench_options_t *opts,
                               const bench_result_t *results,
                               size_t result_count,
-                              int regression) {
+                              int regression,
+                              const char *vm_profile) {
     if (!fp) {
         return;
     }
@@ -269,6 +456,9 @@ static void write_json_report(FILE *fp,
     fprintf(fp, "    \"profile\": %s\n", opts->include_profile ? "true" : "false");
     fprintf(fp, "  },\n");
     fprintf(fp, "  \"regression\": %s,\n", regression ? "true" : "false");
+    if (vm_profile) {
+        fprintf(fp, "  \"vm_profile\": %s,\n", vm_profile);
+    }
     fprintf(fp, "  \"benchmarks\": [\n");
     for (size_t i = 0; i < result_count; ++i) {
         const bench_result_t *r = &results[i];
@@ -298,10 +488,38 @@ static void write_json_report(FILE *fp,
     fprintf(fp, "}\n");
 }
 
+/*
+ * Runs the Δ-VM benchmark program and an F-KV lookup under the profiler,
+ * after the timed cases so the timings stay unprofiled. Returns the JSON
+ * report, or NULL.
+ */
+static char *bench_vm_profile(const bench_options_t *opts, const bench_vm_ctx_t *vm_ctx) {
+    /* PUSHN 1230, READ_FKV, HALT: key 1230 is one of the F-KV bench keys. */
+    static const uint8_t fkv_code[] = {0x13, 0xCE, 0x09, 0x0C, 0x12};
+    prog_t fkv_program = {fkv_code, sizeof(fkv_code)};
+    vm_profile_t *profile = malloc(sizeof(*profile));
+    if (!profile) {
+        return NULL;
+    }
+    vm_profile_reset();
+    vm_profile_enable(1);
+    for (size_t i = 0; i < opts->iterations; ++i) {
+        vm_result_t result;
+        vm_run(&vm_ctx->program, &vm_ctx->limits, NULL, &result);
+        vm_run(&fkv_program, &vm_ctx->limits, NULL, &result);
+    }
+    vm_profile_enable(0);
+    vm_profile_snapshot(profile);
+    char *json = vm_profile_serialize(profile, 16);
+    free(profile);
+    return json;
+}
+
 static void populate_vm_program(bench_vm_ctx_t *ctx) {
     static uint8_t code[] = {
         0x01, 2, 0x01, 3, 0x02, 0x01, 5, 0x04, 0x01, 1, 0x03, 0x12
     };
+    memset(ctx, 0, sizeof(*ctx));
     ctx->program.code = code;
     ctx->program.len = ARRAY_SIZE(code);
     ctx->limits.max_stack = 64;
@@ -407,127 +625,178 @@ int bench_options_add_threshold_override(bench_options_t *opts,
     return 0;
 }
 
+static void run_bench_case(const bench_options_t *opts,
+                           bench_result_t *result,
+                           double **profile_out,
+                           const char *name,
+                           double threshold_p95_ms,
+                           double threshold_p99_ms,
+                           int (*fn)(void *),
+                           void *ctx) {
+    memset(result, 0, sizeof(*result));
+    result->name = name;
+    result->threshold_p95_ms = threshold_p95_ms;
+    result->threshold_p99_ms = threshold_p99_ms;
+    *profile_out = NULL;
+    apply_threshold_override(opts, result);
+
+    double *samples = calloc(opts->iterations, sizeof(double));
+    if (!samples) {
+        result->status = -1;
+        return;
+    }
+    if (run_iterations(opts->warmup, opts->iterations, samples, fn, ctx) != 0) {
+        result->status = -1;
+    } else {
+        compute_stats(result, samples, opts->iterations);
+        if (opts->include_profile) {
+            *profile_out = samples;
+            samples = NULL;
+        }
+        if (result->p95_ms > result->threshold_p95_ms ||
+            result->p99_ms > result->threshold_p99_ms) {
+            result->status = 1;
+        }
+    }
+    free(samples);
+}
+
 int bench_run_all(const kolibri_config_t *cfg, const bench_options_t *opts) {
     if (!opts) {
         return -1;
     }
 
-    bench_result_t results[3];
+    if (vm_jit_available() && bench_jit_differential(2000) != 0) {
+        log_error("Δ-VM JIT disagrees with the interpreter; not benchmarking");
+        return -1;
+    }
+
+    bench_result_t results[11];
+    double *profiles[ARRAY_SIZE(results)];
     memset(results, 0, sizeof(results));
+    memset(profiles, 0, sizeof(profiles));
 
     bench_vm_ctx_t vm_ctx;
     populate_vm_program(&vm_ctx);
-
-    bench_fkv_ctx_t fkv_ctx;
-    if (populate_fkv(&fkv_ctx) != 0) {
-        log_error("failed to set up F-KV benchmark data");
-        teardown_fkv();
+    bench_vm_ctx_t vm_threaded_ctx = vm_ctx;
+    vm_threaded_ctx.limits.engine = VM_ENGINE_THREADED;
+    bench_vm_ctx_t vm_reuse_ctx = vm_threaded_ctx;
+    vm_reuse_ctx.context = vm_context_create(&vm_reuse_ctx.limits, 0);
+    if (!vm_reuse_ctx.context) {
+        log_error("failed to create Δ-VM benchmark context");
         return -1;
     }
-
-    bench_http_ctx_t http_ctx;
-    populate_http_ctx(&http_ctx, cfg);
-
-    double *delta_vm_samples = calloc(opts->iterations, sizeof(double));
-    double *delta_vm_profile = NULL;
-    if (!delta_vm_samples) {
-        teardown_fkv();
+    bench_vm_ctx_t vm_jit_ctx = vm_ctx;
+    vm_jit_ctx.limits.engine = VM_ENGINE_JIT;
+    bench_vm_ctx_t vm_register_ctx = vm_ctx;
+    vm_register_ctx.limits.engine = VM_ENGINE_REGISTER;
+    bench_vm_verified_ctx_t vm_verified_ctx;
+    vm_verified_ctx.limits = vm_ctx.limits;
+    if (vm_verify(&vm_ctx.program, &vm_ctx.limits, &vm_verified_ctx.verified) != 0) {
+        log_error("failed to verify Δ-VM benchmark program");
+        vm_context_destroy(vm_reuse_ctx.context);
         return -1;
     }
-    memcpy(&results[0],
-           &(bench_result_t){
-               .name = "delta_vm",
-               .threshold_p95_ms = 50.0,
-               .threshold_p99_ms = 70.0,
-           },
-           sizeof(bench_result_t));
-    apply_threshold_override(opts, &results[0]);
-
-    if (run_iterations(opts->warmup, opts->iterations, delta_vm_samples, bench_vm_iteration, &vm_ctx) != 0) {
-        results[0].status = -1;
-    } else {
-        compute_stats(&results[0], delta_vm_samples, opts->iterations);
-        if (opts->include_profile) {
-            delta_vm_profile = calloc(opts->iterations, sizeof(double));
-            if (delta_vm_profile) {
-                memcpy(delta_vm_profile, delta_vm_samples, opts->iterations * sizeof(double));
-            }
-        }
-        if (results[0].p95_ms > results[0].threshold_p95_ms ||
-            results[0].p99_ms > results[0].threshold_p99_ms) {
-            results[0].status = 1;
-        }
-    }
-
-    double *fkv_samples = calloc(opts->iterations, sizeof(double));
-    double *fkv_profile = NULL;
-    if (!fkv_samples) {
-        free(delta_vm_samples);
-        free(delta_vm_profile);
-        teardown_fkv();
+    bench_vm_verified_ctx_t vm_fused_ctx;
+    vm_fused_ctx.limits = vm_ctx.limits;
+    if (vm_verify(&vm_ctx.program, &vm_ctx.limits, &vm_fused_ctx.verified) != 0 ||
+        vm_optimize(&vm_fused_ctx.verified) != 0) {
+        log_error("failed to optimize Δ-VM benchmark program");
+        vm_verified_free(&vm_fused_ctx.verified);
+        vm_verified_free(&vm_verified_ctx.verified);
+        vm_context_destroy(vm_reuse_ctx.context);
         return -1;
     }
-    memcpy(&results[1],
-           &(bench_result_t){
-               .name = "fkv_prefix_get",
-               .threshold_p95_ms = 10.0,
-               .threshold_p99_ms = 20.0,
-           },
-           sizeof(bench_result_t));
-    apply_threshold_override(opts, &results[1]);
-
-    if (run_iterations(opts->warmup, opts->iterations, fkv_samples, bench_fkv_iteration, &fkv_ctx) != 0) {
-        results[1].status = -1;
-    } else {
-        compute_stats(&results[1], fkv_samples, opts->iterations);
-        if (opts->include_profile) {
-            fkv_profile = calloc(opts->iterations, sizeof(double));
-            if (fkv_profile) {
-                memcpy(fkv_profile, fkv_samples, opts->iterations * sizeof(double));
-            }
-        }
-        if (results[1].p95_ms > results[1].threshold_p95_ms ||
-            results[1].p99_ms > results[1].threshold_p99_ms) {
-            results[1].status = 1;
-        }
-    }
 
-    double *http_samples = calloc(opts->iterations, sizeof(double));
-    double *http_profile = NULL;
-    if (!http_samples) {
-        free(delta_vm_samples);
-        free(delta_vm_profile);
-        free(fkv_samples);
-        free(fkv_profile);
+    bench_fkv_ctx_t fkv_ctx;
+    if (populate_fkv(&fkv_ctx) != 0) {
+        log_error("failed to set up F-KV benchmark data");
         teardown_fkv();
+        vm_verified_free(&vm_fused_ctx.verified);
+        vm_verified_free(&vm_verified_ctx.verified);
+        vm_context_destroy(vm_reuse_ctx.context);
         return -1;
     }
-    memcpy(&results[2],
-           &(bench_result_t){
-               .name = "http_dialog",
-               .threshold_p95_ms = 30.0,
-               .threshold_p99_ms = 50.0,
-           },
-           sizeof(bench_result_t));
-    apply_threshold_override(opts, &results[2]);
-
-    if (run_iterations(opts->warmup, opts->iterations, http_samples, bench_http_iteration, &http_ctx) != 0) {
-        results[2].status = -1;
-    } else {
-        compute_stats(&results[2], http_samples, opts->iterations);
-        if (opts->include_profile) {
-            http_profile = calloc(opts->iterations, sizeof(double));
-            if (http_profile) {
-                memcpy(http_profile, http_samples, opts->iterations * sizeof(double));
-            }
-        }
-        if (results[2].p95_ms > results[2].threshold_p95_ms ||
-            results[2].p99_ms > results[2].threshold_p99_ms) {
-            results[2].status = 1;
-        }
-    }
 
+    bench_fkv_mt_ctx_t fkv_mt_ctx = {&fkv_ctx, 4, BENCH_FKV_THREAD_LOOKUPS};
+
+    bench_http_ctx_t http_ctx;
+    populate_http_ctx(&http_ctx, cfg);
+
+    run_bench_case(opts, &results[0], &profiles[0], "delta_vm", 50.0, 70.0, bench_vm_iteration, &vm_ctx);
+    run_bench_case(opts,
+                   &results[1],
+                   &profiles[1],
+                   "delta_vm_threaded",
+                   50.0,
+                   70.0,
+                   bench_vm_iteration,
+                   &vm_threaded_ctx);
+    run_bench_case(opts,
+                   &results[2],
+                   &profiles[2],
+                   "delta_vm_context",
+                   50.0,
+                   70.0,
+                   bench_vm_iteration,
+                   &vm_reuse_ctx);
+    run_bench_case(opts,
+                   &results[3],
+                   &profiles[3],
+                   "delta_vm_verified",
+                   50.0,
+                   70.0,
+                   bench_vm_verified_iteration,
+                   &vm_verified_ctx);
+    run_bench_case(opts,
+                   &results[4],
+                   &profiles[4],
+                   "delta_vm_jit",
+                   50.0,
+                   70.0,
+                   bench_vm_iteration,
+                   &vm_jit_ctx);
+    run_bench_case(opts,
+                   &results[5],
+                   &profiles[5],
+                   "delta_vm_fused",
+                   50.0,
+                   70.0,
+                   bench_vm_verified_iteration,
+                   &vm_fused_ctx);
+    run_bench_case(opts,
+                   &results[6],
+                   &profiles[6],
+                   "delta_vm_register",
+                   50.0,
+                   70.0,
+                   bench_vm_iteration,
+                   &vm_register_ctx);
+    run_bench_case(opts, &results[7], &profiles[7], "fkv_prefix_get", 10.0, 20.0, bench_fkv_iteration, &fkv_ctx);
+    run_bench_case(opts,
+                   &results[8],
+                   &profiles[8],
+                   "fkv_prefix_view",
+                   10.0,
+                   20.0,
+                   bench_fkv_view_iteration,
+                   &fkv_ctx);
+    run_bench_case(opts,
+                   &results[9],
+                   &profiles[9],
+                   "fkv_prefix_get_4t",
+                   20.0,
+                   40.0,
+                   bench_fkv_mt_iteration,
+                   &fkv_mt_ctx);
+    bench_fkv_scaling(&fkv_ctx);
+    run_bench_case(opts, &results[10], &profiles[10], "http_dialog", 30.0, 50.0, bench_http_iteration, &http_ctx);
+
+    char *vm_profile = opts->include_profile ? bench_vm_profile(opts, &vm_ctx) : NULL;
     teardown_fkv();
+    vm_verified_free(&vm_fused_ctx.verified);
+    vm_verified_free(&vm_verified_ctx.verified);
+    vm_context_destroy(vm_reuse_ctx.context);
 
     int regression = 0;
     for (size_t i = 0; i < ARRAY_SIZE(results); ++i) {
@@ -545,21 +814,19 @@ int bench_run_all(const kolibri_config_t *cfg, const bench_options_t *opts) {
         if (!fp) {
             log_error("failed to open %s for writing", opts->output_path);
         } else {
-            results[0].profile_ms = delta_vm_profile;
-            results[1].profile_ms = fkv_profile;
-            results[2].profile_ms = http_profile;
-            write_json_report(fp, opts, results, ARRAY_SIZE(results), regression);
+            for (size_t i = 0; i < ARRAY_SIZE(results); ++i) {
+                results[i].profile_ms = profiles[i];
+            }
+            write_json_report(fp, opts, results, ARRAY_SIZE(results), regression, vm_profile);
             fclose(fp);
             log_info("benchmark report saved to %s", opts->output_path);
         }
     }
 
-    free(delta_vm_samples);
-    free(fkv_samples);
-    free(http_samples);
-    free(delta_vm_profile);
-    free(fkv_profile);
-    free(http_profile);
+    for (size_t i = 0; i < ARRAY_SIZE(results); ++i) {
+        free(profiles[i]);
+    }
+    free(vm_profile);
 
     if (regression) {
         log_warn("benchmark regression detected");
@@ -572,3 +839,70 @@ int bench_run_all(const kolibri_config_t *cfg, const bench_options_t *opts) {
     }
     return 0;
 }
+
+int bench_decode_trace(const char *path, FILE *out) {
+    if (!path || !out) {
+        return -1;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        log_error("failed to open trace %s: %s", path, strerror(errno));
+        return -1;
+    }
+    uint8_t *data = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    for (;;) {
+        if (len == cap) {
+            size_t new_cap = cap ? cap * 2 : 65536;
+            uint8_t *tmp = realloc(data, new_cap);
+            if (!tmp) {
+                free(data);
+                fclose(fp);
+                log_error("out of memory reading trace %s", path);
+                return -1;
+            }
+            data = tmp;
+            cap = new_cap;
+        }
+        size_t n = fread(data + len, 1, cap - len, fp);
+        len += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    vm_trace_reader_t reader;
+    if (vm_trace_reader_init(&reader, data, len) != 0) {
+        log_error("%s is not a Δ-VM trace stream", path);
+        free(data);
+        return -1;
+    }
+    vm_trace_record_t record;
+    uint64_t runs = 0;
+    uint64_t steps = 0;
+    int rc;
+    while ((rc = vm_trace_reader_next(&reader, &record)) == 1) {
+        if (record.kind == VM_TRACE_RECORD_RUN) {
+            runs++;
+            continue;
+        }
+        steps++;
+        fprintf(out,
+                "{\"run\":%llu,\"step\":%u,\"ip\":%u,\"opcode\":%u,\"stack_top\":%lld,\"gas_left\":%u}\n",
+                (unsigned long long)runs,
+                record.entry.step,
+                record.entry.ip,
+                (unsigned)record.entry.opcode,
+                (long long)(int64_t)record.entry.stack_top,
+                record.entry.gas_left);
+    }
+    free(data);
+    if (rc < 0) {
+        log_error("trace %s is corrupt at byte %zu", path, reader.offset);
+        return -1;
+    }
+    log_info("decoded %llu steps in %llu runs from %s", (unsigned long long)steps, (unsigned long long)runs, path);
+    return 0;
+}
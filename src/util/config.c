@@ -22,6 +22,8 @@ static void set_defaults(kolibri_config_t *cfg) {
     cfg->vm.max_steps = 2048;
     cfg->vm.max_stack = 128;
     cfg->vm.trace_depth = 64;
+    cfg->vm.result_cache_entries = 4096;
+    cfg->vm.profile = 0;
 
     cfg->fkv.top_k = 4;
 
@@ -187,6 +189,19 @@ static int skip_literal(json_cursor_t *cur, const char *literal) {
     return 0;
 }
 
+static int parse_bool(json_cursor_t *cur, int *out) {
+    skip_ws(cur);
+    if (skip_literal(cur, "true") == 0) {
+        *out = 1;
+        return 0;
+    }
+    if (skip_literal(cur, "false") == 0) {
+        *out = 0;
+        return 0;
+    }
+    return -1;
+}
+
 static int skip_value(json_cursor_t *cur);
 
 static int skip_array(json_cursor_t *cur) {
@@ -350,6 +365,71 @@ static int parse_http_object(json_cursor_t *cur, kolibri_config_t *cfg) {
     return 0;
 }
 
+/* Mnemonics accepted as keys of "vm.gas". */
+static const struct {
+    const char *name;
+    uint8_t opcode;
+} vm_opcode_names[] = {
+    {"PUSHd", 0x01},      {"ADD10", 0x02},      {"SUB10", 0x03},        {"MUL10", 0x04},
+    {"DIV10", 0x05},      {"MOD10", 0x06},      {"CMP", 0x07},          {"JZ", 0x08},
+    {"JNZ", 0x09},        {"CALL", 0x0A},       {"RET", 0x0B},          {"READ_FKV", 0x0C},
+    {"WRITE_FKV", 0x0D},  {"HASH10", 0x0E},     {"RANDOM10", 0x0F},     {"TIME10", 0x10},
+    {"NOP", 0x11},        {"HALT", 0x12},       {"PUSHN", 0x13},        {"SUM_PREFIX", 0x14},
+    {"COUNT_PREFIX", 0x15},
+};
+
+static int parse_vm_gas_object(json_cursor_t *cur, kolibri_config_t *cfg) {
+    if (consume_char(cur, '{') != 0) {
+        return -1;
+    }
+    uint8_t seen[sizeof(cfg->vm.gas_costs) / sizeof(cfg->vm.gas_costs[0])] = {0};
+    while (*cur->cur) {
+        skip_ws(cur);
+        if (*cur->cur == '}') {
+            cur->cur++;
+            return 0;
+        }
+        char key[32];
+        if (parse_string(cur, key, sizeof(key)) != 0) {
+            return -1;
+        }
+        if (consume_char(cur, ':') != 0) {
+            return -1;
+        }
+        size_t i = 0;
+        while (i < sizeof(vm_opcode_names) / sizeof(vm_opcode_names[0]) && strcmp(key, vm_opcode_names[i].name) != 0) {
+            i++;
+        }
+        if (i == sizeof(vm_opcode_names) / sizeof(vm_opcode_names[0])) {
+            return -1;
+        }
+        uint8_t opcode = vm_opcode_names[i].opcode;
+        if (seen[opcode]) {
+            if (skip_value(cur) != 0) {
+                return -1;
+            }
+        } else {
+            uint64_t value = 0;
+            if (parse_uint(cur, &value) != 0 || value == 0 || value > UINT32_MAX) {
+                return -1;
+            }
+            cfg->vm.gas_costs[opcode] = (uint32_t)value;
+            seen[opcode] = 1;
+        }
+        skip_ws(cur);
+        if (*cur->cur == ',') {
+            cur->cur++;
+            continue;
+        }
+        if (*cur->cur == '}') {
+            cur->cur++;
+            return 0;
+        }
+        return -1;
+    }
+    return -1;
+}
+
 static int parse_vm_object(json_cursor_t *cur, kolibri_config_t *cfg) {
     if (consume_char(cur, '{') != 0) {
         return -1;
@@ -357,6 +437,9 @@ static int parse_vm_object(json_cursor_t *cur, kolibri_config_t *cfg) {
     int saw_steps = 0;
     int saw_stack = 0;
     int saw_trace = 0;
+    int saw_cache = 0;
+    int saw_profile = 0;
+    int saw_gas = 0;
     while (*cur->cur) {
         skip_ws(cur);
         if (*cur->cur == '}') {
@@ -409,6 +492,41 @@ static int parse_vm_object(json_cursor_t *cur, kolibri_config_t *cfg) {
                 cfg->vm.trace_depth = (uint32_t)value;
                 saw_trace = 1;
             }
+        } else if (strcmp(key, "result_cache_entries") == 0) {
+            if (saw_cache) {
+                if (skip_value(cur) != 0) {
+                    return -1;
+                }
+            } else {
+                uint64_t value = 0;
+                if (parse_uint(cur, &value) != 0 || value > UINT32_MAX) {
+                    return -1;
+                }
+                cfg->vm.result_cache_entries = (uint32_t)value;
+                saw_cache = 1;
+            }
+        } else if (strcmp(key, "profile") == 0) {
+            if (saw_profile) {
+                if (skip_value(cur) != 0) {
+                    return -1;
+                }
+            } else {
+                if (parse_bool(cur, &cfg->vm.profile) != 0) {
+                    return -1;
+                }
+                saw_profile = 1;
+            }
+        } else if (strcmp(key, "gas") == 0) {
+            if (saw_gas) {
+                if (skip_value(cur) != 0) {
+                    return -1;
+                }
+            } else {
+                if (parse_vm_gas_object(cur, cfg) != 0) {
+                    return -1;
+                }
+                saw_gas = 1;
+            }
         } else {
             return -1;
         }
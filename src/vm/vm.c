@@ -2,8 +2,8 @@
 
 #include "vm/vm.h"
 
-#include "fkv/fkv.h"
 #include "util/log.h"
+#include "vm/vm_internal.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -11,49 +11,85 @@
 #include <string.h>
 #include <time.h>
 
-#define CALL_STACK_MAX 32
+static uint32_t vm_seed = 1337u;
+static vm_engine_t vm_default_engine = VM_ENGINE_SWITCH;
+/* Filled, with every entry >= 1, only while vm_gas_custom is set. */
+static uint32_t vm_gas_costs[VM_GAS_OPCODES];
+static int vm_gas_custom = 0;
 
-static uint32_t lcg_state = 1337u;
+/*
+ * RANDOM10 state of the run on this thread. vm_rng_begin() only records the
+ * program; the state is derived when RANDOM10 is first reached, so runs that
+ * never draw do not hash their bytecode.
+ */
+typedef struct {
+    const prog_t *prog;
+    uint64_t request_id;
+    int seeded;
+    uint32_t state;
+} vm_rng_t;
+
+static _Thread_local vm_rng_t vm_rng;
 
 void vm_set_seed(uint32_t seed) {
-    lcg_state = seed;
+    vm_seed = seed;
 }
 
-static uint64_t current_time_ms(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return (uint64_t)ts.tv_sec * 1000ull + ts.tv_nsec / 1000000ull;
+void vm_set_gas_schedule(const uint32_t *costs) {
+    int custom = 0;
+    for (size_t i = 0; i < VM_GAS_OPCODES; ++i) {
+        vm_gas_costs[i] = (costs && costs[i]) ? costs[i] : 1;
+        custom |= vm_gas_costs[i] != 1;
+    }
+    vm_gas_custom = custom;
+    /* Cached results carry the gas_used of the old schedule. */
+    vm_result_cache_clear();
 }
 
-static int vm_fkv_force_get_enabled = 0;
-static int vm_fkv_force_get_rc = 0;
-static int vm_fkv_force_put_enabled = 0;
-static int vm_fkv_force_put_rc = 0;
+uint32_t vm_gas_cost(uint8_t opcode) {
+    return vm_gas_custom ? vm_gas_costs[opcode] : 1;
+}
 
-void vm_force_fkv_errors(int get_enabled, int get_rc, int put_enabled, int put_rc) {
-    vm_fkv_force_get_enabled = get_enabled;
-    vm_fkv_force_get_rc = get_rc;
-    vm_fkv_force_put_enabled = put_enabled;
-    vm_fkv_force_put_rc = put_rc;
+const uint32_t *vm_gas_table(void) {
+    return vm_gas_custom ? vm_gas_costs : NULL;
 }
 
-void vm_reset_fkv_errors(void) {
-    vm_force_fkv_errors(0, 0, 0, 0);
+void vm_set_default_engine(vm_engine_t engine) {
+    vm_default_engine = (engine == VM_ENGINE_DEFAULT) ? VM_ENGINE_SWITCH : engine;
 }
 
-static void trace_add(vm_trace_t *trace, uint32_t step, uint32_t ip, uint8_t opcode, int64_t stack_top, uint32_t gas_left) {
-    if (!trace || !trace->entries || trace->capacity == 0) {
-        return;
-    }
-    if (trace->count >= trace->capacity) {
-        return;
+vm_engine_t vm_get_default_engine(void) {
+    return vm_default_engine;
+}
+
+const char *vm_engine_name(vm_engine_t engine) {
+    switch (engine) {
+    case VM_ENGINE_DEFAULT:
+        return "default";
+    case VM_ENGINE_SWITCH:
+        return "switch";
+    case VM_ENGINE_THREADED:
+        return "threaded";
+    case VM_ENGINE_JIT:
+        return "jit";
+    case VM_ENGINE_REGISTER:
+        return "register";
     }
-    vm_trace_entry_t *entry = &trace->entries[trace->count++];
-    entry->step = step;
-    entry->ip = ip;
-    entry->opcode = opcode;
-    entry->stack_top = stack_top;
-    entry->gas_left = gas_left;
+    return "unknown";
+}
+
+uint32_t vm_effective_max_steps(const vm_limits_t *lim) {
+    return (lim && lim->max_steps) ? lim->max_steps : 1024;
+}
+
+uint32_t vm_effective_max_stack(const vm_limits_t *lim) {
+    return (lim && lim->max_stack) ? lim->max_stack : 128;
+}
+
+static uint64_t current_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + ts.tv_nsec / 1000000ull;
 }
 
 static int64_t pop(int64_t *stack, size_t *sp) {
@@ -71,74 +107,152 @@ static int push(int64_t *stack, size_t *sp, size_t max_stack, int64_t v) {
     return 0;
 }
 
-static int number_to_digits(int64_t value, uint8_t *digits, size_t *len) {
-    if (!digits || !len || *len == 0) {
-        return -1;
-    }
-
-    if (value < 0) {
-        return -1;
-    }
-
-    size_t capacity = *len;
-    if (value == 0) {
-        if (capacity < 1) {
-            return -1;
+int vm_read_pushn(const uint8_t *code, size_t len, size_t at, int64_t *value) {
+    uint64_t acc = 0;
+    for (int i = 0; i < VM_PUSHN_MAX_OPERAND; ++i) {
+        if (at + (size_t)i >= len) {
+            return 0;
         }
-        digits[0] = 0;
-        *len = 1;
-        return 0;
-    }
-
-    size_t pos = capacity;
-    while (value > 0) {
-        if (pos == 0) {
+        uint8_t byte = code[at + (size_t)i];
+        /* The tenth group holds only the top bit of a 64-bit value. */
+        if (i == VM_PUSHN_MAX_OPERAND - 1 && byte > 1) {
             return -1;
         }
-        digits[--pos] = (uint8_t)(value % 10);
-        value /= 10;
+        acc |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            *value = (int64_t)acc;
+            return i + 1;
+        }
     }
+    return -1;
+}
 
-    size_t count = capacity - pos;
-    memmove(digits, digits + pos, count);
-    *len = count;
-    return 0;
+int64_t vm_hash10(int64_t value) {
+    uint64_t hash = (uint64_t)value * 2654435761u;
+    return (int64_t)(hash % 10000000000ull);
 }
 
-int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
-    if (!p || !p->code || p->len == 0 || !lim || !out) {
-        errno = EINVAL;
-        return -1;
+uint64_t vm_rng_program_hash(const prog_t *p) {
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < p->len; ++i) {
+        hash ^= p->code[i];
+        hash *= 1099511628211ull;
     }
-    uint32_t max_steps = lim->max_steps ? lim->max_steps : 1024;
-    uint32_t max_stack = lim->max_stack ? lim->max_stack : 128;
+    return hash;
+}
 
-    int64_t *stack = calloc(max_stack, sizeof(int64_t));
-    if (!stack) {
-        return -1;
+uint32_t vm_rng_seed(uint64_t program_hash, uint64_t request_id) {
+    /* splitmix64 finalizer over the (seed, program, request) triple. */
+    uint64_t x = (uint64_t)vm_seed * 0x9E3779B97F4A7C15ull ^ program_hash ^ (request_id + 1) * 0xD6E8FEB86659FD93ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return (uint32_t)x;
+}
+
+void vm_rng_begin(const prog_t *p, uint64_t request_id) {
+    vm_rng.prog = p;
+    vm_rng.request_id = request_id;
+    vm_rng.seeded = 0;
+}
+
+uint32_t vm_rng_get(void) {
+    if (!vm_rng.seeded) {
+        vm_rng.state = vm_rng.prog ? vm_rng_seed(vm_rng_program_hash(vm_rng.prog), vm_rng.request_id)
+                                   : vm_rng_seed(0, 0);
+        vm_rng.seeded = 1;
     }
+    return vm_rng.state;
+}
+
+void vm_rng_set(uint32_t state) {
+    vm_rng.state = state;
+    vm_rng.seeded = 1;
+}
 
-    uint32_t ip = 0;
-    size_t sp = 0;
-    uint32_t steps = 0;
-    uint16_t call_stack[CALL_STACK_MAX];
-    size_t call_sp = 0;
+int64_t vm_rng_next(uint32_t *state) {
+    *state = 1664525u * *state + 1013904223u;
+    return (int64_t)((uint64_t)*state % 10000000000ull);
+}
+
+int64_t vm_random10(void) {
+    uint32_t state = vm_rng_get();
+    int64_t value = vm_rng_next(&state);
+    vm_rng.state = state;
+    return value;
+}
+
+int64_t vm_time10(void) {
+    return (int64_t)current_time_ms();
+}
+
+int vm_exec_switch(const prog_t *p,
+                   uint32_t max_steps,
+                   uint32_t max_stack,
+                   int64_t *stack,
+                   vm_trace_t *trace,
+                   vm_result_t *out) {
+    vm_exec_state_t state;
+    state.ip = 0;
+    state.steps = 0;
+    state.gas = 0;
+    state.sp = 0;
+    state.call_sp = 0;
+    return vm_exec_switch_resume(p, max_steps, max_steps, max_stack, stack, &state, trace, out);
+}
+
+int vm_exec_switch_resume(const prog_t *p,
+                          uint32_t max_steps,
+                          uint32_t pause_at,
+                          uint32_t max_stack,
+                          int64_t *stack,
+                          vm_exec_state_t *state,
+                          vm_trace_t *trace,
+                          vm_result_t *out) {
+    uint32_t ip = state->ip;
+    size_t sp = state->sp;
+    uint32_t steps = state->steps;
+    uint32_t gas = state->gas;
+    const uint32_t *gas_table = vm_gas_table();
+    uint16_t *call_stack = state->call_stack;
+    size_t call_sp = state->call_sp;
+    /* One comparison per step covers both the slice and the gas limit. */
+    uint32_t limit = pause_at < max_steps ? pause_at : max_steps;
     vm_status_t status = VM_OK;
     uint8_t halted = 0;
+    /* Each instruction is charged the clock from its start to the next one. */
+    vm_profile_thread_t *prof = vm_profile_thread();
+    uint64_t prof_start = 0;
+    uint32_t prof_ip = 0;
+    uint8_t prof_opcode = 0;
+    uint32_t first_step = steps;
 
-    if (trace) {
-        trace->count = 0;
+    if (trace && steps == 0) {
+        vm_trace_begin(trace);
     }
 
     while (ip < p->len) {
-        if (steps >= max_steps) {
-            status = VM_ERR_GAS_EXHAUSTED;
+        uint8_t opcode = p->code[ip];
+        uint32_t cost = gas_table ? gas_table[opcode] : 1;
+        /* The first step of a slice runs even if it costs more than the slice. */
+        if ((gas > limit || cost > limit - gas) && (steps != first_step || cost > max_steps - gas)) {
+            status = cost > max_steps - gas ? VM_ERR_GAS_EXHAUSTED : VM_YIELD;
             break;
         }
-        uint8_t opcode = p->code[ip++];
+        ip++;
         int64_t before_top = (sp > 0) ? stack[sp - 1] : 0;
-        trace_add(trace, steps, ip - 1, opcode, before_top, max_steps - steps);
+        vm_trace_record(trace, steps, ip - 1, opcode, before_top, max_steps - gas);
+        if (prof) {
+            uint64_t now = vm_profile_clock();
+            if (steps > first_step) {
+                vm_profile_record(prof, prof_ip, prof_opcode, now - prof_start);
+            }
+            prof_start = now;
+            prof_ip = ip - 1;
+            prof_opcode = opcode;
+        }
         steps++;
+        gas += cost;
 
         switch (opcode) {
         case 0x01: { // PUSHd
@@ -160,7 +274,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
             }
             int64_t b = pop(stack, &sp);
             int64_t a = pop(stack, &sp);
-            if (push(stack, &sp, max_stack, a + b) != 0) {
+            if (push(stack, &sp, max_stack, (int64_t)((uint64_t)a + (uint64_t)b)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -173,7 +287,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
             }
             int64_t b = pop(stack, &sp);
             int64_t a = pop(stack, &sp);
-            if (push(stack, &sp, max_stack, a - b) != 0) {
+            if (push(stack, &sp, max_stack, (int64_t)((uint64_t)a - (uint64_t)b)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -186,7 +300,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
             }
             int64_t b = pop(stack, &sp);
             int64_t a = pop(stack, &sp);
-            if (push(stack, &sp, max_stack, a * b) != 0) {
+            if (push(stack, &sp, max_stack, (int64_t)((uint64_t)a * (uint64_t)b)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -203,7 +317,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
                 status = VM_ERR_DIV_BY_ZERO;
                 goto done;
             }
-            if (push(stack, &sp, max_stack, a / b) != 0) {
+            if (push(stack, &sp, max_stack, vm_div10(a, b)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -220,7 +334,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
                 status = VM_ERR_DIV_BY_ZERO;
                 goto done;
             }
-            if (push(stack, &sp, max_stack, a % b) != 0) {
+            if (push(stack, &sp, max_stack, vm_mod10(a, b)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -275,7 +389,7 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
                 status = VM_ERR_INVALID_OPCODE;
                 goto done;
             }
-            if (call_sp >= CALL_STACK_MAX) {
+            if (call_sp >= VM_CALL_STACK_MAX) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -303,35 +417,12 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
                 goto done;
             }
             int64_t key_value = pop(stack, &sp);
-            uint8_t key_digits[32];
-            size_t key_len = sizeof(key_digits);
-            if (number_to_digits(key_value, key_digits, &key_len) != 0) {
-                status = VM_ERR_INVALID_OPCODE;
+            int64_t value = 0;
+            status = vm_fkv_read(key_value, &value);
+            if (status != VM_OK) {
                 goto done;
             }
-
-            fkv_iter_t it = {0};
-            int rc = vm_fkv_force_get_enabled ? vm_fkv_force_get_rc
-                                              : fkv_get_prefix(key_digits, key_len, &it, 1);
-            if (rc != 0) {
-                fkv_iter_free(&it);
-                status = VM_ERR_INVALID_OPCODE;
-                goto done;
-            }
-            if (it.count == 0) {
-                fkv_iter_free(&it);
-                if (push(stack, &sp, max_stack, 0) != 0) {
-                    status = VM_ERR_STACK_OVERFLOW;
-                    goto done;
-                }
-                break;
-            }
-            uint64_t value = 0;
-            for (size_t i = 0; i < it.entries[0].value_len; ++i) {
-                value = value * 10 + it.entries[0].value[i];
-            }
-            fkv_iter_free(&it);
-            if (push(stack, &sp, max_stack, (int64_t)value) != 0) {
+            if (push(stack, &sp, max_stack, value) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -345,24 +436,8 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
 
             int64_t value_value = pop(stack, &sp);
             int64_t key_value = pop(stack, &sp);
-
-            uint8_t key_digits[32];
-            size_t key_len = sizeof(key_digits);
-            if (number_to_digits(key_value, key_digits, &key_len) != 0) {
-                status = VM_ERR_INVALID_OPCODE;
-                goto done;
-            }
-            uint8_t value_digits[32];
-            size_t value_len = sizeof(value_digits);
-            if (number_to_digits(value_value, value_digits, &value_len) != 0) {
-                status = VM_ERR_INVALID_OPCODE;
-                goto done;
-            }
-
-            int rc = vm_fkv_force_put_enabled ? vm_fkv_force_put_rc
-                                               : fkv_put(key_digits, key_len, value_digits, value_len, FKV_ENTRY_TYPE_VALUE);
-            if (rc != 0) {
-                status = VM_ERR_INVALID_OPCODE;
+            status = vm_fkv_write(key_value, value_value);
+            if (status != VM_OK) {
                 goto done;
             }
             break;
@@ -372,26 +447,22 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
                 status = VM_ERR_STACK_UNDERFLOW;
                 goto done;
             }
-            uint64_t value = (uint64_t)pop(stack, &sp);
-            uint64_t hash = value * 2654435761u;
-            if (push(stack, &sp, max_stack, (int64_t)(hash % 10000000000ull)) != 0) {
+            int64_t value = pop(stack, &sp);
+            if (push(stack, &sp, max_stack, vm_hash10(value)) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
             break;
         }
         case 0x0F: { // RANDOM10
-            lcg_state = 1664525u * lcg_state + 1013904223u;
-            uint64_t rnd = (uint64_t)lcg_state % 10000000000ull;
-            if (push(stack, &sp, max_stack, (int64_t)rnd) != 0) {
+            if (push(stack, &sp, max_stack, vm_random10()) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
             break;
         }
         case 0x10: { // TIME10
-            uint64_t t = current_time_ms();
-            if (push(stack, &sp, max_stack, (int64_t)t) != 0) {
+            if (push(stack, &sp, max_stack, vm_time10()) != 0) {
                 status = VM_ERR_STACK_OVERFLOW;
                 goto done;
             }
@@ -404,6 +475,38 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
             halted = 1;
             goto done;
         }
+        case 0x13: { // PUSHN
+            int64_t value = 0;
+            int used = vm_read_pushn(p->code, p->len, ip, &value);
+            if (used <= 0) {
+                status = VM_ERR_INVALID_OPCODE;
+                goto done;
+            }
+            ip += (uint32_t)used;
+            if (push(stack, &sp, max_stack, value) != 0) {
+                status = VM_ERR_STACK_OVERFLOW;
+                goto done;
+            }
+            break;
+        }
+        case 0x14:   // SUM_PREFIX
+        case 0x15: { // COUNT_PREFIX
+            if (sp == 0) {
+                status = VM_ERR_STACK_UNDERFLOW;
+                goto done;
+            }
+            int64_t key_value = pop(stack, &sp);
+            int64_t value = 0;
+            status = opcode == 0x14 ? vm_fkv_sum_prefix(key_value, &value) : vm_fkv_count_prefix(key_value, &value);
+            if (status != VM_OK) {
+                goto done;
+            }
+            if (push(stack, &sp, max_stack, value) != 0) {
+                status = VM_ERR_STACK_OVERFLOW;
+                goto done;
+            }
+            break;
+        }
         default:
             status = VM_ERR_INVALID_OPCODE;
             goto done;
@@ -411,12 +514,83 @@ int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result
     }
 
 done:
+    state->ip = ip;
+    state->sp = sp;
+    state->steps = steps;
+    state->gas = gas;
+    state->call_sp = call_sp;
+    if (prof) {
+        if (steps > first_step) {
+            vm_profile_record(prof, prof_ip, prof_opcode, vm_profile_clock() - prof_start);
+        }
+        vm_profile_finish_run(prof);
+    }
     if (out) {
         out->status = status;
         out->steps = steps;
+        out->gas_used = gas;
         out->result = (sp > 0) ? (uint64_t)stack[sp - 1] : 0;
         out->halted = halted;
     }
-    free(stack);
     return 0;
 }
+
+vm_engine_t vm_resolve_engine(const vm_limits_t *lim) {
+    return (lim && lim->engine != VM_ENGINE_DEFAULT) ? lim->engine : vm_default_engine;
+}
+
+static int vm_run_switch(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    uint32_t max_stack = vm_effective_max_stack(lim);
+    int64_t *stack = calloc(max_stack, sizeof(int64_t));
+    if (!stack) {
+        return -1;
+    }
+    int rc = vm_exec_switch(p, vm_effective_max_steps(lim), max_stack, stack, trace, out);
+    free(stack);
+    return rc;
+}
+
+static int vm_run_dispatch(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    if (vm_profile_enabled()) {
+        return vm_run_switch(p, lim, trace, out);
+    }
+    switch (vm_resolve_engine(lim)) {
+    case VM_ENGINE_THREADED:
+        return vm_run_threaded(p, lim, trace, out);
+    case VM_ENGINE_JIT:
+        return vm_run_jit(p, lim, trace, out);
+    case VM_ENGINE_REGISTER:
+        return vm_run_register(p, lim, trace, out);
+    case VM_ENGINE_DEFAULT:
+    case VM_ENGINE_SWITCH:
+        break;
+    }
+    return vm_run_switch(p, lim, trace, out);
+}
+
+static int vm_run_engine(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    vm_rng_begin(p, lim->request_id);
+    vm_fkv_txn_begin();
+    int rc = vm_run_dispatch(p, lim, trace, out);
+    vm_fkv_txn_end(rc, out);
+    return rc;
+}
+
+int vm_run(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (trace || vm_profile_enabled()) {
+        return vm_run_engine(p, lim, trace, out);
+    }
+    vm_cache_key_t key;
+    if (vm_cache_lookup(p, lim, &key, out)) {
+        return 0;
+    }
+    int rc = vm_run_engine(p, lim, NULL, out);
+    if (rc == 0) {
+        vm_cache_store(&key, out);
+    }
+    return rc;
+}
@@ -0,0 +1,155 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Batch execution. The programs are split into one contiguous range per
+ * worker; a worker drains its own range in small grains and then steals
+ * grains from the other ranges, so a worker stuck on a long program does
+ * not hold back the rest of the batch. Every worker runs in its own
+ * vm_context_t.
+ */
+
+#define VM_BATCH_GRAIN 4
+#define VM_BATCH_MAX_THREADS 256
+
+typedef struct {
+    _Alignas(64) atomic_size_t next;
+    size_t end;
+} batch_range_t;
+
+typedef struct {
+    const prog_t *progs;
+    const vm_limits_t *lim;
+    vm_result_t *out;
+    batch_range_t *ranges;
+    size_t workers;
+    atomic_int failed;
+} batch_job_t;
+
+typedef struct {
+    batch_job_t *job;
+    size_t self;
+} batch_worker_t;
+
+static int batch_claim(batch_range_t *range, size_t *begin, size_t *end) {
+    if (atomic_load_explicit(&range->next, memory_order_relaxed) >= range->end) {
+        return 0;
+    }
+    size_t first = atomic_fetch_add_explicit(&range->next, VM_BATCH_GRAIN, memory_order_relaxed);
+    if (first >= range->end) {
+        return 0;
+    }
+    *begin = first;
+    *end = (range->end - first > VM_BATCH_GRAIN) ? first + VM_BATCH_GRAIN : range->end;
+    return 1;
+}
+
+static void batch_run_range(batch_job_t *job, vm_context_t *ctx, size_t begin, size_t end) {
+    vm_limits_t lim = *job->lim;
+    for (size_t i = begin; i < end; ++i) {
+        lim.request_id = job->lim->request_id + i;
+        int rc = ctx ? vm_context_run(ctx, &job->progs[i], &lim, &job->out[i])
+                     : vm_run(&job->progs[i], &lim, NULL, &job->out[i]);
+        if (rc != 0) {
+            memset(&job->out[i], 0, sizeof(job->out[i]));
+            job->out[i].status = VM_ERR_INVALID_OPCODE;
+            atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+        }
+    }
+}
+
+static void *batch_worker_main(void *arg) {
+    batch_worker_t *worker = (batch_worker_t *)arg;
+    batch_job_t *job = worker->job;
+    vm_context_t *ctx = vm_context_create(job->lim, 0);
+
+    size_t begin = 0;
+    size_t end = 0;
+    for (size_t k = 0; k < job->workers; ++k) {
+        batch_range_t *range = &job->ranges[(worker->self + k) % job->workers];
+        while (batch_claim(range, &begin, &end)) {
+            batch_run_range(job, ctx, begin, end);
+        }
+    }
+
+    vm_context_destroy(ctx);
+    return NULL;
+}
+
+static size_t batch_default_threads(void) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    return nproc < 1 ? 1 : (size_t)nproc;
+}
+
+int vm_run_batch(const prog_t *progs, size_t n, const vm_limits_t *lim, vm_result_t *out, size_t threads) {
+    if ((!progs && n > 0) || !lim || (!out && n > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (threads == 0) {
+        threads = batch_default_threads();
+    }
+    if (threads > VM_BATCH_MAX_THREADS) {
+        threads = VM_BATCH_MAX_THREADS;
+    }
+    size_t max_useful = (n + VM_BATCH_GRAIN - 1) / VM_BATCH_GRAIN;
+    if (threads > max_useful) {
+        threads = max_useful;
+    }
+
+    batch_range_t *ranges = aligned_alloc(_Alignof(batch_range_t), threads * sizeof(*ranges));
+    batch_worker_t *workers = malloc(threads * sizeof(*workers));
+    pthread_t *tids = malloc(threads * sizeof(*tids));
+    if (!ranges || !workers || !tids) {
+        free(ranges);
+        free(workers);
+        free(tids);
+        return -1;
+    }
+
+    batch_job_t job = {.progs = progs, .lim = lim, .out = out, .ranges = ranges, .workers = threads};
+    atomic_init(&job.failed, 0);
+    size_t per_worker = n / threads;
+    size_t extra = n % threads;
+    size_t cursor = 0;
+    for (size_t i = 0; i < threads; ++i) {
+        size_t count = per_worker + (i < extra ? 1 : 0);
+        atomic_init(&ranges[i].next, cursor);
+        ranges[i].end = cursor + count;
+        cursor += count;
+        workers[i].job = &job;
+        workers[i].self = i;
+    }
+
+    /* The calling thread is worker 0. Ranges of workers that failed to
+     * start are drained by stealing. */
+    size_t started = 1;
+    for (size_t i = 1; i < threads; ++i) {
+        if (pthread_create(&tids[started], NULL, batch_worker_main, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    batch_worker_main(&workers[0]);
+    for (size_t i = 1; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    free(ranges);
+    free(workers);
+    free(tids);
+    return atomic_load(&job.failed) ? -1 : 0;
+}
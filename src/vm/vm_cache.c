@@ -0,0 +1,271 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include "fkv/fkv.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Result cache. Keys are two independent 64-bit hashes of the bytecode and
+ * the effective limits; the low bits of one select the shard, the rest the
+ * bucket. Each shard has its own lock, and each bucket holds a few entries
+ * replaced least-recently-used first. Programs that can never be cached
+ * are remembered as such, so repeated runs skip the reachability scan.
+ */
+
+#define VM_CACHE_SHARDS 16
+#define VM_CACHE_WAYS 4
+
+enum {
+    CACHE_KIND_NONE = 0,    /* empty entry / do not store */
+    CACHE_KIND_PURE,        /* depends on bytecode and limits only */
+    CACHE_KIND_FKV,         /* also reads F-KV: valid for one generation */
+    CACHE_KIND_UNCACHEABLE, /* may reach RANDOM10, TIME10 or WRITE_FKV */
+};
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t generation;
+    uint64_t stamp;
+    vm_result_t result;
+    uint8_t kind;
+} cache_entry_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    cache_entry_t *entries;
+    size_t buckets;
+    size_t used;
+    uint64_t clock;
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+    atomic_uint_fast64_t bypassed;
+} cache_shard_t;
+
+static cache_shard_t cache_shards[VM_CACHE_SHARDS] = {
+#define VM_CACHE_SHARD_INIT {.lock = PTHREAD_MUTEX_INITIALIZER}
+    VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT,
+    VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT,
+    VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT,
+    VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT, VM_CACHE_SHARD_INIT,
+#undef VM_CACHE_SHARD_INIT
+};
+static atomic_size_t cache_capacity = 0;
+
+static uint64_t cache_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static void cache_hash(const prog_t *p, const vm_limits_t *lim, vm_cache_key_t *key) {
+    uint64_t a = 1469598103934665603ull;
+    uint64_t b = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < p->len; ++i) {
+        a = (a ^ p->code[i]) * 1099511628211ull;
+        b = (b ^ p->code[i]) * 0xC2B2AE3D27D4EB4Full;
+        b ^= b >> 31;
+    }
+    uint64_t limits = ((uint64_t)vm_effective_max_steps(lim) << 32) | vm_effective_max_stack(lim);
+    key->lo = cache_mix(a ^ limits ^ (uint64_t)p->len);
+    key->hi = cache_mix(b + limits * 0x9E3779B97F4A7C15ull + (uint64_t)p->len);
+}
+
+static cache_shard_t *cache_shard(const vm_cache_key_t *key) {
+    return &cache_shards[key->lo % VM_CACHE_SHARDS];
+}
+
+static cache_entry_t *cache_bucket(const cache_shard_t *shard, const vm_cache_key_t *key) {
+    return &shard->entries[((key->lo / VM_CACHE_SHARDS) % shard->buckets) * VM_CACHE_WAYS];
+}
+
+static cache_entry_t *cache_find(cache_shard_t *shard, const vm_cache_key_t *key) {
+    cache_entry_t *bucket = cache_bucket(shard, key);
+    for (size_t i = 0; i < VM_CACHE_WAYS; ++i) {
+        if (bucket[i].kind != CACHE_KIND_NONE && bucket[i].lo == key->lo && bucket[i].hi == key->hi) {
+            return &bucket[i];
+        }
+    }
+    return NULL;
+}
+
+/* Finds the entry for key, or an empty or least recently used one for it. */
+static cache_entry_t *cache_slot(cache_shard_t *shard, const vm_cache_key_t *key) {
+    cache_entry_t *found = cache_find(shard, key);
+    if (found) {
+        return found;
+    }
+    cache_entry_t *bucket = cache_bucket(shard, key);
+    cache_entry_t *victim = &bucket[0];
+    for (size_t i = 0; i < VM_CACHE_WAYS; ++i) {
+        if (bucket[i].kind == CACHE_KIND_NONE) {
+            shard->used++;
+            return &bucket[i];
+        }
+        if (bucket[i].stamp < victim->stamp) {
+            victim = &bucket[i];
+        }
+    }
+    atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+    return victim;
+}
+
+static uint8_t cache_classify(const prog_t *p) {
+    vm_insn_t *insns = malloc((p->len + 1) * sizeof(*insns));
+    uint8_t *reach = calloc(p->len + 1, 1);
+    uint8_t kind = CACHE_KIND_NONE;
+    if (insns && reach) {
+        vm_decode(p, insns);
+        if (vm_mark_reachable(insns, p->len, reach) == 0) {
+            kind = CACHE_KIND_PURE;
+            for (size_t ip = 0; ip < p->len; ++ip) {
+                if (!reach[ip]) {
+                    continue;
+                }
+                vm_op_t op = (vm_op_t)insns[ip].op;
+                if (op == VM_OP_RANDOM10 || op == VM_OP_TIME10 || op == VM_OP_WRITE_FKV) {
+                    kind = CACHE_KIND_UNCACHEABLE;
+                    break;
+                }
+                if (op == VM_OP_READ_FKV || op == VM_OP_SUM_PREFIX || op == VM_OP_COUNT_PREFIX) {
+                    kind = CACHE_KIND_FKV;
+                }
+            }
+        }
+    }
+    free(insns);
+    free(reach);
+    return kind;
+}
+
+static void cache_store_entry(const vm_cache_key_t *key, uint8_t kind, const vm_result_t *result) {
+    cache_shard_t *shard = cache_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->entries) {
+        cache_entry_t *entry = cache_slot(shard, key);
+        entry->lo = key->lo;
+        entry->hi = key->hi;
+        entry->kind = kind;
+        entry->generation = key->generation;
+        entry->stamp = ++shard->clock;
+        if (result) {
+            entry->result = *result;
+        } else {
+            memset(&entry->result, 0, sizeof(entry->result));
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int vm_cache_lookup(const prog_t *p, const vm_limits_t *lim, vm_cache_key_t *key, vm_result_t *out) {
+    memset(key, 0, sizeof(*key));
+    if (atomic_load_explicit(&cache_capacity, memory_order_relaxed) == 0) {
+        return 0;
+    }
+    cache_hash(p, lim, key);
+    cache_shard_t *shard = cache_shard(key);
+
+    uint8_t kind = CACHE_KIND_NONE;
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = shard->entries ? cache_find(shard, key) : NULL;
+    if (entry) {
+        kind = entry->kind;
+        if (kind == CACHE_KIND_PURE || (kind == CACHE_KIND_FKV && entry->generation == fkv_generation())) {
+            entry->stamp = ++shard->clock;
+            *out = entry->result;
+            pthread_mutex_unlock(&shard->lock);
+            atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (kind == CACHE_KIND_NONE) {
+        kind = cache_classify(p);
+        if (kind == CACHE_KIND_UNCACHEABLE) {
+            cache_store_entry(key, kind, NULL);
+        }
+    }
+    if (kind == CACHE_KIND_UNCACHEABLE || kind == CACHE_KIND_NONE) {
+        atomic_fetch_add_explicit(&shard->bypassed, 1, memory_order_relaxed);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+    key->kind = kind;
+    /* Taken before the run, so a write during the run invalidates it. */
+    key->generation = (kind == CACHE_KIND_FKV) ? fkv_generation() : 0;
+    return 0;
+}
+
+void vm_cache_store(const vm_cache_key_t *key, const vm_result_t *result) {
+    if (key->kind == CACHE_KIND_PURE || key->kind == CACHE_KIND_FKV) {
+        cache_store_entry(key, key->kind, result);
+    }
+}
+
+int vm_result_cache_configure(size_t capacity) {
+    size_t per_shard = (capacity + VM_CACHE_SHARDS - 1) / VM_CACHE_SHARDS;
+    size_t buckets = (per_shard + VM_CACHE_WAYS - 1) / VM_CACHE_WAYS;
+    atomic_store(&cache_capacity, 0);
+    for (size_t i = 0; i < VM_CACHE_SHARDS; ++i) {
+        cache_shard_t *shard = &cache_shards[i];
+        cache_entry_t *entries = NULL;
+        if (buckets > 0) {
+            entries = calloc(buckets * VM_CACHE_WAYS, sizeof(*entries));
+            if (!entries) {
+                vm_result_cache_configure(0);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        pthread_mutex_lock(&shard->lock);
+        free(shard->entries);
+        shard->entries = entries;
+        shard->buckets = buckets;
+        shard->used = 0;
+        shard->clock = 0;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    atomic_store(&cache_capacity, buckets * VM_CACHE_WAYS * VM_CACHE_SHARDS);
+    return 0;
+}
+
+void vm_result_cache_clear(void) {
+    for (size_t i = 0; i < VM_CACHE_SHARDS; ++i) {
+        cache_shard_t *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (shard->entries) {
+            memset(shard->entries, 0, shard->buckets * VM_CACHE_WAYS * sizeof(*shard->entries));
+        }
+        shard->used = 0;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void vm_result_cache_stats(vm_result_cache_stats_t *out) {
+    if (!out) {
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    for (size_t i = 0; i < VM_CACHE_SHARDS; ++i) {
+        cache_shard_t *shard = &cache_shards[i];
+        out->hits += atomic_load_explicit(&shard->hits, memory_order_relaxed);
+        out->misses += atomic_load_explicit(&shard->misses, memory_order_relaxed);
+        out->evictions += atomic_load_explicit(&shard->evictions, memory_order_relaxed);
+        out->bypassed += atomic_load_explicit(&shard->bypassed, memory_order_relaxed);
+        pthread_mutex_lock(&shard->lock);
+        out->entries += shard->used;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    out->capacity = atomic_load(&cache_capacity);
+}
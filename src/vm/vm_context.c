@@ -0,0 +1,267 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct vm_context {
+    int64_t *stack;
+    uint32_t stack_capacity;
+    vm_insn_t *insns;
+    size_t insn_capacity; /* entries, including the END sentinel */
+    vm_trace_entry_t *trace_entries;
+    vm_trace_t trace;
+    /* Run loaded by vm_context_start(), live while suspended is set. */
+    int suspended;
+    vm_fkv_txn_t *resume_txn; /* its F-KV writes so far */
+    prog_t resume_prog;
+    uint32_t resume_max_steps;
+    uint32_t resume_max_stack;
+    vm_exec_state_t resume_state;
+    uint32_t resume_rng;
+};
+
+static int context_reserve_stack(vm_context_t *ctx, uint32_t max_stack) {
+    if (max_stack <= ctx->stack_capacity) {
+        return 0;
+    }
+    int64_t *stack = realloc(ctx->stack, (size_t)max_stack * sizeof(*stack));
+    if (!stack) {
+        return -1;
+    }
+    ctx->stack = stack;
+    ctx->stack_capacity = max_stack;
+    return 0;
+}
+
+static int context_reserve_insns(vm_context_t *ctx, size_t len) {
+    if (len + 1 <= ctx->insn_capacity) {
+        return 0;
+    }
+    size_t capacity = ctx->insn_capacity ? ctx->insn_capacity : 64;
+    while (capacity < len + 1) {
+        capacity *= 2;
+    }
+    vm_insn_t *insns = realloc(ctx->insns, capacity * sizeof(*insns));
+    if (!insns) {
+        return -1;
+    }
+    ctx->insns = insns;
+    ctx->insn_capacity = capacity;
+    return 0;
+}
+
+/* Drops a suspended run and the F-KV writes it buffered. */
+static void context_abandon(vm_context_t *ctx) {
+    if (ctx->suspended) {
+        vm_fkv_txn_discard(ctx->resume_txn);
+        ctx->suspended = 0;
+    }
+}
+
+static vm_trace_t *context_trace(vm_context_t *ctx) {
+    return (ctx->trace.capacity > 0 || ctx->trace.sink) ? &ctx->trace : NULL;
+}
+
+vm_context_t *vm_context_create(const vm_limits_t *lim, size_t trace_capacity) {
+    vm_context_t *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    if (context_reserve_stack(ctx, vm_effective_max_stack(lim)) != 0) {
+        vm_context_destroy(ctx);
+        return NULL;
+    }
+    if (trace_capacity > 0) {
+        ctx->trace_entries = calloc(trace_capacity, sizeof(*ctx->trace_entries));
+        if (!ctx->trace_entries) {
+            vm_context_destroy(ctx);
+            return NULL;
+        }
+        ctx->trace.entries = ctx->trace_entries;
+        ctx->trace.capacity = trace_capacity;
+    }
+    return ctx;
+}
+
+void vm_context_reset(vm_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    memset(ctx->stack, 0, (size_t)ctx->stack_capacity * sizeof(*ctx->stack));
+    context_abandon(ctx);
+    ctx->trace.count = 0;
+    ctx->trace.cursor = 0;
+    ctx->trace.total = 0;
+}
+
+void vm_context_set_trace(vm_context_t *ctx, vm_trace_mode_t mode, uint32_t sample_every, vm_trace_sink_t *sink) {
+    if (!ctx) {
+        return;
+    }
+    ctx->trace.mode = mode;
+    ctx->trace.sample_every = sample_every;
+    ctx->trace.sink = sink;
+    vm_context_reset(ctx);
+}
+
+static int context_run_dispatch(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim, vm_result_t *out) {
+    uint32_t max_steps = vm_effective_max_steps(lim);
+    uint32_t max_stack = vm_effective_max_stack(lim);
+    if (context_reserve_stack(ctx, max_stack) != 0) {
+        return -1;
+    }
+
+    vm_engine_t engine = vm_profile_enabled() ? VM_ENGINE_SWITCH : vm_resolve_engine(lim);
+    switch (engine) {
+    case VM_ENGINE_JIT:
+    case VM_ENGINE_REGISTER:
+        /* Native and register code do not trace; traced runs use the interpreter. */
+        if (!context_trace(ctx)) {
+            return engine == VM_ENGINE_JIT ? vm_run_jit(p, lim, NULL, out) : vm_run_register(p, lim, NULL, out);
+        }
+        /* fall through */
+    case VM_ENGINE_THREADED:
+        if (context_reserve_insns(ctx, p->len) != 0) {
+            return -1;
+        }
+        return vm_exec_threaded(p, max_steps, max_stack, ctx->stack, ctx->insns, context_trace(ctx), out);
+    case VM_ENGINE_DEFAULT:
+    case VM_ENGINE_SWITCH:
+        break;
+    }
+    return vm_exec_switch(p, max_steps, max_stack, ctx->stack, context_trace(ctx), out);
+}
+
+static int context_run_engine(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim, vm_result_t *out) {
+    context_abandon(ctx);
+    vm_rng_begin(p, lim->request_id);
+    vm_fkv_txn_begin();
+    int rc = context_run_dispatch(ctx, p, lim, out);
+    vm_fkv_txn_end(rc, out);
+    return rc;
+}
+
+int vm_context_run(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim, vm_result_t *out) {
+    if (!ctx || !p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (context_trace(ctx) || vm_profile_enabled()) {
+        return context_run_engine(ctx, p, lim, out);
+    }
+    vm_cache_key_t key;
+    if (vm_cache_lookup(p, lim, &key, out)) {
+        return 0;
+    }
+    int rc = context_run_engine(ctx, p, lim, out);
+    if (rc == 0) {
+        vm_cache_store(&key, out);
+    }
+    return rc;
+}
+
+int vm_context_run_verified(vm_context_t *ctx,
+                            const vm_verified_prog_t *vp,
+                            const vm_limits_t *lim,
+                            vm_result_t *out) {
+    if (!ctx || !vp || !vp->impl || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Also when profiling, which only the reference interpreter does. */
+    if (vm_effective_max_stack(lim) < vp->max_depth || vm_profile_enabled()) {
+        return vm_context_run(ctx, &vp->prog, lim, out);
+    }
+    if (context_reserve_stack(ctx, vp->max_depth) != 0) {
+        return -1;
+    }
+    context_abandon(ctx);
+    vm_cache_key_t key;
+    if (!context_trace(ctx) && vm_cache_lookup(&vp->prog, lim, &key, out)) {
+        return 0;
+    }
+    vm_rng_begin(&vp->prog, lim->request_id);
+    vm_fkv_txn_begin();
+    int rc = (vp->fused && !context_trace(ctx))
+                 ? vm_exec_fused(vp->fused, vp->impl, vm_effective_max_steps(lim), ctx->stack, out)
+                 : vm_exec_verified(vp->impl, vm_effective_max_steps(lim), ctx->stack, context_trace(ctx), out);
+    vm_fkv_txn_end(rc, out);
+    if (rc == 0 && !context_trace(ctx)) {
+        vm_cache_store(&key, out);
+    }
+    return rc;
+}
+
+int vm_context_start(vm_context_t *ctx, const prog_t *p, const vm_limits_t *lim) {
+    if (!ctx || !p || !p->code || p->len == 0 || !lim) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t max_stack = vm_effective_max_stack(lim);
+    if (context_reserve_stack(ctx, max_stack) != 0) {
+        return -1;
+    }
+    if (!ctx->resume_txn && !(ctx->resume_txn = vm_fkv_txn_create())) {
+        return -1;
+    }
+    context_abandon(ctx);
+    memset(&ctx->resume_state, 0, offsetof(vm_exec_state_t, call_stack));
+    ctx->resume_prog = *p;
+    ctx->resume_max_steps = vm_effective_max_steps(lim);
+    ctx->resume_max_stack = max_stack;
+    ctx->resume_rng = vm_rng_seed(vm_rng_program_hash(p), lim->request_id);
+    ctx->suspended = 1;
+    return 0;
+}
+
+int vm_context_resume(vm_context_t *ctx, uint32_t slice, vm_result_t *out) {
+    if (!ctx || !ctx->suspended || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t done = ctx->resume_state.gas;
+    uint32_t pause_at = ctx->resume_max_steps;
+    if (slice > 0 && slice < pause_at - done) {
+        pause_at = done + slice;
+    }
+    vm_rng_set(ctx->resume_rng);
+    vm_fkv_txn_resume(ctx->resume_txn);
+    int rc = vm_exec_switch_resume(&ctx->resume_prog,
+                                   ctx->resume_max_steps,
+                                   pause_at,
+                                   ctx->resume_max_stack,
+                                   ctx->stack,
+                                   &ctx->resume_state,
+                                   context_trace(ctx),
+                                   out);
+    vm_fkv_txn_suspend(ctx->resume_txn, rc, out);
+    ctx->resume_rng = vm_rng_get();
+    ctx->suspended = (rc == 0 && out->status == VM_YIELD);
+    return rc;
+}
+
+int vm_context_suspended(const vm_context_t *ctx) {
+    return ctx ? ctx->suspended : 0;
+}
+
+const vm_trace_t *vm_context_trace(const vm_context_t *ctx) {
+    if (!ctx || (ctx->trace.capacity == 0 && !ctx->trace.sink)) {
+        return NULL;
+    }
+    return &ctx->trace;
+}
+
+void vm_context_destroy(vm_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    free(ctx->stack);
+    free(ctx->insns);
+    free(ctx->trace_entries);
+    vm_fkv_txn_destroy(ctx->resume_txn);
+    free(ctx);
+}
@@ -0,0 +1,375 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+/*
+ * Body of the decoded-table executor. vm_threaded.c includes this file
+ * once per variant after defining:
+ *
+ *   VM_EXEC_NAME     name of the generated static function;
+ *   VM_EXEC_CHECKED  1 to check stack bounds, operands and jump targets on
+ *                    every instruction, 0 for tables accepted by vm_verify(),
+ *                    where those checks were discharged ahead of time;
+ *   VM_EXEC_FUSED    optional, 1 for vm_optimize() tables. An entry then
+ *                    costs `weight` steps; when less gas than that is left,
+ *                    or under a custom gas schedule, the entry at the same
+ *                    ip of the original table (base) runs instead, so gas
+ *                    runs out on the same original instruction as without
+ *                    fusion. Requires VM_EXEC_CHECKED 0.
+ *
+ * Gas, division by zero and F-KV failures are data dependent and are
+ * checked in both variants. No include guard on purpose.
+ *
+ * The top of the stack is cached in the local `tos`, so binary operators
+ * read one operand from memory and write none. Entry i below the top lives
+ * in stack[i + 1]; stack[0] takes the spill of the empty stack's dummy
+ * top, so a run of depth d still touches stack[0 .. d-1] only. `tos` is
+ * kept valid across every exit so the result comes straight from it.
+ */
+
+#if !defined(VM_EXEC_NAME) || !defined(VM_EXEC_CHECKED)
+#error "define VM_EXEC_NAME and VM_EXEC_CHECKED before including vm_exec_template.h"
+#endif
+#ifndef VM_EXEC_FUSED
+#define VM_EXEC_FUSED 0
+#endif
+
+static int VM_EXEC_NAME(const vm_insn_t *insns,
+#if VM_EXEC_FUSED
+                        const vm_insn_t *base,
+#endif
+                        uint32_t max_steps,
+                        uint32_t max_stack,
+                        int64_t *stack,
+                        vm_trace_t *trace,
+                        vm_result_t *out) {
+    uint32_t ip = 0;
+    size_t sp = 0;
+    uint32_t steps = 0;
+    uint32_t gas = 0;
+    const uint32_t *gas_table = vm_gas_table();
+    uint16_t call_stack[VM_CALL_STACK_MAX];
+    size_t call_sp = 0;
+    vm_status_t status = VM_OK;
+    uint8_t halted = 0;
+    const vm_insn_t *insn = NULL;
+    int64_t tos = 0;
+
+    (void)max_stack;
+    if (trace) {
+        vm_trace_begin(trace);
+    }
+
+#if VM_EXEC_FUSED
+#define VM_UNFUSE_IF_SHORT()                                                        \
+    do {                                                                            \
+        if (gas_table || insn->weight > max_steps - gas) {                          \
+            insn = &base[ip];                                                       \
+        }                                                                           \
+    } while (0)
+#define VM_STEP_COST(insn) ((insn)->weight)
+#else
+#define VM_UNFUSE_IF_SHORT() ((void)0)
+#define VM_STEP_COST(insn) 1u
+#endif
+#define VM_GAS_COST(insn) (gas_table ? gas_table[(insn)->code] : VM_STEP_COST(insn))
+
+#define VM_FETCH()                                                                  \
+    do {                                                                            \
+        insn = &insns[ip];                                                          \
+        if (insn->op != VM_OP_END) {                                                \
+            VM_UNFUSE_IF_SHORT();                                                   \
+            if (VM_GAS_COST(insn) > max_steps - gas) {                              \
+                status = VM_ERR_GAS_EXHAUSTED;                                      \
+                goto done;                                                          \
+            }                                                                       \
+            if (trace) {                                                            \
+                vm_trace_record(trace,                                              \
+                                steps,                                              \
+                                ip,                                                 \
+                                insn->code,                                         \
+                                sp > 0 ? tos : 0,                                   \
+                                max_steps - gas);                                   \
+            }                                                                       \
+            steps += VM_STEP_COST(insn);                                            \
+            gas += VM_GAS_COST(insn);                                               \
+        }                                                                           \
+    } while (0)
+
+#if VM_THREADED_COMPUTED_GOTO
+#define VM_OP_TARGET(name, label) [VM_OP_##name] = &&op_##label,
+    static const void *const dispatch_table[VM_OP_COUNT] = {VM_OP_LIST(VM_OP_TARGET)};
+#undef VM_OP_TARGET
+#define VM_NEXT()                                                                   \
+    do {                                                                            \
+        VM_FETCH();                                                                 \
+        goto *dispatch_table[insn->op];                                             \
+    } while (0)
+#else
+#define VM_NEXT() goto dispatch
+#endif
+
+#define VM_FAIL_IF(cond, err)                                                       \
+    do {                                                                            \
+        if (cond) {                                                                 \
+            status = (err);                                                         \
+            goto done;                                                              \
+        }                                                                           \
+    } while (0)
+
+#if VM_EXEC_CHECKED
+#define VM_CHECK(cond, err) VM_FAIL_IF(!(cond), err)
+#else
+#define VM_CHECK(cond, err) ((void)0)
+#endif
+
+/* Spill the cached top below the new one / reload it from below the old one. */
+#define VM_PUSH(value)                                                              \
+    do {                                                                            \
+        stack[sp++] = tos;                                                          \
+        tos = (value);                                                              \
+    } while (0)
+#define VM_DROP() (tos = stack[--sp])
+
+    VM_NEXT();
+
+#if !VM_THREADED_COMPUTED_GOTO
+dispatch:
+    VM_FETCH();
+    switch ((vm_op_t)insn->op) {
+#define VM_OP_CASE(name, label)                                                     \
+    case VM_OP_##name:                                                              \
+        goto op_##label;
+        VM_OP_LIST(VM_OP_CASE)
+#undef VM_OP_CASE
+    case VM_OP_COUNT:
+        goto op_invalid;
+    }
+    goto op_invalid;
+#endif
+
+op_pushd:
+    VM_CHECK(sp < max_stack, VM_ERR_STACK_OVERFLOW);
+    VM_PUSH(insn->arg);
+    ip += insn->size;
+    VM_NEXT();
+
+op_add10:
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    tos = (int64_t)((uint64_t)stack[--sp] + (uint64_t)tos);
+    ip += 1;
+    VM_NEXT();
+
+op_sub10:
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    tos = (int64_t)((uint64_t)stack[--sp] - (uint64_t)tos);
+    ip += 1;
+    VM_NEXT();
+
+op_mul10:
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    tos = (int64_t)((uint64_t)stack[--sp] * (uint64_t)tos);
+    ip += 1;
+    VM_NEXT();
+
+op_div10: {
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    int64_t b = tos;
+    int64_t a = stack[--sp];
+    if (b == 0) {
+        VM_DROP();
+        status = VM_ERR_DIV_BY_ZERO;
+        goto done;
+    }
+    tos = vm_div10(a, b);
+    ip += 1;
+    VM_NEXT();
+}
+
+op_mod10: {
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    int64_t b = tos;
+    int64_t a = stack[--sp];
+    if (b == 0) {
+        VM_DROP();
+        status = VM_ERR_DIV_BY_ZERO;
+        goto done;
+    }
+    tos = vm_mod10(a, b);
+    ip += 1;
+    VM_NEXT();
+}
+
+op_cmp: {
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    int64_t b = tos;
+    int64_t a = stack[--sp];
+    tos = (a > b) - (a < b);
+    ip += 1;
+    VM_NEXT();
+}
+
+op_jz: {
+    VM_CHECK(sp > 0, VM_ERR_STACK_UNDERFLOW);
+    int64_t cond = tos;
+    VM_DROP();
+    if (cond == 0) {
+        VM_CHECK(insn->target != VM_TARGET_INVALID, VM_ERR_INVALID_OPCODE);
+        ip = (uint32_t)insn->target;
+    } else {
+        ip += 3;
+    }
+    VM_NEXT();
+}
+
+op_jnz: {
+    VM_CHECK(sp > 0, VM_ERR_STACK_UNDERFLOW);
+    int64_t cond = tos;
+    VM_DROP();
+    if (cond != 0) {
+        VM_CHECK(insn->target != VM_TARGET_INVALID, VM_ERR_INVALID_OPCODE);
+        ip = (uint32_t)insn->target;
+    } else {
+        ip += 3;
+    }
+    VM_NEXT();
+}
+
+op_call:
+    VM_CHECK(call_sp < VM_CALL_STACK_MAX, VM_ERR_STACK_OVERFLOW);
+    call_stack[call_sp++] = (uint16_t)insn->arg;
+    VM_CHECK(insn->target != VM_TARGET_INVALID, VM_ERR_INVALID_OPCODE);
+    ip = (uint32_t)insn->target;
+    VM_NEXT();
+
+op_ret:
+    if (call_sp == 0) {
+        status = VM_OK;
+        goto done;
+    }
+    ip = call_stack[--call_sp];
+    VM_NEXT();
+
+op_read_fkv:
+op_sum_prefix:
+op_count_prefix: {
+    VM_CHECK(sp > 0, VM_ERR_STACK_UNDERFLOW);
+    int64_t value = 0;
+    if (insn->op == VM_OP_READ_FKV) {
+        status = vm_fkv_read(tos, &value);
+    } else if (insn->op == VM_OP_SUM_PREFIX) {
+        status = vm_fkv_sum_prefix(tos, &value);
+    } else {
+        status = vm_fkv_count_prefix(tos, &value);
+    }
+    if (status != VM_OK) {
+        VM_DROP();
+        goto done;
+    }
+    tos = value;
+    ip += 1;
+    VM_NEXT();
+}
+
+op_write_fkv: {
+    VM_CHECK(sp >= 2, VM_ERR_STACK_UNDERFLOW);
+    int64_t value = tos;
+    int64_t key = stack[--sp];
+    VM_DROP();
+    status = vm_fkv_write(key, value);
+    if (status != VM_OK) {
+        goto done;
+    }
+    ip += 1;
+    VM_NEXT();
+}
+
+op_hash10:
+    VM_CHECK(sp > 0, VM_ERR_STACK_UNDERFLOW);
+    tos = vm_hash10(tos);
+    ip += 1;
+    VM_NEXT();
+
+op_random10:
+    VM_CHECK(sp < max_stack, VM_ERR_STACK_OVERFLOW);
+    VM_PUSH(vm_random10());
+    ip += 1;
+    VM_NEXT();
+
+op_time10:
+    VM_CHECK(sp < max_stack, VM_ERR_STACK_OVERFLOW);
+    VM_PUSH(vm_time10());
+    ip += 1;
+    VM_NEXT();
+
+op_nop:
+    ip += insn->size;
+    VM_NEXT();
+
+    /*
+     * Superinstructions. The table is only ever built from verified
+     * programs, so they check nothing beyond what their parts would.
+     */
+op_push_add10:
+    tos = (int64_t)((uint64_t)tos + (uint64_t)insn->arg);
+    ip += insn->size;
+    VM_NEXT();
+
+op_push_sub10:
+    tos = (int64_t)((uint64_t)tos - (uint64_t)insn->arg);
+    ip += insn->size;
+    VM_NEXT();
+
+op_push_mul10:
+    tos = (int64_t)((uint64_t)tos * (uint64_t)insn->arg);
+    ip += insn->size;
+    VM_NEXT();
+
+op_cmp_jz: {
+    int64_t b = tos;
+    int64_t a = stack[--sp];
+    VM_DROP();
+    ip = (a == b) ? (uint32_t)insn->target : ip + insn->size;
+    VM_NEXT();
+}
+
+op_cmp_jnz: {
+    int64_t b = tos;
+    int64_t a = stack[--sp];
+    VM_DROP();
+    ip = (a != b) ? (uint32_t)insn->target : ip + insn->size;
+    VM_NEXT();
+}
+
+op_halt:
+    status = VM_OK;
+    halted = 1;
+    goto done;
+
+op_invalid:
+    status = VM_ERR_INVALID_OPCODE;
+    goto done;
+
+op_end:
+    status = VM_OK;
+
+#undef VM_DROP
+#undef VM_PUSH
+#undef VM_CHECK
+#undef VM_FAIL_IF
+#undef VM_NEXT
+#undef VM_FETCH
+
+done:
+    out->status = status;
+    out->steps = steps;
+    out->gas_used = gas;
+    out->result = (sp > 0) ? (uint64_t)tos : 0;
+    out->halted = halted;
+    return 0;
+}
+
+#undef VM_UNFUSE_IF_SHORT
+#undef VM_GAS_COST
+#undef VM_STEP_COST
+#undef VM_EXEC_NAME
+#undef VM_EXEC_CHECKED
+#undef VM_EXEC_FUSED
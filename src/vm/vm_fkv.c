@@ -0,0 +1,423 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include "fkv/fkv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * F-KV access from programs. Each top-level run is one transaction:
+ * WRITE_FKV appends to a per-thread buffer and READ_FKV consults that
+ * buffer, then a small cache of committed values, then F-KV itself. When
+ * the run ends with VM_OK the buffer is applied with one fkv_put_batch();
+ * on any other outcome it is dropped. A resumable run keeps its buffer in
+ * its context between slices, so its writes also land only at the end.
+ * Every entry point runs programs inside a transaction; the opcodes fail
+ * outside one rather than reach F-KV unbuffered.
+ *
+ * SUM_PREFIX and COUNT_PREFIX read the trie's per-node aggregates and then
+ * correct them for the run's buffered writes under the prefix.
+ */
+
+#define VM_FKV_DIGITS 20 /* INT64_MAX has 19 */
+#define VM_FKV_READ_CACHE 16
+#define VM_FKV_INLINE_WRITES 16
+/* 10^64 is a multiple of 2^64, so earlier digits cannot change the result. */
+#define VM_FKV_VALUE_DIGITS 64
+
+typedef struct {
+    int64_t key;
+    int64_t value;
+    uint8_t found; /* F-KV had an entry under the key */
+    uint8_t exact; /* ... and it was stored under exactly this key */
+} vm_fkv_read_t;
+
+typedef struct {
+    int64_t value;
+    uint8_t key[VM_FKV_DIGITS];
+    uint8_t digits[VM_FKV_DIGITS];
+    uint8_t key_len;
+    uint8_t value_len;
+} vm_fkv_write_t;
+
+struct vm_fkv_txn {
+    unsigned depth;
+    size_t read_count;
+    size_t read_next;
+    size_t write_count;
+    size_t write_capacity;
+    vm_fkv_write_t *writes;
+    vm_fkv_read_t reads[VM_FKV_READ_CACHE];
+    vm_fkv_write_t inline_writes[VM_FKV_INLINE_WRITES];
+};
+
+/* The thread's own transaction, unless a resumed slice lent it another one. */
+static _Thread_local vm_fkv_txn_t vm_fkv_txn_local;
+static _Thread_local vm_fkv_txn_t *vm_fkv_txn_lent;
+
+static vm_fkv_txn_t *txn_current(void) {
+    return vm_fkv_txn_lent ? vm_fkv_txn_lent : &vm_fkv_txn_local;
+}
+
+static int vm_fkv_force_get_enabled = 0;
+static int vm_fkv_force_get_rc = 0;
+static int vm_fkv_force_put_enabled = 0;
+static int vm_fkv_force_put_rc = 0;
+
+void vm_force_fkv_errors(int get_enabled, int get_rc, int put_enabled, int put_rc) {
+    vm_fkv_force_get_enabled = get_enabled;
+    vm_fkv_force_get_rc = get_rc;
+    vm_fkv_force_put_enabled = put_enabled;
+    vm_fkv_force_put_rc = put_rc;
+    vm_result_cache_clear();
+}
+
+void vm_reset_fkv_errors(void) {
+    vm_force_fkv_errors(0, 0, 0, 0);
+}
+
+static int number_to_digits(int64_t value, uint8_t *digits, size_t *len) {
+    if (!digits || !len || *len == 0) {
+        return -1;
+    }
+
+    if (value < 0) {
+        return -1;
+    }
+
+    size_t capacity = *len;
+    if (value == 0) {
+        if (capacity < 1) {
+            return -1;
+        }
+        digits[0] = 0;
+        *len = 1;
+        return 0;
+    }
+
+    size_t pos = capacity;
+    while (value > 0) {
+        if (pos == 0) {
+            return -1;
+        }
+        digits[--pos] = (uint8_t)(value % 10);
+        value /= 10;
+    }
+
+    size_t count = capacity - pos;
+    memmove(digits, digits + pos, count);
+    *len = count;
+    return 0;
+}
+
+static int64_t digits_to_number(const uint8_t *digits, size_t len) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; ++i) {
+        value = value * 10 + digits[i];
+    }
+    return (int64_t)value;
+}
+
+/* Reads the entry READ_FKV sees in F-KV: 1 found, 0 none, -1 error. */
+static int fkv_lookup(const uint8_t *key, size_t key_len, int64_t *value, int *exact) {
+    if (vm_fkv_force_get_enabled) {
+        return vm_fkv_force_get_rc == 0 ? 0 : -1;
+    }
+    /* Read in place; only the last VM_FKV_VALUE_DIGITS digits matter. */
+    fkv_view_t view;
+    if (fkv_view_prefix(key, key_len, &view, 1) != 0) {
+        return -1;
+    }
+    int rc = view.count > 0;
+    if (rc) {
+        const fkv_entry_t *entry = &view.entries[0];
+        size_t n = entry->value_len < VM_FKV_VALUE_DIGITS ? entry->value_len : VM_FKV_VALUE_DIGITS;
+        *value = digits_to_number(entry->value + (entry->value_len - n), n);
+        *exact = (entry->key_len == key_len);
+    }
+    fkv_view_release(&view);
+    return rc;
+}
+
+static const vm_fkv_read_t *txn_cached_read(vm_fkv_txn_t *txn, int64_t key_value, const uint8_t *key, size_t key_len) {
+    for (size_t i = 0; i < txn->read_count; ++i) {
+        if (txn->reads[i].key == key_value) {
+            return &txn->reads[i];
+        }
+    }
+    int64_t value = 0;
+    int exact = 0;
+    int rc = fkv_lookup(key, key_len, &value, &exact);
+    if (rc < 0) {
+        return NULL;
+    }
+    vm_fkv_read_t *slot = &txn->reads[txn->read_next];
+    txn->read_next = (txn->read_next + 1) % VM_FKV_READ_CACHE;
+    if (txn->read_count < VM_FKV_READ_CACHE) {
+        txn->read_count++;
+    }
+    slot->key = key_value;
+    slot->value = value;
+    slot->found = (uint8_t)(rc == 1);
+    slot->exact = (uint8_t)(rc == 1 && exact);
+    return slot;
+}
+
+/*
+ * Buffered writes get fresh sequence numbers on commit, so they rank above
+ * every committed entry; the latest one under a prefix is what F-KV would
+ * return, unless an entry sits at exactly the key read.
+ */
+static const vm_fkv_write_t *txn_find_write(const vm_fkv_txn_t *txn, const uint8_t *key, size_t key_len, int exact) {
+    for (size_t i = txn->write_count; i-- > 0;) {
+        const vm_fkv_write_t *w = &txn->writes[i];
+        if (exact ? w->key_len == key_len : w->key_len > key_len) {
+            if (memcmp(w->key, key, key_len) == 0) {
+                return w;
+            }
+        }
+    }
+    return NULL;
+}
+
+static vm_status_t txn_read(vm_fkv_txn_t *txn, int64_t key_value, const uint8_t *key, size_t key_len, int64_t *out) {
+    const vm_fkv_write_t *w = txn_find_write(txn, key, key_len, 1);
+    if (w) {
+        *out = w->value;
+        return VM_OK;
+    }
+    const vm_fkv_read_t *r = txn_cached_read(txn, key_value, key, key_len);
+    if (!r) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    if (!r->exact) {
+        w = txn_find_write(txn, key, key_len, 0);
+        if (w && fkv_get_topk_limit() > 0) {
+            *out = w->value;
+            return VM_OK;
+        }
+    }
+    *out = r->found ? r->value : 0;
+    return VM_OK;
+}
+
+static vm_status_t txn_write(vm_fkv_txn_t *txn, const uint8_t *key, size_t key_len, const uint8_t *digits, size_t value_len, int64_t value) {
+    /* A rewritten key moves to the end so commit order matches run order. */
+    for (size_t i = 0; i < txn->write_count; ++i) {
+        vm_fkv_write_t *w = &txn->writes[i];
+        if (w->key_len == key_len && memcmp(w->key, key, key_len) == 0) {
+            memmove(w, w + 1, (txn->write_count - i - 1) * sizeof(*w));
+            txn->write_count--;
+            break;
+        }
+    }
+    if (txn->write_count == txn->write_capacity) {
+        size_t capacity = txn->write_capacity * 2;
+        vm_fkv_write_t *writes = txn->writes == txn->inline_writes ? NULL : txn->writes;
+        writes = realloc(writes, capacity * sizeof(*writes));
+        if (!writes) {
+            return VM_ERR_INVALID_OPCODE;
+        }
+        if (txn->writes == txn->inline_writes) {
+            memcpy(writes, txn->inline_writes, sizeof(txn->inline_writes));
+        }
+        txn->writes = writes;
+        txn->write_capacity = capacity;
+    }
+    vm_fkv_write_t *w = &txn->writes[txn->write_count++];
+    memcpy(w->key, key, key_len);
+    memcpy(w->digits, digits, value_len);
+    w->key_len = (uint8_t)key_len;
+    w->value_len = (uint8_t)value_len;
+    w->value = value;
+    return VM_OK;
+}
+
+static int txn_commit(vm_fkv_txn_t *txn) {
+    if (txn->write_count == 0) {
+        return 0;
+    }
+    if (vm_fkv_force_put_enabled) {
+        return vm_fkv_force_put_rc;
+    }
+    fkv_entry_t inline_entries[VM_FKV_INLINE_WRITES];
+    fkv_entry_t *entries = inline_entries;
+    if (txn->write_count > VM_FKV_INLINE_WRITES) {
+        entries = malloc(txn->write_count * sizeof(*entries));
+        if (!entries) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < txn->write_count; ++i) {
+        const vm_fkv_write_t *w = &txn->writes[i];
+        entries[i] = (fkv_entry_t){w->key, w->key_len, w->digits, w->value_len, FKV_ENTRY_TYPE_VALUE, 0};
+    }
+    int rc = fkv_put_batch(entries, txn->write_count);
+    if (entries != inline_entries) {
+        free(entries);
+    }
+    return rc;
+}
+
+static void txn_reset(vm_fkv_txn_t *txn) {
+    if (txn->writes != txn->inline_writes) {
+        free(txn->writes);
+    }
+    txn->read_count = 0;
+    txn->read_next = 0;
+    txn->write_count = 0;
+    txn->writes = txn->inline_writes;
+    txn->write_capacity = VM_FKV_INLINE_WRITES;
+}
+
+static void txn_finish(vm_fkv_txn_t *txn, int rc, vm_result_t *out) {
+    if (rc == 0 && out && out->status == VM_OK && txn_commit(txn) != 0) {
+        out->status = VM_ERR_INVALID_OPCODE;
+    }
+    txn_reset(txn);
+}
+
+void vm_fkv_txn_begin(void) {
+    vm_fkv_txn_t *txn = txn_current();
+    if (txn->depth++ > 0) {
+        return;
+    }
+    txn_reset(txn);
+}
+
+void vm_fkv_txn_end(int rc, vm_result_t *out) {
+    vm_fkv_txn_t *txn = txn_current();
+    if (txn->depth == 0 || --txn->depth > 0) {
+        return;
+    }
+    txn_finish(txn, rc, out);
+}
+
+vm_fkv_txn_t *vm_fkv_txn_create(void) {
+    vm_fkv_txn_t *txn = malloc(sizeof(*txn));
+    if (txn) {
+        txn->depth = 0;
+        txn->writes = txn->inline_writes;
+        txn_reset(txn);
+    }
+    return txn;
+}
+
+void vm_fkv_txn_resume(vm_fkv_txn_t *txn) {
+    /* Committed values may have changed since the last slice. */
+    txn->read_count = 0;
+    txn->read_next = 0;
+    txn->depth = 1;
+    vm_fkv_txn_lent = txn;
+}
+
+void vm_fkv_txn_suspend(vm_fkv_txn_t *txn, int rc, vm_result_t *out) {
+    vm_fkv_txn_lent = NULL;
+    txn->depth = 0;
+    if (rc != 0 || !out || out->status != VM_YIELD) {
+        txn_finish(txn, rc, out);
+    }
+}
+
+void vm_fkv_txn_discard(vm_fkv_txn_t *txn) {
+    if (txn) {
+        txn_reset(txn);
+    }
+}
+
+void vm_fkv_txn_destroy(vm_fkv_txn_t *txn) {
+    if (txn) {
+        txn_reset(txn);
+        free(txn);
+    }
+}
+
+vm_status_t vm_fkv_read(int64_t key_value, int64_t *out_value) {
+    uint8_t key_digits[VM_FKV_DIGITS];
+    size_t key_len = sizeof(key_digits);
+    if (number_to_digits(key_value, key_digits, &key_len) != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    vm_fkv_txn_t *txn = txn_current();
+    if (txn->depth == 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    return txn_read(txn, key_value, key_digits, key_len, out_value);
+}
+
+vm_status_t vm_fkv_write(int64_t key_value, int64_t value_value) {
+    uint8_t key_digits[VM_FKV_DIGITS];
+    size_t key_len = sizeof(key_digits);
+    if (number_to_digits(key_value, key_digits, &key_len) != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    uint8_t value_digits[VM_FKV_DIGITS];
+    size_t value_len = sizeof(value_digits);
+    if (number_to_digits(value_value, value_digits, &value_len) != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    if (vm_fkv_force_put_enabled && vm_fkv_force_put_rc != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    vm_fkv_txn_t *txn = txn_current();
+    if (txn->depth == 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    return txn_write(txn, key_digits, key_len, value_digits, value_len, value_value);
+}
+
+/* Aggregates under the prefix key_value as the run sees them. */
+static vm_status_t vm_fkv_aggregate(int64_t key_value, fkv_aggregate_t *agg) {
+    uint8_t key_digits[VM_FKV_DIGITS];
+    size_t key_len = sizeof(key_digits);
+    if (number_to_digits(key_value, key_digits, &key_len) != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    const vm_fkv_txn_t *txn = txn_current();
+    if (txn->depth == 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    agg->count = 0;
+    agg->sum = 0;
+    if (vm_fkv_force_get_enabled) {
+        if (vm_fkv_force_get_rc != 0) {
+            return VM_ERR_INVALID_OPCODE;
+        }
+    } else if (fkv_aggregate_prefix(key_digits, key_len, agg, NULL) != 0) {
+        return VM_ERR_INVALID_OPCODE;
+    }
+    /* Each buffered key appears once; it replaces whatever is committed under it. */
+    for (size_t i = 0; i < txn->write_count; ++i) {
+        const vm_fkv_write_t *w = &txn->writes[i];
+        if (w->key_len < key_len || memcmp(w->key, key_digits, key_len) != 0) {
+            continue;
+        }
+        fkv_aggregate_t committed = {0, 0};
+        if (!vm_fkv_force_get_enabled && fkv_aggregate_prefix(w->key, w->key_len, NULL, &committed) != 0) {
+            return VM_ERR_INVALID_OPCODE;
+        }
+        agg->count += 1 - committed.count;
+        agg->sum += (uint64_t)w->value - committed.sum;
+    }
+    return VM_OK;
+}
+
+vm_status_t vm_fkv_sum_prefix(int64_t key_value, int64_t *out_value) {
+    fkv_aggregate_t agg;
+    vm_status_t status = vm_fkv_aggregate(key_value, &agg);
+    if (status == VM_OK) {
+        *out_value = (int64_t)agg.sum;
+    }
+    return status;
+}
+
+vm_status_t vm_fkv_count_prefix(int64_t key_value, int64_t *out_value) {
+    fkv_aggregate_t agg;
+    vm_status_t status = vm_fkv_aggregate(key_value, &agg);
+    if (status == VM_OK) {
+        *out_value = (int64_t)agg.count;
+    }
+    return status;
+}
@@ -0,0 +1,273 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#ifndef KOLIBRI_VM_VM_INTERNAL_H
+#define KOLIBRI_VM_VM_INTERNAL_H
+
+/*
+ * Declarations shared between the reference interpreter (vm.c) and the
+ * alternative Δ-VM engines. Not part of the public API.
+ */
+
+#include "vm/vm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#endif
+
+#define VM_CALL_STACK_MAX 32
+
+/*
+ * Internal opcodes of the decoded instruction stream, one X(NAME, label)
+ * per opcode: NAME gives VM_OP_NAME, label the op_<label> handler of
+ * vm_exec_template.h, whose dispatch table and switch are generated from
+ * this list. Opcodes sharing a handler repeat its label.
+ */
+#define VM_OP_LIST(X)                                                               \
+    X(INVALID, invalid)                                                             \
+    X(PUSHD, pushd)                                                                 \
+    X(ADD10, add10)                                                                 \
+    X(SUB10, sub10)                                                                 \
+    X(MUL10, mul10)                                                                 \
+    X(DIV10, div10)                                                                 \
+    X(MOD10, mod10)                                                                 \
+    X(CMP, cmp)                                                                     \
+    X(JZ, jz)                                                                       \
+    X(JNZ, jnz)                                                                     \
+    X(CALL, call)                                                                   \
+    X(RET, ret)                                                                     \
+    X(READ_FKV, read_fkv)                                                           \
+    X(WRITE_FKV, write_fkv)                                                         \
+    X(HASH10, hash10)                                                               \
+    X(RANDOM10, random10)                                                           \
+    X(TIME10, time10)                                                               \
+    X(NOP, nop)                                                                     \
+    X(HALT, halt)                                                                   \
+    X(SUM_PREFIX, sum_prefix)                                                       \
+    X(COUNT_PREFIX, count_prefix)                                                   \
+    X(TRUNC, invalid) /* operand cut off by the end of the program */               \
+    X(END, end)       /* ip == len: regular termination */                          \
+    /* Superinstructions, only produced by vm_optimize(). */                        \
+    X(PUSH_ADD10, push_add10)                                                       \
+    X(PUSH_SUB10, push_sub10)                                                       \
+    X(PUSH_MUL10, push_mul10)                                                       \
+    X(CMP_JZ, cmp_jz)                                                               \
+    X(CMP_JNZ, cmp_jnz)
+
+#define VM_OP_ENUM(name, label) VM_OP_##name,
+typedef enum { VM_OP_LIST(VM_OP_ENUM) VM_OP_COUNT } vm_op_t;
+#undef VM_OP_ENUM
+
+#define VM_TARGET_INVALID INT32_MIN
+
+/*
+ * A decoded instruction. Decoded tables are indexed by byte offset, so a
+ * jump into the middle of an instruction behaves exactly as it does in the
+ * reference interpreter.
+ */
+typedef struct {
+    uint8_t op;     /* vm_op_t */
+    uint8_t code;   /* raw opcode byte, reported in traces */
+    uint8_t size;   /* instruction length in bytes */
+    uint8_t weight; /* original instructions this entry stands for */
+    int32_t target; /* JZ/JNZ/CALL destination or VM_TARGET_INVALID */
+    int64_t arg;    /* immediate operand */
+} vm_insn_t;
+
+uint32_t vm_effective_max_steps(const vm_limits_t *lim);
+/* The gas schedule indexed by opcode byte, or NULL while every opcode costs 1. */
+const uint32_t *vm_gas_table(void);
+uint32_t vm_effective_max_stack(const vm_limits_t *lim);
+vm_engine_t vm_resolve_engine(const vm_limits_t *lim);
+
+/* Trace hooks (vm_trace.c): engines call begin once per run, then record per step. */
+void vm_trace_begin(vm_trace_t *trace);
+void vm_trace_record(vm_trace_t *trace,
+                     uint32_t step,
+                     uint32_t ip,
+                     uint8_t opcode,
+                     int64_t stack_top,
+                     uint32_t gas_left);
+
+/*
+ * F-KV bridges and the non-pure opcodes shared by every engine. The F-KV
+ * ones work on the calling thread's transaction and fail outside one.
+ */
+vm_status_t vm_fkv_read(int64_t key_value, int64_t *out_value);
+vm_status_t vm_fkv_write(int64_t key_value, int64_t value_value);
+/* SUM_PREFIX / COUNT_PREFIX: aggregates of the value entries under a key prefix. */
+vm_status_t vm_fkv_sum_prefix(int64_t key_value, int64_t *out_value);
+vm_status_t vm_fkv_count_prefix(int64_t key_value, int64_t *out_value);
+
+/*
+ * F-KV transaction around one run (vm_fkv.c). Calls nest; the outermost end
+ * commits buffered writes when rc is 0 and out->status is VM_OK, and turns a
+ * failed commit into VM_ERR_INVALID_OPCODE.
+ */
+void vm_fkv_txn_begin(void);
+void vm_fkv_txn_end(int rc, vm_result_t *out);
+
+/*
+ * Transaction of a resumable run, owned by its context. vm_fkv_txn_resume
+ * makes it the calling thread's transaction for one slice, and
+ * vm_fkv_txn_suspend ends the slice: on VM_YIELD the buffer is kept for the
+ * next one, otherwise it is committed or dropped as by vm_fkv_txn_end.
+ * vm_fkv_txn_discard drops the buffer of an abandoned run.
+ */
+typedef struct vm_fkv_txn vm_fkv_txn_t;
+
+vm_fkv_txn_t *vm_fkv_txn_create(void);
+void vm_fkv_txn_resume(vm_fkv_txn_t *txn);
+void vm_fkv_txn_suspend(vm_fkv_txn_t *txn, int rc, vm_result_t *out);
+void vm_fkv_txn_discard(vm_fkv_txn_t *txn);
+void vm_fkv_txn_destroy(vm_fkv_txn_t *txn);
+int64_t vm_hash10(int64_t value);
+int64_t vm_random10(void);
+
+/*
+ * RANDOM10 state (vm.c). Entry points call vm_rng_begin() before each run;
+ * the run's state is then vm_rng_seed(vm_rng_program_hash(p), request_id)
+ * and advances per draw on the calling thread only. vm_rng_get/set move a
+ * run's state in and out, e.g. across resumed slices.
+ */
+uint64_t vm_rng_program_hash(const prog_t *p);
+uint32_t vm_rng_seed(uint64_t program_hash, uint64_t request_id);
+void vm_rng_begin(const prog_t *p, uint64_t request_id);
+uint32_t vm_rng_get(void);
+void vm_rng_set(uint32_t state);
+int64_t vm_rng_next(uint32_t *state);
+int64_t vm_time10(void);
+
+/*
+ * PUSHN (0x13) carries its literal as unsigned LEB128 of the two's-complement
+ * value: 7 bits per byte, low group first, high bit set on all but the last
+ * byte. Returns the operand length, 0 when it runs past len, or -1 when it
+ * does not fit 64 bits.
+ */
+#define VM_PUSHN_MAX_OPERAND 10
+int vm_read_pushn(const uint8_t *code, size_t len, size_t at, int64_t *value);
+
+/* Decodes p into a table of p->len + 1 entries. */
+void vm_decode(const prog_t *p, vm_insn_t *insns);
+/*
+ * Marks in reach (len + 1 bytes, zeroed by the caller) every entry that
+ * control flow can reach from ip 0, following both arms of branches and
+ * treating the instruction after a CALL as reachable. Returns -1 when out
+ * of memory.
+ */
+int vm_mark_reachable(const vm_insn_t *insns, size_t len, uint8_t *reach);
+
+/*
+ * Result cache hooks (vm_cache.c) around an untraced run: vm_cache_lookup
+ * returns 1 with *out filled on a hit; otherwise it fills key, and the
+ * caller hands the result of its run to vm_cache_store.
+ */
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t generation;
+    uint8_t kind;
+} vm_cache_key_t;
+
+int vm_cache_lookup(const prog_t *p, const vm_limits_t *lim, vm_cache_key_t *key, vm_result_t *out);
+void vm_cache_store(const vm_cache_key_t *key, const vm_result_t *result);
+
+/*
+ * Profiler hooks (vm_profile.c). vm_profile_thread returns the calling
+ * thread's counters while profiling is enabled and NULL otherwise. Only
+ * vm_exec_switch records into them; the entry points send every run there
+ * while vm_profile_enabled().
+ */
+typedef struct vm_profile_thread vm_profile_thread_t;
+
+vm_profile_thread_t *vm_profile_thread(void);
+void vm_profile_record(vm_profile_thread_t *prof, uint32_t ip, uint8_t opcode, uint64_t cycles);
+void vm_profile_finish_run(vm_profile_thread_t *prof);
+
+static inline uint64_t vm_profile_clock(void) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * DIV10 and MOD10 for a nonzero divisor. INT64_MIN / -1 wraps to INT64_MIN
+ * (remainder 0), as ADD10, SUB10 and MUL10 wrap, where a plain a / b traps.
+ */
+static inline int64_t vm_div10(int64_t a, int64_t b) {
+    return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;
+}
+
+static inline int64_t vm_mod10(int64_t a, int64_t b) {
+    return b == -1 ? 0 : a % b;
+}
+
+/*
+ * Engine cores. They run on caller-provided buffers and never allocate:
+ * stack holds max_stack values, insns holds p->len + 1 entries.
+ */
+int vm_exec_switch(const prog_t *p,
+                   uint32_t max_steps,
+                   uint32_t max_stack,
+                   int64_t *stack,
+                   vm_trace_t *trace,
+                   vm_result_t *out);
+
+/* Registers of a suspended vm_exec_switch run; zeroed, it is a fresh start. */
+typedef struct {
+    uint32_t ip;
+    uint32_t steps;
+    uint32_t gas;
+    size_t sp;
+    size_t call_sp;
+    uint16_t call_stack[VM_CALL_STACK_MAX];
+} vm_exec_state_t;
+
+/*
+ * vm_exec_switch from and back into *state, stopping with VM_YIELD once the
+ * next step would take gas past pause_at (pause_at < max_steps).
+ */
+int vm_exec_switch_resume(const prog_t *p,
+                          uint32_t max_steps,
+                          uint32_t pause_at,
+                          uint32_t max_stack,
+                          int64_t *stack,
+                          vm_exec_state_t *state,
+                          vm_trace_t *trace,
+                          vm_result_t *out);
+int vm_exec_threaded(const prog_t *p,
+                     uint32_t max_steps,
+                     uint32_t max_stack,
+                     int64_t *stack,
+                     vm_insn_t *insns,
+                     vm_trace_t *trace,
+                     vm_result_t *out);
+
+int vm_run_threaded(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out);
+int vm_run_jit(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out);
+int vm_run_register(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out);
+
+/*
+ * Runs a table accepted by vm_verify() without stack, operand or jump
+ * checks. stack must hold at least the verified maximum depth.
+ */
+int vm_exec_verified(const vm_insn_t *insns,
+                     uint32_t max_steps,
+                     int64_t *stack,
+                     vm_trace_t *trace,
+                     vm_result_t *out);
+/* Runs a vm_optimize() table; base is the verified table it was built from. */
+int vm_exec_fused(const vm_insn_t *fused,
+                  const vm_insn_t *base,
+                  uint32_t max_steps,
+                  int64_t *stack,
+                  vm_result_t *out);
+
+#endif
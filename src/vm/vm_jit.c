@@ -0,0 +1,596 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#define _DEFAULT_SOURCE
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define VM_JIT_X86_64 1
+#include <sys/mman.h>
+#else
+#define VM_JIT_X86_64 0
+#endif
+
+/*
+ * Tiering JIT. Programs are counted by content hash in a small
+ * direct-mapped cache; once a program has been seen jit_threshold times it
+ * is verified (vm_verify) and translated to x86-64. Verification is what
+ * lets the native code drop stack, operand and jump checks: what remains
+ * is the per-instruction gas check, division by zero and F-KV status, i.e.
+ * the same set the unchecked threaded executor keeps.
+ *
+ * Register assignment inside generated code:
+ *   rbx  operand stack base       r12  stack depth (sp)
+ *   r13d steps executed           r14d max_steps
+ *   rbp  VM call depth            r15  rsp at entry, restored on every exit
+ *
+ * VM CALL/RET map to native call/ret, so a VM return address is the native
+ * address right after the call. Helpers (F-KV, HASH10, RANDOM10, TIME10) are
+ * plain C functions called with a realigned stack.
+ *
+ * Anything that cannot be compiled (unverifiable program, tracing, other
+ * platforms) runs on the threaded interpreter.
+ */
+
+#define VM_JIT_CACHE_SLOTS 256
+#define VM_JIT_DEFAULT_THRESHOLD 8
+#define VM_JIT_INLINE_STACK 128
+
+typedef struct {
+    uint64_t sp;
+    uint32_t steps;
+    int32_t status;
+    uint8_t halted;
+} vm_jit_exit_t;
+
+typedef void (*vm_jit_fn)(int64_t *stack, uint32_t max_steps, vm_jit_exit_t *out);
+
+enum { JIT_ENTRY_EMPTY = 0, JIT_ENTRY_COUNTING, JIT_ENTRY_COMPILED, JIT_ENTRY_REJECTED };
+
+typedef struct {
+    int state;
+    uint64_t hash;
+    uint8_t *code; /* private copy used to confirm hash hits */
+    size_t len;
+    uint32_t hits;
+    uint32_t refs; /* runs currently executing fn */
+    uint32_t max_depth;
+    void *mem;
+    size_t mem_size;
+    vm_jit_fn fn;
+} vm_jit_entry_t;
+
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static vm_jit_entry_t jit_cache[VM_JIT_CACHE_SLOTS];
+static uint32_t jit_threshold = VM_JIT_DEFAULT_THRESHOLD;
+
+static uint64_t jit_hash(const prog_t *p) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < p->len; ++i) {
+        h ^= p->code[i];
+        h *= 1099511628211ull;
+    }
+    return h ^ (uint64_t)p->len;
+}
+
+#if VM_JIT_X86_64
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} jit_buf_t;
+
+typedef struct {
+    size_t at;      /* offset of the rel32 field */
+    uint32_t target; /* VM ip */
+} jit_patch_t;
+
+static void emit(jit_buf_t *b, const uint8_t *bytes, size_t n) {
+    if (b->len + n <= b->cap) {
+        memcpy(b->buf + b->len, bytes, n);
+    }
+    b->len += n;
+}
+
+#define EMIT(b, ...)                                                                \
+    do {                                                                            \
+        static const uint8_t bytes_[] = {__VA_ARGS__};                              \
+        emit((b), bytes_, sizeof(bytes_));                                          \
+    } while (0)
+
+static void emit_u8(jit_buf_t *b, uint8_t v) {
+    emit(b, &v, 1);
+}
+
+static void emit_u32(jit_buf_t *b, uint32_t v) {
+    uint8_t bytes[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+    emit(b, bytes, 4);
+}
+
+static void emit_u64(jit_buf_t *b, uint64_t v) {
+    emit_u32(b, (uint32_t)v);
+    emit_u32(b, (uint32_t)(v >> 32));
+}
+
+static void patch_rel32(jit_buf_t *b, size_t at, size_t dest) {
+    int32_t rel = (int32_t)((int64_t)dest - (int64_t)(at + 4));
+    if (at + 4 <= b->cap) {
+        memcpy(b->buf + at, &rel, 4);
+    }
+}
+
+/* <prefix> op [rbx + r12*8 + disp8], with reg in ModRM.reg. */
+static void emit_stack_mem(jit_buf_t *b, const uint8_t *op, size_t op_len, uint8_t reg, int8_t disp) {
+    emit_u8(b, (uint8_t)(0x4A | ((reg & 8) ? 0x04 : 0x00))); /* REX.W + REX.X (+ REX.R) */
+    emit(b, op, op_len);
+    emit_u8(b, (uint8_t)((disp ? 0x40 : 0x00) | ((reg & 7) << 3) | 0x04));
+    emit_u8(b, 0xE3); /* SIB: scale 8, index r12, base rbx */
+    if (disp) {
+        emit_u8(b, (uint8_t)disp);
+    }
+}
+
+enum { R_RAX = 0, R_RCX = 1, R_RDX = 2, R_RSI = 6, R_RDI = 7 };
+
+static void load_slot(jit_buf_t *b, uint8_t reg, int8_t disp) {
+    static const uint8_t op[] = {0x8B};
+    emit_stack_mem(b, op, 1, reg, disp);
+}
+
+static void store_slot(jit_buf_t *b, uint8_t reg, int8_t disp) {
+    static const uint8_t op[] = {0x89};
+    emit_stack_mem(b, op, 1, reg, disp);
+}
+
+static void emit_helper_call(jit_buf_t *b, const void *fn) {
+    EMIT(b, 0x48, 0x89, 0xE0);             /* mov rax, rsp */
+    EMIT(b, 0x48, 0x83, 0xE4, 0xF0);       /* and rsp, -16 */
+    EMIT(b, 0x48, 0x83, 0xEC, 0x10);       /* sub rsp, 16 */
+    EMIT(b, 0x48, 0x89, 0x04, 0x24);       /* mov [rsp], rax */
+    EMIT(b, 0x48, 0xB8);                   /* mov rax, imm64 */
+    emit_u64(b, (uint64_t)(uintptr_t)fn);
+    EMIT(b, 0xFF, 0xD0);                   /* call rax */
+    EMIT(b, 0x48, 0x8B, 0x24, 0x24);       /* mov rsp, [rsp] */
+}
+
+static size_t emit_jcc(jit_buf_t *b, uint8_t cc) {
+    emit_u8(b, 0x0F);
+    emit_u8(b, cc);
+    size_t at = b->len;
+    emit_u32(b, 0);
+    return at;
+}
+
+static size_t emit_jmp(jit_buf_t *b) {
+    emit_u8(b, 0xE9);
+    size_t at = b->len;
+    emit_u32(b, 0);
+    return at;
+}
+
+/* Emits code for a verified program into b. Returns 0 on success. */
+static int jit_emit_program(const vm_insn_t *insns, size_t len, jit_buf_t *b) {
+    uint8_t *reach = calloc(len + 1, 1);
+    size_t *native = calloc(len + 1, sizeof(*native));
+    jit_patch_t *patches = malloc((2 * len + 2) * sizeof(*patches));
+    size_t patch_count = 0;
+    if (!reach || !native || !patches) {
+        free(reach);
+        free(native);
+        free(patches);
+        return -1;
+    }
+    if (vm_mark_reachable(insns, len, reach) != 0) {
+        memset(reach, 1, len + 1);
+    }
+
+    /* Prologue. */
+    EMIT(b, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); /* push rbx..r15 */
+    EMIT(b, 0x52);                   /* push rdx (exit record) */
+    EMIT(b, 0x49, 0x89, 0xE7);       /* mov r15, rsp */
+    EMIT(b, 0x48, 0x89, 0xFB);       /* mov rbx, rdi */
+    EMIT(b, 0x41, 0x89, 0xF6);       /* mov r14d, esi */
+    EMIT(b, 0x45, 0x31, 0xE4);       /* xor r12d, r12d */
+    EMIT(b, 0x45, 0x31, 0xED);       /* xor r13d, r13d */
+    EMIT(b, 0x31, 0xED);             /* xor ebp, ebp */
+    patches[patch_count].at = emit_jmp(b);
+    patches[patch_count++].target = 0;
+
+    /* Exit stubs: eax = status, ecx = halted. */
+    size_t exit_gas = b->len;
+    EMIT(b, 0xB8);
+    emit_u32(b, (uint32_t)VM_ERR_GAS_EXHAUSTED);
+    size_t jmp_gas = emit_jmp(b);
+    size_t exit_div = b->len; /* falls into exit_status */
+    EMIT(b, 0xB8);
+    emit_u32(b, (uint32_t)VM_ERR_DIV_BY_ZERO);
+    size_t exit_status = b->len;
+    EMIT(b, 0x31, 0xC9);             /* xor ecx, ecx */
+    size_t jmp_status = emit_jmp(b);
+    size_t exit_ok = b->len;
+    EMIT(b, 0x31, 0xC0, 0x31, 0xC9); /* xor eax, eax; xor ecx, ecx */
+    size_t jmp_ok = emit_jmp(b);
+    size_t exit_halt = b->len;
+    EMIT(b, 0x31, 0xC0);             /* xor eax, eax */
+    EMIT(b, 0xB9, 0x01, 0x00, 0x00, 0x00); /* mov ecx, 1 */
+    size_t epilogue = b->len;
+    EMIT(b, 0x4C, 0x89, 0xFC);       /* mov rsp, r15 */
+    EMIT(b, 0x5A);                   /* pop rdx */
+    EMIT(b, 0x4C, 0x89, 0x22);       /* mov [rdx], r12 */
+    EMIT(b, 0x44, 0x89, 0x6A, 0x08); /* mov [rdx+8], r13d */
+    EMIT(b, 0x89, 0x42, 0x0C);       /* mov [rdx+12], eax */
+    EMIT(b, 0x88, 0x4A, 0x10);       /* mov [rdx+16], cl */
+    EMIT(b, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B); /* pop r15..rbx */
+    EMIT(b, 0xC3);
+    patch_rel32(b, jmp_gas, exit_status);
+    patch_rel32(b, jmp_status, epilogue);
+    patch_rel32(b, jmp_ok, epilogue);
+
+    for (uint32_t ip = 0; ip <= len; ++ip) {
+        if (!reach[ip]) {
+            continue;
+        }
+        native[ip] = b->len;
+        const vm_insn_t *insn = &insns[ip];
+        if (insn->op == VM_OP_END) {
+            patch_rel32(b, emit_jmp(b), exit_ok);
+            continue;
+        }
+
+        /* Gas: steps >= max_steps -> exhausted, else count the step. */
+        EMIT(b, 0x45, 0x39, 0xF5);   /* cmp r13d, r14d */
+        patch_rel32(b, emit_jcc(b, 0x83), exit_gas); /* jae */
+        EMIT(b, 0x41, 0xFF, 0xC5);   /* inc r13d */
+
+        int falls_through = 1;
+        switch ((vm_op_t)insn->op) {
+        case VM_OP_PUSHD:
+            if (insn->arg >= INT32_MIN && insn->arg <= INT32_MAX) {
+                static const uint8_t op[] = {0xC7};
+                emit_stack_mem(b, op, 1, 0, 0); /* mov qword [top], imm32 */
+                emit_u32(b, (uint32_t)insn->arg);
+            } else {
+                EMIT(b, 0x48, 0xB8);           /* mov rax, imm64 */
+                emit_u64(b, (uint64_t)insn->arg);
+                store_slot(b, R_RAX, 0);
+            }
+            EMIT(b, 0x49, 0xFF, 0xC4); /* inc r12 */
+            break;
+        case VM_OP_ADD10:
+        case VM_OP_SUB10: {
+            static const uint8_t add_op[] = {0x01};
+            static const uint8_t sub_op[] = {0x29};
+            load_slot(b, R_RAX, -8);
+            emit_stack_mem(b, insn->op == VM_OP_ADD10 ? add_op : sub_op, 1, R_RAX, -16);
+            EMIT(b, 0x49, 0xFF, 0xCC); /* dec r12 */
+            break;
+        }
+        case VM_OP_MUL10: {
+            static const uint8_t imul_op[] = {0x0F, 0xAF};
+            load_slot(b, R_RAX, -16);
+            emit_stack_mem(b, imul_op, 2, R_RAX, -8);
+            store_slot(b, R_RAX, -16);
+            EMIT(b, 0x49, 0xFF, 0xCC); /* dec r12 */
+            break;
+        }
+        case VM_OP_DIV10:
+        case VM_OP_MOD10:
+            load_slot(b, R_RCX, -8);
+            load_slot(b, R_RAX, -16);
+            EMIT(b, 0x49, 0x83, 0xEC, 0x02); /* sub r12, 2 */
+            EMIT(b, 0x48, 0x85, 0xC9);       /* test rcx, rcx */
+            patch_rel32(b, emit_jcc(b, 0x84), exit_div);
+            /* idiv traps on INT64_MIN / -1; a -1 divisor gives -a (wrapping) and 0 instead. */
+            EMIT(b, 0x48, 0x83, 0xF9, 0xFF); /* cmp rcx, -1 */
+            EMIT(b, 0x75, 0x07);             /* jne idiv */
+            EMIT(b, 0x48, 0xF7, 0xD8);       /* neg rax */
+            EMIT(b, 0x31, 0xD2);             /* xor edx, edx */
+            EMIT(b, 0xEB, 0x05);             /* jmp store */
+            EMIT(b, 0x48, 0x99);             /* idiv: cqo */
+            EMIT(b, 0x48, 0xF7, 0xF9);       /* idiv rcx */
+            store_slot(b, insn->op == VM_OP_DIV10 ? R_RAX : R_RDX, 0);
+            EMIT(b, 0x49, 0xFF, 0xC4);       /* inc r12 */
+            break;
+        case VM_OP_CMP: {
+            static const uint8_t cmp_op[] = {0x3B};
+            load_slot(b, R_RAX, -16);
+            emit_stack_mem(b, cmp_op, 1, R_RAX, -8);
+            EMIT(b, 0x0F, 0x9F, 0xC1);       /* setg cl */
+            EMIT(b, 0x0F, 0x9C, 0xC2);       /* setl dl */
+            EMIT(b, 0x0F, 0xB6, 0xC9);       /* movzx ecx, cl */
+            EMIT(b, 0x0F, 0xB6, 0xD2);       /* movzx edx, dl */
+            EMIT(b, 0x29, 0xD1);             /* sub ecx, edx */
+            EMIT(b, 0x48, 0x63, 0xC9);       /* movsxd rcx, ecx */
+            store_slot(b, R_RCX, -16);
+            EMIT(b, 0x49, 0xFF, 0xCC);       /* dec r12 */
+            break;
+        }
+        case VM_OP_JZ:
+        case VM_OP_JNZ: {
+            static const uint8_t cmp_imm[] = {0x83};
+            EMIT(b, 0x49, 0xFF, 0xCC);       /* dec r12 */
+            emit_stack_mem(b, cmp_imm, 1, 7, 0); /* cmp qword [top], imm8 */
+            emit_u8(b, 0);
+            patches[patch_count].at = emit_jcc(b, insn->op == VM_OP_JZ ? 0x84 : 0x85);
+            patches[patch_count++].target = (uint32_t)insn->target;
+            break;
+        }
+        case VM_OP_CALL:
+            EMIT(b, 0x48, 0xFF, 0xC5);       /* inc rbp */
+            emit_u8(b, 0xE8);                /* call rel32 */
+            patches[patch_count].at = b->len;
+            patches[patch_count++].target = (uint32_t)insn->target;
+            emit_u32(b, 0);
+            break;
+        case VM_OP_RET:
+            EMIT(b, 0x48, 0x85, 0xED);       /* test rbp, rbp */
+            patch_rel32(b, emit_jcc(b, 0x84), exit_ok);
+            EMIT(b, 0x48, 0xFF, 0xCD);       /* dec rbp */
+            EMIT(b, 0xC3);                   /* ret */
+            falls_through = 0;
+            break;
+        case VM_OP_READ_FKV:
+        case VM_OP_SUM_PREFIX:
+        case VM_OP_COUNT_PREFIX: {
+            static const uint8_t lea_op[] = {0x8D};
+            const void *helper = (const void *)vm_fkv_read;
+            if (insn->op == VM_OP_SUM_PREFIX) {
+                helper = (const void *)vm_fkv_sum_prefix;
+            } else if (insn->op == VM_OP_COUNT_PREFIX) {
+                helper = (const void *)vm_fkv_count_prefix;
+            }
+            EMIT(b, 0x49, 0xFF, 0xCC);       /* dec r12 */
+            load_slot(b, R_RDI, 0);
+            emit_stack_mem(b, lea_op, 1, R_RSI, 0);
+            emit_helper_call(b, helper);
+            EMIT(b, 0x85, 0xC0);             /* test eax, eax */
+            patch_rel32(b, emit_jcc(b, 0x85), exit_status);
+            EMIT(b, 0x49, 0xFF, 0xC4);       /* inc r12 */
+            break;
+        }
+        case VM_OP_WRITE_FKV:
+            EMIT(b, 0x49, 0x83, 0xEC, 0x02); /* sub r12, 2 */
+            load_slot(b, R_RDI, 0);
+            load_slot(b, R_RSI, 8);
+            emit_helper_call(b, (const void *)vm_fkv_write);
+            EMIT(b, 0x85, 0xC0);             /* test eax, eax */
+            patch_rel32(b, emit_jcc(b, 0x85), exit_status);
+            break;
+        case VM_OP_HASH10:
+            load_slot(b, R_RDI, -8);
+            emit_helper_call(b, (const void *)vm_hash10);
+            store_slot(b, R_RAX, -8);
+            break;
+        case VM_OP_RANDOM10:
+        case VM_OP_TIME10:
+            emit_helper_call(b, insn->op == VM_OP_RANDOM10 ? (const void *)vm_random10 : (const void *)vm_time10);
+            store_slot(b, R_RAX, 0);
+            EMIT(b, 0x49, 0xFF, 0xC4);       /* inc r12 */
+            break;
+        case VM_OP_NOP:
+            break;
+        case VM_OP_HALT:
+            patch_rel32(b, emit_jmp(b), exit_halt);
+            falls_through = 0;
+            break;
+        case VM_OP_INVALID:
+        case VM_OP_TRUNC:
+        case VM_OP_END:
+        case VM_OP_PUSH_ADD10:
+        case VM_OP_PUSH_SUB10:
+        case VM_OP_PUSH_MUL10:
+        case VM_OP_CMP_JZ:
+        case VM_OP_CMP_JNZ:
+        case VM_OP_COUNT:
+            /* Unreachable in a verified, unfused program. */
+            free(reach);
+            free(native);
+            free(patches);
+            return -1;
+        }
+
+        /* Keep control flow explicit when the successor is not next. */
+        uint32_t next = ip + insn->size;
+        if (falls_through) {
+            uint32_t following = next;
+            if (following > len || !reach[following]) {
+                free(reach);
+                free(native);
+                free(patches);
+                return -1;
+            }
+            int adjacent = 1;
+            for (uint32_t k = ip + 1; k < following; ++k) {
+                if (reach[k]) {
+                    adjacent = 0;
+                }
+            }
+            if (!adjacent) {
+                patches[patch_count].at = emit_jmp(b);
+                patches[patch_count++].target = following;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < patch_count; ++i) {
+        patch_rel32(b, patches[i].at, native[patches[i].target]);
+    }
+    free(reach);
+    free(native);
+    free(patches);
+    return 0;
+}
+
+static int jit_compile(const vm_verified_prog_t *vp, vm_jit_entry_t *entry) {
+    const vm_insn_t *insns = vp->impl;
+    size_t len = vp->prog.len;
+    jit_buf_t b = {0};
+
+    /* First pass sizes the code, second pass writes it. */
+    if (jit_emit_program(insns, len, &b) != 0) {
+        return -1;
+    }
+    size_t size = b.len;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    b.buf = mem;
+    b.cap = size;
+    b.len = 0;
+    if (jit_emit_program(insns, len, &b) != 0 || b.len != size ||
+        mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return -1;
+    }
+    entry->mem = mem;
+    entry->mem_size = size;
+    entry->fn = (vm_jit_fn)mem;
+    return 0;
+}
+
+static void jit_release_code(vm_jit_entry_t *entry) {
+    if (entry->mem) {
+        munmap(entry->mem, entry->mem_size);
+    }
+    entry->mem = NULL;
+    entry->mem_size = 0;
+    entry->fn = NULL;
+}
+
+#else
+
+static int jit_compile(const vm_verified_prog_t *vp, vm_jit_entry_t *entry) {
+    (void)vp;
+    (void)entry;
+    return -1;
+}
+
+static void jit_release_code(vm_jit_entry_t *entry) {
+    entry->mem = NULL;
+    entry->fn = NULL;
+}
+
+#endif
+
+int vm_jit_available(void) {
+    return VM_JIT_X86_64;
+}
+
+void vm_jit_set_threshold(uint32_t hits) {
+    pthread_mutex_lock(&jit_lock);
+    jit_threshold = hits;
+    pthread_mutex_unlock(&jit_lock);
+}
+
+static void jit_entry_clear(vm_jit_entry_t *entry) {
+    jit_release_code(entry);
+    free(entry->code);
+    memset(entry, 0, sizeof(*entry));
+}
+
+void vm_jit_flush(void) {
+    pthread_mutex_lock(&jit_lock);
+    for (size_t i = 0; i < VM_JIT_CACHE_SLOTS; ++i) {
+        if (jit_cache[i].refs == 0) {
+            jit_entry_clear(&jit_cache[i]);
+        }
+    }
+    pthread_mutex_unlock(&jit_lock);
+}
+
+/*
+ * Returns the compiled entry for p with a reference held, or NULL when the
+ * program should be interpreted this time.
+ */
+static vm_jit_entry_t *jit_acquire(const prog_t *p, const vm_limits_t *lim) {
+    uint64_t hash = jit_hash(p);
+    vm_jit_entry_t *entry = &jit_cache[hash % VM_JIT_CACHE_SLOTS];
+    vm_jit_entry_t *result = NULL;
+
+    pthread_mutex_lock(&jit_lock);
+    int same = entry->state != JIT_ENTRY_EMPTY && entry->hash == hash && entry->len == p->len &&
+               memcmp(entry->code, p->code, p->len) == 0;
+    if (!same) {
+        if (entry->refs > 0) {
+            goto out; /* slot busy with another program; interpret */
+        }
+        jit_entry_clear(entry);
+        entry->code = malloc(p->len);
+        if (!entry->code) {
+            goto out;
+        }
+        memcpy(entry->code, p->code, p->len);
+        entry->len = p->len;
+        entry->hash = hash;
+        entry->state = JIT_ENTRY_COUNTING;
+    }
+
+    if (entry->state == JIT_ENTRY_COUNTING && ++entry->hits >= jit_threshold) {
+        vm_verified_prog_t vp;
+        prog_t copy = {entry->code, entry->len};
+        entry->state = JIT_ENTRY_REJECTED;
+        if (vm_verify(&copy, lim, &vp) == 0) {
+            if (jit_compile(&vp, entry) == 0) {
+                entry->state = JIT_ENTRY_COMPILED;
+                entry->max_depth = vp.max_depth;
+            }
+            vm_verified_free(&vp);
+        }
+    }
+    if (entry->state == JIT_ENTRY_COMPILED && vm_effective_max_stack(lim) >= entry->max_depth) {
+        entry->refs++;
+        result = entry;
+    }
+out:
+    pthread_mutex_unlock(&jit_lock);
+    return result;
+}
+
+static void jit_release(vm_jit_entry_t *entry) {
+    pthread_mutex_lock(&jit_lock);
+    entry->refs--;
+    pthread_mutex_unlock(&jit_lock);
+}
+
+int vm_run_jit(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Native code does not record traces and counts steps, not gas. */
+    vm_jit_entry_t *entry = (trace || vm_gas_table()) ? NULL : jit_acquire(p, lim);
+    if (!entry) {
+        return vm_run_threaded(p, lim, trace, out);
+    }
+
+    int64_t inline_stack[VM_JIT_INLINE_STACK];
+    int64_t *stack = inline_stack;
+    if (entry->max_depth > VM_JIT_INLINE_STACK) {
+        stack = malloc(entry->max_depth * sizeof(*stack));
+        if (!stack) {
+            jit_release(entry);
+            return -1;
+        }
+    }
+
+    vm_jit_exit_t exit_state = {0};
+    entry->fn(stack, vm_effective_max_steps(lim), &exit_state);
+    jit_release(entry);
+
+    out->status = (vm_status_t)exit_state.status;
+    out->steps = exit_state.steps;
+    out->gas_used = exit_state.steps;
+    out->result = exit_state.sp > 0 ? (uint64_t)stack[exit_state.sp - 1] : 0;
+    out->halted = exit_state.halted;
+    if (stack != inline_stack) {
+        free(stack);
+    }
+    return 0;
+}
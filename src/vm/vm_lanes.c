@@ -0,0 +1,460 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Lane-parallel interpreter: one program, many independent executions.
+ * Lanes are processed in blocks of VM_LANES_BLOCK. The operand stack of a
+ * block is stored slot-major (stack[slot * VM_LANES_BLOCK + lane]), so an
+ * instruction executed by a group of lanes at the same ip and stack depth
+ * is a masked operation over one contiguous row per stack slot.
+ *
+ * Each step picks the lowest ip among live lanes (lanes that branched
+ * apart meet again there) and runs that instruction for every live lane at
+ * the same ip and depth. Per-lane state evolves exactly as in vm_run with
+ * request_id + lane, RANDOM10 sequence included. Lanes of a program that
+ * can reach an F-KV opcode would see each other's writes mid-run, so such
+ * programs run one lane at a time, in lane order, each in its own F-KV
+ * transaction, as consecutive vm_run calls would.
+ *
+ * Pure stack operations are written with GCC vector extensions sized for
+ * the widest integer unit the build targets (AVX-512, AVX2, otherwise
+ * 16 bytes) and blend their result through an all-ones/all-zeros lane
+ * mask. Other compilers get the same code on plain int64_t.
+ */
+
+#define VM_LANES_BLOCK 64
+
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__AVX512F__)
+#define VM_LANES_VEC_BYTES 64
+#elif defined(__AVX2__)
+#define VM_LANES_VEC_BYTES 32
+#else
+#define VM_LANES_VEC_BYTES 16
+#endif
+typedef int64_t lane_vec_t __attribute__((vector_size(VM_LANES_VEC_BYTES)));
+typedef uint64_t lane_uvec_t __attribute__((vector_size(VM_LANES_VEC_BYTES)));
+/* Vector comparisons yield -1 for true. */
+#define LANE_CMP(a, b) ((lane_vec_t)((a) < (b)) - (lane_vec_t)((a) > (b)))
+#else
+typedef int64_t lane_vec_t;
+typedef uint64_t lane_uvec_t;
+#define LANE_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+#endif
+
+#define VM_LANES_PER_VEC (sizeof(lane_vec_t) / sizeof(int64_t))
+
+typedef struct {
+    size_t count;
+    uint32_t max_steps;
+    uint32_t max_stack;
+    int64_t *stack; /* max_stack * VM_LANES_BLOCK */
+    uint16_t call_stack[VM_CALL_STACK_MAX * VM_LANES_BLOCK];
+    uint32_t ip[VM_LANES_BLOCK];
+    uint32_t sp[VM_LANES_BLOCK];
+    uint32_t call_sp[VM_LANES_BLOCK];
+    uint32_t steps[VM_LANES_BLOCK];
+    uint32_t gas[VM_LANES_BLOCK];
+    uint32_t rng[VM_LANES_BLOCK];
+    uint8_t live[VM_LANES_BLOCK];
+    uint8_t group[VM_LANES_BLOCK];
+    int64_t mask[VM_LANES_BLOCK]; /* -1 for lanes in group, else 0 */
+    vm_result_t *out;
+} lanes_block_t;
+
+#define SLOT(b, slot, lane) ((b)->stack[(size_t)(slot) * VM_LANES_BLOCK + (lane)])
+
+static void lane_finish(lanes_block_t *b, size_t lane, vm_status_t status, uint8_t halted) {
+    uint32_t sp = b->sp[lane];
+    b->out[lane].status = status;
+    b->out[lane].steps = b->steps[lane];
+    b->out[lane].gas_used = b->gas[lane];
+    b->out[lane].result = sp > 0 ? (uint64_t)SLOT(b, sp - 1, lane) : 0;
+    b->out[lane].halted = halted;
+    b->live[lane] = 0;
+    b->group[lane] = 0;
+    b->mask[lane] = 0;
+}
+
+static void group_finish(lanes_block_t *b, vm_status_t status, uint8_t halted) {
+    for (size_t l = 0; l < b->count; ++l) {
+        if (b->group[l]) {
+            lane_finish(b, l, status, halted);
+        }
+    }
+}
+
+/* Selects the lanes to advance; returns 0 when every lane has finished. */
+static int select_group(lanes_block_t *b, uint32_t *ip_out, uint32_t *sp_out) {
+    size_t leader = b->count;
+    for (size_t l = 0; l < b->count; ++l) {
+        if (b->live[l] && (leader == b->count || b->ip[l] < b->ip[leader])) {
+            leader = l;
+        }
+    }
+    if (leader == b->count) {
+        return 0;
+    }
+    uint32_t ip = b->ip[leader];
+    uint32_t sp = b->sp[leader];
+    for (size_t l = 0; l < b->count; ++l) {
+        b->group[l] = b->live[l] && b->ip[l] == ip && b->sp[l] == sp;
+        b->mask[l] = -(int64_t)b->group[l];
+    }
+    *ip_out = ip;
+    *sp_out = sp;
+    return 1;
+}
+
+static void group_advance(lanes_block_t *b, uint32_t ip, uint32_t sp) {
+    for (size_t l = 0; l < b->count; ++l) {
+        if (b->group[l]) {
+            b->ip[l] = ip;
+            b->sp[l] = sp;
+        }
+    }
+}
+
+/*
+ * x[l] = OP(x[l], y[l]) for lanes in mask, over the whole block. Rows are
+ * VM_LANES_BLOCK wide, so lanes past count simply carry a zero mask.
+ */
+#define LANES_APPLY(x, y, mask, EXPR)                                               \
+    do {                                                                            \
+        for (size_t l = 0; l < VM_LANES_BLOCK; l += VM_LANES_PER_VEC) {             \
+            lane_vec_t a;                                                           \
+            lane_vec_t b;                                                           \
+            lane_vec_t m;                                                           \
+            memcpy(&a, (x) + l, sizeof(a));                                         \
+            memcpy(&b, (y) + l, sizeof(b));                                         \
+            memcpy(&m, (mask) + l, sizeof(m));                                      \
+            lane_vec_t r = (EXPR);                                                  \
+            r = (r & m) | (a & ~m);                                                 \
+            memcpy((x) + l, &r, sizeof(r));                                         \
+        }                                                                           \
+    } while (0)
+
+static void lanes_binary(vm_op_t op, int64_t *x, const int64_t *y, const int64_t *mask) {
+    switch (op) {
+    case VM_OP_ADD10:
+        LANES_APPLY(x, y, mask, (lane_vec_t)((lane_uvec_t)a + (lane_uvec_t)b));
+        break;
+    case VM_OP_SUB10:
+        LANES_APPLY(x, y, mask, (lane_vec_t)((lane_uvec_t)a - (lane_uvec_t)b));
+        break;
+    case VM_OP_MUL10:
+        LANES_APPLY(x, y, mask, (lane_vec_t)((lane_uvec_t)a * (lane_uvec_t)b));
+        break;
+    default:
+        LANES_APPLY(x, y, mask, LANE_CMP(a, b));
+        break;
+    }
+}
+
+static void lanes_fill(int64_t *x, int64_t value, const int64_t *mask) {
+    for (size_t l = 0; l < VM_LANES_BLOCK; ++l) {
+        x[l] = (value & mask[l]) | (x[l] & ~mask[l]);
+    }
+}
+
+static void run_block(const vm_insn_t *insns, lanes_block_t *b) {
+    uint32_t ip = 0;
+    uint32_t sp = 0;
+    while (select_group(b, &ip, &sp)) {
+        const vm_insn_t *insn = &insns[ip];
+        if (insn->op == VM_OP_END) {
+            group_finish(b, VM_OK, 0);
+            continue;
+        }
+        int any = 0;
+        uint32_t cost = vm_gas_cost(insn->code);
+        for (size_t l = 0; l < b->count; ++l) {
+            if (!b->group[l]) {
+                continue;
+            }
+            if (cost > b->max_steps - b->gas[l]) {
+                lane_finish(b, l, VM_ERR_GAS_EXHAUSTED, 0);
+                continue;
+            }
+            b->steps[l]++;
+            b->gas[l] += cost;
+            any = 1;
+        }
+        if (!any) {
+            continue;
+        }
+
+        size_t n = b->count;
+        const uint8_t *g = b->group;
+        switch ((vm_op_t)insn->op) {
+        case VM_OP_PUSHD:
+            if (sp >= b->max_stack) {
+                group_finish(b, VM_ERR_STACK_OVERFLOW, 0);
+                break;
+            }
+            lanes_fill(&SLOT(b, sp, 0), insn->arg, b->mask);
+            group_advance(b, ip + insn->size, sp + 1);
+            break;
+        case VM_OP_ADD10:
+        case VM_OP_SUB10:
+        case VM_OP_MUL10:
+        case VM_OP_CMP:
+            if (sp < 2) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            lanes_binary((vm_op_t)insn->op, &SLOT(b, sp - 2, 0), &SLOT(b, sp - 1, 0), b->mask);
+            group_advance(b, ip + 1, sp - 1);
+            break;
+        case VM_OP_DIV10:
+        case VM_OP_MOD10:
+            if (sp < 2) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            group_advance(b, ip + 1, sp - 2);
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                int64_t divisor = SLOT(b, sp - 1, l);
+                int64_t dividend = SLOT(b, sp - 2, l);
+                if (divisor == 0) {
+                    lane_finish(b, l, VM_ERR_DIV_BY_ZERO, 0);
+                    continue;
+                }
+                SLOT(b, sp - 2, l) = insn->op == VM_OP_DIV10 ? vm_div10(dividend, divisor) : vm_mod10(dividend, divisor);
+                b->sp[l] = sp - 1;
+            }
+            break;
+        case VM_OP_JZ:
+        case VM_OP_JNZ:
+            if (sp < 1) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                int64_t v = SLOT(b, sp - 1, l);
+                int taken = (insn->op == VM_OP_JZ) ? (v == 0) : (v != 0);
+                b->sp[l] = sp - 1;
+                if (!taken) {
+                    b->ip[l] = ip + 3;
+                } else if (insn->target == VM_TARGET_INVALID) {
+                    lane_finish(b, l, VM_ERR_INVALID_OPCODE, 0);
+                } else {
+                    b->ip[l] = (uint32_t)insn->target;
+                }
+            }
+            break;
+        case VM_OP_CALL:
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                if (b->call_sp[l] >= VM_CALL_STACK_MAX) {
+                    lane_finish(b, l, VM_ERR_STACK_OVERFLOW, 0);
+                    continue;
+                }
+                b->call_stack[b->call_sp[l]++ * VM_LANES_BLOCK + l] = (uint16_t)insn->arg;
+                if (insn->target == VM_TARGET_INVALID) {
+                    lane_finish(b, l, VM_ERR_INVALID_OPCODE, 0);
+                    continue;
+                }
+                b->ip[l] = (uint32_t)insn->target;
+            }
+            break;
+        case VM_OP_RET:
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                if (b->call_sp[l] == 0) {
+                    lane_finish(b, l, VM_OK, 0);
+                    continue;
+                }
+                b->ip[l] = b->call_stack[--b->call_sp[l] * VM_LANES_BLOCK + l];
+            }
+            break;
+        case VM_OP_READ_FKV:
+        case VM_OP_SUM_PREFIX:
+        case VM_OP_COUNT_PREFIX: {
+            if (sp < 1) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            vm_status_t (*lookup)(int64_t, int64_t *) = vm_fkv_read;
+            if (insn->op == VM_OP_SUM_PREFIX) {
+                lookup = vm_fkv_sum_prefix;
+            } else if (insn->op == VM_OP_COUNT_PREFIX) {
+                lookup = vm_fkv_count_prefix;
+            }
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                int64_t value = 0;
+                b->sp[l] = sp - 1;
+                vm_status_t status = lookup(SLOT(b, sp - 1, l), &value);
+                if (status != VM_OK) {
+                    lane_finish(b, l, status, 0);
+                    continue;
+                }
+                SLOT(b, sp - 1, l) = value;
+                b->sp[l] = sp;
+                b->ip[l] = ip + 1;
+            }
+            break;
+        }
+        case VM_OP_WRITE_FKV:
+            if (sp < 2) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            for (size_t l = 0; l < n; ++l) {
+                if (!g[l]) {
+                    continue;
+                }
+                b->sp[l] = sp - 2;
+                vm_status_t status = vm_fkv_write(SLOT(b, sp - 2, l), SLOT(b, sp - 1, l));
+                if (status != VM_OK) {
+                    lane_finish(b, l, status, 0);
+                    continue;
+                }
+                b->ip[l] = ip + 1;
+            }
+            break;
+        case VM_OP_HASH10:
+            if (sp < 1) {
+                group_finish(b, VM_ERR_STACK_UNDERFLOW, 0);
+                break;
+            }
+            for (size_t l = 0; l < n; ++l) {
+                if (g[l]) {
+                    SLOT(b, sp - 1, l) = vm_hash10(SLOT(b, sp - 1, l));
+                }
+            }
+            group_advance(b, ip + 1, sp);
+            break;
+        case VM_OP_RANDOM10:
+        case VM_OP_TIME10:
+            if (sp >= b->max_stack) {
+                group_finish(b, VM_ERR_STACK_OVERFLOW, 0);
+                break;
+            }
+            for (size_t l = 0; l < n; ++l) {
+                if (g[l]) {
+                    SLOT(b, sp, l) = insn->op == VM_OP_RANDOM10 ? vm_rng_next(&b->rng[l]) : vm_time10();
+                }
+            }
+            group_advance(b, ip + 1, sp + 1);
+            break;
+        case VM_OP_NOP:
+            group_advance(b, ip + 1, sp);
+            break;
+        case VM_OP_HALT:
+            group_finish(b, VM_OK, 1);
+            break;
+        case VM_OP_INVALID:
+        case VM_OP_TRUNC:
+        case VM_OP_END:
+        case VM_OP_PUSH_ADD10:
+        case VM_OP_PUSH_SUB10:
+        case VM_OP_PUSH_MUL10:
+        case VM_OP_CMP_JZ:
+        case VM_OP_CMP_JNZ:
+        case VM_OP_COUNT:
+            group_finish(b, VM_ERR_INVALID_OPCODE, 0);
+            break;
+        }
+    }
+}
+
+/* 1 when a reachable instruction touches F-KV, 0 if none does, -1 when out of memory. */
+static int lanes_use_fkv(const vm_insn_t *insns, size_t len) {
+    uint8_t *reach = calloc(len + 1, 1);
+    if (!reach || vm_mark_reachable(insns, len, reach) != 0) {
+        free(reach);
+        return -1;
+    }
+    int fkv = 0;
+    for (size_t ip = 0; ip < len && !fkv; ++ip) {
+        vm_op_t op = (vm_op_t)insns[ip].op;
+        fkv = reach[ip] && (op == VM_OP_READ_FKV || op == VM_OP_WRITE_FKV || op == VM_OP_SUM_PREFIX ||
+                            op == VM_OP_COUNT_PREFIX);
+    }
+    free(reach);
+    return fkv;
+}
+
+int vm_run_lanes(const prog_t *p,
+                 const vm_limits_t *lim,
+                 const int64_t *inputs,
+                 size_t lanes,
+                 vm_result_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || (!out && lanes > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lanes == 0) {
+        return 0;
+    }
+    uint32_t max_stack = vm_effective_max_stack(lim);
+
+    vm_insn_t *insns = malloc((p->len + 1) * sizeof(*insns));
+    lanes_block_t *b = malloc(sizeof(*b));
+    int64_t *stack = malloc((size_t)max_stack * VM_LANES_BLOCK * sizeof(*stack));
+    if (!insns || !b || !stack) {
+        free(insns);
+        free(b);
+        free(stack);
+        return -1;
+    }
+    vm_decode(p, insns);
+    uint64_t program_hash = vm_rng_program_hash(p);
+    int use_fkv = lanes_use_fkv(insns, p->len);
+    if (use_fkv < 0) {
+        free(insns);
+        free(b);
+        free(stack);
+        return -1;
+    }
+    size_t block = use_fkv ? 1 : VM_LANES_BLOCK;
+
+    for (size_t base = 0; base < lanes; base += block) {
+        memset(b, 0, sizeof(*b));
+        b->count = lanes - base < block ? lanes - base : block;
+        b->max_steps = vm_effective_max_steps(lim);
+        b->max_stack = max_stack;
+        b->stack = stack;
+        b->out = &out[base];
+        memset(stack, 0, (size_t)max_stack * VM_LANES_BLOCK * sizeof(*stack));
+        for (size_t l = 0; l < b->count; ++l) {
+            b->live[l] = 1;
+            b->rng[l] = vm_rng_seed(program_hash, lim->request_id + base + l);
+            if (inputs) {
+                SLOT(b, 0, l) = inputs[base + l];
+                b->sp[l] = 1;
+            }
+        }
+        if (use_fkv) {
+            vm_fkv_txn_begin();
+            run_block(insns, b);
+            vm_fkv_txn_end(0, &out[base]);
+        } else {
+            run_block(insns, b);
+        }
+    }
+
+    free(insns);
+    free(b);
+    free(stack);
+    return 0;
+}
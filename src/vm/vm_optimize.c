@@ -0,0 +1,182 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Peephole optimizer for verified programs. The fused table starts as a
+ * copy of the verified one; at the head of each pattern the entry is
+ * replaced by one that covers the whole pattern, and every other entry is
+ * left alone. Tables are indexed by byte offset, so a jump or return into
+ * the middle of a pattern lands on an untouched entry and runs the original
+ * instructions from there; no control-flow analysis is needed. Patterns
+ * never contain a jump target of their own, a call or a return.
+ *
+ * An entry records in `weight` how many original instructions it replaces;
+ * the fused executor charges that many steps.
+ */
+
+#define VM_OPT_MAX_CONST 16
+
+typedef struct {
+    uint32_t end;    /* first ip after the run */
+    uint32_t weight; /* instructions in the run */
+    int has_value;   /* 1: leaves one constant, 0: NOPs only */
+    int64_t value;
+} opt_run_t;
+
+/* Returns 1 and stores a op b when the operation can be done now. */
+static int opt_fold_binary(vm_op_t op, int64_t a, int64_t b, int64_t *out) {
+    switch (op) {
+    case VM_OP_ADD10:
+        *out = (int64_t)((uint64_t)a + (uint64_t)b);
+        return 1;
+    case VM_OP_SUB10:
+        *out = (int64_t)((uint64_t)a - (uint64_t)b);
+        return 1;
+    case VM_OP_MUL10:
+        *out = (int64_t)((uint64_t)a * (uint64_t)b);
+        return 1;
+    case VM_OP_DIV10:
+    case VM_OP_MOD10:
+        /* Division by zero must still fail at run time, on the right step. */
+        if (b == 0) {
+            return 0;
+        }
+        *out = (op == VM_OP_DIV10) ? vm_div10(a, b) : vm_mod10(a, b);
+        return 1;
+    case VM_OP_CMP:
+        *out = (a > b) - (a < b);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Finds the longest run from ip of literals, NOPs and pure arithmetic that
+ * leaves a single constant (or, for a run of NOPs, nothing) on the stack.
+ * Returns 1 when such a run of at least two instructions exists.
+ */
+static int opt_const_run(const vm_insn_t *insns, size_t len, uint32_t ip, opt_run_t *run) {
+    int64_t values[VM_OPT_MAX_CONST];
+    size_t depth = 0;
+    uint32_t weight = 0;
+    uint32_t at = ip;
+    int found = 0;
+
+    while (at < len && weight < UINT8_MAX) {
+        const vm_insn_t *insn = &insns[at];
+        vm_op_t op = (vm_op_t)insn->op;
+        if (op == VM_OP_PUSHD) {
+            if (depth == VM_OPT_MAX_CONST) {
+                break;
+            }
+            values[depth++] = insn->arg;
+        } else if (op == VM_OP_HASH10) {
+            if (depth == 0) {
+                break;
+            }
+            values[depth - 1] = vm_hash10(values[depth - 1]);
+        } else if (op != VM_OP_NOP) {
+            if (depth < 2 || !opt_fold_binary(op, values[depth - 2], values[depth - 1], &values[depth - 2])) {
+                break;
+            }
+            depth--;
+        }
+        at += insn->size;
+        weight++;
+        if (at - ip > UINT8_MAX) {
+            break;
+        }
+        if (weight >= 2 && depth <= 1) {
+            run->end = at;
+            run->weight = weight;
+            run->has_value = (depth == 1);
+            run->value = depth == 1 ? values[0] : 0;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+static vm_op_t opt_push_fusion(vm_op_t op) {
+    switch (op) {
+    case VM_OP_ADD10:
+        return VM_OP_PUSH_ADD10;
+    case VM_OP_SUB10:
+        return VM_OP_PUSH_SUB10;
+    case VM_OP_MUL10:
+        return VM_OP_PUSH_MUL10;
+    default:
+        return VM_OP_INVALID;
+    }
+}
+
+static void opt_fuse_at(const vm_insn_t *insns, size_t len, uint32_t ip, vm_insn_t *out) {
+    const vm_insn_t *insn = &insns[ip];
+    opt_run_t run;
+
+    if (insn->op == VM_OP_CMP && ip + 1 < len &&
+        (insns[ip + 1].op == VM_OP_JZ || insns[ip + 1].op == VM_OP_JNZ)) {
+        out->op = (insns[ip + 1].op == VM_OP_JZ) ? VM_OP_CMP_JZ : VM_OP_CMP_JNZ;
+        out->size = (uint8_t)(1 + insns[ip + 1].size);
+        out->weight = 2;
+        out->target = insns[ip + 1].target;
+        return;
+    }
+
+    if (!opt_const_run(insns, len, ip, &run)) {
+        if (insn->op != VM_OP_PUSHD) {
+            return;
+        }
+        run.end = ip + insn->size;
+        run.weight = 1;
+        run.has_value = 1;
+        run.value = insn->arg;
+    }
+
+    /* A constant consumed by the next instruction becomes its operand. */
+    if (run.has_value && run.end < len && run.weight < UINT8_MAX && run.end + 1 - ip <= UINT8_MAX) {
+        vm_op_t fused = opt_push_fusion((vm_op_t)insns[run.end].op);
+        if (fused != VM_OP_INVALID) {
+            out->op = (uint8_t)fused;
+            out->size = (uint8_t)(run.end + 1 - ip);
+            out->weight = (uint8_t)(run.weight + 1);
+            out->arg = run.value;
+            return;
+        }
+    }
+    if (run.weight >= 2) {
+        out->op = run.has_value ? VM_OP_PUSHD : VM_OP_NOP;
+        out->size = (uint8_t)(run.end - ip);
+        out->weight = (uint8_t)run.weight;
+        out->arg = run.value;
+    }
+}
+
+int vm_optimize(vm_verified_prog_t *vp) {
+    if (!vp || !vp->impl) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vp->fused) {
+        return 0;
+    }
+    const vm_insn_t *insns = vp->impl;
+    size_t len = vp->prog.len;
+    vm_insn_t *fused = malloc((len + 1) * sizeof(*fused));
+    if (!fused) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(fused, insns, (len + 1) * sizeof(*fused));
+    for (uint32_t ip = 0; ip < len; ++ip) {
+        opt_fuse_at(insns, len, ip, &fused[ip]);
+    }
+    vp->fused = fused;
+    return 0;
+}
@@ -0,0 +1,272 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each thread that runs a program while profiling is enabled gets its own
+ * block of counters, written only by that thread with relaxed atomics so a
+ * snapshot can read them at any time. Blocks are linked into a registry;
+ * when a thread exits its counts are folded into `profile_retired`.
+ */
+
+struct vm_profile_thread {
+    atomic_uint_fast64_t runs;
+    atomic_uint_fast64_t op_count[VM_PROFILE_OPCODES];
+    atomic_uint_fast64_t op_cycles[VM_PROFILE_OPCODES];
+    atomic_uint_fast64_t ip_count[VM_PROFILE_IPS];
+    atomic_uint_fast64_t ip_cycles[VM_PROFILE_IPS];
+    struct vm_profile_thread *next;
+};
+
+static atomic_int profile_enabled = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static vm_profile_thread_t *profile_threads = NULL;
+static vm_profile_t profile_retired;
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local vm_profile_thread_t *profile_self = NULL;
+
+static const char *const profile_opcode_names[] = {
+    [0x01] = "PUSHd",    [0x02] = "ADD10",     [0x03] = "SUB10",    [0x04] = "MUL10",
+    [0x05] = "DIV10",    [0x06] = "MOD10",     [0x07] = "CMP",      [0x08] = "JZ",
+    [0x09] = "JNZ",      [0x0A] = "CALL",      [0x0B] = "RET",      [0x0C] = "READ_FKV",
+    [0x0D] = "WRITE_FKV", [0x0E] = "HASH10",   [0x0F] = "RANDOM10", [0x10] = "TIME10",
+    [0x11] = "NOP",      [0x12] = "HALT",      [0x13] = "PUSHN",    [0x14] = "SUM_PREFIX",
+    [0x15] = "COUNT_PREFIX",
+};
+
+static void counter_add(atomic_uint_fast64_t *counter, uint64_t delta) {
+    /* Single writer: a plain load and store is enough and avoids a locked add. */
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+static uint64_t counter_get(atomic_uint_fast64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* Adds the counts of one thread to out; called with profile_lock held. */
+static void profile_merge_locked(vm_profile_thread_t *prof, vm_profile_t *out) {
+    out->runs += counter_get(&prof->runs);
+    for (size_t i = 0; i < VM_PROFILE_OPCODES; ++i) {
+        out->opcodes[i].count += counter_get(&prof->op_count[i]);
+        out->opcodes[i].cycles += counter_get(&prof->op_cycles[i]);
+    }
+    for (size_t i = 0; i < VM_PROFILE_IPS; ++i) {
+        out->ips[i].count += counter_get(&prof->ip_count[i]);
+        out->ips[i].cycles += counter_get(&prof->ip_cycles[i]);
+    }
+}
+
+static void profile_thread_exit(void *arg) {
+    vm_profile_thread_t *prof = arg;
+    pthread_mutex_lock(&profile_lock);
+    profile_merge_locked(prof, &profile_retired);
+    for (vm_profile_thread_t **link = &profile_threads; *link; link = &(*link)->next) {
+        if (*link == prof) {
+            *link = prof->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    free(prof);
+}
+
+static void profile_make_key(void) {
+    pthread_key_create(&profile_key, profile_thread_exit);
+}
+
+vm_profile_thread_t *vm_profile_thread(void) {
+    if (!atomic_load_explicit(&profile_enabled, memory_order_relaxed)) {
+        return NULL;
+    }
+    if (profile_self) {
+        return profile_self;
+    }
+    pthread_once(&profile_key_once, profile_make_key);
+    vm_profile_thread_t *prof = calloc(1, sizeof(*prof));
+    if (!prof) {
+        return NULL;
+    }
+    pthread_mutex_lock(&profile_lock);
+    prof->next = profile_threads;
+    profile_threads = prof;
+    pthread_mutex_unlock(&profile_lock);
+    pthread_setspecific(profile_key, prof);
+    profile_self = prof;
+    return prof;
+}
+
+void vm_profile_record(vm_profile_thread_t *prof, uint32_t ip, uint8_t opcode, uint64_t cycles) {
+    uint32_t slot = ip < VM_PROFILE_IPS ? ip : VM_PROFILE_IPS - 1;
+    counter_add(&prof->op_count[opcode], 1);
+    counter_add(&prof->op_cycles[opcode], cycles);
+    counter_add(&prof->ip_count[slot], 1);
+    counter_add(&prof->ip_cycles[slot], cycles);
+}
+
+void vm_profile_finish_run(vm_profile_thread_t *prof) {
+    counter_add(&prof->runs, 1);
+}
+
+void vm_profile_enable(int enabled) {
+    atomic_store(&profile_enabled, enabled ? 1 : 0);
+}
+
+int vm_profile_enabled(void) {
+    return atomic_load_explicit(&profile_enabled, memory_order_relaxed);
+}
+
+void vm_profile_reset(void) {
+    pthread_mutex_lock(&profile_lock);
+    memset(&profile_retired, 0, sizeof(profile_retired));
+    for (vm_profile_thread_t *prof = profile_threads; prof; prof = prof->next) {
+        /* Runs in flight on other threads may still land a few counts. */
+        atomic_store_explicit(&prof->runs, 0, memory_order_relaxed);
+        for (size_t i = 0; i < VM_PROFILE_OPCODES; ++i) {
+            atomic_store_explicit(&prof->op_count[i], 0, memory_order_relaxed);
+            atomic_store_explicit(&prof->op_cycles[i], 0, memory_order_relaxed);
+        }
+        for (size_t i = 0; i < VM_PROFILE_IPS; ++i) {
+            atomic_store_explicit(&prof->ip_count[i], 0, memory_order_relaxed);
+            atomic_store_explicit(&prof->ip_cycles[i], 0, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+void vm_profile_snapshot(vm_profile_t *out) {
+    if (!out) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    *out = profile_retired;
+    for (vm_profile_thread_t *prof = profile_threads; prof; prof = prof->next) {
+        profile_merge_locked(prof, out);
+    }
+    pthread_mutex_unlock(&profile_lock);
+    out->enabled = vm_profile_enabled();
+    out->steps = 0;
+    out->cycles = 0;
+    for (size_t i = 0; i < VM_PROFILE_OPCODES; ++i) {
+        out->steps += out->opcodes[i].count;
+        out->cycles += out->opcodes[i].cycles;
+    }
+}
+
+static int profile_append(char **buf, size_t *len, size_t *cap, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (needed < 0) {
+        return -1;
+    }
+    if (*len + (size_t)needed + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (*len + (size_t)needed + 1 > new_cap) {
+            new_cap *= 2;
+        }
+        char *tmp = realloc(*buf, new_cap);
+        if (!tmp) {
+            return -1;
+        }
+        *buf = tmp;
+        *cap = new_cap;
+    }
+    va_start(args, fmt);
+    vsnprintf(*buf + *len, *cap - *len, fmt, args);
+    va_end(args);
+    *len += (size_t)needed;
+    return 0;
+}
+
+char *vm_profile_serialize(const vm_profile_t *profile, size_t hot_ips) {
+    if (!profile) {
+        return NULL;
+    }
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int rc = profile_append(&buf,
+                            &len,
+                            &cap,
+                            "{\"enabled\":%s,\"clock\":\"%s\",\"runs\":%" PRIu64 ",\"steps\":%" PRIu64
+                            ",\"cycles\":%" PRIu64 ",\"opcodes\":[",
+                            profile->enabled ? "true" : "false",
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+                            "tsc",
+#else
+                            "ns",
+#endif
+                            profile->runs,
+                            profile->steps,
+                            profile->cycles);
+    int first = 1;
+    for (size_t op = 0; rc == 0 && op < VM_PROFILE_OPCODES; ++op) {
+        const vm_profile_counter_t *c = &profile->opcodes[op];
+        if (c->count == 0) {
+            continue;
+        }
+        const char *name = op < sizeof(profile_opcode_names) / sizeof(profile_opcode_names[0])
+                               ? profile_opcode_names[op]
+                               : NULL;
+        rc = profile_append(&buf,
+                            &len,
+                            &cap,
+                            "%s{\"opcode\":%zu,\"name\":\"%s\",\"count\":%" PRIu64 ",\"cycles\":%" PRIu64
+                            ",\"share\":%.4f}",
+                            first ? "" : ",",
+                            op,
+                            name ? name : "INVALID",
+                            c->count,
+                            c->cycles,
+                            profile->cycles ? (double)c->cycles / (double)profile->cycles : 0.0);
+        first = 0;
+    }
+    if (rc == 0) {
+        rc = profile_append(&buf, &len, &cap, "],\"hot_ips\":[");
+    }
+
+    /* Repeated selection of the hottest remaining ip; hot_ips is small. */
+    uint8_t taken[VM_PROFILE_IPS] = {0};
+    for (size_t n = 0; rc == 0 && n < hot_ips; ++n) {
+        size_t best = VM_PROFILE_IPS;
+        for (size_t ip = 0; ip < VM_PROFILE_IPS; ++ip) {
+            if (taken[ip] || profile->ips[ip].count == 0) {
+                continue;
+            }
+            if (best == VM_PROFILE_IPS || profile->ips[ip].cycles > profile->ips[best].cycles) {
+                best = ip;
+            }
+        }
+        if (best == VM_PROFILE_IPS) {
+            break;
+        }
+        taken[best] = 1;
+        rc = profile_append(&buf,
+                            &len,
+                            &cap,
+                            "%s{\"ip\":%zu,\"count\":%" PRIu64 ",\"cycles\":%" PRIu64 "}",
+                            n == 0 ? "" : ",",
+                            best,
+                            profile->ips[best].count,
+                            profile->ips[best].cycles);
+    }
+    if (rc == 0) {
+        rc = profile_append(&buf, &len, &cap, "]}");
+    }
+    if (rc != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
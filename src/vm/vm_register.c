@@ -0,0 +1,717 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Register backend. A program whose every reachable instruction is entered
+ * at one stack depth is translated into three-address code: stack slot d
+ * becomes register d, and literals become constant registers placed above
+ * the deepest slot. A PUSHd/PUSHN is not executed at all; its constant is
+ * handed to the instruction that consumes it, so `PUSHd 2; PUSHd 3; ADD10`
+ * is one dispatch writing r[d] = c0 + c1. Literals still pending when
+ * control flow merges, or below the operands of an instruction, are
+ * materialized with a MOV.
+ *
+ * Each register instruction remembers the first original instruction it
+ * covers, the stack depth there and how many original instructions it
+ * stands for. Steps are charged per original instruction; when less gas is
+ * left than an instruction costs, the run continues on the switch
+ * interpreter from that point, whose stack is the register file itself, so
+ * gas runs out on exactly the same original instruction.
+ *
+ * CALL is not translated (its return depth depends on the caller), nor are
+ * programs the depth analysis cannot prove free of stack and operand
+ * faults; those, and traced runs, go to the threaded interpreter.
+ */
+
+#define VM_REG_CACHE_SLOTS 256
+#define VM_REG_INLINE_REGS 128
+
+typedef enum {
+    REG_OP_MOV = 0, /* r[dst] = r[a] */
+    REG_OP_ADD,
+    REG_OP_SUB,
+    REG_OP_MUL,
+    REG_OP_DIV,
+    REG_OP_MOD,
+    REG_OP_CMP,
+    REG_OP_HASH, /* r[dst] = HASH10(r[a]) */
+    REG_OP_READ, /* r[dst] = READ_FKV(r[a]) */
+    REG_OP_SUM_PREFIX,
+    REG_OP_COUNT_PREFIX,
+    REG_OP_WRITE, /* WRITE_FKV(r[a], r[b]) */
+    REG_OP_RANDOM,
+    REG_OP_TIME,
+    REG_OP_JZ, /* to target when r[a] == 0 */
+    REG_OP_JNZ,
+    REG_OP_NOP, /* only charges cost */
+    REG_OP_HALT,
+    REG_OP_RET, /* top-level RET */
+    REG_OP_END, /* ran off the end of the code */
+} reg_op_t;
+
+typedef struct {
+    uint8_t op;
+    uint32_t cost; /* original instructions covered */
+    uint32_t ip;   /* first of them */
+    uint32_t sp;   /* stack depth at ip */
+    uint32_t dst;  /* written slot; for the rest, the depth after operands are popped */
+    uint32_t a;
+    uint32_t b;
+    uint32_t target; /* instruction index for JZ/JNZ */
+} reg_insn_t;
+
+typedef struct {
+    reg_insn_t *insns;
+    size_t count;
+    int64_t *consts;
+    uint32_t const_count;
+    uint32_t depth; /* deepest stack; constants start at this register */
+} reg_prog_t;
+
+enum { REG_ENTRY_EMPTY = 0, REG_ENTRY_TRANSLATED, REG_ENTRY_REJECTED };
+
+typedef struct {
+    int state;
+    uint64_t hash;
+    uint8_t *code; /* private copy used to confirm hash hits */
+    size_t len;
+    uint32_t refs; /* runs currently executing prog */
+    reg_prog_t prog;
+} reg_entry_t;
+
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static reg_entry_t reg_cache[VM_REG_CACHE_SLOTS];
+
+/* Translation state. */
+typedef struct {
+    int64_t value;
+    uint32_t ip;   /* where the instructions ending with this literal start */
+    uint32_t cost; /* and how many there are, NOPs before it included */
+} reg_pending_t;
+
+typedef struct {
+    const vm_insn_t *insns;
+    size_t len;
+    int32_t *depth; /* per ip, -1 when unreached */
+    uint8_t *label; /* per ip, 1 for jump targets */
+    uint32_t *at;   /* per ip, index of the first register instruction */
+
+    reg_prog_t out;
+    size_t insn_cap;
+    uint32_t const_cap;
+
+    reg_pending_t *pending;
+    uint32_t pending_count;
+    uint32_t mat; /* slots holding real values */
+    uint32_t group_ip;
+    uint32_t group_cost;
+    int failed;
+} reg_builder_t;
+
+static void reg_effect(vm_op_t op, uint32_t *pops, uint32_t *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (op) {
+    case VM_OP_PUSHD:
+    case VM_OP_RANDOM10:
+    case VM_OP_TIME10:
+        *pushes = 1;
+        break;
+    case VM_OP_ADD10:
+    case VM_OP_SUB10:
+    case VM_OP_MUL10:
+    case VM_OP_DIV10:
+    case VM_OP_MOD10:
+    case VM_OP_CMP:
+        *pops = 2;
+        *pushes = 1;
+        break;
+    case VM_OP_READ_FKV:
+    case VM_OP_SUM_PREFIX:
+    case VM_OP_COUNT_PREFIX:
+    case VM_OP_HASH10:
+        *pops = 1;
+        *pushes = 1;
+        break;
+    case VM_OP_JZ:
+    case VM_OP_JNZ:
+        *pops = 1;
+        break;
+    case VM_OP_WRITE_FKV:
+        *pops = 2;
+        break;
+    default:
+        break;
+    }
+}
+
+static int reg_enter(reg_builder_t *b, uint32_t ip, int32_t depth, uint32_t *work, size_t *work_count) {
+    if (ip > b->len) {
+        return -1;
+    }
+    if (b->depth[ip] >= 0) {
+        return b->depth[ip] == depth ? 0 : -1;
+    }
+    b->depth[ip] = depth;
+    work[(*work_count)++] = ip;
+    return 0;
+}
+
+/* Assigns one stack depth to every reachable ip; -1 when that is impossible. */
+static int reg_analyze(reg_builder_t *b) {
+    uint32_t *work = malloc((b->len + 1) * sizeof(*work));
+    if (!work) {
+        return -1;
+    }
+    size_t work_count = 0;
+    int rc = reg_enter(b, 0, 0, work, &work_count);
+    uint32_t max_depth = 0;
+    while (rc == 0 && work_count > 0) {
+        uint32_t ip = work[--work_count];
+        const vm_insn_t *insn = &b->insns[ip];
+        vm_op_t op = (vm_op_t)insn->op;
+        if (op == VM_OP_INVALID || op == VM_OP_TRUNC || op == VM_OP_CALL) {
+            rc = -1;
+            break;
+        }
+        uint32_t pops = 0;
+        uint32_t pushes = 0;
+        reg_effect(op, &pops, &pushes);
+        if ((uint32_t)b->depth[ip] < pops) {
+            rc = -1;
+            break;
+        }
+        int32_t depth = b->depth[ip] - (int32_t)pops + (int32_t)pushes;
+        if ((uint32_t)depth > max_depth) {
+            max_depth = (uint32_t)depth;
+        }
+        switch (op) {
+        case VM_OP_HALT:
+        case VM_OP_RET:
+        case VM_OP_END:
+            break;
+        case VM_OP_JZ:
+        case VM_OP_JNZ:
+            if (insn->target == VM_TARGET_INVALID) {
+                rc = -1;
+                break;
+            }
+            b->label[insn->target] = 1;
+            rc = reg_enter(b, ip + insn->size, depth, work, &work_count);
+            if (rc == 0) {
+                rc = reg_enter(b, (uint32_t)insn->target, depth, work, &work_count);
+            }
+            break;
+        default:
+            rc = reg_enter(b, ip + insn->size, depth, work, &work_count);
+            break;
+        }
+    }
+    free(work);
+    if (rc != 0) {
+        return -1;
+    }
+    /* Reachable instructions must not overlap, so they can be laid out in order. */
+    for (size_t ip = 0; ip < b->len; ++ip) {
+        if (b->depth[ip] < 0) {
+            continue;
+        }
+        for (size_t k = 1; k < b->insns[ip].size; ++k) {
+            if (b->depth[ip + k] >= 0) {
+                return -1;
+            }
+        }
+    }
+    b->out.depth = max_depth;
+    return 0;
+}
+
+static reg_insn_t *reg_emit(reg_builder_t *b, reg_op_t op, uint32_t ip, uint32_t cost, uint32_t sp) {
+    if (b->out.count == b->insn_cap) {
+        size_t cap = b->insn_cap ? b->insn_cap * 2 : 32;
+        reg_insn_t *insns = realloc(b->out.insns, cap * sizeof(*insns));
+        if (!insns) {
+            b->failed = 1;
+            return NULL;
+        }
+        b->out.insns = insns;
+        b->insn_cap = cap;
+    }
+    reg_insn_t *insn = &b->out.insns[b->out.count++];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = (uint8_t)op;
+    insn->ip = ip;
+    insn->cost = cost;
+    insn->sp = sp;
+    return insn;
+}
+
+/* Register index of a constant; constants sit above out.depth. */
+static uint32_t reg_const(reg_builder_t *b, int64_t value) {
+    for (uint32_t i = 0; i < b->out.const_count; ++i) {
+        if (b->out.consts[i] == value) {
+            return b->out.depth + i;
+        }
+    }
+    if (b->out.const_count == b->const_cap) {
+        uint32_t cap = b->const_cap ? b->const_cap * 2 : 16;
+        int64_t *consts = realloc(b->out.consts, cap * sizeof(*consts));
+        if (!consts) {
+            b->failed = 1;
+            return b->out.depth;
+        }
+        b->out.consts = consts;
+        b->const_cap = cap;
+    }
+    b->out.consts[b->out.const_count] = value;
+    return b->out.depth + b->out.const_count++;
+}
+
+/* Writes the lowest `count` pending literals into their stack slots. */
+static void reg_materialize(reg_builder_t *b, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const reg_pending_t *p = &b->pending[i];
+        reg_insn_t *insn = reg_emit(b, REG_OP_MOV, p->ip, p->cost, b->mat);
+        if (!insn) {
+            return;
+        }
+        insn->dst = b->mat++;
+        insn->a = reg_const(b, p->value);
+    }
+    memmove(b->pending, b->pending + count, (b->pending_count - count) * sizeof(*b->pending));
+    b->pending_count -= count;
+}
+
+/* Materializes everything and charges outstanding NOPs, e.g. before a label. */
+static void reg_flush(reg_builder_t *b, uint32_t next_ip) {
+    reg_materialize(b, b->pending_count);
+    if (b->group_cost > 0) {
+        reg_emit(b, REG_OP_NOP, b->group_ip, b->group_cost, b->mat);
+    }
+    b->group_ip = next_ip;
+    b->group_cost = 0;
+}
+
+/*
+ * Emits op for the instruction at ip consuming the top `pops` values; the
+ * pending literals among them become constant operands.
+ */
+static reg_insn_t *reg_consume(reg_builder_t *b, reg_op_t op, uint32_t ip, uint32_t size, uint32_t pops) {
+    if (b->pending_count > pops) {
+        reg_materialize(b, b->pending_count - pops);
+    }
+    uint32_t depth = b->mat + b->pending_count;
+    uint32_t first_ip = b->pending_count > 0 ? b->pending[0].ip : b->group_ip;
+    uint32_t cost = b->group_cost + 1;
+    uint32_t operands[2] = {0, 0};
+    for (uint32_t i = 0; i < pops; ++i) {
+        uint32_t pos = depth - pops + i;
+        if (pos < b->mat) {
+            operands[i] = pos;
+        } else {
+            const reg_pending_t *p = &b->pending[pos - b->mat];
+            operands[i] = reg_const(b, p->value);
+            cost += p->cost;
+        }
+    }
+    uint32_t sp = b->mat;
+    b->mat = depth - pops;
+    b->pending_count = 0;
+    b->group_ip = ip + size;
+    b->group_cost = 0;
+    reg_insn_t *insn = reg_emit(b, op, first_ip, cost, sp);
+    if (insn) {
+        insn->dst = b->mat;
+        insn->a = operands[0];
+        insn->b = operands[1];
+    }
+    return insn;
+}
+
+static void reg_translate_insn(reg_builder_t *b, uint32_t ip) {
+    const vm_insn_t *insn = &b->insns[ip];
+    reg_insn_t *out = NULL;
+    switch ((vm_op_t)insn->op) {
+    case VM_OP_PUSHD:
+        b->pending[b->pending_count].value = insn->arg;
+        b->pending[b->pending_count].ip = b->group_ip;
+        b->pending[b->pending_count].cost = b->group_cost + 1;
+        b->pending_count++;
+        b->group_ip = ip + insn->size;
+        b->group_cost = 0;
+        return;
+    case VM_OP_NOP:
+        b->group_cost++;
+        return;
+    case VM_OP_ADD10:
+        out = reg_consume(b, REG_OP_ADD, ip, insn->size, 2);
+        break;
+    case VM_OP_SUB10:
+        out = reg_consume(b, REG_OP_SUB, ip, insn->size, 2);
+        break;
+    case VM_OP_MUL10:
+        out = reg_consume(b, REG_OP_MUL, ip, insn->size, 2);
+        break;
+    case VM_OP_DIV10:
+        out = reg_consume(b, REG_OP_DIV, ip, insn->size, 2);
+        break;
+    case VM_OP_MOD10:
+        out = reg_consume(b, REG_OP_MOD, ip, insn->size, 2);
+        break;
+    case VM_OP_CMP:
+        out = reg_consume(b, REG_OP_CMP, ip, insn->size, 2);
+        break;
+    case VM_OP_HASH10:
+        out = reg_consume(b, REG_OP_HASH, ip, insn->size, 1);
+        break;
+    case VM_OP_READ_FKV:
+        out = reg_consume(b, REG_OP_READ, ip, insn->size, 1);
+        break;
+    case VM_OP_SUM_PREFIX:
+        out = reg_consume(b, REG_OP_SUM_PREFIX, ip, insn->size, 1);
+        break;
+    case VM_OP_COUNT_PREFIX:
+        out = reg_consume(b, REG_OP_COUNT_PREFIX, ip, insn->size, 1);
+        break;
+    case VM_OP_WRITE_FKV:
+        reg_consume(b, REG_OP_WRITE, ip, insn->size, 2);
+        return;
+    case VM_OP_RANDOM10:
+        out = reg_consume(b, REG_OP_RANDOM, ip, insn->size, 0);
+        break;
+    case VM_OP_TIME10:
+        out = reg_consume(b, REG_OP_TIME, ip, insn->size, 0);
+        break;
+    case VM_OP_JZ:
+    case VM_OP_JNZ:
+        out = reg_consume(b, insn->op == VM_OP_JZ ? REG_OP_JZ : REG_OP_JNZ, ip, insn->size, 1);
+        if (out) {
+            /* Patched to an instruction index once every label is placed. */
+            out->target = (uint32_t)insn->target;
+        }
+        return;
+    case VM_OP_HALT:
+    case VM_OP_RET:
+    case VM_OP_END: {
+        /* The result is the stack top, so it has to be in its slot. */
+        reg_materialize(b, b->pending_count);
+        uint32_t cost = b->group_cost + (insn->op == VM_OP_END ? 0 : 1);
+        reg_op_t op = insn->op == VM_OP_HALT ? REG_OP_HALT : (insn->op == VM_OP_RET ? REG_OP_RET : REG_OP_END);
+        out = reg_emit(b, op, b->group_ip, cost, b->mat);
+        if (out) {
+            out->dst = b->mat;
+        }
+        b->group_ip = ip + insn->size;
+        b->group_cost = 0;
+        return;
+    }
+    default:
+        b->failed = 1;
+        return;
+    }
+    if (out) {
+        b->mat++;
+    }
+}
+
+static void reg_prog_free(reg_prog_t *prog) {
+    free(prog->insns);
+    free(prog->consts);
+    memset(prog, 0, sizeof(*prog));
+}
+
+static int reg_translate(const prog_t *p, reg_prog_t *out) {
+    reg_builder_t b;
+    memset(&b, 0, sizeof(b));
+    b.len = p->len;
+    vm_insn_t *insns = malloc((p->len + 1) * sizeof(*insns));
+    b.depth = malloc((p->len + 1) * sizeof(*b.depth));
+    b.label = calloc(p->len + 1, 1);
+    b.at = malloc((p->len + 1) * sizeof(*b.at));
+    int rc = -1;
+    if (!insns || !b.depth || !b.label || !b.at) {
+        goto out;
+    }
+    vm_decode(p, insns);
+    b.insns = insns;
+    for (size_t ip = 0; ip <= p->len; ++ip) {
+        b.depth[ip] = -1;
+    }
+    if (reg_analyze(&b) != 0) {
+        goto out;
+    }
+    b.pending = malloc(((size_t)b.out.depth + 1) * sizeof(*b.pending));
+    if (!b.pending) {
+        goto out;
+    }
+
+    int falls = 1; /* the previous instruction continues at ip */
+    for (uint32_t ip = 0; ip <= p->len && !b.failed; ++ip) {
+        if (b.depth[ip] < 0) {
+            continue;
+        }
+        if (b.label[ip] || !falls) {
+            if (falls) {
+                reg_flush(&b, ip);
+            }
+            b.mat = (uint32_t)b.depth[ip];
+            b.pending_count = 0;
+            b.group_ip = ip;
+            b.group_cost = 0;
+        }
+        b.at[ip] = (uint32_t)b.out.count;
+        reg_translate_insn(&b, ip);
+        vm_op_t op = (vm_op_t)insns[ip].op;
+        falls = op != VM_OP_HALT && op != VM_OP_RET && op != VM_OP_END;
+    }
+    if (b.failed) {
+        goto out;
+    }
+    for (size_t i = 0; i < b.out.count; ++i) {
+        reg_insn_t *insn = &b.out.insns[i];
+        if (insn->op == REG_OP_JZ || insn->op == REG_OP_JNZ) {
+            insn->target = b.at[insn->target];
+        }
+    }
+    *out = b.out;
+    memset(&b.out, 0, sizeof(b.out));
+    rc = 0;
+
+out:
+    reg_prog_free(&b.out);
+    free(b.pending);
+    free(b.at);
+    free(b.label);
+    free(b.depth);
+    free(insns);
+    return rc;
+}
+
+static uint64_t reg_hash(const prog_t *p) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < p->len; ++i) {
+        h ^= p->code[i];
+        h *= 1099511628211ull;
+    }
+    return h ^ (uint64_t)p->len;
+}
+
+static void reg_entry_clear(reg_entry_t *entry) {
+    reg_prog_free(&entry->prog);
+    free(entry->code);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Returns the translation of p with a reference held, or NULL. */
+static reg_entry_t *reg_acquire(const prog_t *p) {
+    uint64_t hash = reg_hash(p);
+    reg_entry_t *entry = &reg_cache[hash % VM_REG_CACHE_SLOTS];
+    reg_entry_t *result = NULL;
+
+    pthread_mutex_lock(&reg_lock);
+    int same = entry->state != REG_ENTRY_EMPTY && entry->hash == hash && entry->len == p->len &&
+               memcmp(entry->code, p->code, p->len) == 0;
+    if (!same) {
+        if (entry->refs > 0) {
+            goto out; /* slot busy with another program */
+        }
+        reg_entry_clear(entry);
+        entry->code = malloc(p->len);
+        if (!entry->code) {
+            goto out;
+        }
+        memcpy(entry->code, p->code, p->len);
+        entry->len = p->len;
+        entry->hash = hash;
+        entry->state = reg_translate(p, &entry->prog) == 0 ? REG_ENTRY_TRANSLATED : REG_ENTRY_REJECTED;
+    }
+    if (entry->state == REG_ENTRY_TRANSLATED) {
+        entry->refs++;
+        result = entry;
+    }
+out:
+    pthread_mutex_unlock(&reg_lock);
+    return result;
+}
+
+static void reg_release(reg_entry_t *entry) {
+    pthread_mutex_lock(&reg_lock);
+    entry->refs--;
+    pthread_mutex_unlock(&reg_lock);
+}
+
+void vm_register_flush(void) {
+    pthread_mutex_lock(&reg_lock);
+    for (size_t i = 0; i < VM_REG_CACHE_SLOTS; ++i) {
+        if (reg_cache[i].refs == 0) {
+            reg_entry_clear(&reg_cache[i]);
+        }
+    }
+    pthread_mutex_unlock(&reg_lock);
+}
+
+static int reg_exec(const reg_prog_t *prog,
+                    const prog_t *p,
+                    uint32_t max_steps,
+                    uint32_t max_stack,
+                    int64_t *r,
+                    vm_result_t *out) {
+    const reg_insn_t *insn = prog->insns;
+    uint32_t steps = 0;
+    uint32_t sp = 0;
+    vm_status_t status = VM_OK;
+    uint8_t halted = 0;
+
+    for (;; ++insn) {
+        if (insn->cost > max_steps - steps) {
+            /* Not enough gas for the whole group: finish on the interpreter. */
+            vm_exec_state_t state;
+            state.ip = insn->ip;
+            state.sp = insn->sp;
+            state.steps = steps;
+            state.gas = steps;
+            state.call_sp = 0;
+            return vm_exec_switch_resume(p, max_steps, max_steps, max_stack, r, &state, NULL, out);
+        }
+        steps += insn->cost;
+        switch ((reg_op_t)insn->op) {
+        case REG_OP_MOV:
+            r[insn->dst] = r[insn->a];
+            continue;
+        case REG_OP_ADD:
+            r[insn->dst] = (int64_t)((uint64_t)r[insn->a] + (uint64_t)r[insn->b]);
+            continue;
+        case REG_OP_SUB:
+            r[insn->dst] = (int64_t)((uint64_t)r[insn->a] - (uint64_t)r[insn->b]);
+            continue;
+        case REG_OP_MUL:
+            r[insn->dst] = (int64_t)((uint64_t)r[insn->a] * (uint64_t)r[insn->b]);
+            continue;
+        case REG_OP_DIV:
+        case REG_OP_MOD: {
+            int64_t divisor = r[insn->b];
+            if (divisor == 0) {
+                status = VM_ERR_DIV_BY_ZERO;
+                sp = insn->dst;
+                goto done;
+            }
+            r[insn->dst] = insn->op == REG_OP_DIV ? vm_div10(r[insn->a], divisor) : vm_mod10(r[insn->a], divisor);
+            continue;
+        }
+        case REG_OP_CMP: {
+            int64_t a = r[insn->a];
+            int64_t b = r[insn->b];
+            r[insn->dst] = (a > b) - (a < b);
+            continue;
+        }
+        case REG_OP_HASH:
+            r[insn->dst] = vm_hash10(r[insn->a]);
+            continue;
+        case REG_OP_READ:
+        case REG_OP_SUM_PREFIX:
+        case REG_OP_COUNT_PREFIX: {
+            int64_t value = 0;
+            if (insn->op == REG_OP_READ) {
+                status = vm_fkv_read(r[insn->a], &value);
+            } else if (insn->op == REG_OP_SUM_PREFIX) {
+                status = vm_fkv_sum_prefix(r[insn->a], &value);
+            } else {
+                status = vm_fkv_count_prefix(r[insn->a], &value);
+            }
+            if (status != VM_OK) {
+                sp = insn->dst;
+                goto done;
+            }
+            r[insn->dst] = value;
+            continue;
+        }
+        case REG_OP_WRITE:
+            status = vm_fkv_write(r[insn->a], r[insn->b]);
+            if (status != VM_OK) {
+                sp = insn->dst;
+                goto done;
+            }
+            continue;
+        case REG_OP_RANDOM:
+            r[insn->dst] = vm_random10();
+            continue;
+        case REG_OP_TIME:
+            r[insn->dst] = vm_time10();
+            continue;
+        case REG_OP_JZ:
+            if (r[insn->a] == 0) {
+                insn = &prog->insns[insn->target] - 1;
+            }
+            continue;
+        case REG_OP_JNZ:
+            if (r[insn->a] != 0) {
+                insn = &prog->insns[insn->target] - 1;
+            }
+            continue;
+        case REG_OP_NOP:
+            continue;
+        case REG_OP_HALT:
+            halted = 1;
+            sp = insn->dst;
+            goto done;
+        case REG_OP_RET:
+        case REG_OP_END:
+            sp = insn->dst;
+            goto done;
+        }
+    }
+
+done:
+    out->status = status;
+    out->steps = steps;
+    out->gas_used = steps;
+    out->result = sp > 0 ? (uint64_t)r[sp - 1] : 0;
+    out->halted = halted;
+    return 0;
+}
+
+int vm_run_register(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t max_stack = vm_effective_max_stack(lim);
+    /* Register code does not record traces and charges every opcode 1. */
+    reg_entry_t *entry = (trace || vm_gas_table()) ? NULL : reg_acquire(p);
+    if (entry && entry->prog.depth > max_stack) {
+        /* Overflows under these limits; let the interpreter report it. */
+        reg_release(entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        return vm_run_threaded(p, lim, trace, out);
+    }
+
+    const reg_prog_t *prog = &entry->prog;
+    size_t regs = (size_t)prog->depth + prog->const_count;
+    if (regs < max_stack) {
+        regs = max_stack; /* the interpreter may take over the file as its stack */
+    }
+    int64_t inline_regs[VM_REG_INLINE_REGS];
+    int64_t *r = inline_regs;
+    if (regs > VM_REG_INLINE_REGS) {
+        r = malloc(regs * sizeof(*r));
+        if (!r) {
+            reg_release(entry);
+            return -1;
+        }
+    }
+    memcpy(r + prog->depth, prog->consts, prog->const_count * sizeof(*r));
+    int rc = reg_exec(prog, p, vm_effective_max_steps(lim), max_stack, r, out);
+    reg_release(entry);
+    if (r != inline_regs) {
+        free(r);
+    }
+    return rc;
+}
@@ -0,0 +1,261 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_THREADED_COMPUTED_GOTO 1
+#else
+#define VM_THREADED_COMPUTED_GOTO 0
+#endif
+
+/* Programs up to this many bytes are decoded into a stack buffer. */
+#define VM_THREADED_INLINE_INSNS 256
+
+static uint16_t read_u16(const uint8_t *code) {
+    return (uint16_t)code[0] | ((uint16_t)code[1] << 8);
+}
+
+void vm_decode(const prog_t *p, vm_insn_t *insns) {
+    size_t len = p->len;
+    for (size_t ip = 0; ip < len; ++ip) {
+        vm_insn_t *insn = &insns[ip];
+        uint8_t code = p->code[ip];
+        insn->code = code;
+        insn->size = 1;
+        insn->weight = 1;
+        insn->target = VM_TARGET_INVALID;
+        insn->arg = 0;
+
+        switch (code) {
+        case 0x01: // PUSHd
+            if (ip + 1 >= len) {
+                insn->op = VM_OP_TRUNC;
+                break;
+            }
+            insn->op = VM_OP_PUSHD;
+            insn->arg = p->code[ip + 1];
+            insn->size = 2;
+            break;
+        case 0x02:
+            insn->op = VM_OP_ADD10;
+            break;
+        case 0x03:
+            insn->op = VM_OP_SUB10;
+            break;
+        case 0x04:
+            insn->op = VM_OP_MUL10;
+            break;
+        case 0x05:
+            insn->op = VM_OP_DIV10;
+            break;
+        case 0x06:
+            insn->op = VM_OP_MOD10;
+            break;
+        case 0x07:
+            insn->op = VM_OP_CMP;
+            break;
+        case 0x08: // JZ
+        case 0x09: { // JNZ
+            if (ip + 2 >= len) {
+                insn->op = VM_OP_TRUNC;
+                break;
+            }
+            insn->op = (code == 0x08) ? VM_OP_JZ : VM_OP_JNZ;
+            insn->size = 3;
+            int64_t new_ip = (int64_t)ip + 3 + (int16_t)read_u16(&p->code[ip + 1]);
+            if (new_ip >= 0 && new_ip <= (int64_t)len) {
+                insn->target = (int32_t)new_ip;
+            }
+            break;
+        }
+        case 0x0A: { // CALL
+            if (ip + 2 >= len) {
+                insn->op = VM_OP_TRUNC;
+                break;
+            }
+            insn->op = VM_OP_CALL;
+            insn->size = 3;
+            uint16_t addr = read_u16(&p->code[ip + 1]);
+            if (addr < len) {
+                insn->target = (int32_t)addr;
+            }
+            /* The reference interpreter keeps return addresses as uint16_t. */
+            insn->arg = (uint16_t)(ip + 3);
+            break;
+        }
+        case 0x0B:
+            insn->op = VM_OP_RET;
+            break;
+        case 0x0C:
+            insn->op = VM_OP_READ_FKV;
+            break;
+        case 0x0D:
+            insn->op = VM_OP_WRITE_FKV;
+            break;
+        case 0x0E:
+            insn->op = VM_OP_HASH10;
+            break;
+        case 0x0F:
+            insn->op = VM_OP_RANDOM10;
+            break;
+        case 0x10:
+            insn->op = VM_OP_TIME10;
+            break;
+        case 0x11:
+            insn->op = VM_OP_NOP;
+            break;
+        case 0x12:
+            insn->op = VM_OP_HALT;
+            break;
+        case 0x14:
+            insn->op = VM_OP_SUM_PREFIX;
+            break;
+        case 0x15:
+            insn->op = VM_OP_COUNT_PREFIX;
+            break;
+        case 0x13: { // PUSHN, decoded as a wide PUSHd
+            int64_t value = 0;
+            int used = vm_read_pushn(p->code, len, ip + 1, &value);
+            if (used <= 0) {
+                insn->op = used == 0 ? VM_OP_TRUNC : VM_OP_INVALID;
+                break;
+            }
+            insn->op = VM_OP_PUSHD;
+            insn->arg = value;
+            insn->size = (uint8_t)(1 + used);
+            break;
+        }
+        default:
+            insn->op = VM_OP_INVALID;
+            break;
+        }
+    }
+
+    vm_insn_t *end = &insns[len];
+    memset(end, 0, sizeof(*end));
+    end->op = VM_OP_END;
+    end->target = VM_TARGET_INVALID;
+}
+
+int vm_mark_reachable(const vm_insn_t *insns, size_t len, uint8_t *reach) {
+    uint32_t *work = malloc((len + 1) * sizeof(*work));
+    if (!work) {
+        return -1;
+    }
+    size_t top = 0;
+    reach[0] = 1;
+    work[top++] = 0;
+    while (top > 0) {
+        uint32_t ip = work[--top];
+        const vm_insn_t *insn = &insns[ip];
+        uint32_t next[2];
+        size_t count = 0;
+        switch ((vm_op_t)insn->op) {
+        case VM_OP_END:
+        case VM_OP_HALT:
+        case VM_OP_RET:
+        case VM_OP_INVALID:
+        case VM_OP_TRUNC:
+        case VM_OP_COUNT:
+            break;
+        case VM_OP_JZ:
+        case VM_OP_JNZ:
+        case VM_OP_CALL:
+        case VM_OP_CMP_JZ:
+        case VM_OP_CMP_JNZ:
+            next[count++] = ip + insn->size;
+            if (insn->target != VM_TARGET_INVALID) {
+                next[count++] = (uint32_t)insn->target;
+            }
+            break;
+        default:
+            next[count++] = ip + insn->size;
+            break;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (next[i] <= len && !reach[next[i]]) {
+                reach[next[i]] = 1;
+                work[top++] = next[i];
+            }
+        }
+    }
+    free(work);
+    return 0;
+}
+
+#define VM_EXEC_NAME exec_decoded
+#define VM_EXEC_CHECKED 1
+#include "vm/vm_exec_template.h"
+
+#define VM_EXEC_NAME exec_verified
+#define VM_EXEC_CHECKED 0
+#include "vm/vm_exec_template.h"
+
+#define VM_EXEC_NAME exec_fused
+#define VM_EXEC_CHECKED 0
+#define VM_EXEC_FUSED 1
+#include "vm/vm_exec_template.h"
+
+int vm_exec_threaded(const prog_t *p,
+                     uint32_t max_steps,
+                     uint32_t max_stack,
+                     int64_t *stack,
+                     vm_insn_t *insns,
+                     vm_trace_t *trace,
+                     vm_result_t *out) {
+    vm_decode(p, insns);
+    return exec_decoded(insns, max_steps, max_stack, stack, trace, out);
+}
+
+int vm_run_threaded(const prog_t *p, const vm_limits_t *lim, vm_trace_t *trace, vm_result_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t max_steps = vm_effective_max_steps(lim);
+    uint32_t max_stack = vm_effective_max_stack(lim);
+
+    vm_insn_t inline_insns[VM_THREADED_INLINE_INSNS + 1];
+    vm_insn_t *insns = inline_insns;
+    if (p->len > VM_THREADED_INLINE_INSNS) {
+        insns = malloc((p->len + 1) * sizeof(*insns));
+        if (!insns) {
+            return -1;
+        }
+    }
+    int64_t *stack = calloc(max_stack, sizeof(int64_t));
+    if (!stack) {
+        if (insns != inline_insns) {
+            free(insns);
+        }
+        return -1;
+    }
+
+    int rc = vm_exec_threaded(p, max_steps, max_stack, stack, insns, trace, out);
+
+    free(stack);
+    if (insns != inline_insns) {
+        free(insns);
+    }
+    return rc;
+}
+
+int vm_exec_verified(const vm_insn_t *insns,
+                     uint32_t max_steps,
+                     int64_t *stack,
+                     vm_trace_t *trace,
+                     vm_result_t *out) {
+    return exec_verified(insns, max_steps, UINT32_MAX, stack, trace, out);
+}
+
+int vm_exec_fused(const vm_insn_t *fused,
+                  const vm_insn_t *base,
+                  uint32_t max_steps,
+                  int64_t *stack,
+                  vm_result_t *out) {
+    return exec_fused(fused, base, max_steps, UINT32_MAX, stack, NULL, out);
+}
@@ -0,0 +1,214 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Trace stream format: the header "KVT" 0x01, then records. A run record
+ * is the single byte 0x01. A step record is 0x02, the opcode byte, and
+ * unsigned LEB128 fields: step minus the previous step of the run, ip,
+ * gas left and the zigzag-encoded stack top. Most steps take 6 bytes.
+ */
+
+static const uint8_t trace_stream_magic[4] = {'K', 'V', 'T', 1};
+
+/* Longest step record: tag, opcode, three 32-bit and one 64-bit LEB128. */
+#define VM_TRACE_RECORD_MAX (2 + 3 * 5 + 10)
+
+static int sink_write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+void vm_trace_sink_init(vm_trace_sink_t *sink, int fd) {
+    if (!sink) {
+        return;
+    }
+    memset(sink, 0, offsetof(vm_trace_sink_t, buffer));
+    sink->fd = fd;
+    memcpy(sink->buffer, trace_stream_magic, sizeof(trace_stream_magic));
+    sink->len = sizeof(trace_stream_magic);
+}
+
+int vm_trace_sink_flush(vm_trace_sink_t *sink) {
+    if (!sink) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sink->error) {
+        errno = sink->error;
+        return -1;
+    }
+    if (sink->len > 0 && sink_write_all(sink->fd, sink->buffer, sink->len) != 0) {
+        sink->error = errno;
+        return -1;
+    }
+    sink->len = 0;
+    return 0;
+}
+
+static void sink_reserve(vm_trace_sink_t *sink, size_t bytes) {
+    if (sink->len + bytes > VM_TRACE_SINK_BUFFER) {
+        vm_trace_sink_flush(sink);
+        /* After a failed write the buffer is recycled and its data lost. */
+        sink->len = 0;
+    }
+}
+
+static void sink_put_uleb(vm_trace_sink_t *sink, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        sink->buffer[sink->len++] = byte | (value ? 0x80 : 0);
+    } while (value);
+}
+
+static void sink_run(vm_trace_sink_t *sink) {
+    sink_reserve(sink, 1);
+    sink->buffer[sink->len++] = VM_TRACE_RECORD_RUN;
+    sink->last_step = 0;
+}
+
+static void sink_step(vm_trace_sink_t *sink, const vm_trace_entry_t *entry) {
+    sink_reserve(sink, VM_TRACE_RECORD_MAX);
+    sink->buffer[sink->len++] = VM_TRACE_RECORD_STEP;
+    sink->buffer[sink->len++] = entry->opcode;
+    sink_put_uleb(sink, entry->step - sink->last_step);
+    sink_put_uleb(sink, entry->ip);
+    sink_put_uleb(sink, entry->gas_left);
+    int64_t top = (int64_t)entry->stack_top;
+    sink_put_uleb(sink, ((uint64_t)top << 1) ^ (uint64_t)(top >> 63));
+    sink->last_step = entry->step;
+    sink->records++;
+}
+
+void vm_trace_begin(vm_trace_t *trace) {
+    trace->count = 0;
+    trace->cursor = 0;
+    trace->total = 0;
+    if (trace->sink) {
+        sink_run(trace->sink);
+    }
+}
+
+void vm_trace_record(vm_trace_t *trace,
+                     uint32_t step,
+                     uint32_t ip,
+                     uint8_t opcode,
+                     int64_t stack_top,
+                     uint32_t gas_left) {
+    if (!trace) {
+        return;
+    }
+    if (trace->sample_every > 1 && step % trace->sample_every != 0) {
+        return;
+    }
+    trace->total++;
+    vm_trace_entry_t record = {step, ip, opcode, (uint64_t)stack_top, gas_left};
+    if (trace->sink) {
+        sink_step(trace->sink, &record);
+    }
+    if (!trace->entries || trace->capacity == 0) {
+        return;
+    }
+    if (trace->mode == VM_TRACE_RING) {
+        trace->entries[trace->cursor] = record;
+        trace->cursor = (trace->cursor + 1) % trace->capacity;
+        if (trace->count < trace->capacity) {
+            trace->count++;
+        }
+        return;
+    }
+    if (trace->count >= trace->capacity) {
+        return;
+    }
+    trace->entries[trace->count++] = record;
+}
+
+const vm_trace_entry_t *vm_trace_at(const vm_trace_t *trace, size_t i) {
+    if (!trace || i >= trace->count) {
+        return NULL;
+    }
+    if (trace->mode == VM_TRACE_RING && trace->count == trace->capacity) {
+        return &trace->entries[(trace->cursor + i) % trace->capacity];
+    }
+    return &trace->entries[i];
+}
+
+int vm_trace_reader_init(vm_trace_reader_t *reader, const uint8_t *data, size_t len) {
+    if (!reader || !data || len < sizeof(trace_stream_magic) ||
+        memcmp(data, trace_stream_magic, sizeof(trace_stream_magic)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->data = data;
+    reader->len = len;
+    reader->offset = sizeof(trace_stream_magic);
+    reader->step = 0;
+    return 0;
+}
+
+static int reader_uleb(vm_trace_reader_t *reader, uint64_t max, uint64_t *out) {
+    int64_t value = 0;
+    int used = vm_read_pushn(reader->data, reader->len, reader->offset, &value);
+    if (used <= 0 || (uint64_t)value > max) {
+        return -1;
+    }
+    reader->offset += (size_t)used;
+    *out = (uint64_t)value;
+    return 0;
+}
+
+int vm_trace_reader_next(vm_trace_reader_t *reader, vm_trace_record_t *record) {
+    if (!reader || !record) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (reader->offset >= reader->len) {
+        return 0;
+    }
+    memset(record, 0, sizeof(*record));
+    uint8_t tag = reader->data[reader->offset++];
+    if (tag == VM_TRACE_RECORD_RUN) {
+        record->kind = VM_TRACE_RECORD_RUN;
+        reader->step = 0;
+        return 1;
+    }
+    if (tag != VM_TRACE_RECORD_STEP || reader->offset >= reader->len) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t delta = 0;
+    uint64_t ip = 0;
+    uint64_t gas = 0;
+    uint64_t top = 0;
+    record->entry.opcode = reader->data[reader->offset++];
+    if (reader_uleb(reader, UINT32_MAX - reader->step, &delta) != 0 ||
+        reader_uleb(reader, UINT32_MAX, &ip) != 0 || reader_uleb(reader, UINT32_MAX, &gas) != 0 ||
+        reader_uleb(reader, UINT64_MAX, &top) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->step += (uint32_t)delta;
+    record->kind = VM_TRACE_RECORD_STEP;
+    record->entry.step = reader->step;
+    record->entry.ip = (uint32_t)ip;
+    record->entry.gas_left = (uint32_t)gas;
+    record->entry.stack_top = (uint64_t)((top >> 1) ^ (0 - (top & 1)));
+    return 1;
+}
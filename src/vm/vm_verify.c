@@ -0,0 +1,505 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#include "vm/vm_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Abstract interpretation over the decoded table. The abstract state at an
+ * instruction is the operand stack depth together with the chain of pending
+ * return addresses (an interned call frame). Depths are bounded by max_stack
+ * and frames by the call stack limit, so the set of reachable states is
+ * finite; a loop that keeps growing the stack is rejected once it passes
+ * max_stack. A program is accepted when no reachable state can fail for
+ * structural reasons. Only data-dependent failures (gas, division by zero,
+ * F-KV) remain for the executor to check.
+ *
+ * Every step of a run moves along one edge of the reachable state graph,
+ * so once a program is accepted its step bounds are path lengths in that
+ * graph; when it is acyclic, the shortest and longest paths.
+ */
+
+#define VM_VERIFY_MAX_FRAMES 1024
+#define VM_VERIFY_MAX_STATES 65536
+#define VM_VERIFY_INLINE_STACK 128
+
+typedef struct {
+    uint32_t ret_ip;
+    int32_t parent;
+    uint32_t level;
+} verify_frame_t;
+
+typedef struct {
+    uint32_t ip;
+    int32_t frame;
+    uint32_t depth;
+    int32_t next; /* next state recorded for the same ip */
+} verify_state_t;
+
+typedef struct {
+    const vm_insn_t *insns;
+    size_t len;
+    uint32_t max_stack;
+
+    verify_frame_t frames[VM_VERIFY_MAX_FRAMES];
+    size_t frame_count;
+
+    verify_state_t *states;
+    size_t state_count;
+    size_t state_capacity;
+    int32_t *heads; /* len + 1 entries, -1 when unreached */
+    int32_t *worklist;
+    size_t work_count;
+
+    uint32_t max_depth;
+    uint32_t max_call_depth;
+    vm_status_t reject_status;
+    uint32_t reject_ip;
+    int failed; /* 1 rejected, -1 resource error */
+} verifier_t;
+
+static void verify_reject(verifier_t *v, uint32_t ip, vm_status_t status) {
+    if (v->failed == 0) {
+        v->failed = 1;
+        v->reject_status = status;
+        v->reject_ip = ip;
+    }
+}
+
+static void verify_error(verifier_t *v, int err) {
+    if (v->failed == 0) {
+        v->failed = -1;
+        errno = err;
+    }
+}
+
+static int32_t verify_intern_frame(verifier_t *v, uint32_t ret_ip, int32_t parent) {
+    for (size_t i = 1; i < v->frame_count; ++i) {
+        if (v->frames[i].ret_ip == ret_ip && v->frames[i].parent == parent) {
+            return (int32_t)i;
+        }
+    }
+    if (v->frame_count >= VM_VERIFY_MAX_FRAMES) {
+        verify_error(v, E2BIG);
+        return -1;
+    }
+    verify_frame_t *frame = &v->frames[v->frame_count];
+    frame->ret_ip = ret_ip;
+    frame->parent = parent;
+    frame->level = v->frames[parent].level + 1;
+    return (int32_t)v->frame_count++;
+}
+
+static void verify_visit(verifier_t *v, uint32_t ip, int32_t frame, uint32_t depth) {
+    for (int32_t s = v->heads[ip]; s >= 0; s = v->states[s].next) {
+        if (v->states[s].frame == frame && v->states[s].depth == depth) {
+            return;
+        }
+    }
+    if (v->state_count == v->state_capacity) {
+        if (v->state_capacity >= VM_VERIFY_MAX_STATES) {
+            verify_error(v, E2BIG);
+            return;
+        }
+        size_t capacity = v->state_capacity ? v->state_capacity * 2 : 64;
+        verify_state_t *states = realloc(v->states, capacity * sizeof(*states));
+        if (!states) {
+            verify_error(v, ENOMEM);
+            return;
+        }
+        v->states = states;
+        int32_t *worklist = realloc(v->worklist, capacity * sizeof(*worklist));
+        if (!worklist) {
+            verify_error(v, ENOMEM);
+            return;
+        }
+        v->worklist = worklist;
+        v->state_capacity = capacity;
+    }
+    int32_t idx = (int32_t)v->state_count++;
+    v->states[idx].ip = ip;
+    v->states[idx].frame = frame;
+    v->states[idx].depth = depth;
+    v->states[idx].next = v->heads[ip];
+    v->heads[ip] = idx;
+    v->worklist[v->work_count++] = idx;
+}
+
+static void verify_stack_effect(vm_op_t op, uint32_t *pops, uint32_t *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (op) {
+    case VM_OP_PUSHD:
+    case VM_OP_RANDOM10:
+    case VM_OP_TIME10:
+        *pushes = 1;
+        break;
+    case VM_OP_ADD10:
+    case VM_OP_SUB10:
+    case VM_OP_MUL10:
+    case VM_OP_DIV10:
+    case VM_OP_MOD10:
+    case VM_OP_CMP:
+        *pops = 2;
+        *pushes = 1;
+        break;
+    case VM_OP_READ_FKV:
+    case VM_OP_SUM_PREFIX:
+    case VM_OP_COUNT_PREFIX:
+    case VM_OP_HASH10:
+        *pops = 1;
+        *pushes = 1;
+        break;
+    case VM_OP_JZ:
+    case VM_OP_JNZ:
+        *pops = 1;
+        break;
+    case VM_OP_WRITE_FKV:
+        *pops = 2;
+        break;
+    default:
+        break;
+    }
+}
+
+static void verify_step(verifier_t *v, const verify_state_t *state) {
+    uint32_t ip = state->ip;
+    int32_t frame = state->frame;
+    const vm_insn_t *insn = &v->insns[ip];
+    vm_op_t op = (vm_op_t)insn->op;
+
+    if (op == VM_OP_INVALID || op == VM_OP_TRUNC) {
+        verify_reject(v, ip, VM_ERR_INVALID_OPCODE);
+        return;
+    }
+
+    uint32_t pops = 0;
+    uint32_t pushes = 0;
+    verify_stack_effect(op, &pops, &pushes);
+    if (state->depth < pops) {
+        verify_reject(v, ip, VM_ERR_STACK_UNDERFLOW);
+        return;
+    }
+    uint32_t depth = state->depth - pops + pushes;
+    if (depth > v->max_stack) {
+        verify_reject(v, ip, VM_ERR_STACK_OVERFLOW);
+        return;
+    }
+    if (depth > v->max_depth) {
+        v->max_depth = depth;
+    }
+
+    switch (op) {
+    case VM_OP_HALT:
+    case VM_OP_END:
+        return;
+    case VM_OP_JZ:
+    case VM_OP_JNZ:
+        if (insn->target == VM_TARGET_INVALID) {
+            verify_reject(v, ip, VM_ERR_INVALID_OPCODE);
+            return;
+        }
+        verify_visit(v, ip + insn->size, frame, depth);
+        verify_visit(v, (uint32_t)insn->target, frame, depth);
+        return;
+    case VM_OP_CALL: {
+        if (insn->target == VM_TARGET_INVALID || ip + insn->size > UINT16_MAX) {
+            verify_reject(v, ip, VM_ERR_INVALID_OPCODE);
+            return;
+        }
+        if (v->frames[frame].level >= VM_CALL_STACK_MAX) {
+            verify_reject(v, ip, VM_ERR_STACK_OVERFLOW);
+            return;
+        }
+        int32_t callee = verify_intern_frame(v, ip + insn->size, frame);
+        if (callee < 0) {
+            return;
+        }
+        if (v->frames[callee].level > v->max_call_depth) {
+            v->max_call_depth = v->frames[callee].level;
+        }
+        verify_visit(v, (uint32_t)insn->target, callee, depth);
+        return;
+    }
+    case VM_OP_RET:
+        if (frame == 0) {
+            return;
+        }
+        verify_visit(v, v->frames[frame].ret_ip, v->frames[frame].parent, depth);
+        return;
+    default:
+        verify_visit(v, ip + insn->size, frame, depth);
+        return;
+    }
+}
+
+static int32_t verify_find(const verifier_t *v, uint32_t ip, int32_t frame, uint32_t depth) {
+    for (int32_t s = v->heads[ip]; s >= 0; s = v->states[s].next) {
+        if (v->states[s].frame == frame && v->states[s].depth == depth) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+/* Successor states of an accepted state, as verify_step() visited them. */
+static size_t verify_successors(verifier_t *v, const verify_state_t *state, int32_t succ[2]) {
+    const vm_insn_t *insn = &v->insns[state->ip];
+    vm_op_t op = (vm_op_t)insn->op;
+    uint32_t pops = 0;
+    uint32_t pushes = 0;
+    verify_stack_effect(op, &pops, &pushes);
+    uint32_t depth = state->depth - pops + pushes;
+    uint32_t next = state->ip + insn->size;
+    switch (op) {
+    case VM_OP_HALT:
+    case VM_OP_END:
+        return 0;
+    case VM_OP_JZ:
+    case VM_OP_JNZ:
+        succ[0] = verify_find(v, next, state->frame, depth);
+        succ[1] = verify_find(v, (uint32_t)insn->target, state->frame, depth);
+        return 2;
+    case VM_OP_CALL:
+        succ[0] = verify_find(v, (uint32_t)insn->target, verify_intern_frame(v, next, state->frame), depth);
+        return 1;
+    case VM_OP_RET:
+        if (state->frame == 0) {
+            return 0;
+        }
+        succ[0] = verify_find(v, v->frames[state->frame].ret_ip, v->frames[state->frame].parent, depth);
+        return 1;
+    default:
+        succ[0] = verify_find(v, next, state->frame, depth);
+        return 1;
+    }
+}
+
+static uint32_t gas_add(uint32_t a, uint32_t b) {
+    return a > UINT32_MAX - b ? UINT32_MAX : a + b;
+}
+
+/*
+ * Depth-first walk from the entry state computing the fewest and most steps,
+ * and the least and most gas, to the end of the run from every state;
+ * meeting a state that is still on the walk means a cycle, and the program
+ * is unbounded. Gas sums saturate at UINT32_MAX, which no budget exceeds.
+ */
+static void verify_bound_steps(verifier_t *v, vm_verified_prog_t *out) {
+    size_t n = v->state_count;
+    uint32_t *lo = malloc(n * sizeof(*lo));
+    uint32_t *hi = malloc(n * sizeof(*hi));
+    uint32_t *gas_lo = malloc(n * sizeof(*gas_lo));
+    uint32_t *gas_hi = malloc(n * sizeof(*gas_hi));
+    uint8_t *mark = calloc(n, 1); /* 1 on the walk, 2 finished */
+    int32_t *path = malloc(n * sizeof(*path));
+    uint8_t *edge = malloc(n);
+    if (!lo || !hi || !gas_lo || !gas_hi || !mark || !path || !edge) {
+        free(lo);
+        free(hi);
+        free(gas_lo);
+        free(gas_hi);
+        free(mark);
+        free(path);
+        free(edge);
+        return;
+    }
+    int bounded = 1;
+    size_t top = 0;
+    /* The entry state was recorded first. */
+    path[top] = 0;
+    edge[top++] = 0;
+    mark[0] = 1;
+    while (top > 0) {
+        int32_t s = path[top - 1];
+        int32_t succ[2];
+        size_t count = verify_successors(v, &v->states[s], succ);
+        if (edge[top - 1] < count) {
+            int32_t t = succ[edge[top - 1]++];
+            if (t < 0) {
+                continue;
+            }
+            if (mark[t] == 1) {
+                bounded = 0;
+            } else if (mark[t] == 0) {
+                mark[t] = 1;
+                path[top] = t;
+                edge[top++] = 0;
+            }
+            continue;
+        }
+        const vm_insn_t *insn = &v->insns[v->states[s].ip];
+        uint32_t cost = insn->op == VM_OP_END ? 0 : 1;
+        uint32_t gas = insn->op == VM_OP_END ? 0 : vm_gas_cost(insn->code);
+        uint32_t best_lo = UINT32_MAX;
+        uint32_t best_hi = 0;
+        uint32_t best_gas_lo = UINT32_MAX;
+        uint32_t best_gas_hi = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (succ[i] < 0 || mark[succ[i]] != 2) {
+                continue;
+            }
+            if (lo[succ[i]] < best_lo) {
+                best_lo = lo[succ[i]];
+            }
+            if (hi[succ[i]] > best_hi) {
+                best_hi = hi[succ[i]];
+            }
+            if (gas_lo[succ[i]] < best_gas_lo) {
+                best_gas_lo = gas_lo[succ[i]];
+            }
+            if (gas_hi[succ[i]] > best_gas_hi) {
+                best_gas_hi = gas_hi[succ[i]];
+            }
+        }
+        lo[s] = (count == 0 ? 0 : best_lo) + cost;
+        hi[s] = best_hi + cost;
+        gas_lo[s] = gas_add(count == 0 ? 0 : best_gas_lo, gas);
+        gas_hi[s] = gas_add(best_gas_hi, gas);
+        mark[s] = 2;
+        top--;
+    }
+    /* With a cycle the walk skips edges, so neither value is exact. */
+    if (bounded) {
+        out->bounded = 1;
+        out->min_steps = lo[0];
+        out->max_steps = hi[0];
+        out->min_gas = gas_lo[0];
+        out->max_gas = gas_hi[0];
+    }
+    free(lo);
+    free(hi);
+    free(gas_lo);
+    free(gas_hi);
+    free(mark);
+    free(path);
+    free(edge);
+}
+
+/* No reachable instruction may start inside the operand of another one. */
+static void verify_boundaries(verifier_t *v) {
+    for (size_t ip = 0; ip < v->len && v->failed == 0; ++ip) {
+        if (v->heads[ip] < 0) {
+            continue;
+        }
+        for (size_t k = 1; k < v->insns[ip].size; ++k) {
+            if (v->heads[ip + k] >= 0) {
+                verify_reject(v, (uint32_t)(ip + k), VM_ERR_INVALID_OPCODE);
+                break;
+            }
+        }
+    }
+}
+
+int vm_verify(const prog_t *p, const vm_limits_t *lim, vm_verified_prog_t *out) {
+    if (!p || !p->code || p->len == 0 || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    out->prog = *p;
+
+    vm_insn_t *insns = malloc((p->len + 1) * sizeof(*insns));
+    verifier_t *v = calloc(1, sizeof(*v));
+    int32_t *heads = malloc((p->len + 1) * sizeof(*heads));
+    if (!insns || !v || !heads) {
+        free(insns);
+        free(v);
+        free(heads);
+        errno = ENOMEM;
+        return -1;
+    }
+    vm_decode(p, insns);
+    for (size_t i = 0; i <= p->len; ++i) {
+        heads[i] = -1;
+    }
+
+    v->insns = insns;
+    v->len = p->len;
+    v->max_stack = vm_effective_max_stack(lim);
+    v->heads = heads;
+    v->frames[0].ret_ip = 0;
+    v->frames[0].parent = -1;
+    v->frames[0].level = 0;
+    v->frame_count = 1;
+
+    verify_visit(v, 0, 0, 0);
+    while (v->work_count > 0 && v->failed == 0) {
+        verify_state_t state = v->states[v->worklist[--v->work_count]];
+        verify_step(v, &state);
+    }
+    verify_boundaries(v);
+
+    int rc = v->failed;
+    out->max_depth = v->max_depth;
+    out->max_call_depth = v->max_call_depth;
+    if (rc == 0) {
+        verify_bound_steps(v, out);
+        out->impl = insns;
+    } else {
+        out->reject_status = v->reject_status;
+        out->reject_ip = v->reject_ip;
+        free(insns);
+    }
+    free(v->states);
+    free(v->worklist);
+    free(heads);
+    free(v);
+    return rc;
+}
+
+int vm_run_verified(const vm_verified_prog_t *vp,
+                    const vm_limits_t *lim,
+                    vm_trace_t *trace,
+                    vm_result_t *out) {
+    if (!vp || !vp->impl || !lim || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    /*
+     * The proof was made against a larger stack than these limits allow,
+     * or the profiler needs the reference interpreter.
+     */
+    if (vm_effective_max_stack(lim) < vp->max_depth || vm_profile_enabled()) {
+        return vm_run(&vp->prog, lim, trace, out);
+    }
+
+    vm_cache_key_t key = {0};
+    if (!trace && vm_cache_lookup(&vp->prog, lim, &key, out)) {
+        return 0;
+    }
+
+    int64_t inline_stack[VM_VERIFY_INLINE_STACK];
+    int64_t *stack = inline_stack;
+    if (vp->max_depth > VM_VERIFY_INLINE_STACK) {
+        stack = malloc(vp->max_depth * sizeof(*stack));
+        if (!stack) {
+            return -1;
+        }
+    }
+    vm_rng_begin(&vp->prog, lim->request_id);
+    vm_fkv_txn_begin();
+    int rc = (vp->fused && !trace)
+                 ? vm_exec_fused(vp->fused, vp->impl, vm_effective_max_steps(lim), stack, out)
+                 : vm_exec_verified(vp->impl, vm_effective_max_steps(lim), stack, trace, out);
+    vm_fkv_txn_end(rc, out);
+    if (stack != inline_stack) {
+        free(stack);
+    }
+    if (rc == 0) {
+        vm_cache_store(&key, out);
+    }
+    return rc;
+}
+
+void vm_verified_free(vm_verified_prog_t *vp) {
+    if (!vp) {
+        return;
+    }
+    free(vp->impl);
+    free(vp->fused);
+    vp->impl = NULL;
+    vp->fused = NULL;
+}
@@ -44,6 +44,9 @@ static void test_config_valid(void) {
         "    \"max_steps\": 4096,\n"
         "    \"max_stack\": 256,\n"
         "    \"trace_depth\": 32,\n"
+        "    \"result_cache_entries\": 512,\n"
+        "    \"profile\": true,\n"
+        "    \"gas\": { \"HASH10\": 4, \"WRITE_FKV\": 20, \"HASH10\": 9 },\n"
         "    \"max_stack\": 1024 // duplicate ignored\n"
         "  },\n"
         "  \"fkv\": {\n"
@@ -83,6 +86,11 @@ static void test_config_valid(void) {
     assert(cfg.vm.max_steps == 4096);
     assert(cfg.vm.max_stack == 256);
     assert(cfg.vm.trace_depth == 32);
+    assert(cfg.vm.result_cache_entries == 512);
+    assert(cfg.vm.profile == 1);
+    assert(cfg.vm.gas_costs[0x0E] == 4);
+    assert(cfg.vm.gas_costs[0x0D] == 20);
+    assert(cfg.vm.gas_costs[0x02] == 0);
     assert(cfg.fkv.top_k == 10);
     assert(strcmp(cfg.ai.snapshot_path, "data/custom_snapshot.json") == 0);
     assert(cfg.ai.snapshot_limit == 4096);
@@ -117,10 +125,31 @@ static void test_config_missing_field(void) {
     assert(cfg.vm.max_steps == 2048);
     assert(cfg.vm.max_stack == 128);
     assert(cfg.vm.trace_depth == 64);
+    assert(cfg.vm.result_cache_entries == 4096);
+    assert(cfg.vm.profile == 0);
     assert(cfg.seed == 1337);
     remove_temp_file(path);
 }
 
+static void test_config_invalid_gas(void) {
+    static const char *const schedules[] = {"{ \"HASH11\": 2 }", "{ \"NOP\": 0 }", "{ \"NOP\": -1 }", "[1]"};
+    for (size_t i = 0; i < sizeof(schedules) / sizeof(schedules[0]); ++i) {
+        char content[512];
+        snprintf(content,
+                 sizeof(content),
+                 "{ \"http\": { \"host\": \"0.0.0.0\", \"port\": 9000 },"
+                 " \"vm\": { \"max_steps\": 1, \"max_stack\": 1, \"trace_depth\": 1, \"gas\": %s },"
+                 " \"seed\": 1 }",
+                 schedules[i]);
+        char *path = write_temp_file(content);
+        kolibri_config_t cfg;
+        errno = 0;
+        assert(config_load(path, &cfg) == -1);
+        assert(errno == EINVAL);
+        remove_temp_file(path);
+    }
+}
+
 static void test_config_invalid_json(void) {
     const char *content = "{ \"http\": { \"host\": \"0.0.0.0\" }"; // missing closing braces and other fields
     char *path = write_temp_file(content);
@@ -137,6 +166,7 @@ int main(void) {
     test_config_valid();
     test_config_missing_field();
     test_config_invalid_json();
+    test_config_invalid_gas();
     printf("config tests passed\n");
     return 0;
 }
@@ -4,6 +4,9 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -138,6 +141,100 @@ static void test_load_overwrites_existing(void) {
     unlink(snapshot);
 }
 
+static void test_packed_digits(void) {
+    uint8_t digits[70];
+    uint8_t packed[35];
+    uint8_t unpacked[70];
+    for (size_t i = 0; i < sizeof(digits); ++i) {
+        digits[i] = (uint8_t)((i * 7 + 3) % 10);
+    }
+    for (size_t n = 0; n <= sizeof(digits); ++n) {
+        memset(packed, 0xAA, sizeof(packed));
+        fkv_pack_digits(digits, n, packed);
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t expected = i % 2 ? digits[i] : (uint8_t)(digits[i] << 4);
+            assert((packed[i / 2] & (i % 2 ? 0x0F : 0xF0)) == expected);
+        }
+        if (n % 2) {
+            assert((packed[n / 2] & 0x0F) == 0);
+        }
+        assert(FKV_PACKED_SIZE(n) == n / 2 + n % 2);
+        memset(unpacked, 0xAA, sizeof(unpacked));
+        fkv_unpack_digits(packed, n, unpacked);
+        assert(memcmp(unpacked, digits, n) == 0);
+        if (n < sizeof(unpacked)) {
+            assert(unpacked[n] == 0xAA);
+        }
+    }
+
+    /* Keys longer than the save path's chunk, and a value that does not pack. */
+    fkv_init();
+    uint8_t long_key[1200];
+    for (size_t i = 0; i < sizeof(long_key); ++i) {
+        long_key[i] = (uint8_t)(i % 10);
+    }
+    uint8_t odd_value[] = {1, 2, 3};
+    uint8_t raw_value[] = {4, 200, 5};
+    assert(fkv_put(long_key, sizeof(long_key), odd_value, sizeof(odd_value), FKV_ENTRY_TYPE_PROGRAM) == 0);
+    assert(fkv_put(long_key, 3, raw_value, sizeof(raw_value), FKV_ENTRY_TYPE_VALUE) == 0);
+    char snapshot[128];
+    create_temp_snapshot(snapshot, sizeof(snapshot), "fkv_snapshot_packed");
+    assert(fkv_save(snapshot) == 0);
+    fkv_shutdown();
+
+    assert(fkv_load(snapshot) == 0);
+    fkv_iter_t it = {0};
+    assert(fkv_get_prefix(long_key, sizeof(long_key), &it, 1) == 0);
+    assert(it.count == 1);
+    assert(it.entries[0].key_len == sizeof(long_key));
+    assert(memcmp(it.entries[0].key, long_key, sizeof(long_key)) == 0);
+    assert(memcmp(it.entries[0].value, odd_value, sizeof(odd_value)) == 0);
+    assert(it.entries[0].type == FKV_ENTRY_TYPE_PROGRAM);
+    fkv_iter_free(&it);
+    assert(fkv_get_prefix(long_key, 3, &it, 1) == 0);
+    assert(it.count == 1);
+    assert(memcmp(it.entries[0].value, raw_value, sizeof(raw_value)) == 0);
+    assert(it.entries[0].type == FKV_ENTRY_TYPE_VALUE);
+    fkv_iter_free(&it);
+    fkv_shutdown();
+    unlink(snapshot);
+}
+
+static void test_load_unpacked_snapshot(void) {
+    /* The format before packing: a count, then per entry length-prefixed key and value, type, priority. */
+    char snapshot[128];
+    create_temp_snapshot(snapshot, sizeof(snapshot), "fkv_snapshot_unpacked");
+    FILE *fp = fopen(snapshot, "wb");
+    assert(fp);
+    uint64_t count = 1;
+    uint64_t key_len = 3;
+    uint8_t key[] = {4, 5, 6};
+    uint64_t value_len = 2;
+    uint8_t value[] = {7, 8};
+    uint8_t type = FKV_ENTRY_TYPE_VALUE;
+    uint64_t priority = 5;
+    assert(fwrite(&count, sizeof(count), 1, fp) == 1);
+    assert(fwrite(&key_len, sizeof(key_len), 1, fp) == 1);
+    assert(fwrite(key, 1, sizeof(key), fp) == sizeof(key));
+    assert(fwrite(&value_len, sizeof(value_len), 1, fp) == 1);
+    assert(fwrite(value, 1, sizeof(value), fp) == sizeof(value));
+    assert(fwrite(&type, sizeof(type), 1, fp) == 1);
+    assert(fwrite(&priority, sizeof(priority), 1, fp) == 1);
+    assert(fclose(fp) == 0);
+
+    fkv_init();
+    assert(fkv_load(snapshot) == 0);
+    fkv_iter_t it = {0};
+    assert(fkv_get_prefix(key, sizeof(key), &it, 1) == 0);
+    assert(it.count == 1);
+    assert(it.entries[0].value_len == sizeof(value));
+    assert(memcmp(it.entries[0].value, value, sizeof(value)) == 0);
+    assert(it.entries[0].priority == priority);
+    fkv_iter_free(&it);
+    fkv_shutdown();
+    unlink(snapshot);
+}
+
 static void test_topk_ordering(void) {
     fkv_init();
     fkv_set_topk_limit(3);
@@ -181,12 +278,480 @@ static void test_scored_priority_selection(void) {
     fkv_shutdown();
 }
 
+static void test_put_batch_and_get_first(void) {
+    fkv_init();
+    fkv_set_topk_limit(2);
+    uint8_t k1[] = {7, 1};
+    uint8_t k2[] = {7, 2};
+    uint8_t v1[] = {4};
+    uint8_t v2[] = {5, 6};
+    uint8_t bad[] = {7, 12};
+    fkv_entry_t batch[] = {
+        {k1, sizeof(k1), v1, sizeof(v1), FKV_ENTRY_TYPE_VALUE, 0},
+        {k2, sizeof(k2), v2, sizeof(v2), FKV_ENTRY_TYPE_VALUE, 0},
+    };
+    fkv_entry_t invalid[] = {
+        {k1, sizeof(k1), v2, sizeof(v2), FKV_ENTRY_TYPE_VALUE, 0},
+        {bad, sizeof(bad), v1, sizeof(v1), FKV_ENTRY_TYPE_VALUE, 0},
+    };
+    uint64_t generation = fkv_generation();
+    assert(fkv_put_batch(invalid, 2) == -1);
+    assert(fkv_generation() == generation);
+    assert(fkv_put_batch(batch, 2) == 0);
+
+    uint8_t value[4];
+    size_t value_len = sizeof(value);
+    size_t key_len = 0;
+    uint8_t prefix[] = {7};
+    /* Later entries of a batch get higher priority, as with fkv_put. */
+    assert(fkv_get_first(prefix, sizeof(prefix), value, &value_len, &key_len) == 1);
+    assert(key_len == 2 && value_len == 2 && value[0] == 5 && value[1] == 6);
+    value_len = sizeof(value);
+    assert(fkv_get_first(k1, sizeof(k1), value, &value_len, &key_len) == 1);
+    assert(value_len == 1 && value[0] == 4);
+    value_len = 1;
+    assert(fkv_get_first(k2, sizeof(k2), value, &value_len, &key_len) == 1);
+    assert(value_len == 1 && value[0] == 6);
+    uint8_t missing[] = {8};
+    value_len = sizeof(value);
+    assert(fkv_get_first(missing, sizeof(missing), value, &value_len, &key_len) == 0);
+    assert(value_len == 0);
+
+    fkv_shutdown();
+}
+
+static void assert_aggregate(const char *key_str, uint64_t count, uint64_t sum) {
+    uint8_t key[16];
+    size_t klen = strlen(key_str);
+    for (size_t i = 0; i < klen; ++i) {
+        key[i] = (uint8_t)(key_str[i] - '0');
+    }
+    fkv_aggregate_t agg;
+    assert(fkv_aggregate_prefix(key, klen, &agg, NULL) == 0);
+    assert(agg.count == count);
+    assert(agg.sum == sum);
+}
+
+static void test_prefix_aggregates(void) {
+    fkv_init();
+    fkv_set_topk_limit(1);
+    insert_sample("12", "3", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("15", "40", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("1", "100", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("2", "7", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("17", "9", FKV_ENTRY_TYPE_PROGRAM);
+
+    /* Entries beyond the top-K list still count. */
+    assert_aggregate("", 4, 150);
+    assert_aggregate("1", 3, 143);
+    assert_aggregate("15", 1, 40);
+    assert_aggregate("17", 0, 0);
+    assert_aggregate("3", 0, 0);
+
+    /* Overwrites replace the old value, also across entry types. */
+    insert_sample("12", "5", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("17", "8", FKV_ENTRY_TYPE_VALUE);
+    insert_sample("2", "6", FKV_ENTRY_TYPE_PROGRAM);
+    assert_aggregate("", 4, 153);
+    assert_aggregate("1", 4, 153);
+
+    uint8_t key[] = {1};
+    fkv_aggregate_t exact;
+    assert(fkv_aggregate_prefix(key, sizeof(key), NULL, &exact) == 0);
+    assert(exact.count == 1 && exact.sum == 100);
+    uint8_t bad[] = {1, 10};
+    assert(fkv_aggregate_prefix(bad, sizeof(bad), &exact, NULL) == -1);
+
+    char path[256];
+    create_temp_snapshot(path, sizeof(path), "fkv_aggregates");
+    assert(fkv_save(path) == 0);
+    fkv_shutdown();
+    fkv_init();
+    assert_aggregate("", 0, 0);
+    assert(fkv_load(path) == 0);
+    assert_aggregate("1", 4, 153);
+    unlink(path);
+    fkv_set_topk_limit(4);
+    fkv_shutdown();
+}
+
+static void test_view_prefix(void) {
+    fkv_init();
+    fkv_set_topk_limit(20);
+    char key[3] = "4x";
+    for (int i = 0; i < 10; ++i) {
+        key[1] = (char)('0' + i);
+        insert_sample(key, "12", FKV_ENTRY_TYPE_VALUE);
+    }
+    insert_sample("4", "9", FKV_ENTRY_TYPE_PROGRAM);
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            char longer[4] = {'5', (char)('0' + i), (char)('0' + j), '\0'};
+            insert_sample(longer, "3", FKV_ENTRY_TYPE_VALUE);
+        }
+    }
+
+    uint8_t four[] = {4};
+    fkv_view_t view;
+    assert(fkv_view_prefix(four, sizeof(four), &view, 3) == 0);
+    assert(view.count == 3);
+    assert(view.entries[0].key_len == 1 && view.entries[0].type == FKV_ENTRY_TYPE_PROGRAM);
+    assert(view.entries[1].key_len == 2 && view.entries[1].key[1] == 9);
+    const uint8_t *borrowed = view.entries[1].value;
+
+    /* Overwrites do not touch what a view borrowed. */
+    insert_sample("49", "7", FKV_ENTRY_TYPE_VALUE);
+    assert(view.entries[1].value == borrowed && view.entries[1].value_len == 2);
+    assert(borrowed[0] == 1 && borrowed[1] == 2);
+    fkv_view_t fresh;
+    uint8_t k49[] = {4, 9};
+    assert(fkv_view_prefix(k49, sizeof(k49), &fresh, 0) == 0);
+    assert(fresh.count == 1 && fresh.entries[0].value_len == 1 && fresh.entries[0].value[0] == 7);
+    fkv_view_release(&fresh);
+    fkv_view_release(&view);
+    fkv_view_release(&view);
+
+    /* More than FKV_VIEW_INLINE entries come from the heap; a huge k is capped. */
+    uint8_t five[] = {5};
+    assert(fkv_view_prefix(five, sizeof(five), &view, SIZE_MAX) == 0);
+    assert(view.count == 20);
+    for (size_t i = 1; i < view.count; ++i) {
+        assert(view.entries[i - 1].priority > view.entries[i].priority);
+    }
+    fkv_view_release(&view);
+
+    uint8_t missing[] = {6};
+    assert(fkv_view_prefix(missing, sizeof(missing), &view, 0) == 0 && view.count == 0);
+    fkv_view_release(&view);
+    uint8_t bad[] = {4, 10};
+    assert(fkv_view_prefix(bad, sizeof(bad), &view, 0) == -1);
+    fkv_view_release(&view);
+
+    fkv_set_topk_limit(4);
+    fkv_shutdown();
+}
+
+static void test_memory_usage(void) {
+    fkv_init();
+    fkv_memory_t mem;
+    fkv_memory_usage(&mem);
+    assert(mem.entries == 0 && mem.nodes == 1 && mem.slabs == 1);
+
+    uint8_t key[4];
+    uint8_t value[] = {4, 2};
+    for (size_t i = 0; i < 1000; ++i) {
+        key[0] = (uint8_t)(i / 100 % 10);
+        key[1] = (uint8_t)(i / 10 % 10);
+        key[2] = (uint8_t)(i % 10);
+        assert(fkv_put(key, 3, value, sizeof(value), FKV_ENTRY_TYPE_VALUE) == 0);
+    }
+    fkv_memory_usage(&mem);
+    assert(mem.entries == 1000 && mem.nodes == 1111);
+    assert(mem.large_objects == 0 && mem.retired_objects == 0);
+    assert(mem.used_bytes + mem.free_bytes <= mem.reserved_bytes);
+    assert(mem.reserved_bytes == mem.slabs * 64 * 1024);
+
+    /* Overwrites recycle what they replace instead of growing. */
+    size_t used = mem.used_bytes;
+    for (size_t i = 0; i < 1000; ++i) {
+        key[0] = (uint8_t)(i / 100 % 10);
+        key[1] = (uint8_t)(i / 10 % 10);
+        key[2] = (uint8_t)(i % 10);
+        assert(fkv_put(key, 3, value, sizeof(value), FKV_ENTRY_TYPE_VALUE) == 0);
+    }
+    fkv_memory_usage(&mem);
+    assert(mem.entries == 1000 && mem.used_bytes == used && mem.free_bytes > 0);
+
+    uint8_t long_value[600] = {0};
+    key[3] = 5;
+    assert(fkv_put(key, 4, long_value, sizeof(long_value), FKV_ENTRY_TYPE_VALUE) == 0);
+    fkv_memory_usage(&mem);
+    assert(mem.entries == 1001 && mem.large_objects == 1);
+    assert(fkv_put(key, 4, value, sizeof(value), FKV_ENTRY_TYPE_VALUE) == 0);
+    fkv_memory_usage(&mem);
+    assert(mem.large_objects == 0);
+
+    fkv_shutdown();
+    fkv_memory_usage(&mem);
+    assert(mem.entries == 0 && mem.nodes == 0 && mem.slabs == 0 && mem.reserved_bytes == 0);
+}
+
+#define MODEL_KEYS 600
+#define MODEL_KEY_MAX 20
+
+typedef struct {
+    uint8_t key[MODEL_KEY_MAX];
+    size_t key_len;
+    uint8_t value;
+    fkv_entry_type_t type;
+    uint64_t priority;
+} model_entry_t;
+
+static model_entry_t model[MODEL_KEYS];
+static size_t model_count;
+
+static uint32_t model_rng = 12345u;
+
+static uint32_t model_next(void) {
+    model_rng ^= model_rng << 13;
+    model_rng ^= model_rng >> 17;
+    model_rng ^= model_rng << 5;
+    return model_rng;
+}
+
+/* Keys over a skewed alphabet share long prefixes, which exercises splits and node growth. */
+static size_t model_random_key(uint8_t *key) {
+    size_t len = 1 + model_next() % MODEL_KEY_MAX;
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t r = model_next() % 16;
+        key[i] = (uint8_t)(r < 10 ? r : r % 3);
+    }
+    return len;
+}
+
+static int model_has_prefix(const model_entry_t *e, const uint8_t *prefix, size_t len) {
+    return e->key_len >= len && memcmp(e->key, prefix, len) == 0;
+}
+
+/* fkv_get_prefix(prefix, k) per the model: the exact key, then the rest by priority. */
+static void model_check_prefix(const uint8_t *prefix, size_t len, size_t k) {
+    const model_entry_t *expect[8];
+    size_t expect_count = 0;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < model_count; ++i) {
+        const model_entry_t *e = &model[i];
+        if (e->key_len == len && model_has_prefix(e, prefix, len)) {
+            expect[expect_count++] = e;
+        }
+    }
+    uint64_t below = UINT64_MAX;
+    while (expect_count < k) {
+        const model_entry_t *best = NULL;
+        for (size_t i = 0; i < model_count; ++i) {
+            const model_entry_t *e = &model[i];
+            if (e->key_len > len && model_has_prefix(e, prefix, len) && e->priority < below &&
+                (!best || e->priority > best->priority)) {
+                best = e;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        expect[expect_count++] = best;
+        below = best->priority;
+    }
+    for (size_t i = 0; i < model_count; ++i) {
+        if (model[i].type == FKV_ENTRY_TYPE_VALUE && model_has_prefix(&model[i], prefix, len)) {
+            count++;
+            sum += model[i].value;
+        }
+    }
+
+    fkv_view_t view;
+    assert(fkv_view_prefix(prefix, len, &view, k) == 0);
+    assert(view.count == expect_count);
+    for (size_t i = 0; i < view.count; ++i) {
+        assert(view.entries[i].key_len == expect[i]->key_len);
+        assert(memcmp(view.entries[i].key, expect[i]->key, expect[i]->key_len) == 0);
+        assert(view.entries[i].priority == expect[i]->priority);
+        assert(view.entries[i].value_len == 1 && view.entries[i].value[0] == expect[i]->value);
+    }
+    fkv_view_release(&view);
+    fkv_aggregate_t agg;
+    assert(fkv_aggregate_prefix(prefix, len, &agg, NULL) == 0);
+    assert(agg.count == count && agg.sum == sum);
+}
+
+static void test_compressed_trie_against_model(void) {
+    fkv_init();
+    fkv_set_topk_limit(4);
+    model_count = 0;
+    for (size_t round = 0; round < 3000; ++round) {
+        uint8_t key[MODEL_KEY_MAX];
+        size_t len;
+        model_entry_t *slot = NULL;
+        if (model_count > 0 && model_next() % 4 == 0) {
+            slot = &model[model_next() % model_count];
+            len = slot->key_len;
+            memcpy(key, slot->key, len);
+        } else {
+            len = model_random_key(key);
+            for (size_t i = 0; i < model_count && !slot; ++i) {
+                if (model[i].key_len == len && memcmp(model[i].key, key, len) == 0) {
+                    slot = &model[i];
+                }
+            }
+            if (!slot) {
+                if (model_count == MODEL_KEYS) {
+                    continue;
+                }
+                slot = &model[model_count++];
+                memcpy(slot->key, key, len);
+                slot->key_len = len;
+            }
+        }
+        uint8_t value = (uint8_t)(model_next() % 10);
+        fkv_entry_type_t type = model_next() % 5 == 0 ? FKV_ENTRY_TYPE_PROGRAM : FKV_ENTRY_TYPE_VALUE;
+        assert(fkv_put(key, len, &value, 1, type) == 0);
+        slot->value = value;
+        slot->type = type;
+        slot->priority = fkv_current_sequence();
+
+        if (round % 50 == 0) {
+            for (size_t probe = 0; probe < 40; ++probe) {
+                const model_entry_t *e = &model[model_next() % model_count];
+                model_check_prefix(e->key, model_next() % (e->key_len + 1), 1 + model_next() % 4);
+            }
+            len = model_random_key(key);
+            model_check_prefix(key, len % 4, 4);
+        }
+    }
+
+    char path[256];
+    create_temp_snapshot(path, sizeof(path), "fkv_model");
+    assert(fkv_save(path) == 0);
+    fkv_shutdown();
+    fkv_init();
+    assert(fkv_load(path) == 0);
+    unlink(path);
+    for (size_t i = 0; i < model_count; ++i) {
+        model_check_prefix(model[i].key, model[i].key_len, 4);
+        model_check_prefix(model[i].key, model[i].key_len / 2, 3);
+    }
+    fkv_shutdown();
+}
+
+#define CONCURRENT_ROUNDS 3000
+#define CONCURRENT_READERS 4
+
+static atomic_int concurrent_done;
+
+static size_t encode_number(uint64_t n, uint8_t *digits) {
+    uint8_t tmp[20];
+    size_t len = 0;
+    do {
+        tmp[len++] = (uint8_t)(n % 10);
+        n /= 10;
+    } while (n > 0);
+    for (size_t i = 0; i < len; ++i) {
+        digits[i] = tmp[len - 1 - i];
+    }
+    return len;
+}
+
+static uint64_t decode_number(const uint8_t *digits, size_t len) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        n = n * 10 + digits[i];
+    }
+    return n;
+}
+
+/* Batches write the same round into 71 and 72; single puts fill 8x with one repeated digit. */
+static void *concurrent_writer(void *arg) {
+    (void)arg;
+    uint8_t k71[] = {7, 1};
+    uint8_t k72[] = {7, 2};
+    uint8_t value[20];
+    uint8_t filler[16];
+    for (uint64_t round = 1; round <= CONCURRENT_ROUNDS; ++round) {
+        size_t len = encode_number(round, value);
+        fkv_entry_t batch[] = {
+            {k71, sizeof(k71), value, len, FKV_ENTRY_TYPE_VALUE, 0},
+            {k72, sizeof(k72), value, len, FKV_ENTRY_TYPE_VALUE, 0},
+        };
+        assert(fkv_put_batch(batch, 2) == 0);
+        uint8_t key[] = {8, (uint8_t)(round % 10)};
+        size_t filler_len = 1 + round % sizeof(filler);
+        memset(filler, (int)(round % 10), filler_len);
+        assert(fkv_put(key, sizeof(key), filler, filler_len, FKV_ENTRY_TYPE_VALUE) == 0);
+        /* 9 followed by the round: new keys keep splitting and growing nodes under the readers. */
+        uint8_t nine[21] = {9};
+        size_t nine_len = 1 + encode_number(round * 7919 % 100000, nine + 1);
+        assert(fkv_put(nine, nine_len, nine + 1, nine_len - 1, FKV_ENTRY_TYPE_VALUE) == 0);
+    }
+    atomic_store(&concurrent_done, 1);
+    return NULL;
+}
+
+static void *concurrent_reader(void *arg) {
+    (void)arg;
+    uint8_t seven[] = {7};
+    uint8_t eight[] = {8};
+    uint64_t last_sum = 0;
+    while (!atomic_load(&concurrent_done)) {
+        /* A batch is seen whole or not at all. */
+        fkv_aggregate_t agg;
+        assert(fkv_aggregate_prefix(seven, sizeof(seven), &agg, NULL) == 0);
+        assert(agg.count == 0 || agg.count == 2);
+        assert(agg.sum % 2 == 0 && agg.sum >= last_sum);
+        last_sum = agg.sum;
+
+        fkv_iter_t it = {0};
+        assert(fkv_get_prefix(seven, sizeof(seven), &it, 4) == 0);
+        assert(it.count == 0 || it.count == 2);
+        if (it.count == 2) {
+            assert(decode_number(it.entries[0].value, it.entries[0].value_len) ==
+                   decode_number(it.entries[1].value, it.entries[1].value_len));
+        }
+        fkv_iter_free(&it);
+
+        /* Borrowed values are never torn or freed by a concurrent overwrite. */
+        fkv_view_t view;
+        assert(fkv_view_prefix(eight, sizeof(eight), &view, 4) == 0);
+        sched_yield();
+        for (size_t i = 0; i < view.count; ++i) {
+            assert(view.entries[i].key_len == 2);
+            for (size_t j = 0; j < view.entries[i].value_len; ++j) {
+                assert(view.entries[i].value[j] == view.entries[i].key[1]);
+            }
+        }
+        fkv_view_release(&view);
+
+        uint8_t nine[] = {9, (uint8_t)(last_sum % 10)};
+        assert(fkv_view_prefix(nine, 1 + last_sum % 2, &view, 4) == 0);
+        for (size_t i = 0; i < view.count; ++i) {
+            assert(view.entries[i].key[0] == 9);
+            assert(view.entries[i].value_len == view.entries[i].key_len - 1);
+            assert(memcmp(view.entries[i].value, view.entries[i].key + 1, view.entries[i].value_len) == 0);
+        }
+        fkv_view_release(&view);
+    }
+    return NULL;
+}
+
+static void test_concurrent_readers(void) {
+    fkv_init();
+    atomic_store(&concurrent_done, 0);
+    pthread_t writer;
+    pthread_t readers[CONCURRENT_READERS];
+    for (size_t i = 0; i < CONCURRENT_READERS; ++i) {
+        assert(pthread_create(&readers[i], NULL, concurrent_reader, NULL) == 0);
+    }
+    assert(pthread_create(&writer, NULL, concurrent_writer, NULL) == 0);
+    pthread_join(writer, NULL);
+    for (size_t i = 0; i < CONCURRENT_READERS; ++i) {
+        pthread_join(readers[i], NULL);
+    }
+    assert_aggregate("7", 2, 2 * CONCURRENT_ROUNDS);
+    fkv_shutdown();
+}
+
 int main(void) {
     test_prefix();
     test_serialization_roundtrip();
     test_load_overwrites_existing();
+    test_packed_digits();
+    test_load_unpacked_snapshot();
     test_topk_ordering();
     test_scored_priority_selection();
+    test_put_batch_and_get_first();
+    test_prefix_aggregates();
+    test_view_prefix();
+    test_memory_usage();
+    test_compressed_trie_against_model();
+    test_concurrent_readers();
     printf("fkv tests passed\n");
     return 0;
 }
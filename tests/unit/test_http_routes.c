@@ -4,6 +4,7 @@
 #include "http/http_routes.h"
 #include "synthesis/formula_vm_eval.h"
 #include "util/config.h"
+#include "vm/vm.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -53,8 +54,45 @@ static void test_vm_run_route(const kolibri_config_t *cfg) {
     assert(resp.status == 200);
     assert(resp.data != NULL);
     assert(strstr(resp.data, "\"result\":\"5\"") != NULL);
+    assert(strstr(resp.data, "\"estimate\":{\"bounded\":true,\"min_steps\":") != NULL);
+    assert(strstr(resp.data, "\"min_gas\":") != NULL);
 
     http_response_free(&resp);
+
+    /* Too little gas for any run: refused before it is executed. */
+    const char *starved = "{\"program\":\"2+3\",\"gas_limit\":1}";
+    resp = (http_response_t){0};
+    assert(http_handle_request(cfg, "POST", "/api/v1/vm/run", starved, strlen(starved), &resp) == 0);
+    assert(resp.status == 400);
+    assert(strstr(resp.data, "gas_limit_exceeded") != NULL);
+    http_response_free(&resp);
+}
+
+static void test_vm_profile_route(const kolibri_config_t *cfg) {
+    const char *body = "{\"program\":\"2+3\"}";
+    http_response_t resp = (http_response_t){0};
+
+    vm_profile_enable(1);
+    vm_profile_reset();
+    assert(http_handle_request(cfg, "POST", "/api/v1/vm/run", body, strlen(body), &resp) == 0);
+    assert(resp.status == 200);
+    http_response_free(&resp);
+
+    assert(http_handle_request(cfg, "GET", "/api/v1/vm/profile?top=4&reset=1", NULL, 0, &resp) == 0);
+    assert(resp.status == 200);
+    assert(resp.data != NULL);
+    assert(strstr(resp.data, "\"enabled\":true") != NULL);
+    assert(strstr(resp.data, "\"runs\":1") != NULL);
+    assert(strstr(resp.data, "\"name\":\"ADD10\",\"count\":1") != NULL);
+    assert(strstr(resp.data, "\"hot_ips\":[{\"ip\":") != NULL);
+    http_response_free(&resp);
+    vm_profile_enable(0);
+
+    assert(http_handle_request(cfg, "GET", "/api/v1/vm/profile", NULL, 0, &resp) == 0);
+    assert(resp.status == 200);
+    assert(strstr(resp.data, "\"enabled\":false,") != NULL);
+    assert(strstr(resp.data, "\"runs\":0") != NULL);
+    http_response_free(&resp);
 }
 
 static void test_dialog_route(const kolibri_config_t *cfg) {
@@ -199,6 +237,10 @@ int main(void) {
     test_vm_run_route(&cfg);
     fkv_shutdown();
 
+    assert(fkv_init() == 0);
+    test_vm_profile_route(&cfg);
+    fkv_shutdown();
+
     assert(fkv_init() == 0);
     test_fkv_get_route(&cfg);
     fkv_shutdown();
@@ -1,9 +1,12 @@
 /* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "vm/vm.h"
 #include "fkv/fkv.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,9 +67,9 @@ static int run_program(struct byte_buffer *bb, uint64_t *result, vm_status_t *st
         return -1;
     }
     prog_t prog = {bb->data, bb->len};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t entries[64];
-    vm_trace_t trace = {entries, 64, 0, 0};
+    vm_trace_t trace = {.entries = entries, .capacity = 64};
     vm_result_t out;
     int rc = vm_run(&prog, &lim, &trace, &out);
     *result = out.result;
@@ -79,11 +82,59 @@ static void test_random_deterministic(void) {
     vm_set_seed(42);
     assert(bb_push(&bb, 0x0F) == 0);
     uint64_t result = 0;
+    uint64_t again = 0;
     vm_status_t status;
     assert(run_program(&bb, &result, &status) == 0);
     assert(status == VM_OK);
-    assert(result == 1083814273ull);
+    /* Pinned so that replays of a request_id keep their draws across builds. */
+    assert(result == 1983616043ull);
+    /* Every run starts from its own state, not where the last one stopped. */
+    bb.len = 1;
+    assert(run_program(&bb, &again, &status) == 0);
+    assert(again == result);
+    vm_set_seed(43);
+    bb.len = 1;
+    assert(run_program(&bb, &again, &status) == 0);
+    assert(again != result);
+    vm_set_seed(42);
     free(bb.data);
+
+    /* Two draws, summed; the request id picks a different sequence. */
+    static const uint8_t code[] = {0x0F, 0x0F, 0x02, 0x12};
+    prog_t prog = {code, sizeof(code)};
+    vm_limits_t lim = {.max_steps = 16, .max_stack = 8};
+    vm_result_t first;
+    vm_result_t other;
+    assert(vm_run(&prog, &lim, NULL, &first) == 0);
+    assert(first.result == 3329948703ull);
+    lim.request_id = 1;
+    assert(vm_run(&prog, &lim, NULL, &other) == 0);
+    assert(other.result == 5147392919ull);
+
+    /* Batches draw the same values whatever the thread count. */
+    enum { N = 64 };
+    prog_t progs[N];
+    vm_result_t serial[N];
+    vm_result_t parallel[N];
+    for (size_t i = 0; i < N; ++i) {
+        progs[i] = prog;
+    }
+    lim.request_id = 100;
+    assert(vm_run_batch(progs, N, &lim, serial, 1) == 0);
+    assert(vm_run_batch(progs, N, &lim, parallel, 4) == 0);
+    for (size_t i = 0; i < N; ++i) {
+        assert(serial[i].result == parallel[i].result);
+        vm_limits_t one = lim;
+        one.request_id = lim.request_id + i;
+        vm_result_t single;
+        assert(vm_run(&prog, &one, NULL, &single) == 0);
+        assert(single.result == serial[i].result);
+    }
+    assert(serial[0].result != serial[1].result);
+    assert(vm_run_lanes(&prog, &lim, NULL, N, parallel) == 0);
+    for (size_t i = 0; i < N; ++i) {
+        assert(parallel[i].result == serial[i].result);
+    }
 }
 
 static void test_add(void) {
@@ -127,9 +178,9 @@ static void test_div_zero(void) {
 static void test_halt(void) {
     uint8_t code[] = {0x01, 0x05, 0x12, 0x01, 0x09};
     prog_t prog = {code, sizeof(code)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t entries[8];
-    vm_trace_t trace = {entries, 8, 0, 0};
+    vm_trace_t trace = {.entries = entries, .capacity = 8};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_OK);
@@ -159,9 +210,9 @@ static void test_read_fkv_stack_behavior(void) {
         0x0B        // RET
     };
     prog_t prog = {prog_code, sizeof(prog_code)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t trace_entries[16];
-    vm_trace_t trace = {trace_entries, 16, 0, 0};
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 16};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_OK);
@@ -185,9 +236,9 @@ static void test_write_fkv_stack_behavior(void) {
         0x0B        // RET
     };
     prog_t prog = {prog_code, sizeof(prog_code)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t trace_entries[16];
-    vm_trace_t trace = {trace_entries, 16, 0, 0};
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 16};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_OK);
@@ -215,9 +266,9 @@ static void test_read_fkv_error_propagation(void) {
         0x0B        // RET
     };
     prog_t prog = {prog_code, sizeof(prog_code)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t trace_entries[8];
-    vm_trace_t trace = {trace_entries, 8, 0, 0};
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 8};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_ERR_INVALID_OPCODE);
@@ -238,9 +289,9 @@ static void test_write_fkv_error_propagation(void) {
         0x0B        // RET
     };
     prog_t prog = {prog_code, sizeof(prog_code)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t trace_entries[8];
-    vm_trace_t trace = {trace_entries, 8, 0, 0};
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 8};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_ERR_INVALID_OPCODE);
@@ -269,9 +320,9 @@ static void test_fkv_negative_operands(void) {
         0x0B        // RET
     };
     prog_t prog = {write_prog, sizeof(write_prog)};
-    vm_limits_t lim = {512, 128};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 128};
     vm_trace_entry_t trace_entries[16];
-    vm_trace_t trace = {trace_entries, 16, 0, 0};
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 16};
     vm_result_t out;
     assert(vm_run(&prog, &lim, &trace, &out) == 0);
     assert(out.status == VM_ERR_INVALID_OPCODE);
@@ -361,6 +412,1315 @@ static void test_write_fkv_negative_operand(void) {
     fkv_shutdown();
 }
 
+static void run_with_engine(const uint8_t *code,
+                            size_t len,
+                            uint32_t max_stack,
+                            vm_engine_t engine,
+                            vm_trace_t *trace,
+                            vm_result_t *out) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = max_stack, .engine = engine};
+    vm_set_seed(7);
+    memset(out, 0, sizeof(*out));
+    assert(vm_run(&prog, &lim, trace, out) == 0);
+}
+
+static void assert_engine_matches_switch(const uint8_t *code, size_t len, uint32_t max_stack, vm_engine_t engine) {
+    vm_trace_entry_t ref_entries[64];
+    vm_trace_entry_t alt_entries[64];
+    vm_trace_t ref_trace = {.entries = ref_entries, .capacity = 64};
+    vm_trace_t alt_trace = {.entries = alt_entries, .capacity = 64};
+    vm_result_t ref;
+    vm_result_t alt;
+    run_with_engine(code, len, max_stack, VM_ENGINE_SWITCH, &ref_trace, &ref);
+    run_with_engine(code, len, max_stack, engine, &alt_trace, &alt);
+    assert(ref.status == alt.status);
+    assert(ref.result == alt.result);
+    assert(ref.steps == alt.steps);
+    assert(ref.halted == alt.halted);
+    assert(ref_trace.count == alt_trace.count);
+    for (size_t i = 0; i < ref_trace.count; ++i) {
+        assert(ref_entries[i].step == alt_entries[i].step);
+        assert(ref_entries[i].ip == alt_entries[i].ip);
+        assert(ref_entries[i].opcode == alt_entries[i].opcode);
+        assert(ref_entries[i].stack_top == alt_entries[i].stack_top);
+        assert(ref_entries[i].gas_left == alt_entries[i].gas_left);
+    }
+}
+
+static void test_engines_match_reference(vm_engine_t engine) {
+    static const uint8_t jz_not_taken[] = {0x01, 3, 0x08, 0x02, 0x00, 0x01, 7, 0x12};
+    static const uint8_t jz_taken[] = {0x01, 0, 0x08, 0x02, 0x00, 0x01, 7, 0x01, 9, 0x12};
+    static const uint8_t call_ret[] = {0x0A, 0x04, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t endless[] = {0x11, 0x01, 0, 0x08, 0xFB, 0xFF};
+    static const uint8_t into_operand[] = {0x01, 0x12, 0x01, 0x00, 0x08, 0xFA, 0xFF};
+    static const uint8_t truncated[] = {0x01, 1, 0x08, 0x00};
+    static const uint8_t bad_target[] = {0x01, 0, 0x09, 0x01, 0x00, 0x01, 0, 0x08, 0x40, 0x00};
+    static const uint8_t underflow[] = {0x01, 1, 0x02};
+    static const uint8_t overflow[] = {0x01, 1, 0x01, 2, 0x01, 3, 0x0F};
+    static const uint8_t div_zero[] = {0x01, 8, 0x01, 0, 0x06};
+    static const uint8_t arith[] = {0x01, 9, 0x01, 4, 0x03, 0x01, 7, 0x04, 0x01, 2, 0x07,
+                                    0x0E, 0x0F, 0x02, 0x10, 0x01, 0, 0x04, 0x02, 0x11, 0xEE};
+    static const uint8_t runaway_calls[] = {0x0A, 0x00, 0x00};
+
+    assert_engine_matches_switch(jz_not_taken, sizeof(jz_not_taken), 16, engine);
+    assert_engine_matches_switch(jz_taken, sizeof(jz_taken), 16, engine);
+    assert_engine_matches_switch(call_ret, sizeof(call_ret), 16, engine);
+    assert_engine_matches_switch(endless, sizeof(endless), 16, engine);
+    assert_engine_matches_switch(into_operand, sizeof(into_operand), 16, engine);
+    assert_engine_matches_switch(truncated, sizeof(truncated), 16, engine);
+    assert_engine_matches_switch(bad_target, sizeof(bad_target), 16, engine);
+    assert_engine_matches_switch(underflow, sizeof(underflow), 16, engine);
+    assert_engine_matches_switch(overflow, sizeof(overflow), 3, engine);
+    assert_engine_matches_switch(div_zero, sizeof(div_zero), 16, engine);
+    assert_engine_matches_switch(arith, sizeof(arith), 16, engine);
+    assert_engine_matches_switch(runaway_calls, sizeof(runaway_calls), 16, engine);
+
+    struct byte_buffer bb = {0};
+    assert(emit_push_number(&bb, 98765) == 0);
+    assert(emit_push_number(&bb, 4321) == 0);
+    assert(bb_push(&bb, 0x04) == 0);
+    assert(bb_push(&bb, 0x12) == 0);
+    vm_result_t out;
+    prog_t prog = {bb.data, bb.len};
+    vm_limits_t lim = {.max_steps = 40, .max_stack = 16, .engine = engine};
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_ERR_GAS_EXHAUSTED);
+    assert(out.steps == 40);
+    lim.max_steps = 512;
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(out.halted == 1);
+    assert(out.result == 426763565ull);
+    free(bb.data);
+}
+
+static void test_default_engine_switch(void) {
+    assert(vm_get_default_engine() == VM_ENGINE_SWITCH);
+    vm_set_default_engine(VM_ENGINE_THREADED);
+    assert(vm_get_default_engine() == VM_ENGINE_THREADED);
+    test_add();
+    test_halt();
+    vm_set_default_engine(VM_ENGINE_DEFAULT);
+    assert(vm_get_default_engine() == VM_ENGINE_SWITCH);
+}
+
+static void assert_verified_matches_switch(const uint8_t *code, size_t len, uint32_t max_stack) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = max_stack};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vp.max_depth <= max_stack);
+
+    vm_trace_entry_t ref_entries[64];
+    vm_trace_entry_t alt_entries[64];
+    vm_trace_t ref_trace = {.entries = ref_entries, .capacity = 64};
+    vm_trace_t alt_trace = {.entries = alt_entries, .capacity = 64};
+    vm_result_t ref;
+    vm_result_t alt;
+    run_with_engine(code, len, max_stack, VM_ENGINE_SWITCH, &ref_trace, &ref);
+    vm_set_seed(7);
+    memset(&alt, 0, sizeof(alt));
+    assert(vm_run_verified(&vp, &lim, &alt_trace, &alt) == 0);
+    assert(ref.status == alt.status);
+    assert(ref.result == alt.result);
+    assert(ref.steps == alt.steps);
+    assert(ref.halted == alt.halted);
+    assert(ref_trace.count == alt_trace.count);
+    for (size_t i = 0; i < ref_trace.count; ++i) {
+        assert(ref_entries[i].ip == alt_entries[i].ip);
+        assert(ref_entries[i].stack_top == alt_entries[i].stack_top);
+        assert(ref_entries[i].gas_left == alt_entries[i].gas_left);
+    }
+    vm_verified_free(&vp);
+}
+
+static void assert_rejected(const uint8_t *code, size_t len, uint32_t max_stack, vm_status_t why) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = max_stack};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 1);
+    assert(vp.reject_status == why);
+    assert(vp.impl == NULL);
+}
+
+static void test_verifier(void) {
+    static const uint8_t jz_taken[] = {0x01, 0, 0x08, 0x02, 0x00, 0x01, 7, 0x01, 9, 0x12};
+    static const uint8_t call_ret[] = {0x0A, 0x04, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t shared_sub[] = {0x0A, 0x07, 0x00, 0x0A, 0x07, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t endless[] = {0x11, 0x01, 0, 0x08, 0xFB, 0xFF};
+    static const uint8_t div_zero[] = {0x01, 8, 0x01, 0, 0x06};
+    static const uint8_t arith[] = {0x01, 9, 0x01, 4, 0x03, 0x01, 7, 0x04, 0x01, 2, 0x07,
+                                    0x0E, 0x0F, 0x02, 0x10, 0x01, 0, 0x04, 0x02, 0x11};
+    static const uint8_t into_operand[] = {0x01, 0x12, 0x01, 0x00, 0x08, 0xFA, 0xFF};
+    static const uint8_t truncated[] = {0x01, 1, 0x08, 0x00};
+    static const uint8_t bad_target[] = {0x01, 0, 0x09, 0x01, 0x00, 0x01, 0, 0x08, 0x40, 0x00};
+    static const uint8_t underflow[] = {0x01, 1, 0x02};
+    static const uint8_t overflow[] = {0x01, 1, 0x01, 2, 0x01, 3, 0x0F};
+    static const uint8_t runaway_calls[] = {0x0A, 0x00, 0x00};
+    static const uint8_t growing_loop[] = {0x11, 0x01, 1, 0x01, 1, 0x09, 0xF9, 0xFF};
+
+    assert_verified_matches_switch(jz_taken, sizeof(jz_taken), 16);
+    assert_verified_matches_switch(call_ret, sizeof(call_ret), 16);
+    assert_verified_matches_switch(shared_sub, sizeof(shared_sub), 16);
+    assert_verified_matches_switch(endless, sizeof(endless), 16);
+    assert_verified_matches_switch(div_zero, sizeof(div_zero), 16);
+    assert_verified_matches_switch(arith, sizeof(arith), 16);
+
+    assert_rejected(into_operand, sizeof(into_operand), 16, VM_ERR_INVALID_OPCODE);
+    assert_rejected(truncated, sizeof(truncated), 16, VM_ERR_INVALID_OPCODE);
+    assert_rejected(bad_target, sizeof(bad_target), 16, VM_ERR_INVALID_OPCODE);
+    assert_rejected(underflow, sizeof(underflow), 16, VM_ERR_STACK_UNDERFLOW);
+    assert_rejected(overflow, sizeof(overflow), 3, VM_ERR_STACK_OVERFLOW);
+    assert_rejected(runaway_calls, sizeof(runaway_calls), 16, VM_ERR_STACK_OVERFLOW);
+    assert_rejected(growing_loop, sizeof(growing_loop), 16, VM_ERR_STACK_OVERFLOW);
+
+    struct byte_buffer bb = {0};
+    assert(emit_push_number(&bb, 98765) == 0);
+    assert(emit_push_number(&bb, 4321) == 0);
+    assert(bb_push(&bb, 0x04) == 0);
+    assert(bb_push(&bb, 0x12) == 0);
+    prog_t prog = {bb.data, bb.len};
+    vm_limits_t lim = {.max_steps = 512, .max_stack = 16};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    vm_result_t out;
+    for (int i = 0; i < 3; ++i) {
+        assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+        assert(out.status == VM_OK);
+        assert(out.result == 426763565ull);
+        assert(out.steps == 58);
+    }
+    /* Tighter limits than the proof fall back to the checked interpreter. */
+    lim.max_stack = 2;
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_ERR_STACK_OVERFLOW);
+    vm_verified_free(&vp);
+    free(bb.data);
+}
+
+static void test_context_reuse(void) {
+    static const uint8_t call_ret[] = {0x0A, 0x04, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t div_zero[] = {0x01, 8, 0x01, 0, 0x06};
+    vm_limits_t small = {.max_steps = 64, .max_stack = 2};
+    vm_context_t *ctx = vm_context_create(&small, 16);
+    assert(ctx);
+
+    struct byte_buffer bb = {0};
+    for (int i = 0; i < 60; ++i) {
+        assert(emit_push_number(&bb, 7) == 0);
+    }
+    for (int i = 0; i < 59; ++i) {
+        assert(bb_push(&bb, 0x02) == 0);
+    }
+    assert(bb.len > 256);
+    prog_t big = {bb.data, bb.len};
+    prog_t small_prog = {call_ret, sizeof(call_ret)};
+    prog_t failing = {div_zero, sizeof(div_zero)};
+
+    for (int round = 0; round < 2; ++round) {
+        vm_engine_t engine = round == 0 ? VM_ENGINE_SWITCH : VM_ENGINE_THREADED;
+        vm_limits_t lim = {.max_steps = 2048, .max_stack = 64, .engine = engine};
+        vm_result_t expected;
+        vm_result_t actual;
+
+        assert(vm_run(&big, &lim, NULL, &expected) == 0);
+        assert(vm_context_run(ctx, &big, &lim, &actual) == 0);
+        assert(actual.status == VM_OK && expected.status == VM_OK);
+        assert(actual.result == 420 && expected.result == 420);
+        assert(actual.steps == expected.steps);
+        assert(vm_context_trace(ctx)->count == 16);
+
+        assert(vm_context_run(ctx, &small_prog, &lim, &actual) == 0);
+        assert(actual.status == VM_OK);
+        assert(actual.result == 5);
+        assert(vm_context_trace(ctx)->count == 4);
+        assert(vm_context_trace(ctx)->entries[1].ip == 4);
+
+        assert(vm_context_run(ctx, &failing, &lim, &actual) == 0);
+        assert(actual.status == VM_ERR_DIV_BY_ZERO);
+        vm_context_reset(ctx);
+        assert(vm_context_trace(ctx)->count == 0);
+    }
+
+    vm_limits_t lim = {.max_steps = 2048, .max_stack = 64};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&big, &lim, &vp) == 0);
+    vm_result_t out;
+    assert(vm_context_run_verified(ctx, &vp, &lim, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(out.result == 420);
+    vm_verified_free(&vp);
+
+    vm_context_destroy(ctx);
+    free(bb.data);
+
+    vm_context_t *untraced = vm_context_create(NULL, 0);
+    assert(untraced);
+    assert(vm_context_trace(untraced) == NULL);
+    assert(vm_context_run(untraced, &small_prog, &lim, &out) == 0);
+    assert(out.result == 5);
+    vm_context_destroy(untraced);
+}
+
+static void test_run_batch(void) {
+    enum { PROGRAMS = 97 };
+    struct byte_buffer buffers[PROGRAMS];
+    prog_t progs[PROGRAMS];
+    vm_result_t expected[PROGRAMS];
+    vm_result_t actual[PROGRAMS];
+    vm_limits_t lim = {.max_steps = 4096, .max_stack = 32};
+
+    memset(buffers, 0, sizeof(buffers));
+    for (size_t i = 0; i < PROGRAMS; ++i) {
+        /* Uneven lengths so that stealing actually kicks in. */
+        assert(emit_push_number(&buffers[i], i * 7919u) == 0);
+        for (size_t k = 0; k < (i % 13) * 8; ++k) {
+            assert(bb_push(&buffers[i], 0x11) == 0);
+        }
+        assert(emit_push_number(&buffers[i], 3) == 0);
+        assert(bb_push(&buffers[i], (uint8_t)(i % 3 == 0 ? 0x05 : 0x04)) == 0);
+        assert(bb_push(&buffers[i], 0x12) == 0);
+        progs[i].code = buffers[i].data;
+        progs[i].len = buffers[i].len;
+        assert(vm_run(&progs[i], &lim, NULL, &expected[i]) == 0);
+    }
+
+    size_t thread_counts[] = {1, 4, 0};
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t) {
+        memset(actual, 0xAB, sizeof(actual));
+        assert(vm_run_batch(progs, PROGRAMS, &lim, actual, thread_counts[t]) == 0);
+        for (size_t i = 0; i < PROGRAMS; ++i) {
+            assert(actual[i].status == expected[i].status);
+            assert(actual[i].result == expected[i].result);
+            assert(actual[i].steps == expected[i].steps);
+            assert(actual[i].halted == 1);
+        }
+    }
+
+    assert(vm_run_batch(progs, 0, &lim, NULL, 4) == 0);
+
+    prog_t empty = progs[5];
+    progs[5].len = 0;
+    assert(vm_run_batch(progs, PROGRAMS, &lim, actual, 3) == -1);
+    assert(actual[5].status == VM_ERR_INVALID_OPCODE);
+    assert(actual[6].result == expected[6].result);
+    progs[5] = empty;
+
+    for (size_t i = 0; i < PROGRAMS; ++i) {
+        free(buffers[i].data);
+    }
+}
+
+static void assert_lanes_match_scalar(const uint8_t *body, size_t body_len, uint32_t max_steps) {
+    enum { LANES = 150 };
+    int64_t inputs[LANES];
+    vm_result_t lanes_out[LANES];
+    vm_limits_t lim = {.max_steps = max_steps, .max_stack = 8};
+    prog_t prog = {body, body_len};
+    for (size_t i = 0; i < LANES; ++i) {
+        inputs[i] = (int64_t)((i * 37) % 101);
+    }
+    assert(vm_run_lanes(&prog, &lim, inputs, LANES, lanes_out) == 0);
+
+    for (size_t i = 0; i < LANES; ++i) {
+        /* Scalar reference: push the input, then run the same body. */
+        struct byte_buffer bb = {0};
+        assert(emit_push_number(&bb, (uint64_t)inputs[i]) == 0);
+        prog_t prefix = {bb.data, bb.len};
+        vm_limits_t prefix_lim = {.max_steps = 1024, .max_stack = 8};
+        vm_result_t prefix_out;
+        assert(vm_run(&prefix, &prefix_lim, NULL, &prefix_out) == 0);
+        for (size_t k = 0; k < body_len; ++k) {
+            assert(bb_push(&bb, body[k]) == 0);
+        }
+        prog_t full = {bb.data, bb.len};
+        vm_limits_t full_lim = {.max_steps = max_steps + prefix_out.steps, .max_stack = 8};
+        vm_result_t expected;
+        assert(vm_run(&full, &full_lim, NULL, &expected) == 0);
+
+        assert(lanes_out[i].status == expected.status);
+        assert(lanes_out[i].result == expected.result);
+        assert(lanes_out[i].halted == expected.halted);
+        assert(lanes_out[i].steps + prefix_out.steps == expected.steps);
+        free(bb.data);
+    }
+}
+
+static void test_run_lanes(void) {
+    /* x % 3 == 0 ? HALT with 1 : fall off the end with 9 + 2 */
+    static const uint8_t branchy[] = {0x01, 3, 0x06, 0x08, 0x0A, 0x00, 0x01, 9, 0x01, 2,
+                                      0x02, 0x01, 0, 0x08, 0x03, 0x00, 0x01, 1, 0x12};
+    /* x % 5 == 0 ? 1 / 0 : 8 / 2 */
+    static const uint8_t div_some[] = {0x01, 5, 0x06, 0x08, 0x06, 0x00, 0x01, 8, 0x01, 2,
+                                       0x05, 0x12, 0x01, 1, 0x01, 0, 0x05};
+    /* sign(x - 45), hashed, with a NOP-padded slow path */
+    static const uint8_t cmp_hash[] = {0x01, 5, 0x01, 9, 0x04, 0x03, 0x01, 0, 0x07, 0x0E,
+                                       0x01, 0, 0x07, 0x09, 0x04, 0x00, 0x11, 0x11, 0x11, 0x11,
+                                       0x01, 7, 0x01, 3, 0x02};
+    static const uint8_t call_ret[] = {0x0A, 0x04, 0x00, 0x12, 0x01, 5, 0x0B};
+
+    assert_lanes_match_scalar(branchy, sizeof(branchy), 64);
+    assert_lanes_match_scalar(div_some, sizeof(div_some), 64);
+    assert_lanes_match_scalar(cmp_hash, sizeof(cmp_hash), 64);
+    assert_lanes_match_scalar(cmp_hash, sizeof(cmp_hash), 10);
+
+    vm_result_t lanes_out[70];
+    vm_result_t expected;
+    prog_t prog = {call_ret, sizeof(call_ret)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 8};
+    assert(vm_run(&prog, &lim, NULL, &expected) == 0);
+    assert(vm_run_lanes(&prog, &lim, NULL, 70, lanes_out) == 0);
+    for (size_t i = 0; i < 70; ++i) {
+        assert(lanes_out[i].status == expected.status);
+        assert(lanes_out[i].result == expected.result);
+        assert(lanes_out[i].steps == expected.steps);
+        assert(lanes_out[i].halted == expected.halted);
+    }
+}
+
+static uint32_t lcg_next(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/*
+ * Random programs over every opcode except TIME10 and F-KV. Stack depth is
+ * tracked only along the straight-line path, so a share of the programs
+ * fails verification and exercises the interpreter fallback.
+ */
+static size_t random_program(uint32_t *state, uint8_t *code, size_t cap) {
+    size_t starts[64];
+    size_t patches[64];
+    size_t count = 0;
+    size_t patch_count = 0;
+    size_t len = 0;
+    uint32_t depth = 0;
+    size_t n = 4 + lcg_next(state) % 40;
+    for (size_t i = 0; i < n && count < 64 && len + 11 <= cap; ++i) {
+        starts[count++] = len;
+        uint32_t pick = lcg_next(state) % 16;
+        if ((depth < 2 || pick < 5) && pick % 4 == 0 && len + 11 <= cap) {
+            /* PUSHN with a literal of up to 48 bits */
+            uint64_t value = (uint64_t)lcg_next(state) * lcg_next(state);
+            code[len++] = 0x13;
+            do {
+                code[len++] = (uint8_t)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+                value >>= 7;
+            } while (value != 0);
+            depth++;
+        } else if (depth < 2 || pick < 5) {
+            code[len++] = 0x01;
+            code[len++] = (uint8_t)(lcg_next(state) % 10);
+            depth++;
+        } else if (pick < 11) {
+            code[len++] = (uint8_t)(0x02 + pick - 5); /* ADD10 .. CMP */
+            depth--;
+        } else if (pick < 13) {
+            code[len++] = (pick == 11) ? (uint8_t)(0x08 + lcg_next(state) % 2) : 0x0A;
+            patches[patch_count++] = len - 1;
+            code[len++] = 0;
+            code[len++] = 0;
+            depth -= (pick == 11);
+        } else {
+            static const uint8_t other[] = {0x0E, 0x0F, 0x0B, 0x11, 0x12};
+            uint8_t op = other[lcg_next(state) % sizeof(other)];
+            code[len++] = op;
+            depth += (op == 0x0F);
+        }
+    }
+    for (size_t i = 0; i < patch_count; ++i) {
+        size_t at = patches[i];
+        size_t target = starts[lcg_next(state) % count];
+        uint16_t operand = (code[at] == 0x0A) ? (uint16_t)target : (uint16_t)(int16_t)((int)target - (int)(at + 3));
+        code[at + 1] = (uint8_t)operand;
+        code[at + 2] = (uint8_t)(operand >> 8);
+    }
+    return len;
+}
+
+static void assert_run_matches_switch(vm_engine_t engine,
+                                      const uint8_t *code,
+                                      size_t len,
+                                      uint32_t max_steps,
+                                      uint32_t max_stack) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = max_steps, .max_stack = max_stack, .engine = VM_ENGINE_SWITCH};
+    vm_result_t ref;
+    vm_result_t alt;
+    memset(&ref, 0, sizeof(ref));
+    memset(&alt, 0, sizeof(alt));
+    vm_set_seed(7);
+    assert(vm_run(&prog, &lim, NULL, &ref) == 0);
+    lim.engine = engine;
+    vm_set_seed(7);
+    assert(vm_run(&prog, &lim, NULL, &alt) == 0);
+    assert(ref.status == alt.status);
+    assert(ref.result == alt.result);
+    assert(ref.steps == alt.steps);
+    assert(ref.halted == alt.halted);
+}
+
+static void test_jit_matches_interpreter(void) {
+    static const uint8_t call_ret[] = {0x0A, 0x04, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t shared_sub[] = {0x0A, 0x07, 0x00, 0x0A, 0x07, 0x00, 0x12, 0x01, 5, 0x0B};
+    static const uint8_t div_zero[] = {0x01, 8, 0x01, 0, 0x06};
+    static const uint8_t endless[] = {0x11, 0x01, 0, 0x08, 0xFB, 0xFF};
+
+    vm_jit_set_threshold(0);
+    test_engines_match_reference(VM_ENGINE_JIT);
+    assert_run_matches_switch(VM_ENGINE_JIT, call_ret, sizeof(call_ret), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_JIT, shared_sub, sizeof(shared_sub), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_JIT, div_zero, sizeof(div_zero), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_JIT, endless, sizeof(endless), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_JIT, endless, sizeof(endless), 0, 16);
+
+    fkv_shutdown();
+    assert(fkv_init() == 0);
+    vm_reset_fkv_errors();
+    /* WRITE 5 -> 3, then READ 5 + 1 */
+    static const uint8_t fkv_roundtrip[] = {0x01, 5, 0x01, 3, 0x0D, 0x01, 5, 0x0C, 0x01, 1, 0x02};
+    assert_run_matches_switch(VM_ENGINE_JIT, fkv_roundtrip, sizeof(fkv_roundtrip), 64, 16);
+    fkv_shutdown();
+
+    uint32_t state = 12345;
+    size_t verified = 0;
+    uint8_t code[160];
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t len = random_program(&state, code, sizeof(code));
+        prog_t prog = {code, len};
+        vm_limits_t lim = {.max_steps = 256, .max_stack = 16};
+        vm_verified_prog_t vp;
+        if (vm_verify(&prog, &lim, &vp) == 0) {
+            verified++;
+            vm_verified_free(&vp);
+        }
+        assert_run_matches_switch(VM_ENGINE_JIT, code, len, 256, 16);
+    }
+    if (vm_jit_available()) {
+        assert(verified > 100);
+    }
+    vm_jit_flush();
+    vm_jit_set_threshold(8);
+}
+
+static void test_register_matches_interpreter(void) {
+    /* ((2 + 3) * 4 - 1) % 7 with a NOP inside a fused group */
+    static const uint8_t chain[] = {0x01, 2, 0x01, 3, 0x02, 0x01, 4, 0x11, 0x04, 0x01, 1, 0x03, 0x01, 7, 0x06, 0x12};
+    /* subtracts 1 forever; the loop head is always entered with one value on the stack */
+    static const uint8_t countdown[] = {0x01, 5, 0x01, 1, 0x03, 0x11, 0x01, 1, 0x09, 0xF7, 0xFF, 0x12};
+    static const uint8_t div_zero[] = {0x01, 9, 0x01, 8, 0x01, 0, 0x05};
+    static const uint8_t deep[] = {0x01, 1, 0x01, 2, 0x01, 3, 0x01, 4, 0x02, 0x02, 0x02, 0x12};
+    static const uint8_t top_ret[] = {0x01, 6, 0x0F, 0x0E, 0x02, 0x0B, 0x01, 1};
+    static const uint8_t mixed_depth[] = {0x01, 0, 0x08, 0x02, 0x00, 0x01, 1, 0x12};
+
+    test_engines_match_reference(VM_ENGINE_REGISTER);
+    for (uint32_t steps = 1; steps <= 12; ++steps) {
+        assert_run_matches_switch(VM_ENGINE_REGISTER, chain, sizeof(chain), steps, 16);
+    }
+    for (uint32_t steps = 1; steps <= 32; ++steps) {
+        assert_run_matches_switch(VM_ENGINE_REGISTER, countdown, sizeof(countdown), steps, 16);
+    }
+    assert_run_matches_switch(VM_ENGINE_REGISTER, div_zero, sizeof(div_zero), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_REGISTER, deep, sizeof(deep), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_REGISTER, deep, sizeof(deep), 64, 3);
+    assert_run_matches_switch(VM_ENGINE_REGISTER, top_ret, sizeof(top_ret), 64, 16);
+    assert_run_matches_switch(VM_ENGINE_REGISTER, mixed_depth, sizeof(mixed_depth), 64, 16);
+
+    vm_result_t out;
+    run_with_engine(chain, sizeof(chain), 16, VM_ENGINE_REGISTER, NULL, &out);
+    assert(out.status == VM_OK);
+    assert(out.result == 5);
+    assert(out.steps == 11);
+    assert(out.halted == 1);
+
+    fkv_shutdown();
+    assert(fkv_init() == 0);
+    vm_reset_fkv_errors();
+    static const uint8_t fkv_roundtrip[] = {0x01, 5, 0x01, 3, 0x0D, 0x01, 5, 0x0C, 0x01, 1, 0x02};
+    assert_run_matches_switch(VM_ENGINE_REGISTER, fkv_roundtrip, sizeof(fkv_roundtrip), 64, 16);
+    fkv_shutdown();
+
+    uint32_t state = 777;
+    uint8_t code[160];
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t len = random_program(&state, code, sizeof(code));
+        assert_run_matches_switch(VM_ENGINE_REGISTER, code, len, 256, 16);
+        assert_run_matches_switch(VM_ENGINE_REGISTER, code, len, 1 + i % 24, 16);
+    }
+    vm_register_flush();
+}
+
+static void test_pushn(void) {
+    /* 98765 * 4321 with LEB128 literals */
+    static const uint8_t product[] = {0x13, 0xCD, 0x83, 0x06, 0x13, 0xE1, 0x21, 0x04, 0x12};
+    static const uint8_t minus_one[] = {0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    static const uint8_t truncated[] = {0x13, 0x80, 0x80};
+    static const uint8_t too_long[] = {0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02};
+    static const vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT, VM_ENGINE_REGISTER};
+
+    vm_jit_set_threshold(0);
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        vm_result_t out;
+        run_with_engine(product, sizeof(product), 4, engines[i], NULL, &out);
+        assert(out.status == VM_OK);
+        assert(out.halted == 1);
+        assert(out.steps == 4);
+        assert(out.result == 426763565ull);
+
+        run_with_engine(minus_one, sizeof(minus_one), 4, engines[i], NULL, &out);
+        assert(out.status == VM_OK);
+        assert(out.steps == 1);
+        assert(out.result == UINT64_MAX);
+
+        run_with_engine(truncated, sizeof(truncated), 4, engines[i], NULL, &out);
+        assert(out.status == VM_ERR_INVALID_OPCODE);
+        run_with_engine(too_long, sizeof(too_long), 4, engines[i], NULL, &out);
+        assert(out.status == VM_ERR_INVALID_OPCODE);
+    }
+    vm_jit_flush();
+    vm_jit_set_threshold(8);
+
+    assert_engine_matches_switch(product, sizeof(product), 4, VM_ENGINE_THREADED);
+    assert_verified_matches_switch(product, sizeof(product), 4);
+    assert_rejected(truncated, sizeof(truncated), 4, VM_ERR_INVALID_OPCODE);
+    assert_rejected(too_long, sizeof(too_long), 4, VM_ERR_INVALID_OPCODE);
+    assert_lanes_match_scalar(product + 4, sizeof(product) - 4, 16);
+}
+
+static void assert_optimized_matches_switch(const uint8_t *code, size_t len, uint32_t max_steps) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = max_steps, .max_stack = 16};
+    vm_verified_prog_t vp;
+    if (vm_verify(&prog, &lim, &vp) != 0) {
+        return;
+    }
+    assert(vm_optimize(&vp) == 0);
+    assert(vp.fused != NULL);
+
+    /* Every gas limit up to completion, so fused entries hit the fallback. */
+    for (uint32_t steps = 0; steps <= max_steps; ++steps) {
+        vm_limits_t run_lim = {.max_steps = steps, .max_stack = 16, .engine = VM_ENGINE_SWITCH};
+        vm_result_t ref;
+        vm_result_t alt;
+        memset(&ref, 0, sizeof(ref));
+        memset(&alt, 0, sizeof(alt));
+        vm_set_seed(7);
+        assert(vm_run(&prog, &run_lim, NULL, &ref) == 0);
+        vm_set_seed(7);
+        assert(vm_run_verified(&vp, &run_lim, NULL, &alt) == 0);
+        assert(ref.status == alt.status);
+        assert(ref.result == alt.result);
+        assert(ref.steps == alt.steps);
+        assert(ref.halted == alt.halted);
+        if (ref.status != VM_ERR_GAS_EXHAUSTED) {
+            break;
+        }
+    }
+    vm_verified_free(&vp);
+}
+
+static void test_optimizer(void) {
+    /* 10 > 3 ? push 1 : push 2, via CMP+JNZ; then x + 4 * 2 - 1 */
+    static const uint8_t cmp_branch[] = {0x01, 10, 0x01, 3, 0x07, 0x09, 0x04, 0x00, 0x01, 2, 0x11, 0x11,
+                                         0x12, 0x01, 1, 0x01, 4, 0x01, 2, 0x04, 0x02, 0x01, 1, 0x03, 0x12};
+    static const uint8_t nop_run[] = {0x11, 0x11, 0x11, 0x01, 5, 0x11, 0x11};
+    static const uint8_t div_zero[] = {0x01, 8, 0x01, 0, 0x05, 0x12};
+    /* JZ lands in the middle of the foldable run 4 * 2: 7 * 2 */
+    static const uint8_t into_run[] = {0x01, 7, 0x01, 0, 0x08, 0x02, 0x00, 0x01, 4, 0x01, 2, 0x04, 0x12};
+
+    assert_optimized_matches_switch(cmp_branch, sizeof(cmp_branch), 64);
+    assert_optimized_matches_switch(nop_run, sizeof(nop_run), 64);
+    assert_optimized_matches_switch(div_zero, sizeof(div_zero), 64);
+    assert_optimized_matches_switch(into_run, sizeof(into_run), 64);
+
+    prog_t prog = {into_run, sizeof(into_run)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_verified_prog_t vp;
+    vm_result_t out;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vm_optimize(&vp) == 0);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(out.result == 14);
+    assert(out.steps == 6);
+    vm_verified_free(&vp);
+
+    /* The digit-by-digit literal encoding folds to a handful of entries. */
+    struct byte_buffer bb = {0};
+    assert(emit_push_number(&bb, 98765) == 0);
+    assert(emit_push_number(&bb, 4321) == 0);
+    assert(bb_push(&bb, 0x04) == 0);
+    assert(bb_push(&bb, 0x12) == 0);
+    assert_optimized_matches_switch(bb.data, bb.len, 128);
+    free(bb.data);
+
+    uint32_t state = 777;
+    uint8_t code[160];
+    for (size_t i = 0; i < 500; ++i) {
+        size_t len = random_program(&state, code, sizeof(code));
+        assert_optimized_matches_switch(code, len, 96);
+    }
+}
+
+static void test_div_overflow(void) {
+    /* INT64_MIN / -1 wraps to INT64_MIN and INT64_MIN % -1 is 0, on every engine. */
+    static const uint8_t quotient[] = {0x13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                       0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x05, 0x12};
+    static const uint8_t remainder[] = {0x13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                        0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x06, 0x12};
+    /* Lane bodies: the input plus the quotient or remainder. */
+    static const uint8_t add_quotient[] = {0x13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                           0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x05, 0x02};
+    static const uint8_t add_remainder[] = {0x13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                            0x13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x06, 0x02};
+    static const vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT, VM_ENGINE_REGISTER};
+
+    vm_jit_set_threshold(0);
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        vm_result_t out;
+        run_with_engine(quotient, sizeof(quotient), 4, engines[i], NULL, &out);
+        assert(out.status == VM_OK);
+        assert(out.halted == 1);
+        assert(out.result == UINT64_C(1) << 63);
+
+        run_with_engine(remainder, sizeof(remainder), 4, engines[i], NULL, &out);
+        assert(out.status == VM_OK);
+        assert(out.halted == 1);
+        assert(out.result == 0);
+    }
+    vm_jit_flush();
+    vm_jit_set_threshold(8);
+
+    assert_verified_matches_switch(quotient, sizeof(quotient), 4);
+    assert_verified_matches_switch(remainder, sizeof(remainder), 4);
+    assert_optimized_matches_switch(quotient, sizeof(quotient), 8);
+    assert_optimized_matches_switch(remainder, sizeof(remainder), 8);
+    assert_lanes_match_scalar(add_quotient, sizeof(add_quotient), 16);
+    assert_lanes_match_scalar(add_remainder, sizeof(add_remainder), 16);
+}
+
+static void test_result_cache(void) {
+    fkv_shutdown();
+    assert(fkv_init() == 0);
+    vm_reset_fkv_errors();
+    assert(vm_result_cache_configure(64) == 0);
+
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_result_cache_stats_t before;
+    vm_result_cache_stats_t after;
+    vm_result_t out;
+
+    /* Pure: the second run is served from the cache. */
+    static const uint8_t pure[] = {0x01, 6, 0x01, 7, 0x04, 0x12};
+    prog_t pure_prog = {pure, sizeof(pure)};
+    vm_result_cache_stats(&before);
+    assert(vm_run(&pure_prog, &lim, NULL, &out) == 0);
+    assert(out.result == 42 && out.steps == 4);
+    memset(&out, 0, sizeof(out));
+    assert(vm_run(&pure_prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK && out.result == 42 && out.steps == 4);
+    vm_result_cache_stats(&after);
+    assert(after.misses == before.misses + 1);
+    assert(after.hits == before.hits + 1);
+
+    /* Same bytecode under other limits is a different key. */
+    vm_limits_t tight = {.max_steps = 2, .max_stack = 16};
+    assert(vm_run(&pure_prog, &tight, NULL, &out) == 0);
+    assert(out.status == VM_ERR_GAS_EXHAUSTED);
+
+    /* Traced runs neither read nor fill the cache. */
+    vm_trace_entry_t trace_entries[8];
+    vm_trace_t trace = {.entries = trace_entries, .capacity = 8};
+    vm_result_cache_stats(&before);
+    assert(vm_run(&pure_prog, &lim, &trace, &out) == 0);
+    assert(out.result == 42 && trace.count == 4);
+    vm_result_cache_stats(&after);
+    assert(after.hits == before.hits && after.misses == before.misses && after.bypassed == before.bypassed);
+
+    /* Contexts and verified programs share the cache. */
+    vm_context_t *ctx = vm_context_create(&lim, 0);
+    assert(ctx);
+    vm_verified_prog_t vp;
+    assert(vm_verify(&pure_prog, &lim, &vp) == 0);
+    vm_result_cache_stats(&before);
+    assert(vm_context_run(ctx, &pure_prog, &lim, &out) == 0 && out.result == 42);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0 && out.result == 42);
+    vm_result_cache_stats(&after);
+    assert(after.hits == before.hits + 2);
+    vm_verified_free(&vp);
+    vm_context_destroy(ctx);
+
+    /* RANDOM10 and WRITE_FKV make a program uncacheable. */
+    static const uint8_t random[] = {0x0F, 0x12};
+    static const uint8_t write[] = {0x01, 1, 0x01, 2, 0x0D, 0x01, 9, 0x12};
+    prog_t random_prog = {random, sizeof(random)};
+    prog_t write_prog = {write, sizeof(write)};
+    vm_result_cache_stats(&before);
+    for (int i = 0; i < 2; ++i) {
+        assert(vm_run(&random_prog, &lim, NULL, &out) == 0);
+        assert(vm_run(&write_prog, &lim, NULL, &out) == 0);
+    }
+    vm_result_cache_stats(&after);
+    assert(after.bypassed == before.bypassed + 4);
+    assert(after.hits == before.hits && after.misses == before.misses);
+
+    /* READ_FKV results are dropped once F-KV changes. */
+    uint8_t key_digits[] = {5};
+    uint8_t val_digits[] = {3};
+    assert(fkv_put(key_digits, sizeof(key_digits), val_digits, sizeof(val_digits), FKV_ENTRY_TYPE_VALUE) == 0);
+    static const uint8_t read[] = {0x01, 5, 0x0C, 0x12};
+    prog_t read_prog = {read, sizeof(read)};
+    vm_result_cache_stats(&before);
+    assert(vm_run(&read_prog, &lim, NULL, &out) == 0 && out.result == 3);
+    assert(vm_run(&read_prog, &lim, NULL, &out) == 0 && out.result == 3);
+    val_digits[0] = 4;
+    assert(fkv_put(key_digits, sizeof(key_digits), val_digits, sizeof(val_digits), FKV_ENTRY_TYPE_VALUE) == 0);
+    assert(vm_run(&read_prog, &lim, NULL, &out) == 0 && out.result == 4);
+    vm_result_cache_stats(&after);
+    assert(after.hits == before.hits + 1);
+    assert(after.misses == before.misses + 2);
+
+    /* A full cache evicts instead of growing. */
+    assert(vm_result_cache_configure(1) == 0);
+    vm_result_cache_stats(&before);
+    for (uint8_t i = 0; i < 200; ++i) {
+        uint8_t code[] = {0x01, i, 0x01, 1, 0x02, 0x12};
+        prog_t prog = {code, sizeof(code)};
+        assert(vm_run(&prog, &lim, NULL, &out) == 0);
+        assert(out.result == (uint64_t)i + 1);
+    }
+    vm_result_cache_stats(&after);
+    assert(after.evictions > before.evictions);
+    assert(after.entries <= after.capacity);
+
+    assert(vm_result_cache_configure(0) == 0);
+    fkv_shutdown();
+}
+
+static const uint8_t profile_program[] = {0x01, 6, 0x01, 7, 0x04, 0x12};
+
+static void *profile_worker(void *arg) {
+    (void)arg;
+    prog_t prog = {profile_program, sizeof(profile_program)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16, .engine = VM_ENGINE_THREADED};
+    vm_result_t out;
+    for (int i = 0; i < 3; ++i) {
+        assert(vm_run(&prog, &lim, NULL, &out) == 0);
+        assert(out.result == 42);
+    }
+    return NULL;
+}
+
+static void test_profiler(void) {
+    prog_t prog = {profile_program, sizeof(profile_program)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_result_t out;
+    vm_profile_t *profile = malloc(sizeof(*profile));
+    assert(profile);
+
+    vm_profile_enable(1);
+    vm_profile_reset();
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK && out.result == 42 && out.steps == 4);
+
+    /* Verified and fused runs are profiled through the interpreter too. */
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vm_optimize(&vp) == 0);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.result == 42 && out.steps == 4);
+    vm_verified_free(&vp);
+
+    /* Counts of exited threads are kept. */
+    pthread_t worker;
+    assert(pthread_create(&worker, NULL, profile_worker, NULL) == 0);
+    assert(pthread_join(worker, NULL) == 0);
+
+    vm_profile_snapshot(profile);
+    assert(profile->enabled == 1);
+    assert(profile->runs == 5);
+    assert(profile->steps == 20);
+    assert(profile->opcodes[0x01].count == 10);
+    assert(profile->opcodes[0x04].count == 5);
+    assert(profile->opcodes[0x12].count == 5);
+    assert(profile->opcodes[0x02].count == 0);
+    assert(profile->ips[0].count == 5 && profile->ips[2].count == 5 && profile->ips[4].count == 5);
+    assert(profile->ips[1].count == 0);
+
+    char *json = vm_profile_serialize(profile, 2);
+    assert(json);
+    assert(strstr(json, "\"runs\":5,\"steps\":20") != NULL);
+    assert(strstr(json, "{\"opcode\":4,\"name\":\"MUL10\",\"count\":5,") != NULL);
+    assert(strstr(json, "\"hot_ips\":[{\"ip\":") != NULL);
+    free(json);
+
+    /* Nothing is counted once disabled, and reset clears every thread. */
+    vm_profile_enable(0);
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    vm_profile_snapshot(profile);
+    assert(profile->enabled == 0 && profile->runs == 5);
+    vm_profile_reset();
+    vm_profile_snapshot(profile);
+    assert(profile->runs == 0 && profile->steps == 0 && profile->cycles == 0);
+    free(profile);
+}
+
+static void test_trace_modes(void) {
+    /* 40 NOPs and HALT: 41 steps. */
+    uint8_t code[41];
+    memset(code, 0x11, sizeof(code));
+    code[40] = 0x12;
+    prog_t prog = {code, sizeof(code)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_trace_entry_t entries[8];
+    vm_result_t out;
+
+    vm_trace_t head = {.entries = entries, .capacity = 8};
+    assert(vm_run(&prog, &lim, &head, &out) == 0);
+    assert(head.count == 8 && head.total == 41);
+    assert(vm_trace_at(&head, 7)->step == 7);
+
+    /* The ring keeps the tail, which is what a gas exhaustion needs. */
+    vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED};
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        vm_limits_t ring_lim = {.max_steps = 30, .max_stack = 16, .engine = engines[e]};
+        vm_trace_t ring = {.entries = entries, .capacity = 8, .mode = VM_TRACE_RING};
+        assert(vm_run(&prog, &ring_lim, &ring, &out) == 0);
+        assert(out.status == VM_ERR_GAS_EXHAUSTED);
+        assert(ring.count == 8 && ring.total == 30);
+        for (size_t i = 0; i < 8; ++i) {
+            assert(vm_trace_at(&ring, i)->step == 22 + i);
+        }
+        assert(vm_trace_at(&ring, 8) == NULL);
+    }
+
+    vm_trace_t sampled = {.entries = entries, .capacity = 8, .sample_every = 10};
+    assert(vm_run(&prog, &lim, &sampled, &out) == 0);
+    assert(sampled.count == 5 && sampled.total == 5);
+    assert(vm_trace_at(&sampled, 4)->step == 40 && vm_trace_at(&sampled, 4)->opcode == 0x12);
+
+    /* Streamed records decode to what a buffered trace holds. */
+    static const uint8_t negative[] = {0x01, 2, 0x01, 5, 0x03, 0x11, 0x12};
+    prog_t neg_prog = {negative, sizeof(negative)};
+    vm_trace_entry_t expected[8];
+    vm_trace_t reference = {.entries = expected, .capacity = 8};
+    assert(vm_run(&neg_prog, &lim, &reference, &out) == 0);
+    assert(reference.count == 5 && (int64_t)expected[4].stack_top == -3);
+
+    FILE *fp = tmpfile();
+    assert(fp);
+    vm_trace_sink_t *sink = malloc(sizeof(*sink));
+    assert(sink);
+    vm_trace_sink_init(sink, fileno(fp));
+    vm_trace_t streamed = {.sink = sink};
+    assert(vm_run(&neg_prog, &lim, &streamed, &out) == 0);
+    vm_context_t *ctx = vm_context_create(&lim, 0);
+    assert(ctx && vm_context_trace(ctx) == NULL);
+    vm_context_set_trace(ctx, VM_TRACE_HEAD, 0, sink);
+    assert(vm_context_trace(ctx) != NULL);
+    assert(vm_context_run(ctx, &neg_prog, &lim, &out) == 0);
+    assert(vm_trace_sink_flush(sink) == 0);
+    assert(sink->records == 10);
+    vm_context_destroy(ctx);
+    free(sink);
+
+    uint8_t data[256];
+    rewind(fp);
+    size_t len = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+    /* Header, then per run one tag byte and 6 bytes per step. */
+    assert(len == 4 + 2 * (1 + 5 * 6));
+    vm_trace_reader_t reader;
+    vm_trace_record_t record;
+    assert(vm_trace_reader_init(&reader, data, len) == 0);
+    for (int run = 0; run < 2; ++run) {
+        assert(vm_trace_reader_next(&reader, &record) == 1 && record.kind == VM_TRACE_RECORD_RUN);
+        for (size_t i = 0; i < reference.count; ++i) {
+            assert(vm_trace_reader_next(&reader, &record) == 1);
+            assert(record.kind == VM_TRACE_RECORD_STEP);
+            assert(record.entry.step == expected[i].step && record.entry.ip == expected[i].ip);
+            assert(record.entry.opcode == expected[i].opcode);
+            assert(record.entry.stack_top == expected[i].stack_top);
+            assert(record.entry.gas_left == expected[i].gas_left);
+        }
+    }
+    assert(vm_trace_reader_next(&reader, &record) == 0);
+
+    /* A cut-off record and a foreign file are rejected. */
+    assert(vm_trace_reader_init(&reader, data, len - 1) == 0);
+    int rc = 1;
+    while (rc == 1) {
+        rc = vm_trace_reader_next(&reader, &record);
+    }
+    assert(rc == -1);
+    assert(vm_trace_reader_init(&reader, negative, sizeof(negative)) == -1);
+}
+
+static int64_t fkv_committed(int64_t key) {
+    uint8_t key_digits[20];
+    size_t key_len = 0;
+    do {
+        key_digits[key_len++] = (uint8_t)(key % 10);
+        key /= 10;
+    } while (key > 0);
+    for (size_t i = 0; i < key_len / 2; ++i) {
+        uint8_t tmp = key_digits[i];
+        key_digits[i] = key_digits[key_len - 1 - i];
+        key_digits[key_len - 1 - i] = tmp;
+    }
+    uint8_t value[20];
+    size_t value_len = sizeof(value);
+    size_t found_key_len = 0;
+    int rc = fkv_get_first(key_digits, key_len, value, &value_len, &found_key_len);
+    assert(rc >= 0);
+    if (rc == 0) {
+        return -1;
+    }
+    int64_t out = 0;
+    for (size_t i = 0; i < value_len; ++i) {
+        out = out * 10 + value[i];
+    }
+    return out;
+}
+
+static void test_fkv_transactions(void) {
+    fkv_shutdown();
+    assert(fkv_init() == 0);
+    vm_reset_fkv_errors();
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_result_t out;
+
+    /* A fault after WRITE_FKV leaves F-KV untouched. */
+    static const uint8_t fault[] = {0x01, 2, 0x01, 3, 0x0D, 0x01, 1, 0x01, 0, 0x05, 0x12};
+    prog_t prog = {fault, sizeof(fault)};
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_ERR_DIV_BY_ZERO);
+    assert(fkv_committed(2) == -1);
+
+    /* So does running out of gas. */
+    static const uint8_t gas[] = {0x01, 2, 0x01, 3, 0x0D, 0x11, 0x11, 0x11, 0x11, 0x12};
+    prog = (prog_t){gas, sizeof(gas)};
+    vm_limits_t tight = {.max_steps = 5, .max_stack = 16};
+    assert(vm_run(&prog, &tight, NULL, &out) == 0);
+    assert(out.status == VM_ERR_GAS_EXHAUSTED);
+    assert(fkv_committed(2) == -1);
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(fkv_committed(2) == 3);
+
+    /* Reads see the run's own writes, exact and by prefix, on every engine. */
+    uint8_t committed_key[] = {4, 6};
+    uint8_t committed_value[] = {1};
+    assert(fkv_put(committed_key, 2, committed_value, 1, FKV_ENTRY_TYPE_VALUE) == 0);
+    static const uint8_t own[] = {
+        0x13, 45, 0x01, 8, 0x0D, // WRITE_FKV 45 <- 8
+        0x01, 7, 0x01, 9, 0x0D,  // WRITE_FKV 7 <- 9
+        0x01, 7, 0x0C,           // READ_FKV 7 -> 9
+        0x01, 4, 0x0C,           // READ_FKV 4 -> newest under 4x, 8
+        0x02, 0x12,
+    };
+    prog = (prog_t){own, sizeof(own)};
+    const vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT, VM_ENGINE_REGISTER};
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        fkv_shutdown();
+        assert(fkv_init() == 0);
+        assert(fkv_put(committed_key, 2, committed_value, 1, FKV_ENTRY_TYPE_VALUE) == 0);
+        vm_limits_t elim = {.max_steps = 64, .max_stack = 16, .engine = engines[i]};
+        assert(vm_run(&prog, &elim, NULL, &out) == 0);
+        assert(out.status == VM_OK);
+        assert(out.result == 17);
+        assert(fkv_committed(7) == 9);
+        assert(fkv_committed(4) == 8);
+    }
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    fkv_shutdown();
+    assert(fkv_init() == 0);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK && out.result == 17);
+    assert(fkv_committed(45) == 8);
+    vm_verified_free(&vp);
+
+    /* A rewritten key commits after the others, as it would unbuffered. */
+    static const uint8_t rewrite[] = {
+        0x13, 51, 0x01, 1, 0x0D, 0x13, 52, 0x01, 2, 0x0D, 0x13, 51, 0x01, 3, 0x0D, 0x12,
+    };
+    prog = (prog_t){rewrite, sizeof(rewrite)};
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(fkv_committed(51) == 3);
+    assert(fkv_committed(5) == 3);
+
+    /* A resumable run is one transaction over all its slices. */
+    static const uint8_t slow_fault[] = {0x01, 6, 0x01, 5, 0x0D, 0x01, 6, 0x0C, 0x01, 0, 0x05, 0x12};
+    static const uint8_t slow_ok[] = {0x01, 6, 0x01, 5, 0x0D, 0x01, 6, 0x0C, 0x12};
+    vm_context_t *ctx = vm_context_create(&lim, 0);
+    assert(ctx);
+    prog = (prog_t){slow_fault, sizeof(slow_fault)};
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 4, &out) == 0 && out.status == VM_YIELD);
+    assert(fkv_committed(6) == -1);
+    assert(vm_context_resume(ctx, 0, &out) == 0 && out.status == VM_ERR_DIV_BY_ZERO);
+    assert(fkv_committed(6) == -1);
+    /* Abandoning a suspended run drops its writes too. */
+    prog = (prog_t){slow_ok, sizeof(slow_ok)};
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 4, &out) == 0 && out.status == VM_YIELD);
+    vm_context_reset(ctx);
+    assert(fkv_committed(6) == -1);
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 3, &out) == 0 && out.status == VM_YIELD);
+    assert(fkv_committed(6) == -1);
+    /* Later slices read the buffered write; it commits with VM_OK. */
+    assert(vm_context_resume(ctx, 0, &out) == 0 && out.status == VM_OK && out.result == 5);
+    assert(fkv_committed(6) == 5);
+    vm_context_destroy(ctx);
+
+    /* F-KV lanes behave like consecutive runs: each sees the earlier lanes' writes... */
+    static const uint8_t count_after_write[] = {0x01, 1, 0x0D, 0x01, 9, 0x15, 0x12};
+    const int64_t nines[] = {91, 92, 93};
+    vm_result_t lanes_out[3];
+    prog = (prog_t){count_after_write, sizeof(count_after_write)};
+    assert(vm_run_lanes(&prog, &lim, nines, 3, lanes_out) == 0);
+    for (size_t i = 0; i < 3; ++i) {
+        assert(lanes_out[i].status == VM_OK && lanes_out[i].result == i + 1);
+    }
+    assert(fkv_committed(93) == 1);
+    /* ...and a lane that faults after WRITE_FKV leaves nothing behind. */
+    static const uint8_t write_then_fault[] = {0x01, 1, 0x0D, 0x01, 1, 0x01, 0, 0x05};
+    const int64_t eights[] = {81, 82};
+    prog = (prog_t){write_then_fault, sizeof(write_then_fault)};
+    assert(vm_run_lanes(&prog, &lim, eights, 2, lanes_out) == 0);
+    assert(lanes_out[0].status == VM_ERR_DIV_BY_ZERO && lanes_out[1].status == VM_ERR_DIV_BY_ZERO);
+    assert(fkv_committed(8) == -1);
+
+    fkv_shutdown();
+}
+
+static void test_fkv_aggregates(void) {
+    static const uint8_t values[][2] = {{12, 3}, {15, 4}, {1, 9}, {2, 7}};
+    /* SUM_PREFIX 1, then COUNT_PREFIX 1 after writing 17 <- 5 and 12 <- 1 */
+    static const uint8_t code[] = {
+        0x01, 1, 0x14,                           // 3 + 4 + 9 = 16
+        0x13, 17, 0x01, 5, 0x0D,                 // WRITE_FKV 17 <- 5
+        0x13, 12, 0x01, 1, 0x0D,                 // WRITE_FKV 12 <- 1
+        0x01, 1, 0x14,                           // 1 + 4 + 9 + 5 = 19
+        0x02, 0x13, 100, 0x04,                   // (16 + 19) * 100
+        0x01, 1, 0x15, 0x02,                     // + 4
+        0x01, 3, 0x15, 0x02, 0x12,               // + 0
+    };
+    static const uint8_t negative[] = {0x01, 0, 0x01, 1, 0x03, 0x14};
+    const vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT, VM_ENGINE_REGISTER};
+    prog_t prog = {code, sizeof(code)};
+    vm_result_t out;
+
+    vm_reset_fkv_errors();
+    vm_jit_set_threshold(0);
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        fkv_shutdown();
+        assert(fkv_init() == 0);
+        for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+            uint8_t key[2];
+            size_t key_len = 0;
+            if (values[v][0] >= 10) {
+                key[key_len++] = values[v][0] / 10;
+            }
+            key[key_len++] = values[v][0] % 10;
+            assert(fkv_put(key, key_len, &values[v][1], 1, FKV_ENTRY_TYPE_VALUE) == 0);
+        }
+        vm_limits_t lim = {.max_steps = 64, .max_stack = 16, .engine = engines[i]};
+        assert(vm_run(&prog, &lim, NULL, &out) == 0);
+        assert(out.status == VM_OK);
+        assert(out.result == 3504);
+        assert(fkv_committed(12) == 1);
+        assert(fkv_committed(17) == 5);
+
+        prog_t bad = {negative, sizeof(negative)};
+        assert(vm_run(&bad, &lim, NULL, &out) == 0);
+        assert(out.status == VM_ERR_INVALID_OPCODE);
+    }
+    vm_jit_flush();
+    vm_jit_set_threshold(8);
+
+    /* The committed aggregates now include the writes. */
+    static const uint8_t after[] = {0x01, 1, 0x14, 0x12};
+    prog = (prog_t){after, sizeof(after)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 16};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK);
+    assert(out.result == 19);
+    vm_verified_free(&vp);
+
+    vm_force_fkv_errors(1, -1, 0, 0);
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == VM_ERR_INVALID_OPCODE);
+    vm_reset_fkv_errors();
+    fkv_shutdown();
+}
+
+static void test_resumable(void) {
+    /* PUSH 4, CALL sub, ADD, HALT; sub: NOP, NOP, PUSH 3, RET. */
+    static const uint8_t code[] = {0x01, 4, 0x0A, 7, 0, 0x02, 0x12, 0x11, 0x11, 0x01, 3, 0x0B};
+    prog_t prog = {code, sizeof(code)};
+    vm_limits_t lim = {.max_steps = 64, .max_stack = 8};
+    vm_result_t ref;
+    assert(vm_run(&prog, &lim, NULL, &ref) == 0);
+    assert(ref.status == VM_OK && ref.result == 7 && ref.steps == 8);
+
+    vm_context_t *ctx = vm_context_create(&lim, 16);
+    assert(ctx);
+    vm_result_t out;
+    assert(vm_context_resume(ctx, 1, &out) == -1);
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    uint32_t slices = 0;
+    do {
+        memset(&out, 0, sizeof(out));
+        assert(vm_context_resume(ctx, 1, &out) == 0);
+        slices++;
+        assert(out.steps == slices);
+    } while (out.status == VM_YIELD);
+    assert(slices == 8);
+    assert(out.status == ref.status && out.result == ref.result && out.halted);
+    assert(!vm_context_suspended(ctx));
+    assert(vm_context_resume(ctx, 1, &out) == -1);
+    /* The trace covers the whole run, not just the last slice. */
+    assert(vm_context_trace(ctx)->count == 8);
+    assert(vm_trace_at(vm_context_trace(ctx), 7)->opcode == 0x12);
+
+    /* Gas is counted over all slices. */
+    vm_limits_t tight = {.max_steps = 5, .max_stack = 8};
+    assert(vm_context_start(ctx, &prog, &tight) == 0);
+    assert(vm_context_resume(ctx, 3, &out) == 0);
+    assert(out.status == VM_YIELD && out.steps == 3);
+    assert(vm_context_resume(ctx, 3, &out) == 0);
+    assert(out.status == VM_ERR_GAS_EXHAUSTED && out.steps == 5);
+
+    /* Slice 0 runs to the end; a plain run abandons a suspended one. */
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 0, &out) == 0);
+    assert(out.status == VM_OK && out.result == 7);
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 2, &out) == 0 && out.status == VM_YIELD);
+    assert(vm_context_run(ctx, &prog, &lim, &out) == 0 && out.result == 7);
+    assert(!vm_context_suspended(ctx));
+    vm_context_destroy(ctx);
+}
+
+static void assert_step_bounds(const uint8_t *code, size_t len, int bounded, uint32_t min_steps, uint32_t max_steps) {
+    prog_t prog = {code, len};
+    vm_limits_t lim = {.max_steps = 256, .max_stack = 16};
+    vm_verified_prog_t vp;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vp.bounded == bounded);
+    assert(vp.min_steps == min_steps);
+    assert(vp.max_steps == max_steps);
+    /* Under the default schedule every step costs 1. */
+    assert(vp.min_gas == min_steps);
+    assert(vp.max_gas == max_steps);
+    vm_verified_free(&vp);
+}
+
+static void test_step_bounds(void) {
+    static const uint8_t straight[] = {0x01, 1, 0x01, 2, 0x02, 0x12};
+    assert_step_bounds(straight, sizeof(straight), 1, 4, 4);
+    /* Falling off the end is not a step. */
+    static const uint8_t tail[] = {0x01, 1};
+    assert_step_bounds(tail, sizeof(tail), 1, 1, 1);
+    /* JZ over two NOPs: 3 steps when taken, 5 when not. */
+    static const uint8_t branch[] = {0x0F, 0x08, 2, 0, 0x11, 0x11, 0x12};
+    assert_step_bounds(branch, sizeof(branch), 1, 3, 5);
+    /* Calls are followed into the callee and back. */
+    static const uint8_t call[] = {0x01, 4, 0x0A, 7, 0, 0x02, 0x12, 0x11, 0x11, 0x01, 3, 0x0B};
+    assert_step_bounds(call, sizeof(call), 1, 8, 8);
+    /* A loop at constant depth has no bound. */
+    static const uint8_t loop[] = {0x11, 0x0F, 0x09, 0xFB, 0xFF, 0x12};
+    assert_step_bounds(loop, sizeof(loop), 0, 0, 0);
+
+    /* Actual runs stay inside the bounds. */
+    prog_t prog = {branch, sizeof(branch)};
+    vm_limits_t lim = {.max_steps = 256, .max_stack = 16};
+    for (uint64_t id = 0; id < 8; ++id) {
+        lim.request_id = id;
+        vm_result_t out;
+        assert(vm_run(&prog, &lim, NULL, &out) == 0);
+        assert(out.steps >= 3 && out.steps <= 5);
+    }
+}
+
+static void assert_gas_run(vm_engine_t engine, uint32_t max_steps, vm_status_t status, uint32_t steps, uint32_t gas_used) {
+    /* PUSH 3, HASH10, PUSH 1, ADD10, HALT */
+    static const uint8_t code[] = {0x01, 3, 0x0E, 0x01, 1, 0x02, 0x12};
+    prog_t prog = {code, sizeof(code)};
+    vm_limits_t lim = {.max_steps = max_steps, .max_stack = 8, .engine = engine};
+    vm_result_t out;
+    assert(vm_run(&prog, &lim, NULL, &out) == 0);
+    assert(out.status == status);
+    assert(out.steps == steps);
+    assert(out.gas_used == gas_used);
+}
+
+static void test_gas_schedule(void) {
+    static const vm_engine_t engines[] = {VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT, VM_ENGINE_REGISTER};
+    static const uint8_t code[] = {0x01, 3, 0x0E, 0x01, 1, 0x02, 0x12};
+    prog_t prog = {code, sizeof(code)};
+
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        assert_gas_run(engines[e], 64, VM_OK, 5, 5);
+    }
+    uint32_t costs[VM_GAS_OPCODES] = {0};
+    costs[0x0E] = 5;
+    vm_set_gas_schedule(costs);
+    assert(vm_gas_cost(0x0E) == 5 && vm_gas_cost(0x02) == 1);
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        assert_gas_run(engines[e], 64, VM_OK, 5, 9);
+        assert_gas_run(engines[e], 9, VM_OK, 5, 9);
+        /* A step runs only if its whole cost still fits. */
+        assert_gas_run(engines[e], 8, VM_ERR_GAS_EXHAUSTED, 4, 8);
+        assert_gas_run(engines[e], 5, VM_ERR_GAS_EXHAUSTED, 1, 1);
+    }
+
+    /* Verified and fused runs meter the same way, and the bounds price gas. */
+    vm_limits_t lim = {.max_steps = 8, .max_stack = 8};
+    vm_verified_prog_t vp;
+    vm_result_t out;
+    assert(vm_verify(&prog, &lim, &vp) == 0);
+    assert(vp.bounded && vp.min_steps == 5 && vp.max_steps == 5);
+    assert(vp.min_gas == 9 && vp.max_gas == 9);
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_ERR_GAS_EXHAUSTED && out.steps == 4 && out.gas_used == 8);
+    assert(vm_optimize(&vp) == 0);
+    lim.max_steps = 64;
+    assert(vm_run_verified(&vp, &lim, NULL, &out) == 0);
+    assert(out.status == VM_OK && out.steps == 5 && out.gas_used == 9);
+    vm_verified_free(&vp);
+
+    vm_result_t lanes_out[3];
+    lim.max_steps = 8;
+    assert(vm_run_lanes(&prog, &lim, NULL, 3, lanes_out) == 0);
+    for (size_t i = 0; i < 3; ++i) {
+        assert(lanes_out[i].status == VM_ERR_GAS_EXHAUSTED);
+        assert(lanes_out[i].steps == 4 && lanes_out[i].gas_used == 8);
+    }
+
+    /* A slice smaller than the next cost still makes progress. */
+    lim.max_steps = 64;
+    vm_context_t *ctx = vm_context_create(&lim, 0);
+    assert(ctx);
+    assert(vm_context_start(ctx, &prog, &lim) == 0);
+    assert(vm_context_resume(ctx, 1, &out) == 0 && out.status == VM_YIELD && out.gas_used == 1);
+    assert(vm_context_resume(ctx, 1, &out) == 0 && out.status == VM_YIELD && out.gas_used == 6);
+    assert(vm_context_resume(ctx, 0, &out) == 0);
+    assert(out.status == VM_OK && out.steps == 5 && out.gas_used == 9);
+    vm_context_destroy(ctx);
+
+    vm_set_gas_schedule(NULL);
+    assert(vm_gas_cost(0x0E) == 1);
+    assert_gas_run(VM_ENGINE_SWITCH, 64, VM_OK, 5, 5);
+}
+
 int main(void) {
     test_random_deterministic();
     test_add();
@@ -374,6 +1734,25 @@ int main(void) {
     test_fkv_negative_operands();
     test_read_fkv_negative_operand();
     test_write_fkv_negative_operand();
+    test_engines_match_reference(VM_ENGINE_THREADED);
+    test_default_engine_switch();
+    test_verifier();
+    test_context_reuse();
+    test_run_batch();
+    test_run_lanes();
+    test_jit_matches_interpreter();
+    test_register_matches_interpreter();
+    test_pushn();
+    test_div_overflow();
+    test_optimizer();
+    test_result_cache();
+    test_profiler();
+    test_trace_modes();
+    test_fkv_transactions();
+    test_fkv_aggregates();
+    test_resumable();
+    test_step_bounds();
+    test_gas_schedule();
 
     printf("vm tests passed\n");
     return 0;
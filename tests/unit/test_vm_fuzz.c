@@ -0,0 +1,501 @@
+/* Copyright (c) 2024 Кочуров Владислав Евгеньевич */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm/vm.h"
+#include "fkv/fkv.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Differential fuzzer for the Δ-VM engines. Programs come from a seeded
+ * grammar that only produces verifiable bytecode: nested expressions,
+ * drops, if/else, RANDOM10-terminated loops, F-KV writes and lookups, and
+ * calls into non-recursive subroutines placed after the final HALT. Each
+ * program runs on the reference switch interpreter and then on every other
+ * engine, whose results must match field for field. The second run of each
+ * engine is timed, so translation caches are warm, and the totals are
+ * reported as ns per executed instruction.
+ *
+ * Usage: test_vm_fuzz [programs [seed]]
+ */
+
+#define FUZZ_CODE_MAX 4096
+#define FUZZ_SUBS_MAX 4
+#define FUZZ_LANES 8
+#define FUZZ_MAX_STEPS 4000
+#define FUZZ_MAX_STACK 64
+
+typedef enum {
+    FUZZ_SWITCH,
+    FUZZ_THREADED,
+    FUZZ_JIT,
+    FUZZ_REGISTER,
+    FUZZ_VERIFIED,
+    FUZZ_FUSED,
+    FUZZ_LANES_RUN,
+    FUZZ_ENGINES
+} fuzz_engine_t;
+
+static const char *const fuzz_engine_names[FUZZ_ENGINES] = {
+    "switch", "threaded", "jit", "register", "verified", "fused", "lanes",
+};
+
+typedef struct {
+    uint64_t runs;
+    uint64_t steps;
+    uint64_t ns;
+} fuzz_stats_t;
+
+typedef struct {
+    uint32_t rng;
+    uint8_t code[FUZZ_CODE_MAX];
+    size_t len;
+    int overflow;
+    int with_fkv;
+    size_t sub_count;
+    size_t sub_start[FUZZ_SUBS_MAX];
+    size_t call_at[256]; /* CALL operands to patch with call_sub[] */
+    size_t call_sub[256];
+    size_t call_count;
+} fuzz_gen_t;
+
+static uint32_t fuzz_next(fuzz_gen_t *g) {
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 17;
+    g->rng ^= g->rng << 5;
+    return g->rng;
+}
+
+static uint32_t fuzz_below(fuzz_gen_t *g, uint32_t n) {
+    return fuzz_next(g) % n;
+}
+
+static void emit(fuzz_gen_t *g, uint8_t byte) {
+    if (g->len >= FUZZ_CODE_MAX) {
+        g->overflow = 1;
+        return;
+    }
+    g->code[g->len++] = byte;
+}
+
+static size_t emit_jump(fuzz_gen_t *g, uint8_t opcode) {
+    emit(g, opcode);
+    size_t at = g->len;
+    emit(g, 0);
+    emit(g, 0);
+    return at;
+}
+
+/* Points the rel16 operand at `at` to `target`; offsets count from the next instruction. */
+static void patch_jump(fuzz_gen_t *g, size_t at, size_t target) {
+    if (g->overflow) {
+        return;
+    }
+    uint16_t rel = (uint16_t)(int16_t)((long)target - (long)(at + 2));
+    g->code[at] = (uint8_t)rel;
+    g->code[at + 1] = (uint8_t)(rel >> 8);
+}
+
+static void emit_pushn(fuzz_gen_t *g, uint64_t value) {
+    emit(g, 0x13);
+    do {
+        emit(g, (uint8_t)((value & 0x7F) | (value > 0x7F ? 0x80 : 0)));
+        value >>= 7;
+    } while (value != 0);
+}
+
+/* Small non-negative F-KV keys, so writes and lookups collide often. */
+static void gen_key(fuzz_gen_t *g) {
+    if (fuzz_below(g, 3) == 0) {
+        emit_pushn(g, 10 + fuzz_below(g, 90));
+    } else {
+        emit(g, 0x01);
+        emit(g, (uint8_t)fuzz_below(g, 10));
+    }
+}
+
+/* Pushes exactly one value. `callable` subroutines are those below it. */
+static void gen_expr(fuzz_gen_t *g, unsigned level, size_t callable) {
+    uint32_t pick = level == 0 ? fuzz_below(g, 3) : fuzz_below(g, 12);
+    switch (pick) {
+    case 0:
+        emit(g, 0x01);
+        emit(g, (uint8_t)fuzz_below(g, 10));
+        return;
+    case 1:
+        if (fuzz_below(g, 8) == 0) {
+            /* INT64_MIN DIV10 / MOD10 -1, which overflows a plain a / b. */
+            emit_pushn(g, UINT64_C(1) << 63);
+            emit_pushn(g, UINT64_MAX);
+            emit(g, (uint8_t)(0x05 + fuzz_below(g, 2)));
+            return;
+        }
+        emit_pushn(g, (uint64_t)fuzz_next(g) * fuzz_below(g, 1u << 16));
+        return;
+    case 2:
+        emit(g, 0x0F); /* RANDOM10 */
+        return;
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+        gen_expr(g, level - 1, callable);
+        gen_expr(g, level - 1, callable);
+        emit(g, (uint8_t)(0x02 + fuzz_below(g, 6))); /* ADD10 .. CMP */
+        return;
+    case 7:
+        gen_expr(g, level - 1, callable);
+        emit(g, 0x0E); /* HASH10 */
+        return;
+    case 8:
+    case 9:
+        if (g->with_fkv) {
+            static const uint8_t lookups[] = {0x0C, 0x14, 0x15};
+            gen_key(g);
+            emit(g, lookups[fuzz_below(g, sizeof(lookups))]);
+            return;
+        }
+        break;
+    default:
+        if (callable > 0) {
+            size_t sub = fuzz_below(g, (uint32_t)callable);
+            emit(g, 0x0A);
+            if (g->call_count < sizeof(g->call_at) / sizeof(g->call_at[0])) {
+                g->call_at[g->call_count] = g->len;
+                g->call_sub[g->call_count++] = sub;
+            } else {
+                g->overflow = 1;
+            }
+            emit(g, 0);
+            emit(g, 0);
+            return;
+        }
+        break;
+    }
+    emit(g, 0x01);
+    emit(g, (uint8_t)fuzz_below(g, 10));
+}
+
+/* Emits statements with no net stack effect. */
+static void gen_block(fuzz_gen_t *g, unsigned nest, size_t callable) {
+    size_t n = 1 + fuzz_below(g, 4);
+    for (size_t i = 0; i < n && !g->overflow; ++i) {
+        uint32_t pick = nest == 0 ? fuzz_below(g, 3) : fuzz_below(g, 6);
+        switch (pick) {
+        case 0: {
+            /* Drop: JZ to the next instruction pops either way. */
+            gen_expr(g, 3, callable);
+            size_t at = emit_jump(g, (uint8_t)(0x08 + fuzz_below(g, 2)));
+            patch_jump(g, at, g->len);
+            break;
+        }
+        case 1:
+            if (g->with_fkv) {
+                gen_key(g);
+                gen_expr(g, 2, callable);
+                emit(g, 0x0D); /* WRITE_FKV */
+            } else {
+                emit(g, 0x11);
+            }
+            break;
+        case 2:
+            emit(g, 0x11); /* NOP */
+            break;
+        case 3:
+        case 4: {
+            /* if (expr) block [else block] */
+            gen_expr(g, 2, callable);
+            size_t to_else = emit_jump(g, 0x08);
+            gen_block(g, nest - 1, callable);
+            if (fuzz_below(g, 2) == 0) {
+                patch_jump(g, to_else, g->len);
+                break;
+            }
+            emit(g, 0x01);
+            emit(g, 0);
+            size_t to_end = emit_jump(g, 0x08);
+            patch_jump(g, to_else, g->len);
+            gen_block(g, nest - 1, callable);
+            patch_jump(g, to_end, g->len);
+            break;
+        }
+        default: {
+            /* do block while (RANDOM10 % 3 != 0), three rounds on average */
+            size_t top = g->len;
+            gen_block(g, nest - 1, callable);
+            emit(g, 0x0F);
+            emit(g, 0x01);
+            emit(g, 3);
+            emit(g, 0x06);
+            size_t back = emit_jump(g, 0x09);
+            patch_jump(g, back, top);
+            break;
+        }
+        }
+    }
+}
+
+static int fuzz_program(fuzz_gen_t *g, uint32_t seed) {
+    memset(g, 0, sizeof(*g));
+    g->rng = (seed * 2654435761u) | 1u;
+    g->with_fkv = fuzz_below(g, 2) == 0;
+    g->sub_count = fuzz_below(g, FUZZ_SUBS_MAX + 1);
+
+    gen_block(g, 3, g->sub_count);
+    gen_expr(g, 3, g->sub_count);
+    if (g->sub_count > 0 || fuzz_below(g, 4) != 0) {
+        emit(g, 0x12); /* HALT; otherwise the result falls off the end */
+    }
+    /* Subroutine i may call subroutines below i, never itself. */
+    for (size_t i = 0; i < g->sub_count; ++i) {
+        g->sub_start[i] = g->len;
+        gen_block(g, 1, i);
+        gen_expr(g, 2, i);
+        emit(g, 0x0B);
+    }
+    if (g->overflow) {
+        return -1;
+    }
+    for (size_t i = 0; i < g->call_count; ++i) {
+        size_t target = g->sub_start[g->call_sub[i]];
+        g->code[g->call_at[i]] = (uint8_t)target;
+        g->code[g->call_at[i] + 1] = (uint8_t)(target >> 8);
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Every run of an F-KV program starts from the same empty store. */
+static void fuzz_reset_store(const fuzz_gen_t *g) {
+    if (g->with_fkv) {
+        fkv_shutdown();
+        fkv_init();
+    }
+}
+
+static int fuzz_run(fuzz_engine_t engine,
+                    const prog_t *prog,
+                    vm_verified_prog_t *vp,
+                    const vm_limits_t *lim,
+                    vm_result_t *out) {
+    vm_limits_t run_lim = *lim;
+    switch (engine) {
+    case FUZZ_SWITCH:
+        run_lim.engine = VM_ENGINE_SWITCH;
+        return vm_run(prog, &run_lim, NULL, out);
+    case FUZZ_THREADED:
+        run_lim.engine = VM_ENGINE_THREADED;
+        return vm_run(prog, &run_lim, NULL, out);
+    case FUZZ_JIT:
+        run_lim.engine = VM_ENGINE_JIT;
+        return vm_run(prog, &run_lim, NULL, out);
+    case FUZZ_REGISTER:
+        run_lim.engine = VM_ENGINE_REGISTER;
+        return vm_run(prog, &run_lim, NULL, out);
+    case FUZZ_VERIFIED:
+    case FUZZ_FUSED:
+        return vm_run_verified(vp, &run_lim, NULL, out);
+    case FUZZ_LANES_RUN:
+    case FUZZ_ENGINES:
+        break;
+    }
+    return -1;
+}
+
+static int results_equal(const vm_result_t *a, const vm_result_t *b) {
+    return a->status == b->status && a->result == b->result && a->steps == b->steps && a->halted == b->halted &&
+           a->gas_used == b->gas_used;
+}
+
+static void report_mismatch(const fuzz_gen_t *g,
+                            uint32_t seed,
+                            const char *engine,
+                            uint64_t request_id,
+                            const vm_result_t *want,
+                            const vm_result_t *got) {
+    fprintf(stderr, "vm fuzz: %s differs from switch (program seed %u, request_id %llu)\n", engine, seed,
+            (unsigned long long)request_id);
+    fprintf(stderr, "  switch: status=%d result=%llu steps=%u halted=%u gas=%u\n", want->status,
+            (unsigned long long)want->result, want->steps, want->halted, want->gas_used);
+    fprintf(stderr, "  %s: status=%d result=%llu steps=%u halted=%u gas=%u\n", engine, got->status,
+            (unsigned long long)got->result, got->steps, got->halted, got->gas_used);
+    fprintf(stderr, "  code (%zu bytes):", g->len);
+    for (size_t i = 0; i < g->len; ++i) {
+        fprintf(stderr, "%s%02x", i % 32 == 0 ? "\n   " : " ", g->code[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+/* Runs one engine twice, checking both runs and timing the second. */
+static int fuzz_check_engine(fuzz_engine_t engine,
+                             const fuzz_gen_t *g,
+                             uint32_t seed,
+                             const prog_t *prog,
+                             vm_verified_prog_t *vp,
+                             const vm_limits_t *lim,
+                             const vm_result_t *want,
+                             fuzz_stats_t *stats) {
+    for (int round = 0; round < 2; ++round) {
+        vm_result_t got;
+        memset(&got, 0, sizeof(got));
+        fuzz_reset_store(g);
+        uint64_t start = now_ns();
+        int rc = fuzz_run(engine, prog, vp, lim, &got);
+        uint64_t elapsed = now_ns() - start;
+        if (rc != 0 || !results_equal(want, &got)) {
+            report_mismatch(g, seed, fuzz_engine_names[engine], lim->request_id, want, &got);
+            return -1;
+        }
+        if (round == 1) {
+            stats[engine].runs++;
+            stats[engine].steps += got.steps;
+            stats[engine].ns += elapsed;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lane i must match the reference run under request_id + i. The reference
+ * runs the lanes one after another from an empty store, and both must
+ * leave the same entries behind.
+ */
+static int fuzz_check_lanes(const fuzz_gen_t *g, uint32_t seed, const prog_t *prog, const vm_limits_t *lim, fuzz_stats_t *stats) {
+    vm_result_t want[FUZZ_LANES];
+    vm_result_t got[FUZZ_LANES];
+    fkv_aggregate_t want_store = {0, 0};
+    fkv_aggregate_t got_store = {0, 0};
+    fuzz_reset_store(g);
+    for (size_t i = 0; i < FUZZ_LANES; ++i) {
+        vm_limits_t lane_lim = *lim;
+        lane_lim.request_id += i;
+        lane_lim.engine = VM_ENGINE_SWITCH;
+        if (vm_run(prog, &lane_lim, NULL, &want[i]) != 0) {
+            return -1;
+        }
+    }
+    if (g->with_fkv && fkv_aggregate_prefix(NULL, 0, &want_store, NULL) != 0) {
+        return -1;
+    }
+    for (int round = 0; round < 2; ++round) {
+        memset(got, 0, sizeof(got));
+        fuzz_reset_store(g);
+        uint64_t start = now_ns();
+        int rc = vm_run_lanes(prog, lim, NULL, FUZZ_LANES, got);
+        uint64_t elapsed = now_ns() - start;
+        if (g->with_fkv && (fkv_aggregate_prefix(NULL, 0, &got_store, NULL) != 0 ||
+                            got_store.count != want_store.count || got_store.sum != want_store.sum)) {
+            fprintf(stderr, "vm fuzz: lanes left %llu entries (sum %llu), runs left %llu (sum %llu), seed %u\n",
+                    (unsigned long long)got_store.count, (unsigned long long)got_store.sum,
+                    (unsigned long long)want_store.count, (unsigned long long)want_store.sum, seed);
+            return -1;
+        }
+        for (size_t i = 0; i < FUZZ_LANES; ++i) {
+            if (rc != 0 || !results_equal(&want[i], &got[i])) {
+                report_mismatch(g, seed, "lanes", lim->request_id + i, &want[i], &got[i]);
+                return -1;
+            }
+            if (round == 1) {
+                stats[FUZZ_LANES_RUN].steps += got[i].steps;
+            }
+        }
+        if (round == 1) {
+            stats[FUZZ_LANES_RUN].runs += FUZZ_LANES;
+            stats[FUZZ_LANES_RUN].ns += elapsed;
+        }
+    }
+    return 0;
+}
+
+static int fuzz_one(uint32_t seed, fuzz_stats_t *stats) {
+    static fuzz_gen_t g;
+    if (fuzz_program(&g, seed) != 0) {
+        return 0; /* grammar outgrew the buffer; not a finding */
+    }
+    prog_t prog = {g.code, g.len};
+    vm_limits_t lim = {.max_steps = FUZZ_MAX_STEPS, .max_stack = FUZZ_MAX_STACK, .request_id = seed};
+
+    /* -1 means the proof outgrew the verifier's budget (call frames), not a rejection. */
+    vm_verified_prog_t vp;
+    int verify_rc = vm_verify(&prog, &lim, &vp);
+    if (verify_rc == 1) {
+        fprintf(stderr, "vm fuzz: generated program rejected (seed %u, status %d at ip %u)\n", seed,
+                vp.reject_status, vp.reject_ip);
+        vm_verified_free(&vp);
+        return -1;
+    }
+
+    vm_result_t want;
+    fuzz_reset_store(&g);
+    uint64_t start = now_ns();
+    int rc = fuzz_run(FUZZ_SWITCH, &prog, &vp, &lim, &want);
+    uint64_t elapsed = now_ns() - start;
+    if (rc != 0) {
+        if (verify_rc == 0) {
+            vm_verified_free(&vp);
+        }
+        return -1;
+    }
+    stats[FUZZ_SWITCH].runs++;
+    stats[FUZZ_SWITCH].steps += want.steps;
+    stats[FUZZ_SWITCH].ns += elapsed;
+
+    int failed = 0;
+    for (int e = FUZZ_THREADED; e <= FUZZ_REGISTER && !failed; ++e) {
+        failed = fuzz_check_engine((fuzz_engine_t)e, &g, seed, &prog, &vp, &lim, &want, stats) != 0;
+    }
+    if (!failed && verify_rc == 0) {
+        failed = fuzz_check_engine(FUZZ_VERIFIED, &g, seed, &prog, &vp, &lim, &want, stats) != 0;
+    }
+    if (!failed && verify_rc == 0 && vm_optimize(&vp) == 0) {
+        failed = fuzz_check_engine(FUZZ_FUSED, &g, seed, &prog, &vp, &lim, &want, stats) != 0;
+    }
+    if (!failed) {
+        failed = fuzz_check_lanes(&g, seed, &prog, &lim, stats) != 0;
+    }
+    if (verify_rc == 0) {
+        vm_verified_free(&vp);
+    }
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long programs = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 1;
+
+    /* Cached results would hide the engines behind the first run. */
+    vm_result_cache_configure(0);
+    if (fkv_init() != 0) {
+        fprintf(stderr, "vm fuzz: fkv_init failed\n");
+        return 1;
+    }
+
+    fuzz_stats_t stats[FUZZ_ENGINES];
+    memset(stats, 0, sizeof(stats));
+    for (unsigned long i = 0; i < programs; ++i) {
+        if (fuzz_one(seed + (uint32_t)i, stats) != 0) {
+            fkv_shutdown();
+            return 1;
+        }
+    }
+
+    printf("%-10s %10s %12s %10s\n", "engine", "runs", "steps", "ns/insn");
+    for (int e = 0; e < FUZZ_ENGINES; ++e) {
+        double per_insn = stats[e].steps ? (double)stats[e].ns / (double)stats[e].steps : 0.0;
+        printf("%-10s %10llu %12llu %10.2f\n", fuzz_engine_names[e], (unsigned long long)stats[e].runs,
+               (unsigned long long)stats[e].steps, per_insn);
+    }
+    fkv_shutdown();
+    printf("vm fuzz tests passed (%lu programs, seed %u)\n", programs, seed);
+    return 0;
+}